@@ -35,6 +35,18 @@
     the ext2fs layer anyway, as this layer should give you everything you need
     by interfacing with the VFS in the normal fashion.
 
+    Blocks are cached in the buffer cache shared with the other filesystems on
+    block devices (see kos/bcache.h). Calling fs_ioctl() with
+    IOCTL_BCACHE_GET_STATS on any file open on a filesystem fetches the cache's
+    counters for that filesystem.
+
+    Data written to the end of a file is held in memory for a while before any
+    blocks are picked for it on the disk, so that a file written a bit at a
+    time (or several files written at once) still ends up in long runs of
+    blocks. It goes out when the file is closed or the filesystem is synced.
+    Space can also be allocated for a file ahead of time with
+    IOCTL_EXT2_FALLOCATE.
+
     There's one final note that I should make. Everything in fs_ext2 and ext2fs
     is licensed under the same license as the rest of KOS. None of it was
     derived from GPLed sources. Pretty much all of what's in ext2fs was written
@@ -50,6 +62,7 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <kos/blockdev.h>
 
 /** \defgroup vfs_ext2  EXT2 
@@ -98,6 +111,39 @@ int fs_ext2_shutdown(void);
 #define FS_EXT2_MOUNT_READWRITE     0x00000001  /**< \brief Mount read-write */
 /** @} */
 
+/** \brief   Arguments for IOCTL_EXT2_FALLOCATE.
+    \ingroup vfs_ext2
+*/
+typedef struct ext2_fallocate {
+    off_t offset;               /**< \brief Start of the range */
+    off_t len;                  /**< \brief Length of the range */
+    int mode;                   /**< \brief 0 or EXT2_FALLOC_KEEP_SIZE */
+} ext2_fallocate_t;
+
+/** \brief   Only set the blocks aside, leaving the file's size as it is.
+    \ingroup vfs_ext2
+*/
+#define EXT2_FALLOC_KEEP_SIZE       0x00000001
+
+/** \brief   Allocate space for a file ahead of time.
+    \ingroup vfs_ext2
+
+    Call fs_ioctl() with this and a pointer to an ext2_fallocate_t on a file
+    open for writing to make sure that the file has blocks up to offset + len,
+    like posix_fallocate(). The new blocks are picked all at once, in as long a
+    run as can be found straight after the file's last block, and are filled
+    with zeroes. If the file is shorter than offset + len, it's made that long.
+
+    With EXT2_FALLOC_KEEP_SIZE, the blocks are set aside for writes to the end
+    of the file to use, but the file itself is left alone. Blocks set aside
+    like this that haven't been written to by the time the file is closed or
+    the filesystem is synced are handed back.
+
+    Errors are EINVAL for a bad range or mode, EBADF if the file isn't open for
+    writing, and ENOSPC, EFBIG or EIO from allocating the blocks.
+*/
+#define IOCTL_EXT2_FALLOCATE        0x45585446 /* "EXTF" */
+
 /** \brief   Mount an ext2 filesystem in the VFS.
     \ingroup vfs_ext2
 
@@ -23,6 +23,11 @@
     the fatfs layer anyway, as this layer should give you everything you need
     by interfacing with the VFS in the normal fashion.
 
+    Clusters and blocks of the FAT are cached in the buffer cache shared with
+    the other filesystems on block devices (see kos/bcache.h). Calling
+    fs_ioctl() with IOCTL_BCACHE_GET_STATS on any file open on a filesystem
+    fetches the cache's counters for that filesystem.
+
     \author Lawrence Sebald
 */
 
@@ -131,5 +136,25 @@ int fs_fat_unmount(const char *mp);
 */
 int fs_fat_sync(const char *mp);
 
+/** \brief   Find out how much space is free on a mounted FAT filesystem.
+    \ingroup vfs_fat
+
+    This function returns the free space on the filesystem, and optionally its
+    total size. The free cluster count in the FAT32 FSinfo sector is used if
+    it's there, so this is usually quick. Otherwise, the whole FAT has to be
+    read the first time, which may take a while on a large volume. After that,
+    the count is kept up to date in memory (and written to the FSinfo sector,
+    for FAT32, when the filesystem is synced).
+
+    \param  mp          The mount point of the filesystem.
+    \param  avail       Where to store the number of bytes free.
+    \param  total       Where to store the total size of the data area in
+                        bytes, or NULL if you don't care.
+
+    \retval 0           On success.
+    \retval -1          On error, with errno set as appropriate.
+*/
+int fs_fat_free_space(const char *mp, uint64_t *avail, uint64_t *total);
+
 __END_DECLS
 #endif /* !__FAT_FS_FAT_H */
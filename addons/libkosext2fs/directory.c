@@ -4,6 +4,7 @@
    Copyright (C) 2013 Lawrence Sebald
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -17,13 +18,653 @@
    4-byte boundary as well. */
 #define DENT_SZ(n) (((n) + sizeof(ext2_dirent_t) + 4) & 0x01FC)
 
+/* Number of blocks in a directory. Note that i_blocks can't be used for this,
+   as it counts any indirect blocks too. */
+static inline uint32_t dir_blocks(ext2_fs_t *fs, const struct ext2_inode *dir) {
+    return dir->i_size >> (10 + fs->sb.s_log_block_size);
+}
+
+/* Look through one block of a directory for an entry. Returns 1 if it is
+   found, 0 if not, or -EIO if the block is broken. */
+static int block_find(ext2_fs_t *fs, uint8_t *buf, const char *fn, size_t len,
+                      ext2_dirent_t **rv) {
+    uint32_t off = 0;
+    ext2_dirent_t *dent;
+
+    while(off < fs->block_size) {
+        dent = (ext2_dirent_t *)(buf + off);
+
+        /* Make sure we don't trip and fall on a malformed entry. */
+        if(!dent->rec_len)
+            return -EIO;
+
+        if(dent->inode) {
+            /* Check if this what we're looking for. */
+            if(dent->name_len == len && !memcmp(dent->name, fn, len)) {
+                *rv = dent;
+                return 1;
+            }
+        }
+
+        off += dent->rec_len;
+    }
+
+    return 0;
+}
+
+/* Work out the most space a new entry could have in a block. */
+static uint16_t block_room(ext2_fs_t *fs, const uint8_t *buf) {
+    uint32_t off = 0, room, rv = 0;
+    const ext2_dirent_t *dent;
+
+    while(off < fs->block_size) {
+        dent = (const ext2_dirent_t *)(buf + off);
+
+        if(!dent->rec_len)
+            return 0;
+
+        if(dent->inode)
+            room = dent->rec_len - DENT_SZ(dent->name_len);
+        else
+            room = dent->rec_len;
+
+        if(room > rv)
+            rv = room;
+
+        off += dent->rec_len;
+    }
+
+    return (uint16_t)rv;
+}
+
+/* The hashes used by indexed directories. These have to give the same results
+   as the ones Linux uses (see fs/ext4/hash.c there), so that's where they come
+   from. */
+static uint32_t dx_hack_hash(const char *name, size_t len, int uns) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int c;
+
+    while(len--) {
+        c = uns ? (int)(unsigned char)*name++ : (int)(signed char)*name++;
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+
+        if(hash & 0x80000000)
+            hash -= 0x7fffffff;
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num,
+                        int uns) {
+    uint32_t pad, val;
+    size_t i;
+    int c;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    val = pad;
+
+    if(len > (size_t)num * 4)
+        len = num * 4;
+
+    for(i = 0; i < len; ++i) {
+        c = uns ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+
+        if((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            --num;
+        }
+    }
+
+    if(--num >= 0)
+        *buf++ = val;
+
+    while(--num >= 0)
+        *buf++ = pad;
+}
+
+#define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)  (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z)  ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define K1  0
+#define K2  013240474631U
+#define K3  015666365641U
+
+static void half_md4(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while(--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+static uint32_t dx_hash(ext2_fs_t *fs, int version, const char *name,
+                        size_t len) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8], hash;
+    int uns = version >= EXT2_HASH_LEGACY_UNSIGNED;
+
+    /* Use the seed from the superblock, unless it hasn't got one. */
+    if(fs->sb.s_hash_seed[0] || fs->sb.s_hash_seed[1] ||
+       fs->sb.s_hash_seed[2] || fs->sb.s_hash_seed[3])
+        memcpy(buf, fs->sb.s_hash_seed, sizeof(buf));
+
+    switch(version) {
+        case EXT2_HASH_LEGACY:
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            hash = dx_hack_hash(name, len, uns);
+            break;
+
+        case EXT2_HASH_HALF_MD4:
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            do {
+                str2hashbuf(name, len, in, 8, uns);
+                half_md4(buf, in);
+                name += 32;
+                len = len > 32 ? len - 32 : 0;
+            } while(len);
+
+            hash = buf[1];
+            break;
+
+        default:
+            do {
+                str2hashbuf(name, len, in, 4, uns);
+                tea(buf, in);
+                name += 16;
+                len = len > 16 ? len - 16 : 0;
+            } while(len);
+
+            hash = buf[0];
+            break;
+    }
+
+    return hash & ~1;
+}
+
+/* Where we are in one level of an index. */
+struct dx_frame {
+    uint32_t block;                 /* Block of the directory the node is in */
+    uint32_t off;                   /* Where the entries start in the block */
+    uint32_t count;
+    uint32_t at;                    /* The entry we went down */
+};
+
+/* Read the entries of a node of an index, checking that they make sense. */
+static ext2_dx_entry_t *dx_node(ext2_fs_t *fs, const struct ext2_inode *dir,
+                                struct dx_frame *f, int *err) {
+    ext2_dx_entry_t *ents;
+    ext2_dx_countlimit_t *cl;
+    uint8_t *buf;
+
+    if(!(buf = ext2_inode_read_block(fs, dir, f->block, NULL, err))) {
+        *err = -*err;
+        return NULL;
+    }
+
+    ents = (ext2_dx_entry_t *)(buf + f->off);
+    cl = (ext2_dx_countlimit_t *)ents;
+
+    if(!cl->count || cl->count > cl->limit ||
+       cl->limit != (fs->block_size - f->off) / sizeof(ext2_dx_entry_t))
+        return NULL;
+
+    f->count = cl->count;
+    return ents;
+}
+
+/* Look up a name in a directory with an index on the disk. This only has to
+   look at one block on each level of the index and one block of entries,
+   unless there's more than one block of names with the same hash. Returns 1
+   if the index could be used (with *rv set to NULL if the name isn't there),
+   or 0 if it couldn't, in which case the directory can still be looked
+   through the slow way, as the index is invisible to that. */
+static int dx_find(ext2_fs_t *fs, const struct ext2_inode *dir, const char *fn,
+                   size_t len, ext2_dirent_t **rv, uint32_t *rblk, int *err) {
+    struct dx_frame frames[EXT2_DX_MAX_LEVELS];
+    ext2_dx_root_info_t *info;
+    ext2_dx_entry_t *ents;
+    uint8_t *buf;
+    uint32_t hash, blk, nblocks = dir_blocks(fs, dir), lo, hi, mid;
+    int version, levels, l, found;
+
+    *err = 0;
+
+    /* "." and ".." aren't in the index, but they're right at the start. */
+    if(len <= 2 && fn[0] == '.' && (len == 1 || fn[1] == '.'))
+        return 0;
+
+    if(!(buf = ext2_inode_read_block(fs, dir, 0, NULL, err))) {
+        *err = -*err;
+        return 0;
+    }
+
+    info = (ext2_dx_root_info_t *)(buf + 24);
+    version = info->hash_version;
+    levels = info->indirect_levels;
+
+    if(info->reserved_zero || info->info_length != 8 ||
+       levels >= EXT2_DX_MAX_LEVELS || version > EXT2_HASH_TEA)
+        return 0;
+
+    if(fs->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+
+    hash = dx_hash(fs, version, fn, len);
+
+    /* Go down the tree, taking the last entry at each level with a hash no
+       higher than the name's. */
+    frames[0].block = 0;
+    frames[0].off = 24 + info->info_length;
+
+    for(l = 0; l <= levels; ++l) {
+        if(!(ents = dx_node(fs, dir, &frames[l], err)))
+            return 0;
+
+        lo = 1;
+        hi = frames[l].count;
+
+        while(lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if(ents[mid].hash > hash)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        frames[l].at = lo - 1;
+        blk = ents[lo - 1].block & 0x0FFFFFFF;
+
+        if(!blk || blk >= nblocks)
+            return 0;
+
+        if(l < levels) {
+            frames[l + 1].block = blk;
+            frames[l + 1].off = 8;
+        }
+    }
+
+    for(;;) {
+        if(!(buf = ext2_inode_read_block(fs, dir, blk, NULL, err))) {
+            *err = -*err;
+            return 0;
+        }
+
+        if((found = block_find(fs, buf, fn, len, rv)) < 0)
+            return 0;
+        else if(found) {
+            *rblk = blk;
+            return 1;
+        }
+
+        /* If the next block of entries starts with the same hash, the name
+           could be in there, so carry on to it. */
+        for(l = levels; l >= 0 && frames[l].at + 1 >= frames[l].count; --l) ;
+
+        if(l < 0)
+            break;
+
+        if(!(ents = dx_node(fs, dir, &frames[l], err)))
+            return 0;
+
+        ++frames[l].at;
+
+        if((ents[frames[l].at].hash & ~1) != hash)
+            break;
+
+        blk = ents[frames[l].at].block & 0x0FFFFFFF;
+
+        for(++l; l <= levels; ++l) {
+            frames[l].block = blk;
+            frames[l].off = 8;
+
+            if(!(ents = dx_node(fs, dir, &frames[l], err)))
+                return 0;
+
+            frames[l].at = 0;
+            blk = ents[0].block & 0x0FFFFFFF;
+        }
+
+        if(!blk || blk >= nblocks)
+            return 0;
+    }
+
+    *rv = NULL;
+    return 1;
+}
+
+/* The index of names kept in memory for a directory without one on the disk.
+   Each name's hash is kept with where its entry is, in a hash table, and how
+   much room there is for a new entry in each block is kept too, so that
+   adding one doesn't have to go looking for space. */
+#define DC_NONE     0xFFFFFFFF
+
+struct dir_cent {
+    uint32_t hash;
+    uint32_t block;
+    uint32_t next;                  /* Next in the bucket, or the free list */
+    uint16_t off;
+};
+
+struct ext2_dir_cache {
+    uint32_t *buckets;
+    uint32_t nbuckets;              /* Always a power of two */
+    struct dir_cent *ents;
+    uint32_t nents;                 /* Entries in use, or on the free list */
+    uint32_t size;                  /* Entries there's space for */
+    uint32_t free;
+    uint32_t count;                 /* Entries in the table */
+    uint16_t *room;
+    uint32_t nblocks;
+};
+
+static uint32_t dc_hash(const char *fn, size_t len) {
+    uint32_t hash = 2166136261U;
+
+    while(len--) {
+        hash ^= (uint8_t)*fn++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+void ext2_dir_cache_free(struct ext2_dir_cache *dc) {
+    if(dc) {
+        free(dc->buckets);
+        free(dc->ents);
+        free(dc->room);
+        free(dc);
+    }
+}
+
+static int dc_rehash(struct ext2_dir_cache *dc, uint32_t nbuckets) {
+    uint32_t *buckets, i, *head;
+
+    if(!(buckets = (uint32_t *)malloc(nbuckets * sizeof(uint32_t))))
+        return -ENOMEM;
+
+    memset(buckets, 0xFF, nbuckets * sizeof(uint32_t));
+
+    /* Entries on the free list have DC_NONE as their block. */
+    for(i = 0; i < dc->nents; ++i) {
+        if(dc->ents[i].block != DC_NONE) {
+            head = &buckets[dc->ents[i].hash & (nbuckets - 1)];
+            dc->ents[i].next = *head;
+            *head = i;
+        }
+    }
+
+    free(dc->buckets);
+    dc->buckets = buckets;
+    dc->nbuckets = nbuckets;
+    return 0;
+}
+
+static int dc_add(struct ext2_dir_cache *dc, uint32_t hash, uint32_t block,
+                  uint16_t off) {
+    struct dir_cent *ents;
+    uint32_t i, *head;
+
+    if(dc->free != DC_NONE) {
+        i = dc->free;
+        dc->free = dc->ents[i].next;
+    }
+    else {
+        if(dc->nents == dc->size) {
+            if(!(ents = (struct dir_cent *)realloc(dc->ents, dc->size * 2 *
+                                                   sizeof(struct dir_cent))))
+                return -ENOMEM;
+
+            dc->ents = ents;
+            dc->size *= 2;
+        }
+
+        i = dc->nents++;
+    }
+
+    dc->ents[i].hash = hash;
+    dc->ents[i].block = block;
+    dc->ents[i].off = off;
+    head = &dc->buckets[hash & (dc->nbuckets - 1)];
+    dc->ents[i].next = *head;
+    *head = i;
+
+    if(++dc->count > dc->nbuckets * 2)
+        return dc_rehash(dc, dc->nbuckets * 4);
+
+    return 0;
+}
+
+static void dc_remove(struct ext2_dir_cache *dc, uint32_t hash, uint32_t block,
+                      uint16_t off) {
+    uint32_t *prev = &dc->buckets[hash & (dc->nbuckets - 1)], i;
+
+    for(i = *prev; i != DC_NONE; prev = &dc->ents[i].next, i = *prev) {
+        if(dc->ents[i].block == block && dc->ents[i].off == off) {
+            *prev = dc->ents[i].next;
+            dc->ents[i].block = DC_NONE;
+            dc->ents[i].next = dc->free;
+            dc->free = i;
+            --dc->count;
+            return;
+        }
+    }
+}
+
+static int dc_set_blocks(struct ext2_dir_cache *dc, uint32_t nblocks) {
+    uint16_t *room;
+
+    if(!(room = (uint16_t *)realloc(dc->room, nblocks * sizeof(uint16_t))))
+        return -ENOMEM;
+
+    if(nblocks > dc->nblocks)
+        memset(room + dc->nblocks, 0,
+               (nblocks - dc->nblocks) * sizeof(uint16_t));
+
+    dc->room = room;
+    dc->nblocks = nblocks;
+    return 0;
+}
+
+/* Get rid of a directory's index, if something couldn't be kept up to date in
+   it. It'll just be built again the next time it's needed. */
+static void dc_drop(const struct ext2_inode *dir) {
+    struct ext2_dir_cache **dcp = ext2_inode_dir_cache(dir);
+
+    ext2_dir_cache_free(*dcp);
+    *dcp = NULL;
+}
+
+/* Build the index for a directory, reading through all of it once. */
+static struct ext2_dir_cache *dc_build(ext2_fs_t *fs,
+                                       const struct ext2_inode *dir, int *err) {
+    struct ext2_dir_cache *dc;
+    uint32_t i, off, blocks = dir_blocks(fs, dir);
+    ext2_dirent_t *dent;
+    uint8_t *buf;
+
+    *err = 0;
+
+    if(!(dc = (struct ext2_dir_cache *)calloc(1, sizeof(*dc))))
+        return NULL;
+
+    dc->free = DC_NONE;
+    dc->size = 64;
+
+    if(!(dc->ents = (struct dir_cent *)malloc(dc->size *
+                                              sizeof(struct dir_cent))) ||
+       dc_rehash(dc, 32) || dc_set_blocks(dc, blocks))
+        goto fail;
+
+    for(i = 0; i < blocks; ++i) {
+        if(!(buf = ext2_inode_read_block(fs, dir, i, NULL, err))) {
+            *err = -*err;
+            goto fail;
+        }
+
+        for(off = 0; off < fs->block_size; off += dent->rec_len) {
+            dent = (ext2_dirent_t *)(buf + off);
+
+            if(!dent->rec_len) {
+                *err = -EIO;
+                goto fail;
+            }
+
+            if(dent->inode &&
+               dc_add(dc, dc_hash((char *)dent->name, dent->name_len), i,
+                      (uint16_t)off))
+                goto fail;
+        }
+
+        dc->room[i] = block_room(fs, buf);
+    }
+
+    *ext2_inode_dir_cache(dir) = dc;
+    return dc;
+
+fail:
+    ext2_dir_cache_free(dc);
+    return NULL;
+}
+
+/* Look up a name with a directory's index. */
+static ext2_dirent_t *dc_find(ext2_fs_t *fs, const struct ext2_inode *dir,
+                              struct ext2_dir_cache *dc, const char *fn,
+                              size_t len, uint32_t *rblk, int *err) {
+    uint32_t hash = dc_hash(fn, len), i;
+    ext2_dirent_t *dent;
+    uint8_t *buf;
+
+    for(i = dc->buckets[hash & (dc->nbuckets - 1)]; i != DC_NONE;
+        i = dc->ents[i].next) {
+        if(dc->ents[i].hash != hash)
+            continue;
+
+        if(!(buf = ext2_inode_read_block(fs, dir, dc->ents[i].block, NULL,
+                                         err))) {
+            *err = -*err;
+            return NULL;
+        }
+
+        dent = (ext2_dirent_t *)(buf + dc->ents[i].off);
+
+        if(dent->inode && dent->name_len == len &&
+           !memcmp(dent->name, fn, len)) {
+            *rblk = dc->ents[i].block;
+            return dent;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find an entry in a directory, and the block of the directory it's in. This
+   uses the directory's index if it has one, either on the disk or in memory,
+   and builds one in memory for a big directory that doesn't have either. */
+static ext2_dirent_t *dir_find(ext2_fs_t *fs, const struct ext2_inode *dir,
+                               const char *fn, uint32_t *rblk, int *err) {
+    uint32_t i, blocks = dir_blocks(fs, dir);
+    struct ext2_dir_cache *dc = *ext2_inode_dir_cache(dir);
+    ext2_dirent_t *dent = NULL;
+    uint8_t *buf;
+    size_t len = strlen(fn);
+    int found;
+
+    *err = 0;
+
+    if(dc)
+        return dc_find(fs, dir, dc, fn, len, rblk, err);
+
+    if((dir->i_flags & EXT2_INDEX_FL) &&
+       (fs->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+       dx_find(fs, dir, fn, len, &dent, rblk, err))
+        return dent;
+
+#if EXT2_DIR_CACHE_BLOCKS
+    if(blocks >= EXT2_DIR_CACHE_BLOCKS && (dc = dc_build(fs, dir, err)))
+        return dc_find(fs, dir, dc, fn, len, rblk, err);
+#endif
+
+    for(i = 0; i < blocks; ++i) {
+        if(!(buf = ext2_inode_read_block(fs, dir, i, NULL, err))) {
+            *err = -*err;
+            return NULL;
+        }
+
+        if((found = block_find(fs, buf, fn, len, &dent)) < 0) {
+            *err = found;
+            return NULL;
+        }
+        else if(found) {
+            *rblk = i;
+            return dent;
+        }
+    }
+
+    /* Didn't find it, oh well. */
+    return NULL;
+}
+
 int ext2_dir_is_empty(ext2_fs_t *fs, const struct ext2_inode *dir) {
     uint32_t off, i, blocks;
     ext2_dirent_t *dent;
     uint8_t *buf;
     int err;
 
-    blocks = dir->i_blocks / (2 << fs->sb.s_log_block_size);
+    blocks = dir_blocks(fs, dir);
 
     for(i = 0; i < blocks; ++i) {
         off = 0;
@@ -58,110 +699,79 @@ int ext2_dir_is_empty(ext2_fs_t *fs, const struct ext2_inode *dir) {
 
 ext2_dirent_t *ext2_dir_entry(ext2_fs_t *fs, const struct ext2_inode *dir,
                               const char *fn) {
-    uint32_t off, i, blocks;
-    ext2_dirent_t *dent;
-    uint8_t *buf;
-    size_t len = strlen(fn);
+    uint32_t blk;
     int err;
 
-    blocks = dir->i_blocks / (2 << fs->sb.s_log_block_size);
-
-    for(i = 0; i < blocks; ++i) {
-        off = 0;
-
-        if(!(buf = ext2_inode_read_block(fs, dir, i, NULL, &err)))
-            return NULL;
-
-        while(off < fs->block_size) {
-            dent = (ext2_dirent_t *)(buf + off);
-
-            /* Make sure we don't trip and fall on a malformed entry. */
-            if(!dent->rec_len)
-                return NULL;
-
-            if(dent->inode) {
-                /* Check if this what we're looking for. */
-                if(dent->name_len == len && !memcmp(dent->name, fn, len))
-                    return dent;
-            }
+    return dir_find(fs, dir, fn, &blk, &err);
+}
 
-            off += dent->rec_len;
-        }
-    }
+ext2_dirent_t *ext2_dir_find(ext2_fs_t *fs, const struct ext2_inode *dir,
+                             const char *fn, int *err) {
+    uint32_t blk;
 
-    /* Didn't find it, oh well. */
-    return NULL;
+    return dir_find(fs, dir, fn, &blk, err);
 }
 
 int ext2_dir_rm_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
                       uint32_t *inode) {
-    uint32_t off, i, blocks, bn;
-    ext2_dirent_t *dent, *prev;
+    uint32_t off, blk, bn;
+    ext2_dirent_t *dent, *prev = NULL, *ent;
+    struct ext2_dir_cache *dc;
     uint8_t *buf;
-    size_t len = strlen(fn);
     int err;
 
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return -EROFS;
 
-    blocks = dir->i_blocks / (2 << fs->sb.s_log_block_size);
+    if(!(ent = dir_find(fs, dir, fn, &blk, &err)))
+        return err ? err : -ENOENT;
 
-    for(i = 0; i < blocks; ++i) {
-        off = 0;
-        prev = NULL;
-        dent = NULL;
+    if(!(buf = ext2_inode_read_block(fs, dir, blk, &bn, &err)))
+        return -err;
 
-        if(!(buf = ext2_inode_read_block(fs, dir, i, &bn, &err)))
-            return -err;
+    /* Find the entry before it in its block, if there is one. */
+    for(off = 0; (dent = (ext2_dirent_t *)(buf + off)) != ent;
+        off += dent->rec_len) {
+        /* Make sure we don't trip and fall on a malformed entry. */
+        if(!dent->rec_len || off >= fs->block_size)
+            return -EIO;
 
-        while(off < fs->block_size) {
-            prev = dent;
-            dent = (ext2_dirent_t *)(buf + off);
+        prev = dent;
+    }
 
-            /* Make sure we don't trip and fall on a malformed entry. */
-            if(!dent->rec_len)
-                return -EIO;
+    /* Return the inode number to the calling function. */
+    *inode = dent->inode;
 
-            if(dent->inode) {
-                /* Check if this what we're looking for. */
-                if(dent->name_len == len && !memcmp(dent->name, fn, len)) {
-                    /* Return the inode number to the calling function. */
-                    *inode = dent->inode;
-
-                    if(prev) {
-                        /* Remove it from the chain and clear the entry. */
-                        prev->rec_len += dent->rec_len;
-                        memset(dent, 0, dent->rec_len);
-                    }
-                    else {
-                        /* This is the first entry in a block, so simply mark
-                           the entry as invalid, and clear the filename and such
-                           from it. */
-                        dent->inode = 0;
-                        memset(dent->name, 0, dent->name_len);
-                        dent->name_len = dent->file_type = 0;
-                    }
-
-                    /* Mark the block as dirty so that it gets rewritten to the
-                       block device. */
-                    ext2_block_mark_dirty(fs, bn);
-
-                    /* Since we may well have trashed the tree if we're using a
-                       btree directory structure, make sure that we note that
-                       by setting that the directory is no longer indexed. */
-                    dir->i_flags &= ~EXT2_BTREE_FL;
-                    ext2_inode_mark_dirty(dir);
-                    return 0;
-                }
-            }
+    if((dc = *ext2_inode_dir_cache(dir)))
+        dc_remove(dc, dc_hash(fn, dent->name_len), blk, (uint16_t)off);
 
-            off += dent->rec_len;
-        }
+    if(prev) {
+        /* Remove it from the chain and clear the entry. */
+        prev->rec_len += dent->rec_len;
+        memset(dent, 0, dent->rec_len);
+    }
+    else {
+        /* This is the first entry in a block, so simply mark the entry as
+           invalid, and clear the filename and such from it. */
+        dent->inode = 0;
+        memset(dent->name, 0, dent->name_len);
+        dent->name_len = dent->file_type = 0;
     }
 
-    /* Didn't find it, oh well. */
-    return -ENOENT;
+    if(dc)
+        dc->room[blk] = block_room(fs, buf);
+
+    /* Mark the block as dirty so that it gets rewritten to the block
+       device. */
+    ext2_block_mark_dirty(fs, bn);
+
+    /* Since we may well have trashed the tree if we're using a btree directory
+       structure, make sure that we note that by setting that the directory is
+       no longer indexed. */
+    dir->i_flags &= ~EXT2_BTREE_FL;
+    ext2_inode_mark_dirty(dir);
+    return 0;
 }
 
 static const uint8_t inodetype_to_dirtype[16] = {
@@ -174,8 +784,9 @@ static const uint8_t inodetype_to_dirtype[16] = {
 int ext2_dir_add_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
                        uint32_t inode_num, const struct ext2_inode *ent,
                        ext2_dirent_t **rv) {
-    uint32_t off, i, blocks, bn;
+    uint32_t off, i, blocks, bn, blk;
     ext2_dirent_t *dent;
+    struct ext2_dir_cache *dc;
     uint8_t *buf;
     size_t nlen = strlen(fn);
     uint16_t rlen = DENT_SZ(nlen), tmp;
@@ -185,9 +796,21 @@ int ext2_dir_add_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return -EROFS;
 
-    blocks = dir->i_blocks / (2 << fs->sb.s_log_block_size);
+    /* Make sure there isn't anything by that name in there already. */
+    if(dir_find(fs, dir, fn, &blk, &err))
+        return -EEXIST;
+    else if(err)
+        return err;
+
+    blocks = dir_blocks(fs, dir);
+    dc = *ext2_inode_dir_cache(dir);
 
     for(i = 0; i < blocks; ++i) {
+        /* If the directory has an index in memory, it knows which blocks have
+           enough room in them, so there's no need to look in the others. */
+        if(dc && dc->room[i] < rlen)
+            continue;
+
         off = 0;
         dent = NULL;
 
@@ -201,18 +824,16 @@ int ext2_dir_add_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
             if(!dent->rec_len)
                 return -EIO;
 
-            /* If the entry is filled in, check to make sure it doesn't match
-               the name of the entry we're trying to add. */
+            /* If the entry is filled in, see if there's space at the end of
+               it for the new one. */
             if(dent->inode) {
-                if(dent->name_len == nlen && !memcmp(dent->name, fn, nlen)) {
-                    return -EEXIST;
-                }
-                else if(dent->rec_len >= rlen + DENT_SZ(dent->name_len)) {
+                if(dent->rec_len >= rlen + DENT_SZ(dent->name_len)) {
                     /* We have space at the end of this entry... Cut off the
                        empty space*/
                     rlen = dent->rec_len;
                     tmp = dent->rec_len = DENT_SZ(dent->name_len);
-                    dent = (ext2_dirent_t *)(buf + off + tmp);
+                    off += tmp;
+                    dent = (ext2_dirent_t *)(buf + off);
                     dent->rec_len = rlen - tmp;
                     goto fill_it_in;
                 }
@@ -232,12 +853,17 @@ int ext2_dir_add_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
     if(!(buf = ext2_inode_alloc_block(fs, dir, blocks, &err)))
         return -err;
 
+    off = 0;
     dent = (ext2_dirent_t *)buf;
     dent->rec_len = fs->block_size;
 
     /* Update the directory's size in the inode. */
     dir->i_size += fs->block_size;
 
+    /* Find out where the block is on the disk, to mark it dirty below. */
+    if(!ext2_inode_read_block(fs, dir, blocks, &bn, &err))
+        return -err;
+
     /* Fall through... */
 fill_it_in:
     dent->inode = inode_num;
@@ -255,6 +881,15 @@ fill_it_in:
     /* Mark the directory's block as dirty. */
     ext2_block_mark_dirty(fs, bn);
 
+    /* Keep the index in memory up to date. */
+    if(dc) {
+        if((i >= dc->nblocks && dc_set_blocks(dc, i + 1)) ||
+           dc_add(dc, dc_hash(fn, nlen), i, (uint16_t)off))
+            dc_drop(dir);
+        else
+            dc->room[i] = block_room(fs, buf);
+    }
+
     /* Since we may well have trashed the tree if we're using a btree directory
        structure, make sure that we note that by setting that the directory is
        no longer indexed. */
@@ -316,50 +951,26 @@ int ext2_dir_create_empty(ext2_fs_t *fs, struct ext2_inode *dir,
 
 int ext2_dir_redir_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
                          uint32_t inode_num, ext2_dirent_t **rv) {
-    uint32_t off, i, blocks, bn;
+    uint32_t blk, bn;
     ext2_dirent_t *dent;
-    uint8_t *buf;
-    size_t nlen = strlen(fn);
     int err;
 
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return -EROFS;
 
-    blocks = dir->i_blocks / (2 << fs->sb.s_log_block_size);
-
-    for(i = 0; i < blocks; ++i) {
-        off = 0;
-        dent = NULL;
-
-        if(!(buf = ext2_inode_read_block(fs, dir, i, &bn, &err)))
-            return -err;
-
-        while(off < fs->block_size) {
-            dent = (ext2_dirent_t *)(buf + off);
-
-            /* Make sure we don't trip and fall on a malformed entry. */
-            if(!dent->rec_len)
-                return -EIO;
+    if(!(dent = dir_find(fs, dir, fn, &blk, &err)))
+        return err ? err : -ENOENT;
 
-            /* If the entry is filled in, check if it is the entry we're trying
-               to modify. */
-            if(dent->inode) {
-                if(dent->name_len == nlen && !memcmp(dent->name, fn, nlen)) {
-                    dent->inode = inode_num;
-                    ext2_block_mark_dirty(fs, bn);
-
-                    if(rv)
-                        *rv = dent;
+    /* Find out where the block is on the disk, to mark it dirty. */
+    if(!ext2_inode_read_block(fs, dir, blk, &bn, &err))
+        return -err;
 
-                    return 0;
-                }
-            }
+    dent->inode = inode_num;
+    ext2_block_mark_dirty(fs, bn);
 
-            off += dent->rec_len;
-        }
-    }
+    if(rv)
+        *rv = dent;
 
-    /* Didn't find it... */
-    return -ENOENT;
+    return 0;
 }
@@ -30,8 +30,49 @@ typedef struct ext2_dirent {
 #define EXT2_FT_SOCK        6
 #define EXT2_FT_SYMLINK     7
 
+/* Indexed (htree) directories. The first block of one of these starts with
+   the "." and ".." entries as usual, but ".." takes up the rest of the block,
+   which holds the root of a tree of hashes of the names in the directory. The
+   leaves of the tree are ordinary blocks of entries, and the other nodes are
+   in blocks that look like they only have one empty entry in them, so that
+   anything that doesn't know about the index sees a normal directory. */
+typedef struct ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+/* An entry in a node of the tree: the lowest hash in a block, and the block.
+   The first entry in each node has the number of entries in the node and the
+   most that can fit in it in place of its hash, and points at the block for
+   any hash lower than the one in the second entry. */
+typedef struct ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+} ext2_dx_entry_t;
+
+typedef struct ext2_dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+} ext2_dx_countlimit_t;
+
+/* Values for hash_version. If the superblock says to, the unsigned versions
+   are used in place of the first three. */
+#define EXT2_HASH_LEGACY            0
+#define EXT2_HASH_HALF_MD4          1
+#define EXT2_HASH_TEA               2
+#define EXT2_HASH_LEGACY_UNSIGNED   3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED      5
+
+/* Most levels of nodes an index can have (including the root). */
+#define EXT2_DX_MAX_LEVELS          3
+
 /* Forward declaration... */
 struct ext2_inode;
+struct ext2_dir_cache;
 
 /* Check if a directory is empty. */
 int ext2_dir_is_empty(ext2_fs_t *fs, const struct ext2_inode *dir);
@@ -40,6 +81,11 @@ int ext2_dir_is_empty(ext2_fs_t *fs, const struct ext2_inode *dir);
 ext2_dirent_t *ext2_dir_entry(ext2_fs_t *fs, const struct ext2_inode *dir,
                               const char *fn);
 
+/* Find an entry in a directory, as above. If it isn't found, *err is set to 0
+   if it just isn't there, or a negative error code if something went wrong. */
+ext2_dirent_t *ext2_dir_find(ext2_fs_t *fs, const struct ext2_inode *dir,
+                             const char *fn, int *err);
+
 /* Delete an entry from a directory. Note that this does nothing about cleaning
    up the inode, but it does tell you which inode you're going to need to clean
    up (or lower the reference count on). */
@@ -60,5 +106,8 @@ int ext2_dir_create_empty(ext2_fs_t *fs, struct ext2_inode *dir,
 int ext2_dir_redir_entry(ext2_fs_t *fs, struct ext2_inode *dir, const char *fn,
                          uint32_t inode_num, ext2_dirent_t **rv);
 
+/* Free the index of names kept in memory for a directory. */
+void ext2_dir_cache_free(struct ext2_dir_cache *dc);
+
 __END_DECLS
 #endif /* !__EXT2_DIRECTORY_H */
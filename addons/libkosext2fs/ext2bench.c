@@ -0,0 +1,555 @@
+/* KallistiOS ##version##
+
+   ext2bench.c
+*/
+
+/* Host-side benchmark for the block cache of libkosext2fs. This mounts an
+   ext2 image file through a simple file-backed block device, then replays a
+   typical workload against it: a walk of the whole directory tree, followed
+   by a pass that reads every regular file in full and, with -w, rewrites each
+   of its blocks in place (with the same data), as copying the files to a
+   freshly allocated destination would. This is done for several budgets of
+   the shared buffer cache (see kos/bcache.h), and the time taken, the number
+   of requests made to the block device and the cache's hit rate are printed
+   for each one.
+
+   With -a, it instead writes some new files to the root directory of the
+   image, a chunk at a time, the way fs_ext2 does for write() calls, with one
+   file or several at once, and with and without allocating their space ahead
+   of time. The time taken, the requests made to the block device and how many
+   pieces the files ended up in on the disk are printed, and then the files
+   are deleted again.
+
+   With -d, it times looking up every name in a big directory, in a random
+   order, along with making the directory first, if the image doesn't have it
+   yet. The directory is left on the image, so that it can be given an index
+   on the disk (with "e2fsck -fD image.ext2") and timed again.
+
+   Build it with "make -f Makefile.nonkos ext2bench", then run it like so:
+       ./ext2bench [-w | -a] image.ext2
+       ./ext2bench -d image.ext2 [entries] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kos/bcache.h>
+
+#include "ext2fs.h"
+#include "inode.h"
+#include "directory.h"
+
+#define SECTOR_SIZE     512
+#define MAX_INODES      65536
+
+typedef struct bench_dev {
+    FILE *fp;
+    unsigned long reads, writes;
+    unsigned long blocks_read, blocks_written;
+} bench_dev_t;
+
+static int bd_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int bd_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int bd_read(const kos_blockdev_t *d, uint64_t block, size_t count,
+                   void *buf) {
+    bench_dev_t *dev = (bench_dev_t *)d->dev_data;
+
+    ++dev->reads;
+    dev->blocks_read += count;
+
+    if(fseek(dev->fp, (long)block * SECTOR_SIZE, SEEK_SET))
+        return -1;
+
+    return fread(buf, SECTOR_SIZE, count, dev->fp) == count ? 0 : -1;
+}
+
+static int bd_write(const kos_blockdev_t *d, uint64_t block, size_t count,
+                    const void *buf) {
+    bench_dev_t *dev = (bench_dev_t *)d->dev_data;
+
+    ++dev->writes;
+    dev->blocks_written += count;
+
+    if(fseek(dev->fp, (long)block * SECTOR_SIZE, SEEK_SET))
+        return -1;
+
+    return fwrite(buf, SECTOR_SIZE, count, dev->fp) == count ? 0 : -1;
+}
+
+static uint64_t bd_count(const kos_blockdev_t *d) {
+    bench_dev_t *dev = (bench_dev_t *)d->dev_data;
+    long sz;
+
+    fseek(dev->fp, 0, SEEK_END);
+    sz = ftell(dev->fp);
+    return (uint64_t)(sz / SECTOR_SIZE);
+}
+
+/* Inodes of the regular files found during the directory walk. */
+static uint32_t files[MAX_INODES];
+static int file_count;
+
+static int walk_dir(ext2_fs_t *fs, uint32_t ino) {
+    uint32_t subdirs[256];
+    int subdir_count = 0;
+    ext2_inode_t *inode;
+    ext2_dirent_t *dent;
+    uint8_t *blk;
+    uint32_t i, off, nblocks, bs = ext2_block_size(fs);
+    int err, j;
+
+    if(!(inode = ext2_inode_get(fs, ino, &err)))
+        return -1;
+
+    nblocks = inode->i_size / bs;
+
+    for(i = 0; i < nblocks; ++i) {
+        if(!(blk = ext2_inode_read_block(fs, inode, i, NULL, &err))) {
+            ext2_inode_put(inode);
+            return -1;
+        }
+
+        for(off = 0; off < bs; off += dent->rec_len) {
+            dent = (ext2_dirent_t *)(blk + off);
+
+            if(!dent->rec_len)
+                break;
+
+            if(!dent->inode || (dent->name_len <= 2 && dent->name[0] == '.' &&
+                                (dent->name_len == 1 || dent->name[1] == '.')))
+                continue;
+
+            if(dent->file_type == EXT2_FT_DIR && subdir_count < 256)
+                subdirs[subdir_count++] = dent->inode;
+            else if(dent->file_type == EXT2_FT_REG_FILE &&
+                    file_count < MAX_INODES)
+                files[file_count++] = dent->inode;
+        }
+    }
+
+    ext2_inode_put(inode);
+
+    for(j = 0; j < subdir_count; ++j) {
+        if(walk_dir(fs, subdirs[j]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int copy_files(ext2_fs_t *fs, int rewrite) {
+    ext2_inode_t *inode;
+    uint32_t i, nblocks, bl, bs = ext2_block_size(fs);
+    int j, err;
+
+    for(j = 0; j < file_count; ++j) {
+        if(!(inode = ext2_inode_get(fs, files[j], &err)))
+            return -1;
+
+        nblocks = (uint32_t)((ext2_inode_size(inode) + bs - 1) / bs);
+
+        for(i = 0; i < nblocks; ++i) {
+            if(!ext2_inode_read_block(fs, inode, i, &bl, &err)) {
+                ext2_inode_put(inode);
+                return -1;
+            }
+
+            if(rewrite)
+                ext2_block_mark_dirty(fs, bl);
+        }
+
+        ext2_inode_put(inode);
+    }
+
+    return 0;
+}
+
+/* Write to the end of a file, the way fs_ext2_write() does. */
+static int append(ext2_fs_t *fs, ext2_inode_t *inode, const uint8_t *buf,
+                  size_t cnt) {
+    uint32_t bs = ext2_block_size(fs), lbs = ext2_log_block_size(fs), bo;
+    uint64_t ptr = ext2_inode_size(inode);
+    uint8_t *block;
+    size_t n;
+    int err;
+
+    while(cnt) {
+        if(!(block = ext2_inode_write_block(fs, inode, (uint32_t)(ptr >> lbs),
+                                            &err)))
+            return -1;
+
+        bo = ptr & (bs - 1);
+        n = bs - bo < cnt ? bs - bo : cnt;
+        memcpy(block + bo, buf, n);
+        ptr += n;
+        buf += n;
+        cnt -= n;
+    }
+
+    ext2_inode_set_size(inode, ptr);
+    ext2_inode_mark_dirty(inode);
+    return 0;
+}
+
+#define META_GAP        3
+
+/* Count the runs of blocks that a file is in on the disk, not counting the
+   file's own indirect blocks in between as breaking a run. */
+static uint32_t pieces(ext2_fs_t *fs, ext2_inode_t *inode) {
+    uint32_t i, bl, last = 0, rv = 0, bs = ext2_block_size(fs);
+    uint32_t nblocks = (uint32_t)((ext2_inode_size(inode) + bs - 1) / bs);
+    int err;
+
+    for(i = 0; i < nblocks; ++i) {
+        if(!ext2_inode_read_block(fs, inode, i, &bl, &err))
+            break;
+
+        if(!i || bl <= last || bl > last + 1 + META_GAP)
+            ++rv;
+
+        last = bl;
+    }
+
+    return rv;
+}
+
+#define MAX_WRITERS     8
+
+typedef struct append_test {
+    const char *name;
+    int files;                  /* Written at once, a chunk each in turn */
+    size_t size;                /* Of each file */
+    size_t chunk;               /* Written at a time */
+    int prealloc;               /* Allocate the space up front */
+} append_test_t;
+
+static const append_test_t append_tests[] = {
+    { "1 file, 4KiB writes",            1, 4 << 20, 4096, 0 },
+    { "1 file, 512B writes",            1, 4 << 20, 512,  0 },
+    { "4 files, 4KiB writes",           4, 1 << 20, 4096, 0 },
+    { "4 files, 512B writes",           4, 1 << 20, 512,  0 },
+    { "4 files, preallocated",          4, 1 << 20, 4096, 1 },
+    { "8 files, 4KiB writes",           8, 512 << 10, 4096, 0 },
+    { NULL }
+};
+
+static int run_append(FILE *fp, const append_test_t *t) {
+    bench_dev_t dev = { fp, 0, 0, 0, 0 };
+    kos_blockdev_t bd = { &dev, 9, &bd_init, &bd_shutdown, &bd_read,
+                          &bd_write, &bd_count };
+    ext2_fs_t *fs;
+    ext2_inode_t *root, *inodes[MAX_WRITERS];
+    uint32_t inos[MAX_WRITERS], total = 0;
+    uint8_t buf[4096];
+    char names[MAX_WRITERS][16];
+    size_t off;
+    clock_t start, end;
+    int i, err, rv = -1;
+
+    if(!(fs = ext2_fs_init(&bd, EXT2FS_MNT_FLAG_RW))) {
+        fprintf(stderr, "Cannot mount the filesystem\n");
+        return -1;
+    }
+
+    if(!(root = ext2_inode_get(fs, EXT2_ROOT_INO, &err))) {
+        ext2_fs_shutdown(fs);
+        return -1;
+    }
+
+    memset(buf, 0xA5, sizeof(buf));
+    dev.reads = dev.writes = dev.blocks_read = dev.blocks_written = 0;
+    start = clock();
+
+    for(i = 0; i < t->files; ++i) {
+        sprintf(names[i], "bench.%d", i);
+
+        if(!(inodes[i] = ext2_inode_alloc(fs, EXT2_ROOT_INO, &err, &inos[i])))
+            goto out;
+
+        inodes[i]->i_mode = EXT2_S_IFREG | 0644;
+        inodes[i]->i_links_count = 1;
+
+        if(ext2_dir_add_entry(fs, root, names[i], inos[i], inodes[i], NULL))
+            goto out;
+
+        if(t->prealloc && ext2_inode_fallocate(fs, inodes[i], t->size, 1))
+            goto out;
+    }
+
+    for(off = 0; off < t->size; off += t->chunk) {
+        for(i = 0; i < t->files; ++i) {
+            if(append(fs, inodes[i], buf, t->chunk)) {
+                fprintf(stderr, "Write failed\n");
+                goto out;
+            }
+        }
+    }
+
+    for(i = 0; i < t->files; ++i)
+        ext2_inode_put(inodes[i]);
+
+    ext2_fs_sync(fs);
+    end = clock();
+
+    for(i = 0; i < t->files; ++i) {
+        if(!(inodes[i] = ext2_inode_get(fs, inos[i], &err)))
+            goto out;
+
+        total += pieces(fs, inodes[i]);
+    }
+
+    printf("%-24s %8.2f ms, %6lu writes (%8lu sectors), %5.1f pieces/file\n",
+           t->name, (end - start) * 1000.0 / CLOCKS_PER_SEC, dev.writes,
+           dev.blocks_written, (double)total / t->files);
+    rv = 0;
+
+out:
+    /* Get rid of the files again. */
+    while(i-- > 0)
+        ext2_inode_put(inodes[i]);
+
+    for(i = 0; i < t->files; ++i) {
+        if(!ext2_dir_rm_entry(fs, root, names[i], &inos[i]))
+            ext2_inode_deref(fs, inos[i], 0);
+    }
+
+    ext2_inode_put(root);
+    ext2_fs_shutdown(fs);
+    return rv;
+}
+
+#define DIR_NAME        "bench.d"
+
+static int run_dir(FILE *fp, int count) {
+    bench_dev_t dev = { fp, 0, 0, 0, 0 };
+    kos_blockdev_t bd = { &dev, 9, &bd_init, &bd_shutdown, &bd_read,
+                          &bd_write, &bd_count };
+    ext2_fs_t *fs;
+    ext2_inode_t *root, *dir = NULL, *file;
+    ext2_dirent_t *dent;
+    uint32_t dir_ino, file_ino;
+    char name[16];
+    int *order, i, j, t, err, rv = -1;
+    clock_t start, end;
+
+    if(!(fs = ext2_fs_init(&bd, EXT2FS_MNT_FLAG_RW))) {
+        fprintf(stderr, "Cannot mount the filesystem\n");
+        return -1;
+    }
+
+    order = (int *)malloc(count * sizeof(int));
+
+    if(!order || !(root = ext2_inode_get(fs, EXT2_ROOT_INO, &err))) {
+        free(order);
+        ext2_fs_shutdown(fs);
+        return -1;
+    }
+
+    if((dent = ext2_dir_entry(fs, root, DIR_NAME))) {
+        if(!(dir = ext2_inode_get(fs, dent->inode, &err)))
+            goto out;
+    }
+    else {
+        /* Make the directory, with every entry in it a link to one file. */
+        if(!(dir = ext2_inode_alloc(fs, EXT2_ROOT_INO, &err, &dir_ino)))
+            goto out;
+
+        dir->i_mode = EXT2_S_IFDIR | 0755;
+
+        if(ext2_dir_create_empty(fs, dir, dir_ino, EXT2_ROOT_INO) ||
+           ext2_dir_add_entry(fs, root, DIR_NAME, dir_ino, dir, NULL))
+            goto out;
+
+        ++root->i_links_count;
+        ext2_inode_mark_dirty(root);
+        ext2_inode_mark_dirty(dir);
+
+        if(!(file = ext2_inode_alloc(fs, dir_ino, &err, &file_ino)))
+            goto out;
+
+        file->i_mode = EXT2_S_IFREG | 0644;
+        file->i_links_count = count;
+        ext2_inode_mark_dirty(file);
+        start = clock();
+
+        for(i = 0; i < count; ++i) {
+            sprintf(name, "file%05d", i);
+
+            if(ext2_dir_add_entry(fs, dir, name, file_ino, file, NULL)) {
+                fprintf(stderr, "Cannot add %s\n", name);
+                ext2_inode_put(file);
+                goto out;
+            }
+        }
+
+        end = clock();
+        ext2_inode_put(file);
+        ext2_fs_sync(fs);
+        printf("%-24s %8.2f us each\n", "Create",
+               (end - start) * 1000000.0 / CLOCKS_PER_SEC / count);
+    }
+
+    for(i = 0; i < count; ++i)
+        order[i] = i;
+
+    srand(1234);
+
+    for(i = count - 1; i > 0; --i) {
+        j = rand() % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    dev.reads = dev.blocks_read = 0;
+    start = clock();
+
+    for(i = 0; i < count; ++i) {
+        sprintf(name, "file%05d", order[i]);
+
+        if(!ext2_dir_entry(fs, dir, name)) {
+            fprintf(stderr, "Cannot find %s\n", name);
+            goto out;
+        }
+    }
+
+    end = clock();
+    printf("%-24s %8.2f us each, %6lu reads (%8lu sectors)\n",
+           dir->i_flags & EXT2_INDEX_FL ? "Look up (indexed)" : "Look up",
+           (end - start) * 1000000.0 / CLOCKS_PER_SEC / count, dev.reads,
+           dev.blocks_read);
+    rv = 0;
+
+out:
+    if(dir)
+        ext2_inode_put(dir);
+
+    ext2_inode_put(root);
+    ext2_fs_shutdown(fs);
+    free(order);
+    return rv;
+}
+
+static int run(FILE *fp, size_t budget, int rewrite) {
+    bench_dev_t dev = { fp, 0, 0, 0, 0 };
+    kos_blockdev_t bd = { &dev, 9, &bd_init, &bd_shutdown, &bd_read,
+                          &bd_write, &bd_count };
+    ext2_fs_t *fs;
+    bcache_stats_t st;
+    clock_t start, walk, end;
+
+    bcache_set_budget(budget);
+    bcache_reset_stats(NULL);
+
+    if(!(fs = ext2_fs_init(&bd, rewrite ? EXT2FS_MNT_FLAG_RW :
+                           EXT2FS_MNT_FLAG_RO))) {
+        fprintf(stderr, "Cannot mount the filesystem\n");
+        return -1;
+    }
+
+    file_count = 0;
+    start = clock();
+
+    if(walk_dir(fs, EXT2_ROOT_INO)) {
+        fprintf(stderr, "Directory walk failed\n");
+        ext2_fs_shutdown(fs);
+        return -1;
+    }
+
+    walk = clock();
+
+    if(copy_files(fs, rewrite)) {
+        fprintf(stderr, "File copy failed\n");
+        ext2_fs_shutdown(fs);
+        return -1;
+    }
+
+    ext2_fs_sync(fs);
+    end = clock();
+    bcache_get_stats(NULL, &st);
+
+    printf("%6lu KiB: walk %8.2f ms, copy %8.2f ms, "
+           "%7lu reads (%8lu sectors), %7lu writes (%8lu sectors), "
+           "%5.1f%% hits\n",
+           (unsigned long)(budget >> 10), (walk - start) * 1000.0 /
+           CLOCKS_PER_SEC, (end - walk) * 1000.0 / CLOCKS_PER_SEC, dev.reads,
+           dev.blocks_read, dev.writes, dev.blocks_written,
+           st.hits + st.misses ? 100.0 * st.hits / (st.hits + st.misses) : 0.0);
+
+    ext2_fs_shutdown(fs);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t budgets[] = { 16 << 10, 64 << 10, 256 << 10,
+                                      1 << 20, 4 << 20, 16 << 20 };
+    int rewrite = 0, appending = 0, dirs = 0, count = 10000, i;
+    FILE *fp;
+
+    if(argc > 1 && !strcmp(argv[1], "-w")) {
+        rewrite = 1;
+        --argc;
+        ++argv;
+    }
+    else if(argc > 1 && !strcmp(argv[1], "-a")) {
+        appending = 1;
+        --argc;
+        ++argv;
+    }
+    else if(argc > 1 && !strcmp(argv[1], "-d")) {
+        dirs = 1;
+        --argc;
+        ++argv;
+
+        if(argc == 3) {
+            count = atoi(argv[2]);
+            --argc;
+        }
+    }
+
+    if(argc != 2 || count < 1 || count > 65000) {
+        fprintf(stderr, "Usage: ext2bench [-w | -a] image\n"
+                "       ext2bench -d image [entries]\n");
+        return 1;
+    }
+
+    if(!(fp = fopen(argv[1], rewrite || appending || dirs ? "r+b" : "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    ext2_init();
+
+    if(dirs) {
+        i = run_dir(fp, count);
+        fclose(fp);
+        return i ? 1 : 0;
+    }
+
+    if(appending) {
+        for(i = 0; append_tests[i].name; ++i) {
+            if(run_append(fp, &append_tests[i]))
+                break;
+        }
+
+        fclose(fp);
+        return 0;
+    }
+
+    for(i = 0; i < (int)(sizeof(budgets) / sizeof(budgets[0])); ++i) {
+        if(run(fp, budgets[i], rewrite))
+            break;
+    }
+
+    fclose(fp);
+    return 0;
+}
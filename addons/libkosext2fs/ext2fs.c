@@ -21,69 +21,21 @@
 
 static int initted = 0;
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(ext2_fs_t *fs, ext2_cache_t **cache, int block) {
-    int i;
-    ext2_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
-    }
-
-    cache[fs->cache_size - 1] = tmp;
-}
-
-/* XXXX: This needs locking! */
+/* Blocks are cached in the shared buffer cache (see kos/bcache.h), attached
+   with the filesystem's block size. The rest of the library holds on to
+   pointers into the cache for a while after reading blocks, so they're read
+   with bcache_read(), which keeps the last cache_sz of them around. */
 uint8_t *ext2_block_read(ext2_fs_t *fs, uint32_t bl, int *err) {
-    int i;
     uint8_t *rv;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == bl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
 
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if(ext2_block_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
-
-    /* Try to read the block in question. */
-    if(ext2_block_read_nc(fs, bl, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
+    if(fs->sb.s_blocks_count <= bl) {
+        *err = EINVAL;
         return NULL;
     }
 
-    cache[i]->block = bl;
-    cache[i]->flags = EXT2_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = bcache_read(fs->bcache, bl, 0)))
+        *err = errno;
 
-out:
     return rv;
 }
 
@@ -124,42 +76,36 @@ int ext2_block_write_nc(ext2_fs_t *fs, uint32_t block_num, const uint8_t *blk) {
 }
 
 int ext2_block_mark_dirty(ext2_fs_t *fs, uint32_t block_num) {
-    int i;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == block_num && cache[i]->flags) {
-            cache[i]->flags |= EXT2_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
-    }
+    if(bcache_mark_dirty_block(fs->bcache, block_num))
+        return -EINVAL;
 
-    return -EINVAL;
+    return 0;
 }
 
 int ext2_block_cache_wb(ext2_fs_t *fs) {
-    int i, err;
-    ext2_cache_t **cache = fs->bcache;
-
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if((err = ext2_block_write_nc(fs, cache[i]->block, cache[i]->data)))
-                return err;
+    if(bcache_flush(fs->bcache))
+        return -errno;
 
-            cache[i]->flags &= ~EXT2_CACHE_FLAG_DIRTY;
-        }
-    }
-    
     return 0;
 }
 
+uint8_t *ext2_block_clear(ext2_fs_t *fs, uint32_t bn, int *err) {
+    uint8_t *blk;
+
+    if(!(blk = bcache_read(fs->bcache, bn, BCACHE_NOREAD))) {
+        *err = errno;
+        return NULL;
+    }
+
+    memset(blk, 0, fs->block_size);
+    ext2_block_mark_dirty(fs, bn);
+    return blk;
+}
+
 uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
     uint8_t *buf, *blk;
     uint32_t index;
@@ -170,8 +116,9 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
         return NULL;
     }
 
-    /* See if we have any free blocks at all... */
-    if(!fs->sb.s_free_blocks_count) {
+    /* See if we have any free blocks at all, other than those set aside for
+       data that hasn't been written out yet... */
+    if(fs->sb.s_free_blocks_count <= fs->reserved) {
         *err = ENOSPC;
         return NULL;
     }
@@ -187,8 +134,10 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
             *bn = index + bg * fs->sb.s_blocks_per_group +
                 fs->sb.s_first_data_block;
 
-            if(!(blk = ext2_block_read(fs, *bn, err)))
+            if(!(blk = bcache_read(fs->bcache, *bn, BCACHE_NOREAD))) {
+                *err = errno;
                 return NULL;
+            }
 
             ext2_bit_set((uint32_t *)buf, index);
             ext2_block_mark_dirty(fs, fs->bg[bg].bg_block_bitmap);
@@ -221,8 +170,10 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
                 *bn = index + bg * fs->sb.s_blocks_per_group +
                     fs->sb.s_first_data_block;
 
-                if(!(blk = ext2_block_read(fs, *bn, err)))
+                if(!(blk = bcache_read(fs->bcache, *bn, BCACHE_NOREAD))) {
+                    *err = errno;
                     return NULL;
+                }
 
                 ext2_bit_set((uint32_t *)buf, index);
                 ext2_block_mark_dirty(fs, fs->bg[bg].bg_block_bitmap);
@@ -252,6 +203,147 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
     return NULL;
 }
 
+/* Blocks in a block group, which is fewer than s_blocks_per_group for the last
+   group on most filesystems. */
+static uint32_t group_blocks(const ext2_fs_t *fs, uint32_t bg) {
+    uint32_t left = fs->sb.s_blocks_count - fs->sb.s_first_data_block -
+        bg * fs->sb.s_blocks_per_group;
+
+    return left < fs->sb.s_blocks_per_group ? left : fs->sb.s_blocks_per_group;
+}
+
+uint32_t ext2_block_alloc_run(ext2_fs_t *fs, uint32_t goal, uint32_t want,
+                              uint32_t *count, int *err) {
+    uint8_t *buf;
+    uint32_t bg, gbg, start, limit, index, len, i, n;
+    uint32_t best = 0, best_len = 0, best_bg = 0;
+
+    /* Don't even bother if we're mounted read-only. */
+    if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW)) {
+        *err = EROFS;
+        return 0;
+    }
+
+    /* Blocks set aside for data that hasn't been written out yet aren't up
+       for grabs. */
+    if(fs->sb.s_free_blocks_count <= fs->reserved) {
+        *err = ENOSPC;
+        return 0;
+    }
+
+    if(want > fs->sb.s_free_blocks_count - fs->reserved)
+        want = fs->sb.s_free_blocks_count - fs->reserved;
+
+    if(goal < fs->sb.s_first_data_block || goal >= fs->sb.s_blocks_count)
+        goal = fs->sb.s_first_data_block;
+
+    gbg = (goal - fs->sb.s_first_data_block) / fs->sb.s_blocks_per_group;
+
+    /* Look for a run of free blocks as long as we want, starting at the goal
+       and going around the whole disk, back to the start of the goal's group.
+       A run that starts right at the goal is taken however short it is, so
+       that a file can carry on where it left off. Otherwise, if there's no
+       run long enough, take the longest one there is. */
+    for(n = 0; n <= fs->bg_count; ++n) {
+        bg = (gbg + n) % fs->bg_count;
+
+        if(!fs->bg[bg].bg_free_blocks_count)
+            continue;
+
+        if(!(buf = ext2_block_read(fs, fs->bg[bg].bg_block_bitmap, err)))
+            return 0;
+
+        limit = group_blocks(fs, bg);
+        index = start = n ? 0 : (goal - fs->sb.s_first_data_block) %
+            fs->sb.s_blocks_per_group;
+
+        while((index = ext2_bit_find_zero((uint32_t *)buf, index, limit)) <
+              limit) {
+            for(len = 1; len < want && index + len < limit &&
+                !ext2_bit_is_set((uint32_t *)buf, index + len); ++len) ;
+
+            if(len == want || (!n && index == start)) {
+                best = index;
+                best_len = len;
+                best_bg = bg;
+                goto found;
+            }
+
+            if(len > best_len) {
+                best = index;
+                best_len = len;
+                best_bg = bg;
+            }
+
+            index += len;
+        }
+    }
+
+    if(!best_len) {
+        /* Uh oh... We went through everything and didn't find any. That means
+           the data in the superblock is wrong. */
+        dbglog(DBG_WARNING, "ext2_block_alloc_run: Filesystem indicates that "
+               "it has free blocks, but doesn't appear to. Please run fsck on "
+               "this volume!\n");
+        *err = ENOSPC;
+        return 0;
+    }
+
+    /* The longest run might have been in a group we've since read past. */
+    if(!(buf = ext2_block_read(fs, fs->bg[best_bg].bg_block_bitmap, err)))
+        return 0;
+
+found:
+    /* Take the whole run at once: one change to the bitmap block, and one to
+       the counters. */
+    for(i = 0; i < best_len; ++i)
+        ext2_bit_set((uint32_t *)buf, best + i);
+
+    ext2_block_mark_dirty(fs, fs->bg[best_bg].bg_block_bitmap);
+    fs->bg[best_bg].bg_free_blocks_count -= best_len;
+    fs->sb.s_free_blocks_count -= best_len;
+    fs->flags |= EXT2_FS_FLAG_SB_DIRTY;
+
+    *count = best_len;
+    return best + best_bg * fs->sb.s_blocks_per_group +
+        fs->sb.s_first_data_block;
+}
+
+int ext2_block_free_run(ext2_fs_t *fs, uint32_t blk, uint32_t count) {
+    uint8_t *buf;
+    uint32_t bg, index, n;
+    int err;
+
+    while(count) {
+        bg = (blk - fs->sb.s_first_data_block) / fs->sb.s_blocks_per_group;
+        index = (blk - fs->sb.s_first_data_block) % fs->sb.s_blocks_per_group;
+        n = fs->sb.s_blocks_per_group - index;
+
+        if(n > count)
+            n = count;
+
+        if(!(buf = ext2_block_read(fs, fs->bg[bg].bg_block_bitmap, &err)))
+            return -err;
+
+        blk += n;
+        count -= n;
+        fs->bg[bg].bg_free_blocks_count += n;
+        fs->sb.s_free_blocks_count += n;
+
+        while(n--)
+            ext2_bit_clear((uint32_t *)buf, index++);
+
+        ext2_block_mark_dirty(fs, fs->bg[bg].bg_block_bitmap);
+    }
+
+    fs->flags |= EXT2_FS_FLAG_SB_DIRTY;
+    return 0;
+}
+
+void ext2_fs_cache_stats(const ext2_fs_t *fs, bcache_stats_t *st) {
+    bcache_get_stats(fs->bcache, st);
+}
+
 uint32_t ext2_block_size(const ext2_fs_t *fs) {
     return fs->block_size;
 }
@@ -274,12 +366,11 @@ ext2_fs_t *ext2_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     ext2_fs_t *rv;
     uint32_t bc;
-    int j;
     int block_size;
 
 #ifdef EXT2FS_DEBUG
-    uint32_t tmp;
-    uint32_t p3 = 3, p5 = 5, p7 = 7, i;
+    uint32_t tmp, i;
+    uint32_t p3 = 3, p5 = 5, p7 = 7;
 #endif
 
     /* Make sure we've initialized any of the lower-level stuff. */
@@ -297,6 +388,8 @@ ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     }
 
     rv->dev = bd;
+    rv->flags = 0;
+    rv->reserved = 0;
     rv->mnt_flags = flags & EXT2FS_MNT_VALID_FLAGS_MASK;
 
     if(rv->mnt_flags != flags) {
@@ -408,47 +501,15 @@ ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     }
 #endif /* EXT2FS_DEBUG */
 
-    /* Make space for the block cache. */
-    if(!(rv->bcache = (ext2_cache_t **)malloc(sizeof(ext2_cache_t *) *
-                                              cache_sz))) {
+    /* Attach to the buffer cache. */
+    if(!(rv->bcache = bcache_attach(bd, block_size, 0, cache_sz))) {
         free(rv->bg);
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (ext2_cache_t *)malloc(sizeof(ext2_cache_t))))
-            goto out_cache;
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)malloc(block_size)))
-            goto out_bcache;
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
-
     return rv;
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv->bg);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int ext2_fs_sync(ext2_fs_t *fs) {
@@ -499,17 +560,10 @@ int ext2_fs_sync(ext2_fs_t *fs) {
 }
 
 void ext2_fs_shutdown(ext2_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     ext2_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
+    bcache_detach(fs->bcache);
     fs->dev->shutdown(fs->dev);
     free(fs->bg);
     free(fs);
@@ -11,6 +11,7 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <kos/bcache.h>
 
 #ifndef EXT2_NOT_IN_KOS
 #include <kos/blockdev.h>
@@ -35,14 +36,12 @@ __BEGIN_DECLS
    constant. */
 #define EXT2_LOG_INODE_HASH     (EXT2_LOG_MAX_INODES - 2)
 
-/* Size of the block cache, in filesystem blocks. When reading from the
-   filesystem, all data is read in block-sized units. The size of a block can
-   generally range from 1024 bytes to 4096 bytes, and is dependent on the
-   parameters the filesystem was formatted with. Increasing this value should
-   ensure that more accesses can be handled by the cache, but also increases the
-   latency at which data is written back to the block device itself. Setting
-   this to 32 should work well enough, but if you have more memory to spare,
-   feel free to set it larger.
+/* Number of blocks kept in the block cache for each filesystem. Blocks are
+   cached in the buffer cache shared by all filesystems on block devices (see
+   kos/bcache.h), which has a memory budget of its own. On top of that, the
+   blocks most recently read by each filesystem are always kept, as the rest
+   of the library holds on to pointers into the cache for a while. Setting
+   this to 32 should work well enough; lowering it much is not a good idea.
 
    Note that this is a default value for filesystems initialized/mounted with
    ext2_fs_init(). If you wish to specify your own value that differs from this
@@ -50,6 +49,23 @@ __BEGIN_DECLS
 */
 #define EXT2_CACHE_BLOCKS       32
 
+/* Number of blocks of data written to the end of a file that are held in
+   memory before any blocks on the disk are picked for them. Holding them back
+   lets the blocks be picked all at once, in one run, rather than one at a time
+   as they're written. Each file being written to uses a buffer this many
+   blocks long. This can't be more than 256.
+*/
+#define EXT2_DELALLOC_BLOCKS    32
+
+/* Directories this many blocks long or longer that don't have an index on the
+   disk get an index of the names in them kept in memory, built the first time
+   something is looked up in them. With it, looking up a name or adding one
+   only takes reading a block or two, rather than the whole directory. The
+   index takes about 16 bytes for each entry in the directory. Set this to 0 to
+   not keep any of these indexes.
+*/
+#define EXT2_DIR_CACHE_BLOCKS   4
+
 /* End tunable filesystem parameters. */
 
 /* Convenience stuff, for in case you want to use this outside of KOS. */
@@ -60,11 +76,11 @@ typedef struct kos_blockdev {
     uint32_t l_block_size;
     int (*init)(struct kos_blockdev *d);
     int (*shutdown)(struct kos_blockdev *d);
-    int (*read_blocks)(const struct kos_blockdev *d, uint32_t block, size_t count,
+    int (*read_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                        void *buf);
-    int (*write_blocks)(const struct kos_blockdev *d, uint32_t block, size_t count,
+    int (*write_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                         const void *buf);
-    uint32_t (*count_blocks)(const struct kos_blockdev *d);
+    uint64_t (*count_blocks)(const struct kos_blockdev *d);
 } kos_blockdev_t;
 
 #ifndef SYMLOOP_MAX
@@ -97,6 +113,9 @@ ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz);
 int ext2_fs_sync(ext2_fs_t *fs);
 void ext2_fs_shutdown(ext2_fs_t *fs);
 
+/* Fetch the block cache counters for the filesystem (see kos/bcache.h). */
+void ext2_fs_cache_stats(const ext2_fs_t *fs, bcache_stats_t *st);
+
 int ext2_block_read_nc(ext2_fs_t *fs, uint32_t block_num, uint8_t *rv);
 uint8_t *ext2_block_read(ext2_fs_t *fs, uint32_t block_num, int *err);
 
@@ -110,6 +129,20 @@ int ext2_block_cache_wb(ext2_fs_t *fs);
 
 uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err);
 
+/* Get a block that has just been allocated into the cache, cleared out and
+   marked dirty, without reading it from the block device. */
+uint8_t *ext2_block_clear(ext2_fs_t *fs, uint32_t bn, int *err);
+
+/* Allocate a run of up to want free blocks, as close after goal as can be
+   found. The first block of the run is returned, with the length of it in
+   *count, or 0 on error. The blocks are only marked as used; they aren't read
+   into the cache or cleared. */
+uint32_t ext2_block_alloc_run(ext2_fs_t *fs, uint32_t goal, uint32_t want,
+                              uint32_t *count, int *err);
+
+/* Mark a run of blocks as free again. */
+int ext2_block_free_run(ext2_fs_t *fs, uint32_t blk, uint32_t count);
+
 __END_DECLS
 
 #endif /* !__EXT2_EXT2FS_H */
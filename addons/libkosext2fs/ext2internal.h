@@ -16,14 +16,7 @@
 #ifndef __EXT2_EXT2INTERNAL_H
 #define __EXT2_EXT2INTERNAL_H
 
-#define EXT2_CACHE_FLAG_VALID   1
-#define EXT2_CACHE_FLAG_DIRTY   2
-
-typedef struct ext2_cache {
-    uint32_t flags;
-    uint32_t block;
-    uint8_t *data;
-} ext2_cache_t;
+#include <kos/bcache.h>
 
 struct ext2fs_struct {
     kos_blockdev_t *dev;
@@ -33,11 +26,15 @@ struct ext2fs_struct {
     uint32_t bg_count;
     ext2_bg_desc_t *bg;
 
-    ext2_cache_t **bcache;
-    int cache_size;
+    /* Blocks are cached in the buffer cache shared with other filesystems. */
+    bcache_dev_t *bcache;
 
     uint32_t flags;
     uint32_t mnt_flags;
+
+    /* Free blocks set aside for file data that's waiting in memory to be given
+       blocks (see ext2_inode_write_block()). */
+    uint32_t reserved;
 };
 
 /* The superblock and/or block descriptors need to be written to the block
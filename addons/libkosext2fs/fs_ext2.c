@@ -228,17 +228,26 @@ created:
 
 static int fs_ext2_close(void *h) {
     file_t fd = ((file_t)h) - 1;
+    int rv = 0, err;
 
     mutex_lock(&ext2_mutex);
 
     if(fd < MAX_EXT2_FILES && fh[fd].mode) {
+        /* Give anything written that's still in memory its blocks now, so that
+           running out of space or an I/O error can be reported. */
+        if((fh[fd].fs->mount_flags & FS_EXT2_MOUNT_READWRITE) &&
+           (err = ext2_inode_flush(fh[fd].fs->fs, fh[fd].inode))) {
+            errno = -err;
+            rv = -1;
+        }
+
         ext2_inode_put(fh[fd].inode);
         fh[fd].inode_num = 0;
         fh[fd].mode = 0;
     }
 
     mutex_unlock(&ext2_mutex);
-    return 0;
+    return rv;
 }
 
 static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
@@ -336,12 +345,12 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
 static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     ext2_fs_t *fs;
-    uint32_t bs, lbs, bo, bn;
+    uint32_t bs, lbs, bo, bn, end;
     uint8_t *block;
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
     uint64_t sz;
-    int err, mode;
+    int mode;
 
     mutex_lock(&ext2_mutex);
 
@@ -372,47 +381,32 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
         fh[fd].ptr = sz;
 
     /* If we have already moved beyond the end of the file with a seek
-       operation, allocate any blank blocks we need to to satisfy that. */
+       operation, fill in the gap with zeroes. New blocks come back cleared
+       out already, so only the end of the current last block needs it. */
     if(fh[fd].ptr > sz) {
-        /* Are we staying within the same block? */
-        if(((sz - 1) >> lbs) == ((fh[fd].ptr - 1) >> lbs)) {
-            if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
-                                               (fh[fd].ptr - 1) >> lbs, &bn,
-                                               &errno))) {
+        if((bo = sz & (bs - 1))) {
+            if(!(block = ext2_inode_write_block(fs, fh[fd].inode, sz >> lbs,
+                                                &errno))) {
                 mutex_unlock(&ext2_mutex);
                 return -1;
             }
 
-            memset(block + (sz & (bs - 1)), 0, fh[fd].ptr - sz);
-            ext2_block_mark_dirty(fs, bn);
+            if(fh[fd].ptr - sz < bs - bo)
+                memset(block + bo, 0, fh[fd].ptr - sz);
+            else
+                memset(block + bo, 0, bs - bo);
         }
-        /* Nope, we need to allocate a new one... */
-        else {
-            /* Do we need to clear the end of the current last block? */
-            if(sz & (bs - 1)) {
-                if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
-                                                   (sz - 1) >> lbs,
-                                                   &bn, &errno))) {
-                    mutex_unlock(&ext2_mutex);
-                    return -1;
-                }
 
-                memset(block + (sz & (bs - 1)), 0, bs - (sz & (bs - 1)));
-                ext2_block_mark_dirty(fs, bn);
-                sz &= (bs - 1);
-                sz += bs;
-            }
+        end = (uint32_t)((fh[fd].ptr - 1) >> lbs);
 
-            /* The size should now be nicely at a block boundary... */
-            while(sz < fh[fd].ptr) {
-                if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
-                                                    sz >> lbs, &errno))) {
-                    mutex_unlock(&ext2_mutex);
-                    return -1;
-                }
-
-                sz += bs;
+        for(bn = (uint32_t)((sz + bs - 1) >> lbs); bn <= end; ++bn) {
+            if(!ext2_inode_write_block(fs, fh[fd].inode, bn, &errno)) {
+                mutex_unlock(&ext2_mutex);
+                return -1;
             }
+
+            /* Keep the size up with the blocks the file has. */
+            ext2_inode_set_size(fh[fd].inode, (uint64_t)(bn + 1) << lbs);
         }
 
         ext2_inode_set_size(fh[fd].inode, fh[fd].ptr);
@@ -421,8 +415,8 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
 
     /* Handle the first block specially if we are offset within it. */
     if((bo = fh[fd].ptr & ((1 << lbs) - 1))) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
-                                           &bn, &errno))) {
+        if(!(block = ext2_inode_write_block(fs, fh[fd].inode,
+                                            fh[fd].ptr >> lbs, &errno))) {
             mutex_unlock(&ext2_mutex);
             return -1;
         }
@@ -438,28 +432,20 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
             fh[fd].ptr += cnt;
             cnt = 0;
         }
-
-        ext2_block_mark_dirty(fs, bn);
     }
 
-    /* While we still have more to write, do it. */
+    /* While we still have more to write, do it. Blocks past the end of the
+       file are held in memory for now (see ext2_inode_write_block()), and get
+       blocks on the disk all together later on. */
     while(cnt) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
-                                           &bn, &err))) {
-            if(err != EINVAL) {
-                mutex_unlock(&ext2_mutex);
-                errno = err;
-                return -1;
-            }
+        if(!(block = ext2_inode_write_block(fs, fh[fd].inode,
+                                            fh[fd].ptr >> lbs, &errno))) {
+            /* Keep what did get written. */
+            if(fh[fd].ptr > sz)
+                ext2_inode_set_size(fh[fd].inode, fh[fd].ptr);
 
-            if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
-                                                fh[fd].ptr >> lbs, &errno))) {
-                mutex_unlock(&ext2_mutex);
-                return -1;
-            }
-        }
-        else {
-            ext2_block_mark_dirty(fs, bn);
+            mutex_unlock(&ext2_mutex);
+            return -1;
         }
 
         if(cnt > bs) {
@@ -1358,6 +1344,57 @@ static int fs_ext2_fcntl(void *h, int cmd, va_list ap) {
     return rv;
 }
 
+static int fs_ext2_ioctl(void *h, int cmd, va_list ap) {
+    file_t fd = ((file_t)h) - 1;
+    void *arg = va_arg(ap, void *);
+    ext2_fallocate_t *fa;
+    int rv = 0, mode;
+
+    mutex_lock(&ext2_mutex);
+
+    if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
+        mutex_unlock(&ext2_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    switch(cmd) {
+        case IOCTL_BCACHE_GET_STATS:
+            ext2_fs_cache_stats(fh[fd].fs->fs, (bcache_stats_t *)arg);
+            break;
+
+        case IOCTL_EXT2_FALLOCATE:
+            fa = (ext2_fallocate_t *)arg;
+            mode = fh[fd].mode & O_MODE_MASK;
+
+            if(!fa || fa->offset < 0 || fa->len <= 0 ||
+               (fa->mode & ~EXT2_FALLOC_KEEP_SIZE)) {
+                errno = EINVAL;
+                rv = -1;
+            }
+            else if((mode != O_WRONLY && mode != O_RDWR) ||
+                    (fh[fd].mode & O_DIR)) {
+                errno = EBADF;
+                rv = -1;
+            }
+            else if((rv = ext2_inode_fallocate(fh[fd].fs->fs, fh[fd].inode,
+                                               (uint64_t)fa->offset + fa->len,
+                                               fa->mode &
+                                               EXT2_FALLOC_KEEP_SIZE))) {
+                errno = -rv;
+                rv = -1;
+            }
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+    }
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
 static int fs_ext2_link(vfs_handler_t *vfs, const char *path1,
                         const char *path2) {
     fs_ext2_fs_t *fs = (fs_ext2_fs_t *)vfs->privdata;
@@ -1904,7 +1941,7 @@ static vfs_handler_t vh = {
     NULL,                       /* tell */
     NULL,                       /* total */
     fs_ext2_readdir,            /* readdir */
-    NULL,                       /* ioctl */
+    fs_ext2_ioctl,              /* ioctl */
     fs_ext2_rename,             /* rename */
     fs_ext2_unlink,             /* unlink */
     NULL,                       /* mmap */
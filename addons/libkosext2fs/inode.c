@@ -36,6 +36,22 @@ char *strdup(const char *);
 
 #define INODE_FLAG_DIRTY    0x00000001
 
+/* Indirect blocks that adding up to 256 blocks to the end of a file can need:
+   a trebly-, doubly- and singly-indirect block, at the very worst. */
+#define DA_META             3
+
+/* Most blocks set aside for a file at once, past what it needs right now. */
+#define PA_MAX              1024
+
+/* Data written to the end of a file that hasn't been given any blocks on the
+   disk yet. These are always the blocks straight after the last one that the
+   file has on the disk. */
+struct delalloc {
+    uint32_t first;
+    uint32_t count;
+    uint8_t data[];
+};
+
 /* Internal inode storage structure. This is used for caching used inodes. */
 static struct int_inode {
     /* Start with the on-disk inode itself to make the put() function easier.
@@ -65,6 +81,24 @@ static struct int_inode {
 
     /* What inode number is this? */
     uint32_t inode_num;
+
+    /* A run of blocks set aside for the inode to take its next blocks from.
+       These are marked as used in the bitmap, and are handed back when the
+       inode is let go of or the filesystem is synced. */
+    uint32_t pa_start;
+    uint32_t pa_count;
+
+    /* Where to look for the next run of blocks, and how many blocks the
+       allocation going on now is going to take, so that they can be got as
+       one run. */
+    uint32_t pa_goal;
+    uint32_t pa_want;
+
+    /* Data waiting in memory to be given blocks, or NULL. */
+    struct delalloc *da;
+
+    /* For a directory, the index of the names in it, or NULL. */
+    struct ext2_dir_cache *dc;
 } inodes[MAX_INODES];
 
 /* Head types */
@@ -80,6 +114,11 @@ static struct inode_list inode_hash[INODE_HASH_SZ];
 /* Forward declaration... */
 static ext2_inode_t *ext2_inode_read(ext2_fs_t *fs, uint32_t inode_num);
 static int ext2_inode_wb(struct int_inode *inode);
+static int da_flush(ext2_fs_t *fs, struct int_inode *inode);
+static int inode_bmap(ext2_fs_t *fs, const ext2_inode_t *inode,
+                      uint32_t block_num, uint32_t *r_block, int *err);
+static void da_release(ext2_fs_t *fs, struct int_inode *inode);
+static void prealloc_drop(ext2_fs_t *fs, struct int_inode *inode);
 
 void ext2_inode_init(void) {
     int i;
@@ -96,6 +135,10 @@ void ext2_inode_init(void) {
         inodes[i].flags = 0;
         inodes[i].inode_num = 0;
         inodes[i].refcnt = 0;
+        inodes[i].pa_count = 0;
+        inodes[i].pa_want = 0;
+        inodes[i].da = NULL;
+        inodes[i].dc = NULL;
         TAILQ_INSERT_TAIL(&free_inodes, inodes + i, qentry);
     }
 }
@@ -136,9 +179,15 @@ ext2_inode_t *ext2_inode_get(ext2_fs_t *fs, uint32_t inode_num, int *err) {
     if(i->inode_num)
         LIST_REMOVE(i, entry);
 
+    if(i->dc) {
+        ext2_dir_cache_free(i->dc);
+        i->dc = NULL;
+    }
+
     i->refcnt = 1;
     i->inode_num = inode_num;
     i->fs = fs;
+    i->pa_goal = 0;
 
     /* Read the inode in from the block device. */
     if(!(rinode = ext2_inode_read(fs, inode_num))) {
@@ -177,6 +226,11 @@ void ext2_inode_put(ext2_inode_t *inode) {
             /* XXXX: Should probably make sure this succeeds... */
             ext2_inode_wb(iinode);
 
+        /* Anything that couldn't be written out is lost now. Hand back the
+           blocks that were set aside for it too. */
+        da_release(iinode->fs, iinode);
+        prealloc_drop(iinode->fs, iinode);
+
         /* We've gone and consumed the last reference, so put it on the free
            list at the end, in case we want to bring it back from the dead later
            on. */
@@ -208,6 +262,10 @@ void ext2_inode_retain(ext2_inode_t *inode) {
 #endif
 }
 
+struct ext2_dir_cache **ext2_inode_dir_cache(const ext2_inode_t *inode) {
+    return &((struct int_inode *)inode)->dc;
+}
+
 void ext2_inode_mark_dirty(ext2_inode_t *inode) {
     struct int_inode *iinode = (struct int_inode *)inode;
 
@@ -263,6 +321,11 @@ static int ext2_inode_wb(struct int_inode *inode) {
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return 0;
 
+    /* Give any data waiting in memory its blocks first, so that the inode
+       that goes out points at them. */
+    if((rv = da_flush(fs, inode)))
+        return rv;
+
     in_per_block = (fs->block_size) / fs->sb.s_inode_size;
 
     /* Figure out what block group and index within that group the inode in
@@ -303,6 +366,11 @@ int ext2_inode_cache_wb(ext2_fs_t *fs) {
         if(inodes[i].fs == fs && (inodes[i].flags & INODE_FLAG_DIRTY)) {
             rv = ext2_inode_wb(inodes + i);
         }
+
+        /* Don't leave blocks that no file points at marked as used on the
+           disk. */
+        if(inodes[i].fs == fs)
+            prealloc_drop(fs, inodes + i);
     }
 
     return rv;
@@ -550,6 +618,17 @@ int ext2_inode_free_all(ext2_fs_t *fs, ext2_inode_t *inode,
     struct int_inode *iinode = (struct int_inode *)inode;
     ext2_xattr_hdr_t *xattr;
 
+    /* Anything waiting to be written to the end of the file can go, and so
+       can the blocks set aside for it. */
+    da_release(fs, iinode);
+    prealloc_drop(fs, iinode);
+    iinode->pa_goal = 0;
+
+    if(iinode->dc) {
+        ext2_dir_cache_free(iinode->dc);
+        iinode->dc = NULL;
+    }
+
     /* Do a write-back on the block cache... */
     if((rv = ext2_block_cache_wb(fs)))
         return rv;
@@ -674,6 +753,10 @@ int ext2_inode_deref(ext2_fs_t *fs, uint32_t inode_num, int isdir) {
         fs->flags |= EXT2_FS_FLAG_SB_DIRTY;
     }
 
+    /* No point in writing out data for an inode that's about to go. */
+    if(!inode->i_links_count)
+        da_release(fs, (struct int_inode *)inode);
+
     if((rv = ext2_inode_wb((struct int_inode *)inode)))
         return rv;
 
@@ -687,12 +770,140 @@ int ext2_inode_deref(ext2_fs_t *fs, uint32_t inode_num, int isdir) {
     return rv;
 }
 
+/* Hand back the blocks set aside for an inode. The next run it gets starts
+   looking where this one did, so that it can just pick them up again. */
+static void prealloc_drop(ext2_fs_t *fs, struct int_inode *inode) {
+    if(!inode->pa_count)
+        return;
+
+    ext2_block_free_run(fs, inode->pa_start, inode->pa_count);
+    inode->pa_goal = inode->pa_start;
+    inode->pa_count = 0;
+}
+
+/* Set aside a run of at least want blocks for an inode, to carry on from where
+   the data at file block first - 1 is. Blocks already set aside are used if
+   there are enough of them; otherwise, they're handed back and a longer run is
+   looked for in the same place. A file that keeps growing gets a run as long
+   as it already is (up to PA_MAX blocks), so that files being written at the
+   same time don't end up in little pieces between each other. */
+static void prealloc_for(ext2_fs_t *fs, struct int_inode *inode,
+                         uint32_t first, uint32_t want) {
+    uint32_t bn;
+    int err;
+
+    if(inode->pa_count >= want) {
+        inode->pa_want = want;
+        return;
+    }
+
+    prealloc_drop(fs, inode);
+
+    if(want < (first < PA_MAX ? first : PA_MAX))
+        want = first < PA_MAX ? first : PA_MAX;
+
+    if(!inode->pa_goal && first &&
+       !inode_bmap(fs, &inode->inode, first - 1, &bn, &err) && bn)
+        inode->pa_goal = bn + 1;
+
+    inode->pa_want = want;
+}
+
+/* Allocate a block for an inode, out of the blocks set aside for it. If there
+   aren't any, a run of as many as the allocation going on now wants is set
+   aside first, as close as can be found after the inode's last block (or the
+   start of the block group, for an inode that doesn't have any). */
+static uint8_t *inode_block_alloc(ext2_fs_t *fs, struct int_inode *inode,
+                                  uint32_t bg, uint32_t *rbn, int *err) {
+    uint32_t start, count, goal;
+    uint8_t *buf;
+
+    if(!inode->pa_count) {
+        goal = inode->pa_goal ? inode->pa_goal :
+            bg * fs->sb.s_blocks_per_group + fs->sb.s_first_data_block;
+
+        if(!(start = ext2_block_alloc_run(fs, goal, inode->pa_want ?
+                                          inode->pa_want : 1, &count, err)))
+            return NULL;
+
+        inode->pa_start = start;
+        inode->pa_count = count;
+    }
+
+    *rbn = inode->pa_start++;
+    --inode->pa_count;
+    inode->pa_goal = inode->pa_start;
+
+    if(inode->pa_want)
+        --inode->pa_want;
+
+    if(!(buf = ext2_block_clear(fs, *rbn, err)))
+        ext2_block_free_run(fs, *rbn, 1);
+
+    return buf;
+}
+
+/* Give the data waiting in memory for an inode blocks on the disk, all in one
+   run if there's one long enough. */
+static int da_flush(ext2_fs_t *fs, struct int_inode *inode) {
+    struct delalloc *da = inode->da;
+    uint32_t i;
+    uint8_t *buf;
+    int err = 0;
+
+    if(!da || !da->count)
+        return 0;
+
+    /* The blocks set aside for the data are about to be used for real. */
+    fs->reserved -= da->count + DA_META;
+    prealloc_for(fs, inode, da->first, da->count + DA_META);
+
+    for(i = 0; i < da->count; ++i) {
+        if(!(buf = ext2_inode_alloc_block(fs, &inode->inode, da->first + i,
+                                          &err)))
+            break;
+
+        memcpy(buf, da->data + i * fs->block_size, fs->block_size);
+    }
+
+    inode->pa_want = 0;
+
+    if(i < da->count) {
+        /* Keep what didn't make it, to try again later. */
+        memmove(da->data, da->data + i * fs->block_size,
+                (da->count - i) * fs->block_size);
+        da->first += i;
+        da->count -= i;
+        fs->reserved += da->count + DA_META;
+        return -err;
+    }
+
+    da->count = 0;
+    return 0;
+}
+
+/* Throw away any data waiting in memory for an inode. */
+static void da_release(ext2_fs_t *fs, struct int_inode *inode) {
+    if(!inode->da)
+        return;
+
+    if(inode->da->count)
+        fs->reserved -= inode->da->count + DA_META;
+
+    free(inode->da);
+    inode->da = NULL;
+}
+
+int ext2_inode_flush(ext2_fs_t *fs, ext2_inode_t *inode) {
+    return da_flush(fs, (struct int_inode *)inode);
+}
+
 static uint8_t *alloc_direct_blk(ext2_fs_t *fs, struct int_inode *inode,
                                  uint32_t bg, uint32_t *rbn, int *err) {
     uint8_t *buf;
     uint32_t bn;
 
-    if(!(buf = ext2_block_alloc(fs, bg, &bn, err)))
+    if(!(buf = inode_block_alloc(fs, inode, bg, &bn, err)))
         return NULL;
 
     *rbn = bn;
@@ -709,7 +920,7 @@ static uint8_t *alloc_ind_blk(ext2_fs_t *fs, struct int_inode *inode,
     uint32_t bn, bn2;
 
     /* Allocate the indirect block */
-    if(!(buf = ext2_block_alloc(fs, bg, &bn, err)))
+    if(!(buf = inode_block_alloc(fs, inode, bg, &bn, err)))
         return NULL;
 
     buf32 = (uint32_t *)buf;
@@ -735,7 +946,7 @@ static uint8_t *alloc_dind_blk(ext2_fs_t *fs, struct int_inode *inode,
     uint32_t bn, bn2;
 
     /* Allocate the double indirect block */
-    if(!(buf = ext2_block_alloc(fs, bg, &bn, err)))
+    if(!(buf = inode_block_alloc(fs, inode, bg, &bn, err)))
         return NULL;
 
     buf32 = (uint32_t *)buf;
@@ -761,7 +972,7 @@ static uint8_t *alloc_tind_blk(ext2_fs_t *fs, struct int_inode *inode,
     uint32_t bn, bn2;
 
     /* Allocate the double indirect block */
-    if(!(buf = ext2_block_alloc(fs, bg, &bn, err)))
+    if(!(buf = inode_block_alloc(fs, inode, bg, &bn, err)))
         return NULL;
 
     buf32 = (uint32_t *)buf;
@@ -914,137 +1125,10 @@ uint8_t *ext2_inode_alloc_block(ext2_fs_t *fs, ext2_inode_t *inode,
     }
 }
 
-static ext2_dirent_t *search_dir(uint8_t *buf, int block_size,
-                                 const char *token, int *err) {
-    int block_offset = 0;
-    ext2_dirent_t *dent;
-    char name[256];
-
-    while(block_offset < block_size) {
-        dent = (ext2_dirent_t *)(buf + block_offset);
-
-        /* Make sure we don't trip and fall on a malformed entry. */
-        if(!dent->rec_len) {
-            *err = -EIO;
-            return NULL;
-        }
-
-        if(dent->inode) {
-            /* See if this is what we're looking for. */
-            memcpy(name, dent->name, dent->name_len);
-            name[dent->name_len] = 0;
-
-            if(!strcmp(name, token))
-                return dent;
-        }
-
-        block_offset += dent->rec_len;
-    }
-
-    return NULL;
-}
-
-static ext2_dirent_t *search_indir(ext2_fs_t *fs, const uint32_t *iblock,
-                                   int block_size, const char *token,
-                                   int *err) {
-    uint8_t *buf;
-    int i, block_ents;
-    ext2_dirent_t *rv;
-
-    /* We're going to need this buffer... */
-    if(!(buf = (uint8_t *)malloc(block_size))) {
-        *err = -ENOMEM;
-        return NULL;
-    }
-
-    block_ents = block_size >> 2;
-
-    /* Search through each block until we get to the end. */
-    for(i = 0; i < block_ents && iblock[i]; ++i) {
-        if(ext2_block_read_nc(fs, iblock[i], buf)) {
-            free(buf);
-            *err = -EIO;
-            return NULL;
-        }
-
-        if((rv = search_dir(buf, block_size, token, err))) {
-            free(buf);
-            *err = 0;
-            return rv;
-        }
-        else if(*err) {
-            free(buf);
-            return NULL;
-        }
-    }
-
-    free(buf);
-    *err = 0;
-    return NULL;
-}
-
-static ext2_dirent_t *search_indir_23(ext2_fs_t *fs, const uint32_t *iblock,
-                                      int block_size, const char *token,
-                                      int *err, int triple) {
-    uint32_t *buf;
-    int i, block_ents;
-    ext2_dirent_t *rv;
-    /* Ensure the buffer will hold uint32_ts */
-    size_t bufsize = __align_up(block_size, sizeof(buf[0]));
-
-    /* We're going to need this buffer... */
-    if(!(buf = (uint32_t *)malloc(bufsize))) {
-        *err = -ENOMEM;
-        return NULL;
-    }
-
-    block_ents = block_size >> 2;
-
-    if(!triple) {
-        /* Search through each indirect block until we get to the end. */
-        for(i = 0; i < block_ents && iblock[i]; ++i) {
-            if(ext2_block_read_nc(fs, iblock[i], (uint8_t *)buf)) {
-                free(buf);
-                *err = -EIO;
-                return NULL;
-            }
-
-            if((rv = search_indir(fs, buf, block_size, token, err))) {
-                free(buf);
-                *err = 0;
-                return rv;
-            }
-        }
-    }
-    else {
-        /* Search through each doubly-indirect block until we get to the end. */
-        for(i = 0; i < block_size && iblock[i]; ++i) {
-            if(ext2_block_read_nc(fs, iblock[i], (uint8_t *)buf)) {
-                free(buf);
-                *err = -EIO;
-                return NULL;
-            }
-
-            if((rv = search_indir_23(fs, buf, block_size, token, err, 0))) {
-                free(buf);
-                *err = 0;
-                return rv;
-            }
-        }
-    }
-
-    free(buf);
-    *err = 0;
-    return NULL;
-}
-
 int ext2_inode_by_path(ext2_fs_t *fs, const char *path, ext2_inode_t **rv,
                        uint32_t *inode_num, int rlink, ext2_dirent_t **rdent) {
     ext2_inode_t *inode, *last;
     char *ipath, *cxt, *token;
-    int blocks, i, block_size;
-    uint8_t *buf;
-    uint32_t *ib;
     ext2_dirent_t *dent = NULL;
     int err = 0;
     size_t tmp_sz;
@@ -1079,8 +1163,6 @@ int ext2_inode_by_path(ext2_fs_t *fs, const char *path, ext2_inode_t **rv,
         return 0;
     }
 
-    block_size = fs->block_size;
-
     while(token) {
         last = inode;
 
@@ -1091,40 +1173,7 @@ int ext2_inode_by_path(ext2_fs_t *fs, const char *path, ext2_inode_t **rv,
             return -ENOTDIR;
         }
 
-        blocks = inode->i_blocks / (2 << fs->sb.s_log_block_size);
-
-        /* Run through any direct blocks in the inode. */
-        for(i = 0; i < blocks && inode->i_block[i] && i < 12; ++i) {
-            /* Grab the block, looking in the directory cache. */
-            if(!(buf = ext2_block_read(fs, inode->i_block[i], &err))) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return -EIO;
-            }
-
-            /* Search through the directory block */
-            if((dent = search_dir(buf, block_size, token, &err))) {
-                goto next_token;
-            }
-            else if(err) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return err;
-            }
-        }
-
-        /* Short circuit... */
-        if(!inode->i_block[i])
-            goto out;
-
-        /* Next, look through the indirect block. */
-        if(!(ib = (uint32_t *)ext2_block_read(fs, inode->i_block[12], &err))) {
-            free(ipath);
-            ext2_inode_put(inode);
-            return -EIO;
-        }
-
-        if((dent = search_indir(fs, ib, block_size, token, &err))) {
+        if((dent = ext2_dir_find(fs, inode, token, &err))) {
             goto next_token;
         }
         else if(err) {
@@ -1133,48 +1182,6 @@ int ext2_inode_by_path(ext2_fs_t *fs, const char *path, ext2_inode_t **rv,
             return err;
         }
 
-        /* Next, look through the doubly-indirect block. */
-        if(inode->i_block[13]) {
-            /* Grab the block, looking in the directory cache. */
-            if(!(ib = (uint32_t *)ext2_block_read(fs, inode->i_block[13],
-                                                  &err))) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return -EIO;
-            }
-
-            if((dent = search_indir_23(fs, ib, block_size, token, &err, 0))) {
-                goto next_token;
-            }
-            else if(err) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return err;
-            }
-        }
-
-        /* Finally, try the triply-indirect block... God help us if we actually
-           have to look all the way through one of these... */
-        if(inode->i_block[14]) {
-            /* Grab the block, looking in the directory cache. */
-            if(!(ib = (uint32_t *)ext2_block_read(fs, inode->i_block[14],
-                                                  &err))) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return -EIO;
-            }
-
-            if((dent = search_indir_23(fs, ib, block_size, token, &err, 1))) {
-                goto next_token;
-            }
-            else if(err) {
-                free(ipath);
-                ext2_inode_put(inode);
-                return err;
-            }
-        }
-
-out:
         /* If we get here, we didn't find the next entry. Return that error. */
         ext2_inode_put(inode);
 
@@ -1278,32 +1285,16 @@ next_token:
     return 0;
 }
 
-uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
-                               uint32_t block_num, uint32_t *r_block,
-                               int *err) {
+/* Find the block on the disk that holds a block of a file. */
+static int inode_bmap(ext2_fs_t *fs, const ext2_inode_t *inode,
+                      uint32_t block_num, uint32_t *r_block, int *err) {
     uint32_t blks_per_ind, ibn;
     uint32_t *iblock;
-    int shift = 1 + fs->sb.s_log_block_size;
-    uint64_t sz;
-
-    /* Grab the size */
-    if((inode->i_mode & 0xF000) == EXT2_S_IFREG)
-        sz = ext2_inode_size(inode);
-    else
-        sz = (uint64_t)inode->i_size;
-
-    /* Check to be sure we're not being asked to do something stupid... */
-    if((block_num << (shift + 9)) >= sz) {
-        *err = EINVAL;
-        return NULL;
-    }
 
     /* If we're reading a direct block, this is easy. */
     if(block_num < 12) {
-        if(r_block)
-            *r_block = inode->i_block[block_num];
-
-        return ext2_block_read(fs, inode->i_block[block_num], err);
+        *r_block = inode->i_block[block_num];
+        return 0;
     }
 
     blks_per_ind = fs->block_size >> 2;
@@ -1312,63 +1303,255 @@ uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
     /* Are we looking at the singly-indirect block? */
     if(block_num < blks_per_ind) {
         if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[12], err)))
-            return NULL;
-
-        if(r_block)
-            *r_block = iblock[block_num];
+            return -1;
 
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
 
     /* Ok, we're looking at at least a doubly-indirect block... */
     block_num -= blks_per_ind;
     if(block_num < (blks_per_ind * blks_per_ind)) {
         if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[13], err)))
-            return NULL;
+            return -1;
 
         /* Figure out what entry we want in here... */
         ibn = block_num / blks_per_ind;
         block_num %= blks_per_ind;
 
         if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-            return NULL;
+            return -1;
 
         /* Ok... Now we should be good to go. */
-        if(r_block)
-            *r_block = iblock[block_num];
-
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
 
     /* Ugh... You're going to make me look at a triply-indirect block now? */
     block_num -= blks_per_ind * blks_per_ind;
     if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[14], err)))
-        return NULL;
+        return -1;
 
     /* Figure out what entry we want in here... */
     ibn = block_num / blks_per_ind;
     block_num %= blks_per_ind;
 
     if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-        return NULL;
+        return -1;
 
     /* And in this one too... */
     ibn = block_num / blks_per_ind;
     block_num %= blks_per_ind;
 
     if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-        return NULL;
+        return -1;
 
     /* Ok... Now we should be good to go. Finally. */
     if(block_num < blks_per_ind) {
-        if(r_block)
-            *r_block = iblock[block_num];
-
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
     else {
         /* This really shouldn't happen... */
         *err = EIO;
+        return -1;
+    }
+}
+
+uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
+                               uint32_t block_num, uint32_t *r_block,
+                               int *err) {
+    const struct int_inode *iinode = (const struct int_inode *)inode;
+    const struct delalloc *da = iinode->da;
+    int shift = 1 + fs->sb.s_log_block_size;
+    uint32_t bn;
+    uint64_t sz;
+
+    /* Grab the size */
+    if((inode->i_mode & 0xF000) == EXT2_S_IFREG)
+        sz = ext2_inode_size(inode);
+    else
+        sz = (uint64_t)inode->i_size;
+
+    /* Check to be sure we're not being asked to do something stupid... */
+    if(((uint64_t)block_num << (shift + 9)) >= sz) {
+        *err = EINVAL;
         return NULL;
     }
+
+    /* Data that's still waiting in memory doesn't have a block yet. */
+    if(da && block_num >= da->first && block_num - da->first < da->count) {
+        if(r_block)
+            *r_block = 0;
+
+        return (uint8_t *)da->data + (block_num - da->first) * fs->block_size;
+    }
+
+    if(inode_bmap(fs, inode, block_num, &bn, err))
+        return NULL;
+
+    if(r_block)
+        *r_block = bn;
+
+    return ext2_block_read(fs, bn, err);
+}
+
+uint8_t *ext2_inode_write_block(ext2_fs_t *fs, ext2_inode_t *inode,
+                                uint32_t block_num, int *err) {
+    struct int_inode *iinode = (struct int_inode *)inode;
+    struct delalloc *da = iinode->da;
+    uint32_t nblocks, bn;
+    uint64_t sz = ext2_inode_size(inode);
+    uint8_t *buf;
+    int rv;
+
+    /* Don't even bother if we're mounted read-only. */
+    if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW)) {
+        *err = EROFS;
+        return NULL;
+    }
+
+    /* Is it waiting in memory already? */
+    if(da && block_num >= da->first && block_num - da->first < da->count)
+        return da->data + (block_num - da->first) * fs->block_size;
+
+    /* Is it on the disk? */
+    nblocks = (uint32_t)((sz + fs->block_size - 1) >> ext2_log_block_size(fs));
+
+    if(block_num < ((da && da->count) ? da->first : nblocks)) {
+        if(!(buf = ext2_inode_read_block(fs, inode, block_num, &bn, err)))
+            return NULL;
+
+        ext2_block_mark_dirty(fs, bn);
+        return buf;
+    }
+
+    /* It's a new block on the end, so it goes in memory, if there's room. */
+    if(!da) {
+        da = (struct delalloc *)malloc(sizeof(struct delalloc) +
+                                       EXT2_DELALLOC_BLOCKS * fs->block_size);
+
+        /* If not, just give it a block straight away. */
+        if(!da)
+            return ext2_inode_alloc_block(fs, inode, block_num, err);
+
+        da->count = 0;
+        iinode->da = da;
+    }
+
+    if(da->count == EXT2_DELALLOC_BLOCKS) {
+        if((rv = da_flush(fs, iinode))) {
+            *err = -rv;
+            return NULL;
+        }
+    }
+
+    /* Set aside a free block for it, so that running out of space shows up
+       now rather than when it gets written out. */
+    if(fs->sb.s_free_blocks_count < fs->reserved + 1 +
+       (da->count ? 0 : DA_META)) {
+        *err = ENOSPC;
+        return NULL;
+    }
+
+    if(!da->count) {
+        da->first = block_num;
+        fs->reserved += DA_META;
+    }
+
+    ++fs->reserved;
+    buf = da->data + da->count++ * fs->block_size;
+    memset(buf, 0, fs->block_size);
+    iinode->flags |= INODE_FLAG_DIRTY;
+
+    return buf;
+}
+
+int ext2_inode_fallocate(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t end,
+                         int keep_size) {
+    struct int_inode *iinode = (struct int_inode *)inode;
+    uint32_t lbs = ext2_log_block_size(fs), bs = fs->block_size;
+    uint32_t have, want, i, start, bn, bg, count = 0;
+    uint64_t sz = ext2_inode_size(inode);
+    uint8_t *buf;
+    int err = 0;
+
+    /* Don't even bother if we're mounted read-only. */
+    if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
+        return -EROFS;
+
+    /* Start from the file as it is on the disk. */
+    if((err = da_flush(fs, iinode)))
+        return err;
+
+    if((end + bs - 1) >> lbs > UINT32_MAX)
+        return -EFBIG;
+
+    have = (uint32_t)((sz + bs - 1) >> lbs);
+    want = (uint32_t)((end + bs - 1) >> lbs);
+
+    if(want > have) {
+        count = want - have;
+        count += count / (bs >> 2) + DA_META;
+
+        if(keep_size) {
+            /* Just set the blocks aside for the writes to come. */
+            prealloc_for(fs, iinode, have, count);
+            iinode->pa_want = 0;
+
+            if(iinode->pa_count)
+                return 0;
+
+            bg = (iinode->inode_num - 1) / fs->sb.s_inodes_per_group;
+
+            if(!(start = ext2_block_alloc_run(fs, iinode->pa_goal ?
+                                              iinode->pa_goal :
+                                              bg * fs->sb.s_blocks_per_group +
+                                              fs->sb.s_first_data_block,
+                                              count, &count, &err)))
+                return -err;
+
+            iinode->pa_start = start;
+            iinode->pa_count = count;
+            return 0;
+        }
+    }
+    else if(keep_size || end <= sz) {
+        return 0;
+    }
+
+    /* Clear out the rest of the last block, which the file's going to take in
+       now. */
+    if(sz & (bs - 1)) {
+        if(!(buf = ext2_inode_read_block(fs, inode, have - 1, &bn, &err)))
+            return -err;
+
+        memset(buf + (sz & (bs - 1)), 0, bs - (sz & (bs - 1)));
+        ext2_block_mark_dirty(fs, bn);
+    }
+
+    if(want > have) {
+        prealloc_for(fs, iinode, have, count);
+
+        for(i = have; i < want; ++i) {
+            if(!ext2_inode_alloc_block(fs, inode, i, &err))
+                break;
+        }
+
+        iinode->pa_want = 0;
+
+        if(i < want) {
+            /* Keep what was allocated. */
+            if(i > have)
+                ext2_inode_set_size(inode, (uint64_t)i << lbs);
+
+            iinode->flags |= INODE_FLAG_DIRTY;
+            return -err;
+        }
+    }
+
+    ext2_inode_set_size(inode, end);
+    inode->i_mtime = inode->i_ctime = time(NULL);
+    iinode->flags |= INODE_FLAG_DIRTY;
+    return 0;
 }
@@ -158,6 +158,34 @@ uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
                                uint32_t block_num, uint32_t *r_block,
                                int *err);
 
+/* Get a block of a regular file to write to. A block that's on the disk is
+   read in and marked dirty. A new block on the end of the file (block_num
+   must be the one straight after the last, counting from the file's size
+   before the write) is held in memory, cleared out, with enough free blocks
+   set aside for it. Blocks held like this are only given blocks on the disk
+   when the inode is written back, or when EXT2_DELALLOC_BLOCKS of them have
+   built up, so that they can all be put in one run. As with
+   ext2_inode_alloc_block(), the caller updates i_size. */
+uint8_t *ext2_inode_write_block(ext2_fs_t *fs, ext2_inode_t *inode,
+                                uint32_t block_num, int *err);
+
+/* Give any blocks of a file held in memory by ext2_inode_write_block() blocks
+   on the disk now. Returns 0 or a negative error code. */
+int ext2_inode_flush(ext2_fs_t *fs, ext2_inode_t *inode);
+
+/* Allocate blocks for a regular file up to byte end, all in one run if
+   possible, and make the file at least that long. The new blocks are cleared
+   out. With keep_size, the blocks are only set aside for the writes to come,
+   and the file is left as it is; they are handed back if they're still unused
+   when the inode is let go of or the filesystem is synced. Returns 0 or a
+   negative error code. */
+int ext2_inode_fallocate(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t end,
+                         int keep_size);
+
+/* Where the index of names kept in memory for a directory inode goes. This is
+   kept with the inode in the inode cache, and freed along with it. */
+struct ext2_dir_cache **ext2_inode_dir_cache(const ext2_inode_t *inode);
+
 /* In symlink.c */
 int ext2_resolve_symlink(ext2_fs_t *fs, ext2_inode_t *inode, char *rv,
                          size_t *rv_len);
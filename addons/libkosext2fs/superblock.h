@@ -94,7 +94,9 @@ typedef struct ext2_superblock {
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
 
-    uint8_t unused[760];
+    uint8_t unused0[88];
+    uint32_t s_flags;
+    uint8_t unused[668];
 } __packed ext2_superblock_t;
 
 /* s_state values */
@@ -117,6 +119,10 @@ typedef struct ext2_superblock {
 #define EXT2_GOOD_OLD_REV   0
 #define EXT2_DYNAMIC_REV    1
 
+/* s_flags values */
+#define EXT2_FLAGS_SIGNED_HASH      0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002
+
 /* s_feature_compat values */
 #define EXT2_FEATURE_COMPAT_DIR_PREALLOC    0x0001
 #define EXT2_FEATURE_COMPAT_IMAGIC_INODES   0x0002
@@ -205,6 +205,8 @@ int fat_read_boot(fat_superblock_t *sb, kos_blockdev_t *bd) {
         return -EINVAL;
     }
 
+    sb->free_clusters = FAT_FREE_UNKNOWN;
+
     /* If we have an fsinfo sector, read it. */
     if(sb->fsinfo_sector) {
         memset(&fsinfo, 0, sizeof(fat32_fsinfo_t));
@@ -228,9 +230,15 @@ int fat_read_boot(fat_superblock_t *sb, kos_blockdev_t *bd) {
             sb->last_alloc_cluster = fsinfo.last_alloc_cluster;
         }
     }
-    else {
+
+    /* These are only hints, and either may be 0xFFFFFFFF if it isn't known.
+       Anything out of range gets ignored too. */
+    if(sb->free_clusters > sb->num_clusters)
+        sb->free_clusters = FAT_FREE_UNKNOWN;
+
+    if(sb->last_alloc_cluster < 2 ||
+       sb->last_alloc_cluster >= sb->num_clusters + 2)
         sb->last_alloc_cluster = 2;
-    }
 
     return 0;
 }
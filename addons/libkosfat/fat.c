@@ -6,139 +6,316 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <malloc.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "fatfs.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+/* Blocks of the FAT are cached in the shared buffer cache, through a handle
+   of their own. FAT12 entries can straddle two blocks, so the handle has to
+   keep at least the last two blocks read (see FAT_FCACHE_BLOCKS in fatfs.h). */
+static uint8_t *fat_read_fatblock(fat_fs_t *fs, uint32_t block, int *err) {
+    uint8_t *rv;
 
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
+    if(fs->sb.reserved_sectors + fs->sb.fat_size <= block) {
+        *err = EIO;
+        return NULL;
     }
 
-    cache[fs->cache_size - 1] = tmp;
-}
+    if(!(rv = bcache_read(fs->fcache, block, 0)))
+        *err = errno;
 
+    return rv;
+}
 
-static int fat_fatblock_read_nc(fat_fs_t *fs, uint32_t bn, uint8_t *rv) {
-    if(fs->sb.fat_size <= bn)
+static int fat_fatblock_mark_dirty(fat_fs_t *fs, uint32_t bn) {
+    if(bcache_mark_dirty_block(fs->fcache, bn))
         return -EINVAL;
 
-    if(fs->dev->read_blocks(fs->dev, bn, 1, rv))
-        return -EIO;
+    return 0;
+}
+
+int fat_fatblock_cache_wb(fat_fs_t *fs) {
+    /* Don't even bother if we're mounted read-only. */
+    if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
+        return 0;
+
+    if(bcache_flush(fs->fcache))
+        return -errno;
 
     return 0;
 }
 
-static int fat_fatblock_write_nc(fat_fs_t *fs, uint32_t bn,
-                                 const uint8_t *blk) {
-    if(fs->sb.fat_size <= bn)
-        return -EINVAL;
+/* Free cluster map.
+
+   Rather than searching through the FAT for a free cluster each time one is
+   needed, the FAT is summed up in a bitmap, with a bit set for each cluster
+   that is free. The map is only filled in as it's needed, FAT_MAP_CHUNK
+   clusters at a time: allocating a cluster loads the chunks the search passes
+   through, starting from the FSinfo hint, so the first write after mounting
+   doesn't have to read the whole FAT. Counting the free clusters (if FSinfo
+   doesn't have a count we can use) loads all of it. Blocks of the FAT that
+   aren't in the cache are read straight from the block device, as many at a
+   time as will fit in a chunk, without pushing anything out of the cache.
+   fat_write_fat() keeps the map and the free count up to date from then on.
+
+   If the map would be bigger than FAT_FREE_MAP_BYTES or it can't be allocated,
+   the FAT is searched directly instead. */
+static inline int fmap_loaded(const fat_fs_t *fs, uint32_t chunk) {
+    return fs->fmap_chunks[chunk >> 3] & (1 << (chunk & 7));
+}
+
+static int fmap_init(fat_fs_t *fs) {
+    uint32_t words, chunks;
+
+    if(fs->fmap)
+        return 0;
 
-    if(fs->dev->write_blocks(fs->dev, bn, 1, blk))
-        return -EIO;
+    if(fs->flags & FAT_FS_FLAG_NO_FMAP)
+        return -1;
 
+    words = (fs->sb.num_clusters + 2 + 31) >> 5;
+    chunks = (fs->sb.num_clusters + 2 + FAT_MAP_CHUNK - 1) / FAT_MAP_CHUNK;
+
+    if(words * 4 > FAT_FREE_MAP_BYTES)
+        goto out;
+
+    if(!(fs->fmap = (uint32_t *)calloc(words, 4)))
+        goto out;
+
+    if(!(fs->fmap_chunks = (uint8_t *)calloc((chunks + 7) >> 3, 1))) {
+        free(fs->fmap);
+        fs->fmap = NULL;
+        goto out;
+    }
+
+    fs->fmap_unloaded = chunks;
     return 0;
+
+out:
+    fs->flags |= FAT_FS_FLAG_NO_FMAP;
+    return -1;
 }
 
-static uint8_t *fat_read_fatblock(fat_fs_t *fs, uint32_t block, int *err) {
-    int i;
-    uint8_t *rv;
-    fat_cache_t **cache = fs->fcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == block && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
+/* Fill in the map for n entries of a FAT16/FAT32 FAT starting at cluster cl
+   (which is a multiple of 32) from blk. */
+static void fmap_fill(fat_fs_t *fs, const uint8_t *blk, uint32_t cl,
+                      uint32_t n) {
+    uint32_t i, bits = 0, end = fs->sb.num_clusters + 2;
+    int fat32 = fs->sb.fs_type == FAT_FS_FAT32;
+
+    for(i = 0; i < n; ++i, ++cl) {
+        if(fat32) {
+            if(!blk[0] && !blk[1] && !blk[2] && !(blk[3] & 0x0F))
+                bits |= 1U << (cl & 31);
+
+            blk += 4;
         }
-    }
+        else {
+            if(!blk[0] && !blk[1])
+                bits |= 1U << (cl & 31);
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_fatblock_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
+            blk += 2;
+        }
+
+        if((cl & 31) == 31 || i == n - 1) {
+            /* Clusters 0 and 1 and those past the end are never free. */
+            if(cl >> 5 == 0)
+                bits &= ~3U;
+
+            if(cl >= end - 1)
+                bits &= ~0U >> (31 - ((end - 1) & 31));
+
+            fs->fmap[cl >> 5] = bits;
+            bits = 0;
         }
     }
+}
 
-    /* Try to read the block in question. */
-    if(fat_fatblock_read_nc(fs, block, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
-        return NULL;
+static int fmap_load_fat12(fat_fs_t *fs, uint32_t first, uint32_t last) {
+    uint32_t cl, val;
+    int err = 0;
+
+    for(cl = first; cl < last; ++cl) {
+        val = fat_read_fat(fs, cl, &err);
+
+        if(val == FAT_INVALID_CLUSTER)
+            return -err;
+
+        if(cl >= 2 && !val)
+            fs->fmap[cl >> 5] |= 1U << (cl & 31);
+        else
+            fs->fmap[cl >> 5] &= ~(1U << (cl & 31));
     }
 
-    cache[i]->block = block;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    return 0;
+}
+
+/* Load count chunks of the map, starting from chunk, skipping any that are
+   loaded already. */
+static int fmap_load(fat_fs_t *fs, uint32_t chunk, uint32_t count) {
+    uint32_t bps = fs->sb.bytes_per_sector, end = fs->sb.num_clusters + 2;
+    uint32_t es, first, last, sn, lsn, n, i;
+    uint8_t *buf = NULL;
+    const uint8_t *blk;
+    int err = 0;
+
+    es = fs->sb.fs_type == FAT_FS_FAT32 ? 4 : 2;
+
+    for(; count && fs->fmap_unloaded; --count, ++chunk) {
+        if(fmap_loaded(fs, chunk))
+            continue;
+
+        first = chunk * FAT_MAP_CHUNK;
+        last = first + FAT_MAP_CHUNK < end ? first + FAT_MAP_CHUNK : end;
+
+        if(fs->sb.fs_type == FAT_FS_FAT12) {
+            /* The FAT12 FAT is small enough (and awkward enough) to just go
+               through fat_read_fat(). */
+            if((err = -fmap_load_fat12(fs, first, last)))
+                break;
+
+            goto loaded;
+        }
+
+        /* A chunk always starts on a block of the FAT, but may end part way
+           through one at the end of the FAT. */
+        sn = fs->sb.reserved_sectors + first * es / bps;
+        lsn = fs->sb.reserved_sectors + ((last - 1) * es) / bps + 1;
+
+        while(sn < lsn) {
+            if(bcache_cached(fs->fcache, sn)) {
+                /* It might be dirty, so go through the cache. */
+                if(!(blk = fat_read_fatblock(fs, sn, &err)))
+                    goto out;
+
+                n = 1;
+            }
+            else {
+                if(!buf) {
+                    if(!(buf = (uint8_t *)memalign(32, FAT_MAP_CHUNK * 4))) {
+                        err = ENOMEM;
+                        goto out;
+                    }
+                }
+
+                for(n = 1; sn + n < lsn && !bcache_cached(fs->fcache, sn + n);
+                    ++n) {
+                }
+
+                if(fs->dev->read_blocks(fs->dev, sn, n, buf)) {
+                    err = EIO;
+                    goto out;
+                }
+
+                blk = buf;
+            }
+
+            i = (sn - fs->sb.reserved_sectors) * (bps / es);
+            fmap_fill(fs, blk, i, last - i < n * (bps / es) ? last - i :
+                      n * (bps / es));
+            sn += n;
+        }
+
+loaded:
+        fs->fmap_chunks[chunk >> 3] |= 1 << (chunk & 7);
+        --fs->fmap_unloaded;
+    }
 
 out:
-    return rv;
+    free(buf);
+    return -err;
 }
 
-static int fat_fatblock_mark_dirty(fat_fs_t *fs, uint32_t bn) {
-    int i;
-    fat_cache_t **cache = fs->fcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == bn && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
+/* Is cl free? Returns 1 if so, 0 if not or a negative error code. */
+static int cluster_free(fat_fs_t *fs, uint32_t cl) {
+    uint32_t val;
+    int err = 0;
+
+    if(fs->fmap) {
+        if((err = fmap_load(fs, cl / FAT_MAP_CHUNK, 1)))
+            return err;
+
+        return !!(fs->fmap[cl >> 5] & (1U << (cl & 31)));
     }
 
-    return -EINVAL;
+    val = fat_read_fat(fs, cl, &err);
+
+    if(val == FAT_INVALID_CLUSTER && err)
+        return -err;
+
+    return !(val & 0x0FFFFFFF);
 }
 
-int fat_fatblock_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->fcache;
+/* Find the first free cluster in [cl, end). Returns 0 if there isn't one, or
+   FAT_INVALID_CLUSTER on error. */
+static uint32_t find_free(fat_fs_t *fs, uint32_t cl, uint32_t end, int *err) {
+    uint32_t bits;
+    int rv;
 
-    /* Don't even bother if we're mounted read-only. */
-    if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
-        return 0;
+    if(!fs->fmap) {
+        for(; cl < end; ++cl) {
+            if((rv = cluster_free(fs, cl)) < 0) {
+                *err = -rv;
+                return FAT_INVALID_CLUSTER;
+            }
+            else if(rv) {
+                return cl;
+            }
+        }
 
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_fatblock_write_nc(fs, cache[i]->block,
-                                            cache[i]->data)))
-                return err;
+        return 0;
+    }
 
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
+    while(cl < end) {
+        if((rv = fmap_load(fs, cl / FAT_MAP_CHUNK, 1)) < 0) {
+            *err = -rv;
+            return FAT_INVALID_CLUSTER;
         }
+
+        /* Look through the rest of the chunk a word at a time. */
+        do {
+            if((bits = fs->fmap[cl >> 5] & (~0U << (cl & 31)))) {
+                cl = (cl & ~31U) + __builtin_ctz(bits);
+                return cl < end ? cl : 0;
+            }
+
+            cl = (cl | 31) + 1;
+        } while(cl < end && cl % FAT_MAP_CHUNK);
     }
 
     return 0;
 }
 
+/* Called whenever an entry in the FAT goes from free to used or back. */
+static void fmap_update(fat_fs_t *fs, uint32_t cl, int free) {
+    if(fs->fmap) {
+        if(free)
+            fs->fmap[cl >> 5] |= 1U << (cl & 31);
+        else
+            fs->fmap[cl >> 5] &= ~(1U << (cl & 31));
+    }
+
+    if(fs->sb.free_clusters != FAT_FREE_UNKNOWN) {
+        if(free)
+            ++fs->sb.free_clusters;
+        else
+            --fs->sb.free_clusters;
+    }
+}
+
+void fat_free_map_release(fat_fs_t *fs) {
+    free(fs->fmap);
+    free(fs->fmap_chunks);
+    fs->fmap = NULL;
+    fs->fmap_chunks = NULL;
+}
+
 uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
     uint32_t sn, off, val;
     const uint8_t *blk, *blk2;
@@ -214,14 +391,22 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
 }
 
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
-    uint32_t sn, off;
+    uint32_t sn, off, old, ocl = cl;
     uint8_t *blk, *blk2;
-    int err;
+    int err = 0, was_free, now_free = !(val & 0x0FFFFFFF);
 
     /* Don't let us write to the FAT if we're on a read-only FS. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return -EROFS;
 
+    /* See what's there now, to keep the free map and count up to date. */
+    old = fat_read_fat(fs, cl, &err);
+
+    if(old == FAT_INVALID_CLUSTER && err)
+        return -err;
+
+    was_free = !(old & 0x0FFFFFFF);
+
     /* Figure out what sector the value is on... */
     switch(fs->sb.fs_type) {
         case FAT_FS_FAT32:
@@ -308,6 +493,9 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
             break;
     }
 
+    if(was_free != now_free && ocl >= 2 && ocl < fs->sb.num_clusters + 2)
+        fmap_update(fs, ocl, now_free);
+
     return 0;
 }
 
@@ -326,11 +514,47 @@ int fat_is_eof(fat_fs_t *fs, uint32_t cl) {
     return -1;
 }
 
+static uint32_t fat_eoc(const fat_fs_t *fs) {
+    switch(fs->sb.fs_type) {
+        case FAT_FS_FAT32:
+            return 0x0FFFFFFF;
+
+        case FAT_FS_FAT16:
+            return 0xFFFF;
+
+        default:
+            return 0x0FFF;
+    }
+}
+
 uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
-    uint32_t sn, off, val;
-    uint8_t *blk;
-    uint32_t cl, i, cps, last;
-    int tries = 1;
+    uint32_t got;
+
+    return fat_allocate_chain(fs, 0, 1, &got, err);
+}
+
+/* Count the free clusters starting from cl, up to max of them. Returns the
+   count, or a negative error code. */
+static int run_length(fat_fs_t *fs, uint32_t cl, uint32_t max) {
+    uint32_t n, end = fs->sb.num_clusters + 2;
+    int rv;
+
+    for(n = 0; n < max && cl + n < end; ++n) {
+        if((rv = cluster_free(fs, cl + n)) < 0)
+            return rv;
+        else if(!rv)
+            break;
+    }
+
+    return (int)n;
+}
+
+uint32_t fat_allocate_chain(fat_fs_t *fs, uint32_t goal, uint32_t count,
+                            uint32_t *got, int *err) {
+    uint32_t cl, start, end = fs->sb.num_clusters + 2, n, i, next, limit;
+    int rv;
+
+    *got = 0;
 
     /* Don't let us write to the FAT if we're on a read-only FS. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW)) {
@@ -338,158 +562,123 @@ uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
         return FAT_INVALID_CLUSTER;
     }
 
-    i = fs->sb.last_alloc_cluster + 1;
-    last = fs->sb.num_clusters + 2;
-
-    /* Search for a free cluster in the FAT...
-       There are optimized versions here for FAT32 and FAT16. Perhaps I'll write
-       one for FAT12 at some point too... */
-    switch(fs->sb.fs_type) {
-        case FAT_FS_FAT32:
-retry_fat32:
-            cps = (fs->sb.bytes_per_sector >> 2) - 1;
-            cl = i << 2;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
+    if(!count || count > INT_MAX) {
+        *err = EINVAL;
+        return FAT_INVALID_CLUSTER;
+    }
 
-            if(!(blk = fat_read_fatblock(fs, sn, err)))
-                return FAT_INVALID_CLUSTER;
+    /* If we can't have the map, we'll just have to search the FAT. */
+    fmap_init(fs);
 
-            while(i < last) {
-                off = cl & (fs->sb.bytes_per_sector - 1);
-                val = blk[off] | (blk[off + 1] << 8) | (blk[off + 2] << 16) |
-                    (blk[off + 3] << 24);
-
-                /* Did we find a free cluster? */
-                if(val == 0) {
-                    /* Put an end of chain marker in to allocate it. */
-                    blk[off] = 0xFF;
-                    blk[off + 1] = 0xFF;
-                    blk[off + 2] = 0xFF;
-                    blk[off + 3] = (blk[off + 3] & 0xF0) | 0x0F;
-
-                    /* Mark the block as dirty so it can get flushed to the
-                       backing store at some point. */
-                    fat_fatblock_mark_dirty(fs, sn);
-
-                    fs->sb.last_alloc_cluster = i;
-                    --fs->sb.free_clusters;
-                    return i;
-                }
+    /* Carry on from where the caller asked, if we can, otherwise from the
+       cluster after the last one allocated, wrapping around to the start. */
+    if(goal >= 2 && goal < end && (rv = cluster_free(fs, goal)) != 0) {
+        if(rv < 0) {
+            *err = -rv;
+            return FAT_INVALID_CLUSTER;
+        }
 
-                ++i;
-                cl += 4;
+        cl = goal;
+    }
+    else {
+        start = fs->sb.last_alloc_cluster + 1;
 
-                /* Do we have to read a new block? */
-                if(!(i & cps) && i < fs->sb.num_clusters + 2) {
-                    ++sn;
+        if(start < 2 || start >= end)
+            start = 2;
 
-                    if(!(blk = fat_read_fatblock(fs, sn, err)))
-                        return FAT_INVALID_CLUSTER;
-                }
-            }
+        if(!(cl = find_free(fs, start, end, err)) && start > 2)
+            cl = find_free(fs, 2, start, err);
 
-            /* If we get here, then restart the search and try one more time.
-               If we get here a second time, then there really aren't any
-               clusters left. */
-            if(tries--) {
-                i = 2;
-                last = fs->sb.last_alloc_cluster;
-                goto retry_fat32;
-            }
+        if(cl == FAT_INVALID_CLUSTER)
+            return cl;
 
+        if(!cl) {
             *err = ENOSPC;
             return FAT_INVALID_CLUSTER;
+        }
+    }
 
-        case FAT_FS_FAT16:
-retry_fat16:
-            cps = (fs->sb.bytes_per_sector >> 1) - 1;
-            cl = i << 1;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
-
-            if(!(blk = fat_read_fatblock(fs, sn, err)))
-                return FAT_INVALID_CLUSTER;
-
-            while(i < last) {
-                off = cl & (fs->sb.bytes_per_sector - 1);
-                val = blk[off] | (blk[off + 1] << 8);
+    if((rv = run_length(fs, cl, count)) < 0) {
+        *err = -rv;
+        return FAT_INVALID_CLUSTER;
+    }
 
-                /* Did we find a free cluster? */
-                if(val == 0) {
-                    /* Put an end of chain marker in to allocate it. */
-                    blk[off] = 0xFF;
-                    blk[off + 1] = 0xFF;
+    n = (uint32_t)rv;
 
-                    /* Mark the block as dirty so it can get flushed to the
-                       backing store at some point. */
-                    fat_fatblock_mark_dirty(fs, sn);
+    /* If that isn't enough, and we've got the map, look a little further on
+       for a run that is, rather than filling in all the little holes left
+       behind by deleted files. Failing that, take the longest one. */
+    if(fs->fmap && n < count && cl != goal) {
+        limit = cl + FAT_MAP_CHUNK * 8 < end ? cl + FAT_MAP_CHUNK * 8 : end;
 
-                    fs->sb.last_alloc_cluster = i;
-                    return i;
-                }
+        for(next = cl + n + 1; next < limit; next += (uint32_t)rv + 1) {
+            if(!(next = find_free(fs, next, limit, err)))
+                break;
+            else if(next == FAT_INVALID_CLUSTER)
+                return next;
 
-                ++i;
-                cl += 2;
+            if((rv = run_length(fs, next, count)) < 0) {
+                *err = -rv;
+                return FAT_INVALID_CLUSTER;
+            }
 
-                /* Do we have to read a new block? */
-                if(!(i & cps) && i < fs->sb.num_clusters + 2) {
-                    ++sn;
+            if((uint32_t)rv > n) {
+                cl = next;
+                n = (uint32_t)rv;
 
-                    if(!(blk = fat_read_fatblock(fs, sn, err)))
-                        return FAT_INVALID_CLUSTER;
-                }
+                if(n == count)
+                    break;
             }
+        }
+    }
 
-            /* If we get here, then restart the search and try one more time.
-               If we get here a second time, then there really aren't any
-               clusters left. */
-            if(tries--) {
-                i = 2;
-                last = fs->sb.last_alloc_cluster;
-                goto retry_fat16;
-            }
+    /* Link them up, from the end back so that there's never a chain pointing
+       at a free cluster. */
+    for(i = n; i > 0; --i) {
+        if((rv = fat_write_fat(fs, cl + i - 1, i == n ? fat_eoc(fs) :
+                               cl + i)) < 0) {
+            while(++i <= n)
+                fat_write_fat(fs, cl + i - 1, FAT_FREE_CLUSTER);
 
-            *err = ENOSPC;
+            *err = -rv;
             return FAT_INVALID_CLUSTER;
+        }
+    }
 
-        case FAT_FS_FAT12:
-            /* Do this twice, so the search can loop around. */
-            for(i = fs->sb.last_alloc_cluster + 1; i < fs->sb.num_clusters + 2;
-                ++i) {
-                if(!(cl = fat_read_fat(fs, i, err))) {
-                    /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
-                        return FAT_INVALID_CLUSTER;
-
-                    fs->sb.last_alloc_cluster = i;
-                }
-                else if(cl == FAT_INVALID_CLUSTER) {
-                    return cl;
-                }
-            }
+    fs->sb.last_alloc_cluster = cl + n - 1;
+    *got = n;
+    return cl;
+}
 
-            for(i = 2; i < fs->sb.last_alloc_cluster + 1; ++i) {
-                if(!(cl = fat_read_fat(fs, i, err))) {
-                    /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
-                        return FAT_INVALID_CLUSTER;
+int fat_free_clusters(fat_fs_t *fs, uint32_t *count) {
+    uint32_t cl, end = fs->sb.num_clusters + 2, n = 0, i, words;
+    int rv;
 
-                    fs->sb.last_alloc_cluster = i;
-                }
-                else if(cl == FAT_INVALID_CLUSTER) {
-                    return cl;
-                }
-            }
+    if(fs->sb.free_clusters != FAT_FREE_UNKNOWN) {
+        *count = fs->sb.free_clusters;
+        return 0;
+    }
 
-            /* If we get here, there really wasn't anything left. */
-            *err = ENOSPC;
-            return FAT_INVALID_CLUSTER;
+    if(!fmap_init(fs)) {
+        if((rv = fmap_load(fs, 0, (end + FAT_MAP_CHUNK - 1) / FAT_MAP_CHUNK)))
+            return rv;
 
-        default:
-            *err = EBADF;
-            return FAT_INVALID_CLUSTER;
+        words = (end + 31) >> 5;
+
+        for(i = 0; i < words; ++i)
+            n += __builtin_popcount(fs->fmap[i]);
     }
+    else {
+        for(cl = 2; cl < end; ++cl) {
+            if((rv = cluster_free(fs, cl)) < 0)
+                return rv;
 
-    return val;
+            n += rv;
+        }
+    }
+
+    *count = fs->sb.free_clusters = n;
+    return 0;
 }
 
 /* This function could be made better/more optimized... However, it takes the
@@ -517,7 +706,6 @@ int fat_erase_chain(fat_fs_t *fs, uint32_t cluster) {
         }
 
         cluster = next;
-        ++fs->sb.free_clusters;
     }
 
     return 0;
@@ -0,0 +1,698 @@
+/* KallistiOS ##version##
+
+   fatbench.c
+*/
+
+/* Host-side benchmark for sequential reads through libkosfat. This formats a
+   FAT32 volume in memory and lays out two files on it: one in a single run of
+   contiguous clusters, and one fragmented into short runs. The volume is then
+   mounted through a RAM-backed block device, and both files are read from
+   start to finish with various read sizes through fat_file_read() (which is
+   what fs_fat_read uses), into aligned and unaligned buffers, with two
+   budgets for the shared buffer cache (see kos/bcache.h). The data is
+   checked, and the throughput, number of requests made to the block device
+   and the cache's hit rate are printed for each pass.
+
+   Since the block device is just a memcpy, the -l option can be used to add a
+   fixed latency (in microseconds) to each request, to get an idea of how
+   things go on a device where each command has a cost (such as an SD card).
+
+   With -a, it tests and times allocating clusters instead, on a FAT32 volume
+   with the given size in GiB (32 by default) and 32KiB clusters, half full,
+   part of it in small pieces. Only the FAT and root directory are kept in
+   memory for this; everything else reads back as zeroes. It counts the free
+   clusters and allocates one cluster right after mounting, with and without
+   the FSinfo hints and with and without the free cluster map, then appends to
+   a few files at once, a cluster at a time and in runs the size of each
+   write (as fs_fat_write does). The FAT is then checked against the free
+   counts in memory and in FSinfo, both as they are and recounted after
+   remounting, and against the chains of the files.
+
+   Build it with "make -f Makefile.nonkos fatbench", then run it like so:
+       ./fatbench [-l usec] [size in MiB]
+       ./fatbench -a [-l usec] [size in GiB] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kos/bcache.h>
+
+#include "fatfs.h"
+#include "fatinternal.h"
+
+#define SECTOR_SIZE     512
+#define RESERVED        32
+#define FILE_SIZE       (24 * 1024 * 1024 + 1234)
+
+/* Sectors per cluster: 8 for the read tests, 64 for the allocation tests. */
+static uint32_t spc = 8;
+
+typedef struct bench_dev {
+    uint8_t *data;
+    uint32_t count;
+    uint32_t stored;            /* Sectors kept in data, the rest are zero */
+    long latency;
+    unsigned long reads, blocks_read;
+} bench_dev_t;
+
+static int bd_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int bd_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static void bd_delay(long usec) {
+    clock_t end = clock() + (clock_t)(usec * (double)CLOCKS_PER_SEC / 1000000);
+
+    while(usec > 0 && clock() < end)
+        ;
+}
+
+static int bd_read(const kos_blockdev_t *d, uint64_t block, size_t count,
+                   void *buf) {
+    bench_dev_t *dev = (bench_dev_t *)d->dev_data;
+
+    if(block + count > dev->count)
+        return -1;
+
+    ++dev->reads;
+    dev->blocks_read += count;
+    bd_delay(dev->latency);
+
+    for(; count; --count, ++block, buf = (uint8_t *)buf + SECTOR_SIZE) {
+        if(block < dev->stored)
+            memcpy(buf, dev->data + block * SECTOR_SIZE, SECTOR_SIZE);
+        else
+            memset(buf, 0, SECTOR_SIZE);
+    }
+
+    return 0;
+}
+
+static int bd_write(const kos_blockdev_t *d, uint64_t block, size_t count,
+                    const void *buf) {
+    bench_dev_t *dev = (bench_dev_t *)d->dev_data;
+
+    if(block + count > dev->count)
+        return -1;
+
+    if(block < dev->stored)
+        memcpy(dev->data + block * SECTOR_SIZE, buf,
+               (count < dev->stored - block ? count : dev->stored - block) *
+               SECTOR_SIZE);
+
+    return 0;
+}
+
+static uint64_t bd_count(const kos_blockdev_t *d) {
+    return ((bench_dev_t *)d->dev_data)->count;
+}
+
+static void put16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Data of the test files, one word at a time. */
+static inline uint32_t pattern(int id, uint32_t off) {
+    return ((uint32_t)id << 28) ^ (off >> 2) ^ 0x5A5A5A5A;
+}
+
+typedef struct bench_file {
+    int id;
+    uint32_t first;
+    uint32_t size;
+} bench_file_t;
+
+static uint8_t *cl_data(bench_dev_t *dev, uint32_t fds, uint32_t cl) {
+    return dev->data + (fds + (cl - 2) * spc) * SECTOR_SIZE;
+}
+
+/* Lay out a file starting at cluster *next, in runs of the given length (or
+   in one run if it's 0) with a free cluster between each run. */
+static void make_file(bench_dev_t *dev, uint32_t fsz, uint32_t fds,
+                      bench_file_t *f, uint32_t *next, uint32_t runlen) {
+    uint32_t ncl, i, j, off = 0, cl = *next, prev = 0;
+    uint8_t *fat = dev->data + RESERVED * SECTOR_SIZE, *p;
+
+    ncl = (f->size + spc * SECTOR_SIZE - 1) / (spc * SECTOR_SIZE);
+    f->first = cl;
+
+    for(i = 0; i < ncl; ++i) {
+        if(prev) {
+            put32(fat + prev * 4, cl);
+            put32(fat + fsz * SECTOR_SIZE + prev * 4, cl);
+        }
+
+        p = cl_data(dev, fds, cl);
+
+        for(j = 0; j < spc * SECTOR_SIZE; j += 4, off += 4)
+            put32(p + j, pattern(f->id, off));
+
+        prev = cl++;
+
+        if(runlen && (i + 1) % runlen == 0)
+            ++cl;
+    }
+
+    put32(fat + prev * 4, 0x0FFFFFFF);
+    put32(fat + fsz * SECTOR_SIZE + prev * 4, 0x0FFFFFFF);
+    *next = cl + 1;
+}
+
+/* Layout of the volume. */
+typedef struct bench_vol {
+    uint32_t fsz;               /* Sectors in each copy of the FAT */
+    uint32_t fds;               /* First data sector */
+    uint32_t ncl;               /* Number of clusters */
+} bench_vol_t;
+
+static int layout(uint32_t count, bench_vol_t *v) {
+    /* Figure out how big the FAT needs to be. This is a slight overestimate,
+       which is fine. */
+    v->ncl = (count - RESERVED) / spc;
+    v->fsz = ((v->ncl + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    v->fds = RESERVED + 2 * v->fsz;
+    v->ncl = (count - v->fds) / spc;
+
+    if(v->ncl <= 65524) {
+        fprintf(stderr, "Volume is too small for FAT32\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Format the volume, with the test files on it if files isn't NULL. */
+static int format(bench_dev_t *dev, const bench_vol_t *v,
+                  bench_file_t *files) {
+    uint8_t *p = dev->data;
+    uint32_t fsz = v->fsz, fds = v->fds, next = 3;
+
+    memset(p, 0, fds * SECTOR_SIZE);
+
+    /* Boot sector */
+    p[0] = 0xEB;
+    p[1] = 0x58;
+    p[2] = 0x90;
+    memcpy(p + 3, "KOSBENCH", 8);
+    put16(p + 11, SECTOR_SIZE);
+    p[13] = (uint8_t)spc;
+    put16(p + 14, RESERVED);
+    p[16] = 2;
+    p[21] = 0xF8;
+    put32(p + 32, dev->count);
+    put32(p + 36, fsz);
+    put32(p + 44, 2);
+    put16(p + 48, 1);
+    p[66] = 0x29;
+    memcpy(p + 71, "FATBENCH   ", 11);
+    memcpy(p + 82, "FAT32   ", 8);
+    p[510] = 0x55;
+    p[511] = 0xAA;
+
+    /* FSinfo sector */
+    p += SECTOR_SIZE;
+    put32(p, 0x41615252);
+    put32(p + 484, 0x61417272);
+    put32(p + 488, 0xFFFFFFFF);
+    put32(p + 492, 0xFFFFFFFF);
+    put32(p + 508, 0xAA550000);
+
+    /* Both copies of the FAT, with the (empty) root directory in cluster 2. */
+    p = dev->data + RESERVED * SECTOR_SIZE;
+    put32(p, 0x0FFFFFF8);
+    put32(p + 4, 0x0FFFFFFF);
+    put32(p + 8, 0x0FFFFFFF);
+    memcpy(p + fsz * SECTOR_SIZE, p, 12);
+    memset(cl_data(dev, fds, 2), 0, spc * SECTOR_SIZE);
+
+    if(!files)
+        return 0;
+
+    make_file(dev, fsz, fds, &files[0], &next, 0);
+    make_file(dev, fsz, fds, &files[1], &next, 7);
+
+    if(next >= v->ncl + 2) {
+        fprintf(stderr, "Volume is too small for the test files\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run(bench_dev_t *dev, const bench_file_t *f, size_t budget,
+               uint32_t rsz, int align) {
+    kos_blockdev_t bd = { dev, 9, &bd_init, &bd_shutdown, &bd_read,
+                          &bd_write, &bd_count };
+    fat_file_pos_t pos = { f->first, 0, 0, 0, 1 };
+    fat_fs_t *fs;
+    bcache_stats_t st;
+    uint8_t *mem, *buf;
+    uint32_t n, i, off;
+    clock_t start, elapsed;
+    double secs;
+    int rv = 0;
+
+    bcache_set_budget(budget);
+
+    if(!(fs = fat_fs_init(&bd, FAT_MNT_FLAG_RO))) {
+        fprintf(stderr, "Cannot mount the filesystem\n");
+        return -1;
+    }
+
+    /* Keep the buffer aligned for the block device, or deliberately not. */
+    mem = (uint8_t *)malloc(rsz + 64);
+    buf = mem + ((32 - ((uintptr_t)mem & 31)) & 31) + (align ? 0 : 4);
+
+    dev->reads = dev->blocks_read = 0;
+    elapsed = 0;
+
+    while(pos.ptr < f->size) {
+        n = f->size - pos.ptr < rsz ? f->size - pos.ptr : rsz;
+        start = clock();
+
+        if(fat_file_read(fs, &pos, buf, n)) {
+            fprintf(stderr, "Read failed at offset %lu\n",
+                    (unsigned long)pos.ptr);
+            rv = -1;
+            break;
+        }
+
+        elapsed += clock() - start;
+
+        /* Check what we got (this doesn't count towards the time taken). */
+        for(i = 0, off = pos.ptr - n; i < n; ++i, ++off) {
+            if(buf[i] != (uint8_t)(pattern(f->id, off & ~3U) >>
+                                   ((off & 3) * 8))) {
+                fprintf(stderr, "Bad data at offset %lu\n",
+                        (unsigned long)off);
+                rv = -1;
+                break;
+            }
+        }
+
+        if(rv)
+            break;
+    }
+
+    secs = (double)elapsed / CLOCKS_PER_SEC;
+    fat_fs_cache_stats(fs, &st);
+
+    if(!rv)
+        printf("  %4lu KiB cache, %6lu byte %s reads: %8.2f MB/s, "
+               "%7lu requests (%lu sectors), %5.1f%% hits\n",
+               (unsigned long)(budget >> 10),
+               (unsigned long)rsz, align ? "  aligned" : "unaligned",
+               secs > 0 ? f->size / secs / 1048576.0 : 0.0, dev->reads,
+               dev->blocks_read, st.hits + st.misses ?
+               100.0 * st.hits / (st.hits + st.misses) : 0.0);
+
+    free(mem);
+    fat_fs_shutdown(fs);
+    return rv;
+}
+
+/* Allocation tests. */
+#define ALLOC_FILES     4
+#define ALLOC_CLUSTERS  1024    /* Appended to each file */
+#define ALLOC_HOLES     2048    /* Free clusters left in the fragmented part */
+
+typedef struct alloc_file {
+    uint32_t first, last, count;
+} alloc_file_t;
+
+static kos_blockdev_t alloc_bd = { NULL, 9, &bd_init, &bd_shutdown, &bd_read,
+                                   &bd_write, &bd_count };
+static uint8_t *orig;
+static int failures;
+
+static void check(int ok, const char *what) {
+    if(!ok && ++failures <= 10)
+        printf("  FAIL: %s\n", what);
+}
+
+static uint32_t raw_entry(bench_dev_t *dev, uint32_t cl) {
+    return get32(dev->data + RESERVED * SECTOR_SIZE + cl * 4) & 0x0FFFFFFF;
+}
+
+static void raw_set(bench_dev_t *dev, const bench_vol_t *v, uint32_t cl,
+                    uint32_t val) {
+    put32(dev->data + RESERVED * SECTOR_SIZE + cl * 4, val);
+    put32(dev->data + (RESERVED + v->fsz) * SECTOR_SIZE + cl * 4, val);
+}
+
+/* Count the free clusters straight from the FAT on the disk. */
+static uint32_t raw_free(bench_dev_t *dev, const bench_vol_t *v) {
+    uint32_t cl, n = 0;
+
+    for(cl = 2; cl < v->ncl + 2; ++cl)
+        n += !raw_entry(dev, cl);
+
+    return n;
+}
+
+static void set_hints(bench_dev_t *dev, uint32_t nfree, uint32_t last) {
+    put32(dev->data + SECTOR_SIZE + 488, nfree);
+    put32(dev->data + SECTOR_SIZE + 492, last);
+}
+
+/* Fill the first half of the volume, and then every cluster but one in eight
+   of the next ALLOC_HOLES * 8, as deleting lots of small files would leave
+   it. */
+static void fill(bench_dev_t *dev, const bench_vol_t *v) {
+    uint32_t cl, half = v->ncl / 2 + 2;
+
+    for(cl = 3; cl < half + ALLOC_HOLES * 8; ++cl) {
+        if(cl < half || cl % 8)
+            raw_set(dev, v, cl, 0x0FFFFFFF);
+    }
+}
+
+static fat_fs_t *alloc_mount(bench_dev_t *dev, int rw, int nomap) {
+    fat_fs_t *fs;
+
+    if(!(fs = fat_fs_init(&alloc_bd, rw ? FAT_MNT_FLAG_RW : FAT_MNT_FLAG_RO)))
+        return NULL;
+
+    if(nomap)
+        fs->flags |= FAT_FS_FLAG_NO_FMAP;
+
+    dev->reads = dev->blocks_read = 0;
+    return fs;
+}
+
+/* Does the free cluster map (if there is one) agree with the FAT? */
+static int map_matches(fat_fs_t *fs) {
+    uint32_t cl, val;
+    int err, isfree;
+
+    if(!fs->fmap)
+        return 1;
+
+    for(cl = 2; cl < fs->sb.num_clusters + 2; ++cl) {
+        if(!(fs->fmap_chunks[cl / FAT_MAP_CHUNK >> 3] &
+             (1 << (cl / FAT_MAP_CHUNK & 7))))
+            continue;
+
+        val = fat_read_fat(fs, cl, &err);
+        isfree = !!(fs->fmap[cl >> 5] & (1U << (cl & 31)));
+
+        if(isfree != !(val & 0x0FFFFFFF))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Count the free clusters and then allocate one, each right after
+   mounting. */
+static int alloc_first(bench_dev_t *dev, const bench_vol_t *v, int hints,
+                       int nomap, uint32_t nfree) {
+    fat_fs_t *fs;
+    uint32_t count = 0, cl;
+    unsigned long creads, areads;
+    clock_t start;
+    double csecs, asecs;
+    int err = 0;
+
+    memcpy(dev->data, orig, dev->stored * SECTOR_SIZE);
+
+    if(!hints)
+        set_hints(dev, 0xFFFFFFFF, 0xFFFFFFFF);
+
+    if(!(fs = alloc_mount(dev, 0, nomap)))
+        return -1;
+
+    start = clock();
+    err = fat_free_clusters(fs, &count);
+    csecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    creads = dev->reads;
+    check(!err && count == nfree, "wrong free cluster count");
+    fat_fs_shutdown(fs);
+
+    if(!(fs = alloc_mount(dev, 1, nomap)))
+        return -1;
+
+    start = clock();
+    cl = fat_allocate_cluster(fs, &err);
+    asecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    areads = dev->reads;
+    check(cl != FAT_INVALID_CLUSTER && !raw_entry(dev, cl),
+          "allocated a cluster that wasn't free");
+    check(map_matches(fs), "free cluster map doesn't match the FAT");
+    fat_fs_shutdown(fs);
+
+    printf("  %-13s %-6s free count %7.3f s %6lu requests, "
+           "first allocation %7.3f s %6lu requests\n",
+           hints ? "FSinfo hints" : "no hints", nomap ? "no map" : "map",
+           csecs, creads, asecs, areads);
+    return 0;
+}
+
+/* Append to each of the files in turn, wsize clusters at a time. */
+static int alloc_append(bench_dev_t *dev, const bench_vol_t *v, int nomap,
+                        int runs, uint32_t wsize) {
+    alloc_file_t files[ALLOC_FILES];
+    fat_fs_t *fs;
+    uint32_t cl, need, got, pieces = 0, count, i, n, prev;
+    clock_t start;
+    double secs;
+    int f, err = 0;
+
+    memcpy(dev->data, orig, dev->stored * SECTOR_SIZE);
+    memset(files, 0, sizeof(files));
+
+    if(!(fs = alloc_mount(dev, 1, nomap)))
+        return -1;
+
+    start = clock();
+
+    for(n = 0; n < ALLOC_CLUSTERS; n += wsize) {
+        for(f = 0; f < ALLOC_FILES; ++f) {
+            for(need = wsize; need; need -= got) {
+                /* The way fs_fat_write does it now, or the way it used to. */
+                if(runs) {
+                    cl = fat_allocate_chain(fs, files[f].last + 1, need, &got,
+                                            &err);
+                }
+                else {
+                    cl = fat_allocate_cluster(fs, &err);
+                    got = 1;
+                }
+
+                if(cl == FAT_INVALID_CLUSTER) {
+                    fprintf(stderr, "Allocation failed: %s\n", strerror(err));
+                    fat_fs_shutdown(fs);
+                    return -1;
+                }
+
+                if(files[f].last)
+                    fat_write_fat(fs, files[f].last, cl);
+                else
+                    files[f].first = cl;
+
+                files[f].last = cl + got - 1;
+                files[f].count += got;
+            }
+        }
+    }
+
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    check(map_matches(fs), "free cluster map doesn't match the FAT");
+
+    for(f = 0; f < ALLOC_FILES; ++f) {
+        for(cl = files[f].first, prev = 0; !fat_is_eof(fs, cl); prev = cl,
+            cl = fat_read_fat(fs, cl, &err)) {
+            if(cl != prev + 1)
+                ++pieces;
+        }
+    }
+
+    /* Delete every other file, and write everything out. */
+    for(f = 0; f < ALLOC_FILES; f += 2)
+        fat_erase_chain(fs, files[f].first);
+
+    check(map_matches(fs), "free cluster map doesn't match the FAT");
+    check(!fat_free_clusters(fs, &count), "couldn't count free clusters");
+    fat_fs_shutdown(fs);
+
+    check(count == raw_free(dev, v), "free count in memory is wrong");
+    check(get32(dev->data + SECTOR_SIZE + 488) == count,
+          "free count in FSinfo is wrong");
+
+    for(f = 1; f < ALLOC_FILES; f += 2) {
+        for(cl = files[f].first, i = 0; cl >= 2 && cl < v->ncl + 2;
+            cl = raw_entry(dev, cl))
+            ++i;
+
+        check(i == files[f].count && cl >= 0x0FFFFFF8,
+              "file's chain is wrong on the disk");
+    }
+
+    /* Count again after remounting, with the count in FSinfo and without. */
+    if(!(fs = alloc_mount(dev, 0, nomap)))
+        return -1;
+
+    check(!fat_free_clusters(fs, &i) && i == count,
+          "free count from FSinfo is wrong");
+    fat_fs_shutdown(fs);
+    set_hints(dev, 0xFFFFFFFF, 0xFFFFFFFF);
+
+    if(!(fs = alloc_mount(dev, 0, nomap)))
+        return -1;
+
+    check(!fat_free_clusters(fs, &i) && i == count,
+          "recounted free clusters are wrong");
+    fat_fs_shutdown(fs);
+
+    printf("  %-6s %-26s %7.1f allocations/ms, %5.1f pieces per file\n",
+           nomap ? "no map" : "map", runs ? "runs from the last cluster" :
+           "a cluster at a time", (double)ALLOC_FILES * ALLOC_CLUSTERS /
+           (secs > 0 ? secs * 1000 : 1), (double)pieces / ALLOC_FILES);
+    return 0;
+}
+
+static int alloc_main(bench_dev_t *dev, uint32_t gib) {
+    static const uint32_t wsizes[] = { 1, 16 };
+    bench_vol_t v;
+    uint32_t nfree;
+    int hints, nomap, runs, w;
+
+    spc = 64;
+    dev->count = gib * (1073741824 / SECTOR_SIZE);
+    alloc_bd.dev_data = dev;
+
+    if(layout(dev->count, &v))
+        return 1;
+
+    /* Just keep the FAT and root directory. */
+    dev->stored = v.fds + spc;
+
+    if(!(dev->data = (uint8_t *)calloc(dev->stored, SECTOR_SIZE)) ||
+       !(orig = (uint8_t *)malloc(dev->stored * SECTOR_SIZE))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    format(dev, &v, NULL);
+    fill(dev, &v);
+    nfree = raw_free(dev, &v);
+    set_hints(dev, nfree, v.ncl / 2 + 1);
+    memcpy(orig, dev->data, dev->stored * SECTOR_SIZE);
+
+    printf("%lu GiB volume, %lu clusters, %lu free:\n", (unsigned long)gib,
+           (unsigned long)v.ncl, (unsigned long)nfree);
+
+    for(hints = 1; hints >= 0; --hints) {
+        for(nomap = 1; nomap >= 0; --nomap) {
+            if(alloc_first(dev, &v, hints, nomap, nfree))
+                goto out;
+        }
+    }
+
+    for(w = 0; w < 2; ++w) {
+        printf("%d files, appending %lu cluster(s) at a time:\n", ALLOC_FILES,
+               (unsigned long)wsizes[w]);
+
+        for(nomap = 1; nomap >= 0; --nomap) {
+            for(runs = 0; runs < 2; ++runs) {
+                if(alloc_append(dev, &v, nomap, runs, wsizes[w]))
+                    goto out;
+            }
+        }
+    }
+
+out:
+    free(orig);
+    free(dev->data);
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const uint32_t rsizes[] = { 512, 4096, 65536 };
+    static const size_t budgets[] = { 32 << 10, 256 << 10 };
+    static const char *names[] = { "contiguous", "fragmented (runs of 7)" };
+    bench_file_t files[2] = { { 1, 0, FILE_SIZE }, { 2, 0, FILE_SIZE } };
+    bench_dev_t dev = { NULL, 0, 0, 0, 0, 0 };
+    bench_vol_t v;
+    uint32_t mib = 512;
+    int f, c, r, a, alloc = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-a")) {
+        alloc = 1;
+        --argc;
+        ++argv;
+    }
+
+    if(argc > 2 && !strcmp(argv[1], "-l")) {
+        dev.latency = atol(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if(argc > 2) {
+        fprintf(stderr, "Usage: fatbench [-l usec] [size in MiB]\n"
+                "       fatbench -a [-l usec] [size in GiB]\n");
+        return 1;
+    }
+
+    if(alloc)
+        return alloc_main(&dev, argc == 2 ? (uint32_t)atoi(argv[1]) : 32);
+
+    if(argc == 2)
+        mib = (uint32_t)atoi(argv[1]);
+
+    dev.count = dev.stored = mib * (1048576 / SECTOR_SIZE);
+
+    if(layout(dev.count, &v))
+        return 1;
+
+    if(!(dev.data = (uint8_t *)calloc(dev.count, SECTOR_SIZE))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if(format(&dev, &v, files)) {
+        free(dev.data);
+        return 1;
+    }
+
+    for(f = 0; f < 2; ++f) {
+        printf("%s file, %lu bytes:\n", names[f], (unsigned long)files[f].size);
+
+        for(c = 0; c < 2; ++c) {
+            for(r = 0; r < 3; ++r) {
+                for(a = 1; a >= 0; --a) {
+                    if(run(&dev, &files[f], budgets[c], rsizes[r], a))
+                        goto out;
+                }
+            }
+        }
+    }
+
+out:
+    free(dev.data);
+    return 0;
+}
@@ -16,111 +16,282 @@
 #include "bpb.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
+/* Clusters are cached in the shared buffer cache (see kos/bcache.h), attached
+   with the cluster size starting at the first data block, so cluster cl is
+   cache block cl - 2. Raw blocks (for the FAT12/FAT16 root directory) have a
+   handle of their own, attached with the sector size. The rest of the library
+   holds on to pointers into the cache for a while after reading clusters, so
+   they're read with bcache_read(), which keeps the last cache_sz of them. */
+static inline int cluster_is_raw(const fat_fs_t *fs, uint32_t cl) {
+    return (cl & 0x80000000) && fs->sb.fs_type != FAT_FS_FAT32;
+}
+
+static inline int cluster_valid(const fat_fs_t *fs, uint32_t cl) {
+    return cl >= 2 && cl < fs->sb.num_clusters + 2;
+}
+
+/* Figure out which cache handle and block a cluster lives in. Returns NULL if
+   the cluster is out of range. */
+static bcache_dev_t *cluster_cache(fat_fs_t *fs, uint32_t cl, uint64_t *bl) {
+    if(cluster_is_raw(fs, cl)) {
+        *bl = cl & 0x7FFFFFFF;
+        return fs->rcache;
+    }
+
+    if(!cluster_valid(fs, cl))
+        return NULL;
+
+    *bl = cl - 2;
+    return fs->bcache;
+}
+
+static int cluster_read_run_nc(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                               uint8_t *buf) {
+    uint32_t spc = fs->sb.sectors_per_cluster;
+
+    if(!cluster_valid(fs, cl) || count > fs->sb.num_clusters + 2 - cl)
+        return -EINVAL;
+
+    if(fs->dev->read_blocks(fs->dev, (cl - 2) * spc + fs->sb.first_data_block,
+                            count * spc, buf))
+        return -EIO;
+
+    return 0;
+}
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
+/* Count how many clusters of the chain starting at cl are contiguous on the
+   disk and not already in the cache, up to max. The cluster following the run
+   in the chain is returned in *next. Returns 0 on error. */
+static uint32_t chain_run(fat_fs_t *fs, uint32_t cl, uint32_t max,
+                          uint32_t *next, int *err) {
+    uint32_t count = 1, val;
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    for(;;) {
+        val = fat_read_fat(fs, cl + count - 1, err);
 
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
+        if(val == FAT_INVALID_CLUSTER)
+            return 0;
+
+        if(count == max || val != cl + count ||
+           bcache_cached(fs->bcache, val - 2))
+            break;
+
+        ++count;
     }
 
-    cache[fs->cache_size - 1] = tmp;
+    *next = val;
+    return count;
 }
 
-/* XXXX: This needs locking! */
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    bcache_dev_t *d;
+    uint64_t bl;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
+
+    if(!(d = cluster_cache(fs, cl, &bl))) {
+        *err = EIO;
+        return NULL;
     }
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
+    if(!(rv = bcache_read(d, bl, 0)))
+        *err = errno;
+
+    return rv;
+}
+
+int fat_cluster_read_ahead(fat_fs_t *fs, uint32_t cl, uint32_t count) {
+    uint32_t run, next;
+    int err = 0, got;
+
+    if(count > fs->rabuf_clusters)
+        count = fs->rabuf_clusters;
+
+    while(count > 1 && cluster_valid(fs, cl) &&
+          !bcache_cached(fs->bcache, cl - 2)) {
+        if(!(run = chain_run(fs, cl, count, &next, &err)))
+            return -err;
+
+        if((got = bcache_prefetch(fs->bcache, cl - 2, run)) < 0)
+            return -errno;
+
+        /* The buffer cache cuts the run short once clusters read ahead would
+           start pushing each other out, so stop there. */
+        if((uint32_t)got < run)
+            break;
+
+        count -= run;
+        cl = next;
+    }
+
+    return 0;
+}
+
+int fat_cluster_read_chain(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                           uint8_t *buf, uint32_t *next) {
+    uint32_t run, i, n, csz = fat_cluster_size(fs);
+    bcache_buf_t *b;
+    uint8_t *block;
+    int err = 0;
+
+    while(count) {
+        if(!cluster_valid(fs, cl))
+            return -EIO;
+
+        if(bcache_cached(fs->bcache, cl - 2)) {
+            /* We've already got this one, so copy it out of the cache. */
+            if(!(b = bcache_get(fs->bcache, cl - 2, 0)))
+                return -errno;
+
+            memcpy(buf, b->data, csz);
+            bcache_put(b);
+
+            if((*next = fat_read_fat(fs, cl, &err)) == FAT_INVALID_CLUSTER)
+                return -err;
+
+            run = 1;
+        }
+        else {
+            if(!(run = chain_run(fs, cl, count, next, &err)))
+                return -err;
+
+            if(!((uintptr_t)buf & 31)) {
+                if((err = cluster_read_run_nc(fs, cl, run, buf)))
+                    return err;
             }
+            else {
+                /* The block device might need an aligned buffer (for DMA),
+                   so bounce the data through the staging buffer, or through
+                   the cache if we don't have one. */
+                for(i = 0; i < run; i += n) {
+                    if(fs->rabuf) {
+                        n = run - i;
+
+                        if(n > fs->rabuf_clusters)
+                            n = fs->rabuf_clusters;
+
+                        if((err = cluster_read_run_nc(fs, cl + i, n,
+                                                      fs->rabuf)))
+                            return err;
+
+                        memcpy(buf + i * csz, fs->rabuf, n * csz);
+                    }
+                    else {
+                        n = 1;
+
+                        if(!(block = fat_cluster_read(fs, cl + i, &err)))
+                            return -err;
+
+                        memcpy(buf + i * csz, block, csz);
+                    }
+                }
+            }
+        }
+
+        buf += run * csz;
+        count -= run;
+        cl = *next;
+    }
+
+    return 0;
+}
+
+int fat_file_read(fat_fs_t *fs, fat_file_pos_t *pos, uint8_t *buf,
+                  uint32_t cnt) {
+    uint32_t bs = fat_cluster_size(fs), bo = pos->ptr & (bs - 1), n, next;
+    uint8_t *block;
+    int err = 0;
+
+    /* Grow the read-ahead window while the file is being read sequentially,
+       and start over whenever it isn't. */
+    if(pos->ptr != pos->ra_next)
+        pos->ra_window = 1;
+    else if(pos->ra_window < FAT_READAHEAD_BYTES / bs)
+        pos->ra_window <<= 1;
+
+    /* Handle the first block specially if we are offset within it. */
+    if(bo && cnt) {
+        fat_cluster_read_ahead(fs, pos->cluster, pos->ra_window);
+
+        if(!(block = fat_cluster_read(fs, pos->cluster, &err)))
+            return -err;
+
+        n = cnt > bs - bo ? bs - bo : cnt;
+        memcpy(buf, block + bo, n);
+        pos->ptr += n;
+        cnt -= n;
+        buf += n;
+
+        /* Did we hit the end of the cluster? */
+        if(n == bs - bo) {
+            next = fat_read_fat(fs, pos->cluster, &err);
+
+            if(next == FAT_INVALID_CLUSTER)
+                return -err;
+            else if(cnt && fat_is_eof(fs, next))
+                return -EIO;
+
+            pos->cluster = next;
+            ++pos->cluster_order;
         }
     }
 
-    /* Try to read the block in question. */
-    if(fat_cluster_read_nc(fs, cl, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
-        return NULL;
+    /* Read as many whole clusters as we can straight into the buffer. Runs of
+       contiguous clusters are read in one go. */
+    if(cnt >= bs) {
+        n = cnt / bs;
+
+        /* Reads of only a cluster or two still benefit from read-ahead. */
+        if(n < pos->ra_window)
+            fat_cluster_read_ahead(fs, pos->cluster, pos->ra_window);
+
+        if((err = fat_cluster_read_chain(fs, pos->cluster, n, buf, &next)))
+            return err;
+
+        pos->ptr += n * bs;
+        cnt -= n * bs;
+        buf += n * bs;
+        pos->cluster = next;
+        pos->cluster_order += n;
+
+        if(cnt && fat_is_eof(fs, next))
+            return -EIO;
     }
 
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    /* Read whatever is left from the last cluster. */
+    if(cnt) {
+        fat_cluster_read_ahead(fs, pos->cluster, pos->ra_window);
 
-out:
-    return rv;
+        if(!(block = fat_cluster_read(fs, pos->cluster, &err)))
+            return -err;
+
+        memcpy(buf, block, cnt);
+        pos->ptr += cnt;
+    }
+
+    pos->ra_next = pos->ptr;
+    return 0;
 }
 
 uint8_t *fat_cluster_clear(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    bcache_dev_t *d;
+    uint64_t bl;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
+    if(!(d = cluster_cache(fs, cl, &bl))) {
+        *err = EIO;
+        return NULL;
     }
 
     /* Don't bother reading the cluster from disk, since we're erasing it
        anyway... */
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID | FAT_CACHE_FLAG_DIRTY;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = bcache_read(d, bl, BCACHE_NOREAD))) {
+        *err = errno;
+        return NULL;
+    }
 
-out:
-    memset(rv, 0, fs->sb.bytes_per_sector * fs->sb.sectors_per_cluster);
+    memset(rv, 0, d == fs->rcache ? fs->sb.bytes_per_sector :
+           fat_cluster_size(fs));
+    bcache_mark_dirty_block(d, bl);
     return rv;
 }
 
@@ -181,43 +352,49 @@ int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk) {
 }
 
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster) {
-    int i;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cluster && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
-    }
+    bcache_dev_t *d;
+    uint64_t bl;
+
+    if(!(d = cluster_cache(fs, cluster, &bl)) ||
+       bcache_mark_dirty_block(d, bl))
+        return -EINVAL;
 
-    return -EINVAL;
+    return 0;
 }
 
 int fat_cluster_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->bcache;
-
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_cluster_write_nc(fs, cache[i]->block,
-                                           cache[i]->data)))
-                return err;
-
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
-        }
-    }
+    if(bcache_flush(fs->bcache) || bcache_flush(fs->rcache))
+        return -errno;
 
     return 0;
 }
 
+void fat_fs_cache_stats(const fat_fs_t *fs, bcache_stats_t *st) {
+    const bcache_dev_t *handles[2] = { fs->rcache, fs->fcache };
+    bcache_stats_t tmp;
+    int i;
+
+    bcache_get_stats(fs->bcache, st);
+
+    for(i = 0; i < 2; ++i) {
+        bcache_get_stats(handles[i], &tmp);
+        st->hits += tmp.hits;
+        st->misses += tmp.misses;
+        st->evictions += tmp.evictions;
+        st->read_reqs += tmp.read_reqs;
+        st->write_reqs += tmp.write_reqs;
+        st->blocks_read += tmp.blocks_read;
+        st->blocks_written += tmp.blocks_written;
+        st->buffers += tmp.buffers;
+        st->dirty += tmp.dirty;
+        st->bytes += tmp.bytes;
+    }
+}
+
 static inline uint32_t ilog2(uint32_t i) {
     i |= (i >> 1);
     i |= (i >> 2);
@@ -248,6 +425,10 @@ uint32_t fat_blocks_per_cluster(const fat_fs_t *fs) {
     return fs->sb.sectors_per_cluster;
 }
 
+uint32_t fat_fs_clusters(const fat_fs_t *fs) {
+    return fs->sb.num_clusters;
+}
+
 int fat_fs_type(const fat_fs_t *fs) {
     return (int)fs->sb.fs_type;
 }
@@ -265,7 +446,6 @@ fat_fs_t *fat_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
                          int fcache_sz) {
     fat_fs_t *rv;
-    int j;
     int block_size, cluster_size;
 
     if(bd->init(bd)) {
@@ -278,6 +458,9 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     }
 
     rv->dev = bd;
+    rv->flags = 0;
+    rv->fmap = NULL;
+    rv->fmap_chunks = NULL;
     rv->mnt_flags = flags & FAT_MNT_VALID_FLAGS_MASK;
 
     if(rv->mnt_flags != flags) {
@@ -301,79 +484,41 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     block_size = rv->sb.bytes_per_sector;
     cluster_size = rv->sb.bytes_per_sector * rv->sb.sectors_per_cluster;
 
-    /* Make space for the block cache. */
-    if(!(rv->bcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             cache_sz))) {
-        free(rv);
-        bd->shutdown(bd);
-        return NULL;
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_cache;
-        }
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)memalign(32, cluster_size))) {
-            goto out_bcache;
-        }
-
-        rv->bcache[j]->flags = 0;
-    }
+    if(cache_sz < 1 || fcache_sz < 1)
+        goto out;
 
-    rv->cache_size = cache_sz;
+    /* Attach to the buffer cache, for clusters, raw blocks and FAT blocks. */
+    if(!(rv->bcache = bcache_attach(bd, cluster_size, rv->sb.first_data_block,
+                                    cache_sz)))
+        goto out;
 
-    /* Make space for the FAT block cache. */
-    if(!(rv->fcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             fcache_sz))) {
+    if(!(rv->rcache = bcache_attach(bd, block_size, 0, cache_sz)))
         goto out_bcache;
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_fcache;
-        }
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j]->data = (uint8_t *)memalign(32, block_size))) {
-            goto out_fcache2;
-        }
 
-        rv->fcache[j]->flags = 0;
-    }
+    if(!(rv->fcache = bcache_attach(bd, block_size, 0, fcache_sz)))
+        goto out_rcache;
 
-    rv->fcache_size = fcache_sz;
-    return rv;
+    /* Set up the staging buffer for runs of clusters. This isn't fatal if it
+       fails, we'll just do everything one cluster at a time. */
+    rv->rabuf = NULL;
+    rv->rabuf_clusters = FAT_READAHEAD_BYTES / cluster_size;
 
-out_fcache2:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]->data);
-    }
+    if(rv->rabuf_clusters > FAT_CACHE_RUN_MAX)
+        rv->rabuf_clusters = FAT_CACHE_RUN_MAX;
 
-    j = fcache_sz - 1;
+    if(rv->rabuf_clusters >= 2)
+        rv->rabuf = (uint8_t *)memalign(32, rv->rabuf_clusters * cluster_size);
 
-out_fcache:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]);
-    }
+    if(!rv->rabuf)
+        rv->rabuf_clusters = 0;
 
-    free(rv->fcache);
+    return rv;
 
+out_rcache:
+    bcache_detach(rv->rcache);
 out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
+    bcache_detach(rv->bcache);
+out:
     free(rv);
     bd->shutdown(bd);
     return NULL;
@@ -415,22 +560,14 @@ int fat_fs_sync(fat_fs_t *fs) {
 }
 
 void fat_fs_shutdown(fat_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     fat_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
-
-    for(i = 0; i < fs->fcache_size; ++i) {
-        free(fs->fcache[i]->data);
-        free(fs->fcache[i]);
-    }
+    bcache_detach(fs->bcache);
+    bcache_detach(fs->rcache);
+    bcache_detach(fs->fcache);
+    free(fs->rabuf);
+    fat_free_map_release(fs);
 
     fs->dev->shutdown(fs->dev);
     free(fs);
@@ -11,6 +11,7 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <kos/bcache.h>
 
 #ifndef FAT_NOT_IN_KOS
 #include <kos/blockdev.h>
@@ -18,16 +19,13 @@ __BEGIN_DECLS
 
 /* Tunable filesystem parameters. These must be set at compile time. */
 
-/* Size of the cluster cache, in filesystem clusters. When reading data from the
-   filesystem, all data is read in cluster-sized units. The size of a cluster
-   can generally range from 1024 bytes to 65536 bytes, and is dependent on the
-   parameters the filesystem was formatted with. Increasing this value should
-   ensure that more accesses can be handled by the cache, but also increases the
-   latency at which data is written back to the block device itself. Setting
-   this to 8 should work well enough, but if you have more memory to spare,
-   feel free to set it larger (just keep in mind your target cluster size!).
-   For reference, a 16-cluster cache at 64k clusters would give a cache size
-   of 1MiB (plus some overhead).
+/* Number of clusters kept in the cache for each filesystem. Clusters are cached
+   in the buffer cache shared by all filesystems on block devices (see
+   kos/bcache.h), which has a memory budget of its own. On top of that, the
+   clusters most recently read by each filesystem are always kept, as the rest
+   of the library holds on to pointers into the cache for a while. Setting this
+   to 8 should work well enough (just keep in mind your target cluster size!).
+   For reference, 16 clusters at 64k per cluster would keep 1MiB around.
 
    Note that this is a default value for filesystems initialized/mounted with
    fat_fs_init(). If you wish to specify your own value that differs from this
@@ -35,12 +33,12 @@ __BEGIN_DECLS
 */
 #define FAT_CACHE_BLOCKS        8
 
-/* Size of the FAT cache, in filesystem blocks. When reading the file allocation
-   table, all data is read one block at a time. Generally, a block is 512 bytes
-   in size (and much of the code in this library makes the assumption that this
-   is the case). This value must be at least set to 2 in order to ensure that
-   FAT12 support works in the library. The default value of 8 should work well
-   enough, but feel free to increase it if you have more memory to spare.
+/* Number of blocks of the FAT kept in the cache for each filesystem. When
+   reading the file allocation table, all data is read one block at a time.
+   Generally, a block is 512 bytes in size (and much of the code in this
+   library makes the assumption that this is the case). This value must be at
+   least set to 2 in order to ensure that FAT12 support works in the library.
+   The default value of 8 should work well enough.
 
    Just like FAT_CACHE_BLOCKS above, this is a default for filesystems
    initialized/mounted with fat_fs_init(). You may specify your own value at
@@ -48,6 +46,28 @@ __BEGIN_DECLS
 */
 #define FAT_FCACHE_BLOCKS       8
 
+/* Maximum amount of data to read ahead of an open file, in bytes. When a file
+   is being read sequentially, the read-ahead window starts at one cluster and
+   doubles each time the reader catches up with it, until it hits this limit
+   (or half of the buffer cache's budget, whichever is smaller). Contiguous
+   clusters in the window are read with a single request to the block device.
+   This also sets the size of the staging buffer used for reading runs of
+   contiguous clusters into unaligned buffers, which is allocated once per
+   filesystem. Set this to 0 to disable read-ahead altogether.
+*/
+#define FAT_READAHEAD_BYTES     65536
+
+/* Largest free cluster map to keep for each filesystem, in bytes. Rather than
+   searching through the FAT for free clusters, a bitmap with one bit for each
+   cluster is built up as clusters are allocated, and is used for counting the
+   free space on the filesystem (when the FAT32 FSinfo sector doesn't have a
+   count already). The default is enough for a million clusters, which covers
+   a 32GiB SD card with the usual 32KiB clusters. If the map for a filesystem
+   would be any bigger than this, the FAT is searched directly instead. Set
+   this to 0 to never keep a map.
+*/
+#define FAT_FREE_MAP_BYTES      131072
+
 /* End tunable filesystem parameters. */
 
 /* Convenience stuff, for in case you want to use this outside of KOS. */
@@ -62,7 +82,7 @@ typedef struct kos_blockdev {
                        void *buf);
     int (*write_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                         const void *buf);
-    uint32_t (*count_blocks)(const struct kos_blockdev *d);
+    uint64_t (*count_blocks)(const struct kos_blockdev *d);
 } kos_blockdev_t;
 #endif /* FAT_NOT_IN_KOS */
 
@@ -70,6 +90,15 @@ typedef struct kos_blockdev {
 struct fatfs_struct;
 typedef struct fatfs_struct fat_fs_t;
 
+/* Where reading an open file is up to (see fat_file_read()). */
+typedef struct fat_file_pos {
+    uint32_t cluster;           /* Cluster that ptr is in */
+    uint32_t cluster_order;     /* Which cluster of the file that is */
+    uint32_t ptr;               /* Offset into the file */
+    uint32_t ra_next;           /* Where a sequential read would start */
+    uint32_t ra_window;         /* Clusters to read ahead */
+} fat_file_pos_t;
+
 /* Filesystem mount flags */
 #define FAT_MNT_FLAG_RO             0x00000000
 #define FAT_MNT_FLAG_RW             0x00000001
@@ -83,12 +112,34 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
 int fat_fs_sync(fat_fs_t *fs);
 void fat_fs_shutdown(fat_fs_t *fs);
 
+/* Fetch the block cache counters for the filesystem (see kos/bcache.h). */
+void fat_fs_cache_stats(const fat_fs_t *fs, bcache_stats_t *st);
+
 int fat_cluster_read_nc(fat_fs_t *fs, uint32_t cluster, uint8_t *rv);
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cluster, int *err);
 uint8_t *fat_cluster_clear(fat_fs_t *fs, uint32_t cl, int *err);
 
 int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk);
 
+/* Read count whole clusters of the chain starting at cl into buf, using as few
+   requests to the block device as possible for runs of contiguous clusters.
+   The cluster following the last one read is returned in *next. */
+int fat_cluster_read_chain(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                           uint8_t *buf, uint32_t *next);
+
+/* Fill the cluster cache with up to count clusters of the chain starting at
+   cl, if they're not already there. */
+int fat_cluster_read_ahead(fat_fs_t *fs, uint32_t cl, uint32_t count);
+
+/* Read cnt bytes of a file into buf, starting from where pos is up to, and
+   move pos along past them. The caller makes sure that cnt doesn't go past
+   the end of the file, and that pos->cluster is the cluster pos->ptr is in.
+   Runs of contiguous clusters are read straight into buf, and the read-ahead
+   window grows for as long as the file is read sequentially. Returns 0, or a
+   negative error number. */
+int fat_file_read(fat_fs_t *fs, fat_file_pos_t *pos, uint8_t *buf,
+                  uint32_t cnt);
+
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster);
 
 uint32_t fat_block_size(const fat_fs_t *fs);
@@ -97,6 +148,7 @@ uint32_t fat_cluster_size(const fat_fs_t *fs);
 uint32_t fat_log_cluster_size(const fat_fs_t *fs);
 uint32_t fat_blocks_per_cluster(const fat_fs_t *fs);
 uint32_t fat_rootdir_length(const fat_fs_t *fs);
+uint32_t fat_fs_clusters(const fat_fs_t *fs);
 
 #define FAT_FS_FAT12    0
 #define FAT_FS_FAT16    1
@@ -121,6 +173,17 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err);
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val);
 int fat_is_eof(fat_fs_t *fs, uint32_t cl);
 uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err);
+
+/* Allocate a chain of up to count clusters, contiguous on the disk, starting
+   at goal if it's free (or from where the last allocation left off, if not).
+   The chain is terminated, and the number of clusters in it is returned in
+   *got. Returns the first cluster, or FAT_INVALID_CLUSTER on error. */
+uint32_t fat_allocate_chain(fat_fs_t *fs, uint32_t goal, uint32_t count,
+                            uint32_t *got, int *err);
+
+/* Count the free clusters on the filesystem. Returns 0 or a negative error
+   code. */
+int fat_free_clusters(fat_fs_t *fs, uint32_t *count);
 int fat_erase_chain(fat_fs_t *fs, uint32_t cluster);
 
 __END_DECLS
@@ -9,27 +9,40 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <kos/bcache.h>
 
 #include "bpb.h"
 
-#define FAT_CACHE_FLAG_VALID    1
-#define FAT_CACHE_FLAG_DIRTY    2
+/* Longest run of clusters read with a single request. */
+#define FAT_CACHE_RUN_MAX       64
 
-typedef struct fat_cache {
-    uint32_t flags;
-    uint32_t block;
-    uint8_t *data;
-} fat_cache_t;
+/* Number of clusters filled in at a time in the free cluster map (see fat.c).
+   This must be a multiple of 32. */
+#define FAT_MAP_CHUNK           4096
+
+/* Value of the FSinfo free cluster count when it isn't known. */
+#define FAT_FREE_UNKNOWN        0xFFFFFFFF
 
 struct fatfs_struct {
     kos_blockdev_t *dev;
     fat_superblock_t sb;
 
-    fat_cache_t **bcache;
-    int cache_size;
+    /* Blocks are cached in the buffer cache shared with other filesystems,
+       through three handles: one for clusters, one for the raw blocks of the
+       FAT12/FAT16 root directory and one for the blocks of the FAT. */
+    bcache_dev_t *bcache;
+    bcache_dev_t *rcache;
+    bcache_dev_t *fcache;
+
+    /* Staging buffer for reading runs of contiguous clusters. */
+    uint8_t *rabuf;
+    uint32_t rabuf_clusters;
 
-    fat_cache_t **fcache;
-    int fcache_size;
+    /* Free cluster map, with a bit set for each free cluster, and a bit set
+       in fmap_chunks for each chunk of it that has been filled in. */
+    uint32_t *fmap;
+    uint8_t *fmap_chunks;
+    uint32_t fmap_unloaded;
 
     uint32_t flags;
     uint32_t mnt_flags;
@@ -38,6 +51,11 @@ struct fatfs_struct {
 /* The BPB/FSinfo blocks need to be written back to the block device... */
 #define FAT_FS_FLAG_SB_DIRTY   1
 
+/* The free cluster map is too big, or couldn't be allocated... */
+#define FAT_FS_FLAG_NO_FMAP    2
+
+void fat_free_map_release(fat_fs_t *fs);
+
 #ifdef FAT_NOT_IN_KOS
     #include <stdio.h>
     #define DBG_DEBUG 0
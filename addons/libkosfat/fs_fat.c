@@ -35,6 +35,11 @@ char *strdup(const char *);
 
 #define MAX_FAT_FILES 16
 
+/* Most clusters allocated at once when a write runs past the end of a file.
+   They're all cleared in the cache straight away, so this shouldn't be much
+   more than the cache can hold. */
+#define FAT_ALLOC_RUN_MAX 16
+
 typedef struct fs_fat_fs {
     LIST_ENTRY(fs_fat_fs) entry;
 
@@ -54,10 +59,8 @@ static struct {
     uint32_t dentry_offset;
     uint32_t dentry_lcl;
     uint32_t dentry_loff;
-    uint32_t cluster;
-    uint32_t cluster_order;
+    fat_file_pos_t pos;
     int mode;
-    uint32_t ptr;
     dirent_t dent;
     fs_fat_fs_t *fs;
 } fh[MAX_FAT_FILES];
@@ -137,12 +140,17 @@ static int fat_create_entry(fat_fs_t *fs, const char *fn, uint8_t attr,
     return 0;
 }
 
-static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
-    uint32_t clo, cl, cl2;
+/* Move the file's cluster pointer to the given cluster of the file. If write
+   is non-zero, it's the number of clusters, from that one on, that are about
+   to be written: any of them past the end of the file are allocated, in as
+   few runs as we can get. */
+static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order,
+                           uint32_t write) {
+    uint32_t clo, cl, cl2, want, got, i;
     int err;
 
-    cl = fh[fd].cluster;
-    clo = fh[fd].cluster_order;
+    cl = fh[fd].pos.cluster;
+    clo = fh[fd].pos.cluster_order;
 
     /* Are we moving forward or backward? */
     if(clo > order) {
@@ -150,8 +158,8 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
            and advance forward. */
         clo = 0;
         cl = fh[fd].dentry.cluster_low | (fh[fd].dentry.cluster_high << 16);
-        fh[fd].cluster = cl;
-        fh[fd].cluster_order = clo;
+        fh[fd].pos.cluster = cl;
+        fh[fd].pos.cluster_order = clo;
     }
 
     /* At this point, we're definitely moving forward, if at all... */
@@ -167,28 +175,36 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
             /* If we've hit the EOF and we're writing, we need to allocate a new
                cluster to the file. If we're reading, then return error. */
             if(!write) {
-                fh[fd].cluster = cl2;
-                fh[fd].cluster_order = clo;
+                fh[fd].pos.cluster = cl2;
+                fh[fd].pos.cluster_order = clo;
                 fh[fd].mode &= ~0x80000000;
                 return -EDOM;
             }
             else {
-                /* Allocate a new cluster */
-                cl2 = fat_allocate_cluster(fs, &err);
+                /* Allocate as many new clusters as we'll need, following on
+                   from the last one if we can. */
+                want = order - clo - 1 + write;
+
+                if(want > FAT_ALLOC_RUN_MAX)
+                    want = FAT_ALLOC_RUN_MAX;
+
+                cl2 = fat_allocate_chain(fs, cl + 1, want, &got, &err);
 
                 if(cl2 == FAT_INVALID_CLUSTER) {
                     return -err;
                 }
 
-                /* Clear it. */
-                if(!fat_cluster_clear(fs, cl2, &err)) {
-                    fat_write_fat(fs, cl2, 0);
-                    return -err;
+                /* Clear them. */
+                for(i = 0; i < got; ++i) {
+                    if(!fat_cluster_clear(fs, cl2 + i, &err)) {
+                        fat_erase_chain(fs, cl2);
+                        return -err;
+                    }
                 }
 
-                /* Write it to the file's FAT chain. */
+                /* Write them to the file's FAT chain. */
                 if((err = fat_write_fat(fs, cl, cl2)) < 0) {
-                    fat_write_fat(fs, cl2, 0);
+                    fat_erase_chain(fs, cl2);
                     return err;
                 }
             }
@@ -198,8 +214,8 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
         ++clo;
     }
 
-    fh[fd].cluster = cl;
-    fh[fd].cluster_order = clo;
+    fh[fd].pos.cluster = cl;
+    fh[fd].pos.cluster_order = clo;
     fh[fd].mode &= ~0x80000000;
     return 0;
 }
@@ -336,11 +352,13 @@ static void *fs_fat_open(vfs_handler_t *vfs, const char *fn, int mode) {
     /* Fill in the rest of the handle */
 created:
     fh[fd].mode = mode;
-    fh[fd].ptr = 0;
+    fh[fd].pos.ptr = 0;
     fh[fd].fs = mnt;
-    fh[fd].cluster = fh[fd].dentry.cluster_low |
+    fh[fd].pos.cluster = fh[fd].dentry.cluster_low |
         (fh[fd].dentry.cluster_high << 16);
-    fh[fd].cluster_order = 0;
+    fh[fd].pos.cluster_order = 0;
+    fh[fd].pos.ra_next = 0;
+    fh[fd].pos.ra_window = 1;
     fh[fd].opened = 1;
 
     mutex_unlock(&fat_mutex);
@@ -370,12 +388,10 @@ static int fs_fat_close(void *h) {
 static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     fat_fs_t *fs;
-    uint32_t bs, bo;
-    uint8_t *block;
-    uint8_t *bbuf = (uint8_t *)buf;
+    uint32_t bs;
     ssize_t rv;
-    uint64_t sz, cl;
-    int mode;
+    uint64_t sz;
+    int mode, err;
 
     mutex_lock(&fat_mutex);
 
@@ -406,22 +422,21 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     /* Did we hit the end of the file? */
     sz = fh[fd].dentry.size;
 
-    if(fat_is_eof(fs, fh[fd].cluster) || fh[fd].ptr >= sz) {
+    if(fat_is_eof(fs, fh[fd].pos.cluster) || fh[fd].pos.ptr >= sz) {
         mutex_unlock(&fat_mutex);
         return 0;
     }
 
     /* Do we have enough left? */
-    if((fh[fd].ptr + cnt) > sz)
-        cnt = sz - fh[fd].ptr;
+    if((fh[fd].pos.ptr + cnt) > sz)
+        cnt = sz - fh[fd].pos.ptr;
 
     bs = fat_cluster_size(fs);
     rv = (ssize_t)cnt;
-    bo = fh[fd].ptr & (bs - 1);
 
     /* Have we had an intervening seek call? */
     if((fh[fd].mode & 0x80000000)) {
-        mode = advance_cluster(fs, fd, fh[fd].ptr / bs, 0);
+        mode = advance_cluster(fs, fd, fh[fd].pos.ptr / bs, 0);
 
         if(mode == -EDOM) {
             mutex_unlock(&fat_mutex);
@@ -434,102 +449,10 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
         }
     }
 
-    /* Handle the first block specially if we are offset within it. */
-    if(bo) {
-        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
-            mutex_unlock(&fat_mutex);
-            return -1;
-        }
-
-        /* Is there still more to read? */
-        if(cnt > bs - bo) {
-            memcpy(bbuf, block + bo, bs - bo);
-            fh[fd].ptr += bs - bo;
-            cnt -= bs - bo;
-            bbuf += bs - bo;
-            cl = fat_read_fat(fs, fh[fd].cluster, &errno);
-
-            if(cl == FAT_INVALID_CLUSTER) {
-                mutex_unlock(&fat_mutex);
-                return -1;
-            }
-            else if(fat_is_eof(fs, cl)) {
-                mutex_unlock(&fat_mutex);
-                errno = EIO;
-                return -1;
-            }
-
-            fh[fd].cluster = cl;
-            ++fh[fd].cluster_order;
-        }
-        else {
-            memcpy(bbuf, block + bo, cnt);
-            fh[fd].ptr += cnt;
-
-            /* Did we hit the end of the cluster? */
-            if(cnt + bo == bs) {
-                cl = fat_read_fat(fs, fh[fd].cluster, &errno);
-
-                if(cl == FAT_INVALID_CLUSTER) {
-                    mutex_unlock(&fat_mutex);
-                    return -1;
-                }
-
-                fh[fd].cluster = cl;
-                ++fh[fd].cluster_order;
-            }
-
-            cnt = 0;
-        }
-    }
-
-    /* While we still have more to read, do it. */
-    while(cnt) {
-        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
-            mutex_unlock(&fat_mutex);
-            return -1;
-        }
-
-        /* Is there still more to read? */
-        if(cnt > bs) {
-            memcpy(bbuf, block, bs);
-            fh[fd].ptr += bs;
-            cnt -= bs;
-            bbuf += bs;
-            cl = fat_read_fat(fs, fh[fd].cluster, &errno);
-
-            if(cl == FAT_INVALID_CLUSTER) {
-                mutex_unlock(&fat_mutex);
-                return -1;
-            }
-            else if(fat_is_eof(fs, cl)) {
-                mutex_unlock(&fat_mutex);
-                errno = EIO;
-                return -1;
-            }
-
-            fh[fd].cluster = cl;
-            ++fh[fd].cluster_order;
-        }
-        else {
-            memcpy(bbuf, block, cnt);
-            fh[fd].ptr += cnt;
-
-            /* Did we hit the end of the cluster? */
-            if(cnt == bs) {
-                cl = fat_read_fat(fs, fh[fd].cluster, &errno);
-
-                if(cl == FAT_INVALID_CLUSTER) {
-                    mutex_unlock(&fat_mutex);
-                    return -1;
-                }
-
-                fh[fd].cluster = cl;
-                ++fh[fd].cluster_order;
-            }
-
-            cnt = 0;
-        }
+    if((err = fat_file_read(fs, &fh[fd].pos, (uint8_t *)buf, cnt))) {
+        mutex_unlock(&fat_mutex);
+        errno = -err;
+        return -1;
     }
 
     /* We're done, clean up and return. */
@@ -571,12 +494,13 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     fs = fh[fd].fs->fs;
     bs = fat_cluster_size(fs);
     rv = (ssize_t)cnt;
-    bo = fh[fd].ptr & (bs - 1);
+    bo = fh[fd].pos.ptr & (bs - 1);
 
     /* Have we had an intervening seek call (or a write that ended exactly on
        a cluster boundary)? */
     if((fh[fd].mode & 0x80000000)) {
-        if((err = advance_cluster(fs, fd, fh[fd].ptr / bs, 1)) < 0) {
+        if((err = advance_cluster(fs, fd, fh[fd].pos.ptr / bs,
+                                  (bo + cnt + bs - 1) / bs)) < 0) {
             mutex_unlock(&fat_mutex);
             errno = -err;
             return -1;
@@ -585,7 +509,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
     /* Are we starting our write in the middle of a block? */
     if(bo) {
-        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
+        if(!(block = fat_cluster_read(fs, fh[fd].pos.cluster, &err))) {
             mutex_unlock(&fat_mutex);
             errno = err;
             return -1;
@@ -594,14 +518,14 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
         /* Are we writing past the end of this block, or not? */
         if(cnt > bs - bo) {
             memcpy(block + bo, bbuf, bs - bo);
-            fat_cluster_mark_dirty(fs, fh[fd].cluster);
+            fat_cluster_mark_dirty(fs, fh[fd].pos.cluster);
 
-            fh[fd].ptr += bs - bo;
+            fh[fd].pos.ptr += bs - bo;
             bbuf += bs - bo;
             cnt -= bs - bo;
 
-            if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
-                                      1)) < 0) {
+            if((err = advance_cluster(fs, fd, fh[fd].pos.cluster_order + 1,
+                                      (cnt + bs - 1) / bs)) < 0) {
                 mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
@@ -609,8 +533,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
         }
         else {
             memcpy(block + bo, bbuf, cnt);
-            fat_cluster_mark_dirty(fs, fh[fd].cluster);
-            fh[fd].ptr += cnt;
+            fat_cluster_mark_dirty(fs, fh[fd].pos.cluster);
+            fh[fd].pos.ptr += cnt;
             cnt = 0;
 
             /* We don't want to advance the cluster even if we've hit the end of
@@ -623,7 +547,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
     /* While we still have more to write, do it. */
     while(cnt) {
-        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
+        if(!(block = fat_cluster_read(fs, fh[fd].pos.cluster, &err))) {
             mutex_unlock(&fat_mutex);
             errno = err;
             return -1;
@@ -632,13 +556,13 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
         /* Is there still more to write after this cluster? */
         if(cnt > bs) {
             memcpy(block, bbuf, bs);
-            fat_cluster_mark_dirty(fs, fh[fd].cluster);
-            fh[fd].ptr += bs;
+            fat_cluster_mark_dirty(fs, fh[fd].pos.cluster);
+            fh[fd].pos.ptr += bs;
             cnt -= bs;
             bbuf += bs;
 
-            if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
-                                      1)) < 0) {
+            if((err = advance_cluster(fs, fd, fh[fd].pos.cluster_order + 1,
+                                      (cnt + bs - 1) / bs)) < 0) {
                 mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
@@ -646,8 +570,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
         }
         else {
             memcpy(block, bbuf, cnt);
-            fat_cluster_mark_dirty(fs, fh[fd].cluster);
-            fh[fd].ptr += cnt;
+            fat_cluster_mark_dirty(fs, fh[fd].pos.cluster);
+            fh[fd].pos.ptr += cnt;
             cnt = 0;
 
             /* We don't want to advance the cluster even if we've hit the end of
@@ -660,8 +584,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
     /* If the file pointer is past the end of the file as recorded in its
        directory entry, update the directory entry with the new size. */
-    if(fh[fd].ptr > fh[fd].dentry.size || mode == O_WRONLY) {
-        fh[fd].dentry.size = fh[fd].ptr;
+    if(fh[fd].pos.ptr > fh[fd].dentry.size || mode == O_WRONLY) {
+        fh[fd].dentry.size = fh[fd].pos.ptr;
 
         if((err = fat_update_dentry(fs, &fh[fd].dentry,
                                     fh[fd].dentry_cluster,
@@ -700,7 +624,7 @@ static _off64_t fs_fat_seek64(void *h, _off64_t offset, int whence) {
             break;
 
         case SEEK_CUR:
-            pos = fh[fd].ptr + offset;
+            pos = fh[fd].pos.ptr + offset;
             break;
 
         case SEEK_END:
@@ -715,7 +639,7 @@ static _off64_t fs_fat_seek64(void *h, _off64_t offset, int whence) {
 
     /* Update the file pointer and set the flag so that we know that we have
        done a seek. */
-    fh[fd].ptr = pos;
+    fh[fd].pos.ptr = pos;
     fh[fd].mode |= 0x80000000;
 
     rv = (_off64_t)pos;
@@ -735,7 +659,7 @@ static _off64_t fs_fat_tell64(void *h) {
         return -1;
     }
 
-    rv = (_off64_t)fh[fd].ptr;
+    rv = (_off64_t)fh[fd].pos.ptr;
     mutex_unlock(&fat_mutex);
     return rv;
 }
@@ -856,13 +780,13 @@ static const dirent_t *fs_fat_readdir(void *h) {
         bs = fat_block_size(fs);
 
     /* Make sure we're not at the end of the directory. */
-    if(fat_is_eof(fs, fh[fd].cluster)) {
+    if(fat_is_eof(fs, fh[fd].pos.cluster)) {
         mutex_unlock(&fat_mutex);
         return NULL;
     }
 
     /* Read the block we're looking at... */
-    if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
+    if(!(block = fat_cluster_read(fs, fh[fd].pos.cluster, &err))) {
         errno = err;
         mutex_unlock(&fat_mutex);
         return NULL;
@@ -873,8 +797,8 @@ static const dirent_t *fs_fat_readdir(void *h) {
 
     /* Grab the entry. */
     do {
-        dent = (fat_dentry_t *)(block + (fh[fd].ptr & (bs - 1)));
-        fh[fd].ptr += 32;
+        dent = (fat_dentry_t *)(block + (fh[fd].pos.ptr & (bs - 1)));
+        fh[fd].pos.ptr += 32;
 
         /* If this is a long name entry, copy the name out... */
         if(FAT_IS_LONG_NAME(dent)) {
@@ -886,16 +810,16 @@ static const dirent_t *fs_fat_readdir(void *h) {
         if(dent->name[0] == FAT_ENTRY_EOD) {
             /* This will work for all versions of FAT, because of how the
                fat_is_eof() function works. */
-            fh[fd].cluster = 0x0FFFFFF8;
+            fh[fd].pos.cluster = 0x0FFFFFF8;
             mutex_unlock(&fat_mutex);
             return NULL;
         }
         /* This entry is empty, so move onto the next one... */
         else if(dent->name[0] == FAT_ENTRY_FREE || FAT_IS_LONG_NAME(dent)) {
             /* Are we at the end of this block/cluster? */
-            if((fh[fd].ptr & (bs - 1)) == 0) {
+            if((fh[fd].pos.ptr & (bs - 1)) == 0) {
                 if(fat_fs_type(fs) == FAT_FS_FAT32 || fh[fd].dentry_cluster) {
-                    cl = fat_read_fat(fs, fh[fd].cluster, &err);
+                    cl = fat_read_fat(fs, fh[fd].pos.cluster, &err);
 
                     if(cl == FAT_INVALID_CLUSTER) {
                         errno = err;
@@ -908,19 +832,19 @@ static const dirent_t *fs_fat_readdir(void *h) {
                         return NULL;
                     }
 
-                    fh[fd].cluster = cl;
-                    ++fh[fd].cluster_order;
+                    fh[fd].pos.cluster = cl;
+                    ++fh[fd].pos.cluster_order;
                 }
                 else {
                     /* Are we at the end of the directory? */
-                    if((fh[fd].ptr >> 5) >= fat_rootdir_length(fs)) {
-                        fh[fd].cluster = 0x0FFFFFFF;
+                    if((fh[fd].pos.ptr >> 5) >= fat_rootdir_length(fs)) {
+                        fh[fd].pos.cluster = 0x0FFFFFFF;
                         mutex_unlock(&fat_mutex);
                         return NULL;
                     }
 
-                    ++fh[fd].cluster;
-                    ++fh[fd].cluster_order;
+                    ++fh[fd].pos.cluster;
+                    ++fh[fd].pos.cluster_order;
                 }
             }
         }
@@ -979,6 +903,33 @@ static int fs_fat_fcntl(void *h, int cmd, va_list ap) {
     return rv;
 }
 
+static int fs_fat_ioctl(void *h, int cmd, va_list ap) {
+    file_t fd = ((file_t)h) - 1;
+    void *arg = va_arg(ap, void *);
+    int rv = 0;
+
+    mutex_lock(&fat_mutex);
+
+    if(fd >= MAX_FAT_FILES || !fh[fd].opened) {
+        mutex_unlock(&fat_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    switch(cmd) {
+        case IOCTL_BCACHE_GET_STATS:
+            fat_fs_cache_stats(fh[fd].fs->fs, (bcache_stats_t *)arg);
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+    }
+
+    mutex_unlock(&fat_mutex);
+    return rv;
+}
+
 static int fs_fat_unlink(vfs_handler_t *vfs, const char *fn) {
     fs_fat_fs_t *fs = (fs_fat_fs_t *)vfs->privdata;
     fat_dentry_t ent;
@@ -1236,10 +1187,10 @@ static int fs_fat_rewinddir(void *h) {
     }
 
     /* Rewind to the beginning of the directory. */
-    fh[fd].ptr = 0;
-    fh[fd].cluster = fh[fd].dentry.cluster_low |
+    fh[fd].pos.ptr = 0;
+    fh[fd].pos.cluster = fh[fd].dentry.cluster_low |
         (fh[fd].dentry.cluster_high << 16);
-    fh[fd].cluster_order = 0;
+    fh[fd].pos.cluster_order = 0;
 
     mutex_unlock(&fat_mutex);
     return 0;
@@ -1332,7 +1283,7 @@ static vfs_handler_t vh = {
     NULL,                       /* tell */
     NULL,                       /* total */
     fs_fat_readdir,             /* readdir */
-    NULL,                       /* ioctl */
+    fs_fat_ioctl,               /* ioctl */
     NULL,                       /* rename */
     fs_fat_unlink,              /* unlink */
     NULL,                       /* mmap */
@@ -1477,6 +1428,40 @@ int fs_fat_sync(const char *mp) {
     return rv;
 }
 
+int fs_fat_free_space(const char *mp, uint64_t *avail, uint64_t *total) {
+    fs_fat_fs_t *i;
+    uint32_t count;
+    int found = 0, rv = 0, err;
+
+    /* Find the fs in question */
+    mutex_lock(&fat_mutex);
+    LIST_FOREACH(i, &fat_fses, entry) {
+        if(!strcmp(mp, i->vfsh->nmmgr.pathname)) {
+            found = 1;
+            break;
+        }
+    }
+
+    if(!found) {
+        errno = ENOENT;
+        rv = -1;
+    }
+    else if((err = fat_free_clusters(i->fs, &count)) < 0) {
+        errno = -err;
+        rv = -1;
+    }
+    else {
+        *avail = (uint64_t)count * fat_cluster_size(i->fs);
+
+        if(total)
+            *total = (uint64_t)fat_fs_clusters(i->fs) *
+                fat_cluster_size(i->fs);
+    }
+
+    mutex_unlock(&fat_mutex);
+    return rv;
+}
+
 int fs_fat_init(void) {
     if(initted)
         return 0;
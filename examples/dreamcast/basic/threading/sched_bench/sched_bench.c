@@ -0,0 +1,96 @@
+/* KallistiOS ##version##
+
+   sched_bench.c
+
+*/
+
+/* This program measures the cost of a context switch as the number of
+   runnable threads grows. For each thread count, a set of threads of the same
+   priority is created, and each of them gives up the CPU with thd_pass() a
+   fixed number of times. With the scheduler picking the next thread through
+   its bucketed run queue, the time per switch should stay roughly constant
+   regardless of how many threads are in the run queue.
+
+   A second pass adds as many threads that are blocked in thd_poll() on a
+   condition that never becomes true, to show the overhead of the polling
+   threads on the scheduler. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#define ITERATIONS      2000
+#define MAX_THREADS     64
+
+static volatile bool pollers_done;
+
+static void *switch_thd(void *param) {
+    (void)param;
+
+    for(int i = 0; i < ITERATIONS; i++)
+        thd_pass();
+
+    return NULL;
+}
+
+static int poll_cb(void *data) {
+    (void)data;
+    return pollers_done;
+}
+
+static void *poll_thd(void *param) {
+    (void)param;
+    thd_poll(poll_cb, NULL, 0);
+    return NULL;
+}
+
+static void run_bench(unsigned int nthds, unsigned int npollers) {
+    kthread_t *thds[MAX_THREADS], *pollers[MAX_THREADS];
+    uint64_t start, end;
+    unsigned int i;
+
+    pollers_done = false;
+
+    for(i = 0; i < npollers; i++)
+        pollers[i] = thd_create(false, poll_thd, NULL);
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < nthds; i++)
+        thds[i] = thd_create(false, switch_thd, NULL);
+
+    for(i = 0; i < nthds; i++)
+        thd_join(thds[i], NULL);
+
+    end = timer_ns_gettime64();
+
+    pollers_done = true;
+
+    for(i = 0; i < npollers; i++)
+        thd_join(pollers[i], NULL);
+
+    printf("%3u threads, %3u pollers: %6llu ns/switch\n", nthds, npollers,
+           (end - start) / ((uint64_t)nthds * ITERATIONS));
+}
+
+int main(int argc, char **argv) {
+    unsigned int n;
+
+    (void)argc;
+    (void)argv;
+
+    printf("KallistiOS scheduler benchmark\n");
+
+    for(n = 1; n <= MAX_THREADS; n <<= 1)
+        run_bench(n, 0);
+
+    for(n = 1; n <= MAX_THREADS; n <<= 1)
+        run_bench(n, n);
+
+    printf("Done\n");
+
+    return 0;
+}
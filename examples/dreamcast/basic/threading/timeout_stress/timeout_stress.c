@@ -0,0 +1,120 @@
+/* KallistiOS ##version##
+
+   timeout_stress.c
+
+*/
+
+/* This program is a stress test for the timed waits of the genwait system.
+   A few thousand threads are created, each of which repeatedly sleeps or waits
+   on a condition variable with a short, random timeout. Every wake up is
+   checked against the requested deadline, so that a timeout firing too early
+   (or a wait that never times out) gets reported. Once in a while the main
+   thread broadcasts the condition, so that timed waits also get cancelled
+   before they expire. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/timer.h>
+
+#define THD_COUNT       2000
+#define THD_STACK_SIZE  2048
+#define ITERATIONS      50
+#define MAX_TIMEOUT     64
+
+static mutex_t lock = MUTEX_INITIALIZER;
+static condvar_t cv = COND_INITIALIZER;
+
+static volatile unsigned int early_wakeups;
+static volatile unsigned int timeouts;
+static volatile unsigned int signals;
+
+static void *waiter(void *param) {
+    unsigned int seed = (uintptr_t)param;
+    uint64_t start, elapsed;
+    int timeout, rv;
+
+    for(int i = 0; i < ITERATIONS; i++) {
+        timeout = 1 + rand_r(&seed) % MAX_TIMEOUT;
+        start = timer_ms_gettime64();
+
+        if(i & 1) {
+            thd_sleep(timeout);
+            rv = -1;
+        }
+        else {
+            mutex_lock(&lock);
+            rv = cond_wait_timed(&cv, &lock, timeout);
+            mutex_unlock(&lock);
+        }
+
+        elapsed = timer_ms_gettime64() - start;
+
+        irq_disable_scoped();
+
+        if(rv) {
+            timeouts++;
+
+            if(elapsed < (uint64_t)timeout)
+                early_wakeups++;
+        }
+        else {
+            signals++;
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    kthread_attr_t attr = {
+        .stack_size = THD_STACK_SIZE,
+        .disable_tls = true,
+        .label = "waiter"
+    };
+    kthread_t *thds[THD_COUNT];
+    uint64_t start, end;
+    int i, count;
+
+    (void)argc;
+    (void)argv;
+
+    printf("KallistiOS timed wait stress test\n");
+
+    start = timer_ms_gettime64();
+
+    for(count = 0; count < THD_COUNT; count++) {
+        thds[count] = thd_create_ex(&attr, waiter, (void *)(uintptr_t)(count + 1));
+
+        if(!thds[count]) {
+            printf("Could only create %d threads\n", count);
+            break;
+        }
+    }
+
+    /* Randomly cancel some of the condvar waits. */
+    for(i = 0; i < 100; i++) {
+        thd_sleep(MAX_TIMEOUT / 2);
+        cond_broadcast(&cv);
+    }
+
+    for(i = 0; i < count; i++)
+        thd_join(thds[i], NULL);
+
+    end = timer_ms_gettime64();
+
+    printf("%d threads, %u timeouts, %u signals, %u early wakeups in %llu ms\n",
+           count, timeouts, signals, early_wakeups, end - start);
+
+    if(early_wakeups || timeouts + signals != (unsigned int)count * ITERATIONS) {
+        printf("Test failed!\n");
+        return 1;
+    }
+
+    printf("Test passed\n");
+    return 0;
+}
@@ -0,0 +1,355 @@
+/* KallistiOS ##version##
+
+   loopback_bench.c
+*/
+
+/* This example measures how fast the network stack can push TCP and UDP data
+   through itself, without any network hardware getting in the way. It
+   registers a virtual ethernet device that hands every frame it is asked to
+   send back to the stack, as if it had come in off the wire, and then times a
+   bulk TCP transfer and a burst of UDP datagrams between two sockets on the
+   console.
+
+   Each test is run twice: once with the device only providing if_tx(), which
+   means the stack has to copy the payload into a contiguous frame first, and
+   once with if_tx_sg() as well, which lets the device pick the payload up
+   straight out of the socket's send buffer. The device copies the frame into
+   its own buffer in both cases, just as real hardware would. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <arch/timer.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define TCP_PORT        5001
+#define UDP_PORT        5002
+#define TCP_SIZE        (8 * 1024 * 1024)
+#define UDP_COUNT       4096
+#define UDP_SIZE        1400
+#define CHUNK_SIZE      8192
+
+/* Frames waiting to be looped back */
+#define RING_SLOTS      128
+
+typedef struct {
+    int len;
+    uint8_t data[1514];
+} frame_t;
+
+static frame_t *ring;
+static int head, count;
+static volatile int done;
+static mutex_t ring_lock = MUTEX_INITIALIZER;
+static condvar_t ring_cv = COND_INITIALIZER;
+
+/* Grab a free slot in the ring, or NULL if it's full (the frame is dropped,
+   like a real device would do if it ran out of buffers). */
+static frame_t *slot_get(void) {
+    mutex_lock(&ring_lock);
+
+    if(count == RING_SLOTS) {
+        mutex_unlock(&ring_lock);
+        return NULL;
+    }
+
+    return &ring[(head + count) % RING_SLOTS];
+}
+
+static void slot_put(void) {
+    ++count;
+    cond_signal(&ring_cv);
+    mutex_unlock(&ring_lock);
+}
+
+static int vif_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    frame_t *f;
+
+    (void)self;
+    (void)blocking;
+
+    if(len > 1514)
+        return NETIF_TX_ERROR;
+
+    if(!(f = slot_get()))
+        return NETIF_TX_OK;
+
+    memcpy(f->data, data, len);
+    f->len = len;
+    slot_put();
+
+    return NETIF_TX_OK;
+}
+
+static int vif_tx_sg(netif_t *self, const struct iovec *iov, int iovcnt,
+                     int blocking) {
+    frame_t *f;
+    int i, len = 0;
+
+    (void)self;
+    (void)blocking;
+
+    for(i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    if(len > 1514)
+        return NETIF_TX_ERROR;
+
+    if(!(f = slot_get()))
+        return NETIF_TX_OK;
+
+    for(i = 0, len = 0; i < iovcnt; ++i) {
+        memcpy(f->data + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    f->len = len;
+    slot_put();
+
+    return NETIF_TX_OK;
+}
+
+static int vif_nop(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int vif_set_flags(netif_t *self, uint32_t flags_and, uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int vif_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+static netif_t vif = {
+    .name = "bench",
+    .descr = "Loopback benchmark device",
+    .flags = NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING,
+    .mac_addr = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 },
+    .ip_addr = { 10, 0, 0, 1 },
+    .netmask = { 255, 255, 255, 0 },
+    .broadcast = { 10, 0, 0, 255 },
+    .mtu = 1500,
+    .mtu6 = 1500,
+    .hop_limit = 64,
+    .if_detect = vif_nop,
+    .if_init = vif_nop,
+    .if_shutdown = vif_nop,
+    .if_start = vif_nop,
+    .if_stop = vif_nop,
+    .if_tx = vif_tx,
+    .if_tx_commit = vif_nop,
+    .if_rx_poll = vif_nop,
+    .if_set_flags = vif_set_flags,
+    .if_set_mc = vif_set_mc
+};
+
+static void *rx_thd(void *p) {
+    static frame_t f;
+
+    (void)p;
+
+    mutex_lock(&ring_lock);
+
+    while(!done) {
+        if(!count) {
+            cond_wait_timed(&ring_cv, &ring_lock, 10);
+            continue;
+        }
+
+        memcpy(&f, &ring[head], sizeof(f));
+        head = (head + 1) % RING_SLOTS;
+        --count;
+
+        mutex_unlock(&ring_lock);
+        net_input(&vif, f.data, f.len);
+        mutex_lock(&ring_lock);
+    }
+
+    mutex_unlock(&ring_lock);
+    return NULL;
+}
+
+static struct sockaddr_in bench_addr(int port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(0x0A000001);
+
+    return addr;
+}
+
+static void *tcp_sink_thd(void *p) {
+    int ls = (int)(intptr_t)p, s;
+    uint8_t *buf = malloc(CHUNK_SIZE);
+    ssize_t rv;
+    size_t total = 0;
+
+    if(buf && (s = accept(ls, NULL, NULL)) >= 0) {
+        while((rv = recv(s, buf, CHUNK_SIZE, 0)) > 0)
+            total += rv;
+
+        close(s);
+    }
+
+    free(buf);
+    return (void *)(uintptr_t)total;
+}
+
+static int tcp_test(int port) {
+    struct sockaddr_in addr = bench_addr(port);
+    uint8_t *buf;
+    kthread_t *thd;
+    uint64_t start, end;
+    size_t sent = 0;
+    void *rcvd = NULL;
+    ssize_t n;
+    int ls, s;
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    if(ls < 0 || bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 1) < 0) {
+        perror("tcp listen");
+        return -1;
+    }
+
+    buf = calloc(1, CHUNK_SIZE);
+    thd = thd_create(0, tcp_sink_thd, (void *)(intptr_t)ls);
+    s = socket(AF_INET, SOCK_STREAM, 0);
+
+    start = timer_us_gettime64();
+
+    if(buf && s >= 0 && connect(s, (struct sockaddr *)&addr, sizeof(addr)) >= 0) {
+        while(sent < TCP_SIZE) {
+            if((n = send(s, buf, CHUNK_SIZE, 0)) <= 0)
+                break;
+
+            sent += n;
+        }
+    }
+    else {
+        perror("tcp connect");
+    }
+
+    if(s >= 0)
+        close(s);
+
+    close(ls);
+    thd_join(thd, &rcvd);
+    end = timer_us_gettime64();
+    free(buf);
+
+    if((size_t)(uintptr_t)rcvd != sent || sent < TCP_SIZE) {
+        printf("  TCP: only %lu of %d bytes made it\n", (unsigned long)(uintptr_t)rcvd,
+               TCP_SIZE);
+        return -1;
+    }
+
+    printf("  TCP: %d KiB in %lu ms, %lu KiB/s\n", TCP_SIZE / 1024,
+           (unsigned long)((end - start) / 1000),
+           (unsigned long)(TCP_SIZE / 1024 * 1000000ULL / (end - start)));
+    return 0;
+}
+
+static int udp_test(int port) {
+    struct sockaddr_in addr = bench_addr(port);
+    uint8_t *buf = calloc(1, UDP_SIZE);
+    uint64_t start, end;
+    int rs, ss, i, rcvd = 0;
+
+    rs = socket(AF_INET, SOCK_DGRAM, 0);
+    ss = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if(!buf || rs < 0 || ss < 0 ||
+       bind(rs, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("udp socket");
+        free(buf);
+        return -1;
+    }
+
+    /* Send in bursts, draining the receiver in between so it doesn't have to
+       drop anything. */
+    start = timer_us_gettime64();
+
+    for(i = 0; i < UDP_COUNT; ++i) {
+        sendto(ss, buf, UDP_SIZE, 0, (struct sockaddr *)&addr, sizeof(addr));
+
+        if((i & 15) == 15) {
+            thd_pass();
+
+            while(recv(rs, buf, UDP_SIZE, MSG_DONTWAIT) > 0)
+                ++rcvd;
+        }
+    }
+
+    end = timer_us_gettime64();
+    thd_sleep(50);
+
+    while(recv(rs, buf, UDP_SIZE, MSG_DONTWAIT) > 0)
+        ++rcvd;
+
+    close(ss);
+    close(rs);
+    free(buf);
+
+    printf("  UDP: %d x %d bytes in %lu ms, %lu KiB/s, %d received\n",
+           UDP_COUNT, UDP_SIZE, (unsigned long)((end - start) / 1000),
+           (unsigned long)((uint64_t)UDP_COUNT * UDP_SIZE / 1024 * 1000000ULL /
+                           (end - start)), rcvd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    netif_t *old_dev;
+    kthread_t *rx;
+    int pass, failed = 0;
+
+    (void)argc;
+    (void)argv;
+
+    if(!(ring = malloc(sizeof(frame_t) * RING_SLOTS)))
+        return 1;
+
+    net_reg_device(&vif);
+    old_dev = net_set_default(&vif);
+
+    /* We talk to ourselves, so there's no point in asking around. */
+    net_arp_insert(&vif, vif.mac_addr, vif.ip_addr, 0);
+
+    rx = thd_create(0, rx_thd, NULL);
+
+    for(pass = 0; pass < 2; ++pass) {
+        vif.if_tx_sg = pass ? vif_tx_sg : NULL;
+        printf("%s:\n", pass ? "Scatter-gather transmit" : "Contiguous transmit");
+
+        if(tcp_test(TCP_PORT + pass) < 0 || udp_test(UDP_PORT + pass) < 0)
+            ++failed;
+    }
+
+    done = 1;
+    thd_join(rx, NULL);
+
+    net_set_default(old_dev);
+    net_unreg_device(&vif);
+    free(ring);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,295 @@
+/* KallistiOS ##version##
+
+   poll_bench.c
+*/
+
+/* This example measures how the cost of waiting for an event with poll() and
+   with epoll_wait() changes as the number of file descriptors being watched
+   grows. A server thread waits on one active UDP socket along with a growing
+   number of idle ones, and answers every datagram that the main thread sends
+   it over the loopback interface. The average round trip time is reported for
+   each set size.
+
+   poll() has to look at, and register interest in, every descriptor that it
+   is given on every call, so its cost goes up with the size of the set. An
+   epoll instance is set up once and only hears about the descriptors that
+   actually have something happening on them, so its cost should stay about
+   the same no matter how many idle sockets there are. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <arch/timer.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define BASE_PORT       6000
+#define ROUNDS          2000
+#define MAX_IDLE        512
+
+static const int set_sizes[] = { 0, 16, 64, 256, MAX_IDLE };
+
+#define SET_COUNT (sizeof(set_sizes) / sizeof(set_sizes[0]))
+
+static int idle[MAX_IDLE];
+static int nidle, active, use_epoll;
+
+/* Everything goes over 127.0.0.1, which never reaches a device. The stack
+   still wants a default one to be there though, so this one is only used if
+   there's no real one. */
+static int vif_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    (void)self;
+    (void)data;
+    (void)len;
+    (void)blocking;
+    return NETIF_TX_OK;
+}
+
+static int vif_nop(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int vif_set_flags(netif_t *self, uint32_t flags_and, uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int vif_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+static netif_t vif = {
+    .name = "null",
+    .descr = "Placeholder device",
+    .flags = NETIF_NOETH | NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING,
+    .ip_addr = { 127, 0, 0, 1 },
+    .netmask = { 255, 0, 0, 0 },
+    .broadcast = { 127, 255, 255, 255 },
+    .mtu = 1500,
+    .mtu6 = 1500,
+    .hop_limit = 64,
+    .if_detect = vif_nop,
+    .if_init = vif_nop,
+    .if_shutdown = vif_nop,
+    .if_start = vif_nop,
+    .if_stop = vif_nop,
+    .if_tx = vif_tx,
+    .if_tx_commit = vif_nop,
+    .if_rx_poll = vif_nop,
+    .if_set_flags = vif_set_flags,
+    .if_set_mc = vif_set_mc
+};
+
+static struct sockaddr_in bench_addr(int port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    return addr;
+}
+
+static int udp_socket(int port) {
+    struct sockaddr_in addr = bench_addr(port);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if(s >= 0 && bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Answer one datagram on the active socket, from whoever sent it. */
+static int echo(void) {
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    uint32_t seq;
+
+    if(recvfrom(active, &seq, sizeof(seq), 0, (struct sockaddr *)&from,
+                &fromlen) != sizeof(seq))
+        return -1;
+
+    return sendto(active, &seq, sizeof(seq), 0, (struct sockaddr *)&from,
+                  fromlen) == sizeof(seq) ? 0 : -1;
+}
+
+static void *server_thd(void *p) {
+    struct pollfd *fds;
+    struct epoll_event ev;
+    int i, n, ep = -1, served = 0;
+
+    (void)p;
+
+    if(!(fds = malloc(sizeof(struct pollfd) * (nidle + 1))))
+        return (void *)-1;
+
+    /* The active socket goes last, so poll() has to get through all of the
+       idle ones before it gets to the one that matters. */
+    for(i = 0; i < nidle; ++i) {
+        fds[i].fd = idle[i];
+        fds[i].events = POLLIN;
+    }
+
+    fds[nidle].fd = active;
+    fds[nidle].events = POLLIN;
+
+    if(use_epoll) {
+        if((ep = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            free(fds);
+            return (void *)-1;
+        }
+
+        for(i = 0; i <= nidle; ++i) {
+            ev.events = EPOLLIN;
+            ev.data.fd = fds[i].fd;
+
+            if(epoll_ctl(ep, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0) {
+                perror("epoll_ctl");
+                goto out;
+            }
+        }
+    }
+
+    while(served < ROUNDS) {
+        if(use_epoll) {
+            if((n = epoll_wait(ep, &ev, 1, 1000)) <= 0)
+                break;
+
+            if(ev.data.fd != active)
+                break;
+        }
+        else {
+            if((n = poll(fds, nidle + 1, 1000)) <= 0)
+                break;
+
+            if(!(fds[nidle].revents & POLLIN))
+                break;
+        }
+
+        if(echo() < 0)
+            break;
+
+        ++served;
+    }
+
+out:
+    if(ep >= 0)
+        close(ep);
+
+    free(fds);
+    return (void *)(intptr_t)(served == ROUNDS ? 0 : -1);
+}
+
+static int run_test(int count, int epoll) {
+    struct sockaddr_in addr = bench_addr(BASE_PORT);
+    kthread_t *srv;
+    uint64_t start, end;
+    uint32_t seq, reply;
+    void *rv = NULL;
+    int s, ok = 1;
+
+    nidle = count;
+    use_epoll = epoll;
+
+    if((s = udp_socket(BASE_PORT - 1)) < 0) {
+        perror("client socket");
+        return -1;
+    }
+
+    srv = thd_create(0, server_thd, NULL);
+    start = timer_us_gettime64();
+
+    for(seq = 0; seq < ROUNDS; ++seq) {
+        if(sendto(s, &seq, sizeof(seq), 0, (struct sockaddr *)&addr,
+                  sizeof(addr)) != sizeof(seq) ||
+           recv(s, &reply, sizeof(reply), 0) != sizeof(reply) ||
+           reply != seq) {
+            ok = 0;
+            break;
+        }
+    }
+
+    end = timer_us_gettime64();
+
+    /* If we gave up early, the server times out on its own. */
+    thd_join(srv, &rv);
+    close(s);
+
+    if(!ok || rv) {
+        printf("%-12s %4d idle: FAILED\n", epoll ? "epoll_wait()" : "poll()",
+               count);
+        return -1;
+    }
+
+    printf("%-12s %4d idle: %5lu us per round trip\n",
+           epoll ? "epoll_wait()" : "poll()", count,
+           (unsigned long)((end - start) / ROUNDS));
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    netif_t *old_dev = NULL;
+    size_t i;
+    int j, opened, failed = 0;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        net_reg_device(&vif);
+        old_dev = net_set_default(&vif);
+    }
+
+    if((active = udp_socket(BASE_PORT)) < 0) {
+        perror("server socket");
+        failed = 1;
+        goto out;
+    }
+
+    for(opened = 0; opened < MAX_IDLE; ++opened) {
+        if((idle[opened] = udp_socket(BASE_PORT + 1 + opened)) < 0) {
+            perror("idle socket");
+            failed = 1;
+            goto out_idle;
+        }
+    }
+
+    for(i = 0; i < SET_COUNT; ++i) {
+        if(run_test(set_sizes[i], 0) < 0 || run_test(set_sizes[i], 1) < 0)
+            ++failed;
+    }
+
+out_idle:
+    for(j = 0; j < opened; ++j)
+        close(idle[j]);
+
+    close(active);
+
+out:
+    if(net_default_dev == &vif) {
+        net_set_default(old_dev);
+        net_unreg_device(&vif);
+    }
+
+    return failed ? 1 : 0;
+}
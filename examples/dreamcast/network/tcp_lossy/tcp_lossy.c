@@ -0,0 +1,369 @@
+/* KallistiOS ##version##
+
+   tcp_lossy.c
+*/
+
+/* This example exercises the TCP stack's loss recovery without needing any
+   network hardware. It registers a virtual network device whose transmit
+   function puts outgoing IPv4 packets on a simulated link with a fixed one way
+   delay, a limited bandwidth, a bounded queue and a random loss rate. A thread
+   delivers the packets that make it across back into the stack, so a client
+   and a server on the same console talk to each other through the link.
+
+   The client sends a known pattern to the server, which checks every byte and
+   the time that the transfer took is reported for each of the link settings
+   below. Lost segments need to be recovered by fast retransmit, SACK or the
+   retransmission timer, so this is a decent way to see how the congestion
+   control behaves when things get rough. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <arch/timer.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define TEST_PORT       5000
+#define TEST_SIZE       (2 * 1024 * 1024)
+#define CHUNK_SIZE      4096
+
+/* Maximum number of packets that can be on the simulated link at once. */
+#define LINK_SLOTS      256
+
+typedef struct link_cfg {
+    const char *name;
+    int delay_ms;           /* One way delay */
+    int kbps;               /* Bandwidth, 0 for unlimited */
+    int queue;              /* Packets queued before tail drop */
+    int loss;               /* Random loss in tenths of a percent */
+} link_cfg_t;
+
+static const link_cfg_t tests[] = {
+    { "clean, 1ms",             1,    0, 256,   0 },
+    { "1% loss, 1ms",           1,    0, 256,  10 },
+    { "5% loss, 1ms",           1,    0, 256,  50 },
+    { "2% loss, 10ms",         10,    0, 256,  20 },
+    { "10Mbit, 20ms, 32 pkts", 20, 10000,  32,   0 },
+    { "10Mbit, 20ms, 2% loss", 20, 10000,  64,  20 }
+};
+
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+typedef struct link_pkt {
+    uint64_t due;
+    int len;
+    uint8_t data[1514];
+} link_pkt_t;
+
+static link_pkt_t *slots;
+static int head, count;
+static uint64_t link_busy;
+static const link_cfg_t *cfg;
+static volatile int done;
+static mutex_t link_lock = MUTEX_INITIALIZER;
+
+static struct {
+    int sent, dropped, lost;
+} stats;
+
+/* The device is NETIF_NOETH, so the stack hands us bare IP packets. net_input
+   expects an ethernet frame though, so we make one up on the way back. */
+static int vif_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    link_pkt_t *p;
+    uint64_t now = timer_ms_gettime64();
+
+    (void)self;
+    (void)blocking;
+
+    if(len > 1500)
+        return NETIF_TX_ERROR;
+
+    mutex_lock(&link_lock);
+    ++stats.sent;
+
+    if(count >= cfg->queue || count >= LINK_SLOTS) {
+        ++stats.dropped;
+        mutex_unlock(&link_lock);
+        return NETIF_TX_OK;
+    }
+
+    if(cfg->loss && (rand() % 1000) < cfg->loss) {
+        ++stats.lost;
+        mutex_unlock(&link_lock);
+        return NETIF_TX_OK;
+    }
+
+    /* Serialize the packet onto the link, then add the propagation delay. */
+    if(link_busy < now)
+        link_busy = now;
+
+    if(cfg->kbps)
+        link_busy += (uint64_t)len * 8 / cfg->kbps;
+
+    p = &slots[(head + count) % LINK_SLOTS];
+    p->due = link_busy + cfg->delay_ms;
+    p->len = len + 14;
+    memset(p->data, 0xff, 12);
+    p->data[12] = 0x08;
+    p->data[13] = 0x00;
+    memcpy(p->data + 14, data, len);
+    ++count;
+
+    mutex_unlock(&link_lock);
+    return NETIF_TX_OK;
+}
+
+static int vif_nop(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int vif_set_flags(netif_t *self, uint32_t flags_and, uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int vif_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+static netif_t vif = {
+    .name = "lossy",
+    .descr = "Simulated lossy link",
+    .flags = NETIF_NOETH | NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING,
+    .ip_addr = { 10, 0, 0, 1 },
+    .netmask = { 255, 255, 255, 0 },
+    .broadcast = { 10, 0, 0, 255 },
+    .mtu = 1500,
+    .mtu6 = 1500,
+    .hop_limit = 64,
+    .if_detect = vif_nop,
+    .if_init = vif_nop,
+    .if_shutdown = vif_nop,
+    .if_start = vif_nop,
+    .if_stop = vif_nop,
+    .if_tx = vif_tx,
+    .if_tx_commit = vif_nop,
+    .if_rx_poll = vif_nop,
+    .if_set_flags = vif_set_flags,
+    .if_set_mc = vif_set_mc
+};
+
+static void *link_thd(void *p) {
+    static link_pkt_t pkt;
+    uint64_t now;
+
+    (void)p;
+
+    while(!done) {
+        now = timer_ms_gettime64();
+        mutex_lock(&link_lock);
+
+        while(count && slots[head].due <= now) {
+            memcpy(&pkt, &slots[head], sizeof(pkt));
+            head = (head + 1) % LINK_SLOTS;
+            --count;
+
+            mutex_unlock(&link_lock);
+            net_input(&vif, pkt.data, pkt.len);
+            mutex_lock(&link_lock);
+        }
+
+        mutex_unlock(&link_lock);
+        thd_sleep(1);
+    }
+
+    return NULL;
+}
+
+static uint8_t pattern(uint32_t off) {
+    return (uint8_t)((off * 7) ^ (off >> 11));
+}
+
+static int server_sock;
+
+static void *server_thd(void *p) {
+    uint8_t *buf = malloc(CHUNK_SIZE);
+    uint32_t off = 0;
+    ssize_t i, rv;
+    int s;
+
+    (void)p;
+
+    if(!buf)
+        return (void *)-1;
+
+    if((s = accept(server_sock, NULL, NULL)) < 0) {
+        perror("accept");
+        free(buf);
+        return (void *)-1;
+    }
+
+    while((rv = recv(s, buf, CHUNK_SIZE, 0)) > 0) {
+        for(i = 0; i < rv; ++i) {
+            if(buf[i] != pattern(off + i)) {
+                printf("Data mismatch at offset %lu\n",
+                       (unsigned long)(off + i));
+                close(s);
+                free(buf);
+                return (void *)-1;
+            }
+        }
+
+        off += rv;
+    }
+
+    close(s);
+    free(buf);
+    return (void *)(off == TEST_SIZE ? 0 : -1);
+}
+
+static int run_test(const link_cfg_t *c, int port) {
+    struct sockaddr_in addr;
+    uint8_t *buf;
+    uint64_t start, end;
+    uint32_t off = 0, i, len;
+    kthread_t *srv;
+    void *srv_rv = NULL;
+    int s, rv = -1;
+    ssize_t n;
+
+    mutex_lock(&link_lock);
+    cfg = c;
+    head = count = 0;
+    link_busy = 0;
+    memset(&stats, 0, sizeof(stats));
+    mutex_unlock(&link_lock);
+
+    if(!(buf = malloc(CHUNK_SIZE)))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(0x0A000001);
+
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(server_sock < 0 ||
+       bind(server_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(server_sock, 1) < 0) {
+        perror("server socket");
+        goto out;
+    }
+
+    srv = thd_create(0, server_thd, NULL);
+    start = timer_us_gettime64();
+
+    if((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        goto out_srv;
+    }
+
+    if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(s);
+        goto out_srv;
+    }
+
+    while(off < TEST_SIZE) {
+        len = TEST_SIZE - off < CHUNK_SIZE ? TEST_SIZE - off : CHUNK_SIZE;
+
+        for(i = 0; i < len; ++i)
+            buf[i] = pattern(off + i);
+
+        for(i = 0; i < len; i += n) {
+            if((n = send(s, buf + i, len - i, 0)) <= 0) {
+                perror("send");
+                close(s);
+                goto out_srv;
+            }
+        }
+
+        off += len;
+    }
+
+    close(s);
+    rv = 0;
+
+out_srv:
+    /* The server exits once the client closes. If the client never got that
+       far, closing the listening socket kicks the server out of accept(). */
+    if(rv < 0) {
+        close(server_sock);
+        server_sock = -1;
+    }
+
+    thd_join(srv, &srv_rv);
+    end = timer_us_gettime64();
+
+    if(!rv && srv_rv)
+        rv = -1;
+
+    if(!rv) {
+        printf("%-24s %7.2f s %8.1f KiB/s  sent %d, lost %d, dropped %d\n",
+               c->name, (end - start) / 1000000.0,
+               (TEST_SIZE / 1024.0) / ((end - start) / 1000000.0),
+               stats.sent, stats.lost, stats.dropped);
+    }
+    else {
+        printf("%-24s FAILED\n", c->name);
+    }
+
+out:
+    if(server_sock >= 0)
+        close(server_sock);
+
+    free(buf);
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    netif_t *old_dev;
+    kthread_t *lnk;
+    size_t i;
+    int failed = 0;
+
+    (void)argc;
+    (void)argv;
+
+    if(!(slots = malloc(sizeof(link_pkt_t) * LINK_SLOTS)))
+        return 1;
+
+    /* Route everything through our link, whatever the real device is. */
+    cfg = &tests[0];
+    net_reg_device(&vif);
+    old_dev = net_set_default(&vif);
+    lnk = thd_create(0, link_thd, NULL);
+
+    printf("Transferring %d KiB over each link...\n", TEST_SIZE / 1024);
+
+    for(i = 0; i < TEST_COUNT; ++i) {
+        if(run_test(&tests[i], TEST_PORT + i) < 0)
+            ++failed;
+
+        /* Let the old connection wind down before changing the link. */
+        thd_sleep(500);
+    }
+
+    done = 1;
+    thd_join(lnk, NULL);
+
+    net_set_default(old_dev);
+    net_unreg_device(&vif);
+    free(slots);
+
+    printf("%s\n", failed ? "Some tests FAILED" : "All tests passed");
+    return failed ? 1 : 0;
+}
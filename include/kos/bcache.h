@@ -0,0 +1,276 @@
+/* KallistiOS ##version##
+
+   kos/bcache.h
+
+*/
+
+/** \file    kos/bcache.h
+    \brief   Buffer cache shared by filesystems on block devices.
+    \ingroup vfs_bcache
+
+    This file contains a cache of blocks read from block devices, for use by
+    filesystem drivers. Rather than each mounted filesystem keeping a cache of
+    its own, they all share this one, so that the memory goes to whichever of
+    them is busy at the time. The total amount of memory used for blocks that
+    aren't in use is kept under a budget set with bcache_set_budget().
+
+    A filesystem attaches to the cache with bcache_attach(), giving the block
+    device and the size of block it works in, and gets back a handle that the
+    rest of the functions take. It can attach more than once to the same
+    device with different block sizes (FAT does, for its clusters and for the
+    sectors of the allocation table), as long as the handles don't cover the
+    same parts of the device.
+
+    Blocks are got with bcache_get(), which pins them in the cache until
+    bcache_put() is called. For code that was written for a cache that just
+    hands out pointers, bcache_read() instead keeps the last few blocks each
+    handle has read pinned, so that the pointer it returns stays good until
+    that many other blocks have been read through the same handle.
+
+    Changed blocks are marked with bcache_mark_dirty() and written back when
+    they're evicted (along with any dirty blocks next to them) or when
+    bcache_flush() is called, which writes the handle's dirty blocks in
+    contiguous runs, in one sweep across the device.
+
+    The cache's lock isn't held while a device is being read or written.
+    Anyone after a block that is still being read waits for it, and blocks
+    that are being written back can still be used (and changed, and marked
+    dirty again) in the meantime.
+*/
+
+#ifndef __KOS_BCACHE_H
+#define __KOS_BCACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/** \defgroup vfs_bcache   Buffer Cache
+    \brief                  Cache of blocks shared by block device filesystems
+    \ingroup                vfs_blockdev
+
+    @{
+*/
+
+struct kos_blockdev;
+
+/** \brief  A filesystem's handle on the buffer cache.
+
+    This is an opaque structure, returned by bcache_attach().
+*/
+typedef struct bcache_dev bcache_dev_t;
+
+/** \brief  A block in the buffer cache.
+
+    Only the data and block fields are for use outside of the cache, and
+    neither of them should be changed (the contents of data may be, of
+    course, followed by a call to bcache_mark_dirty()).
+
+    \headerfile kos/bcache.h
+*/
+typedef struct bcache_buf {
+    uint8_t *data;              /**< \brief The block's data */
+    uint64_t block;             /**< \brief Which block this is */
+
+    /** \cond */
+    bcache_dev_t *dev;
+    uint32_t flags;
+    int refcnt;
+
+    LIST_ENTRY(bcache_buf) hash;
+    TAILQ_ENTRY(bcache_buf) lru;
+    TAILQ_ENTRY(bcache_buf) kept;
+    TAILQ_ENTRY(bcache_buf) dirty;
+    LIST_ENTRY(bcache_buf) all;
+    /** \endcond */
+} bcache_buf_t;
+
+/** \brief  Buffer cache counters.
+
+    The counters count since the handle was attached (or since the cache was
+    first used, for the whole cache), or since the last call to
+    bcache_reset_stats().
+
+    \headerfile kos/bcache.h
+*/
+typedef struct bcache_stats {
+    uint32_t hits;              /**< \brief Blocks found in the cache */
+    uint32_t misses;            /**< \brief Blocks that had to be read */
+    uint32_t evictions;         /**< \brief Blocks dropped to make room */
+    uint32_t read_reqs;         /**< \brief Read requests to the device */
+    uint32_t write_reqs;        /**< \brief Write requests to the device */
+    uint32_t blocks_read;       /**< \brief Blocks read from the device */
+    uint32_t blocks_written;    /**< \brief Blocks written to the device */
+    uint32_t buffers;           /**< \brief Blocks in the cache now */
+    uint32_t dirty;             /**< \brief Dirty blocks in the cache now */
+    size_t bytes;               /**< \brief Memory used by blocks now */
+} bcache_stats_t;
+
+/** \brief  Get the buffer cache counters for an open file.
+
+    Filesystems on block devices that use the buffer cache answer this
+    ioctl, given a pointer to a bcache_stats_t, with the counters for the
+    filesystem that the file is on.
+*/
+#define IOCTL_BCACHE_GET_STATS  0x42434153 /* "BCAS" */
+
+/** \brief  Don't read the block from the device.
+
+    Pass this to bcache_get() or bcache_read() for a block that is about to
+    be completely overwritten. If the block isn't in the cache already, its
+    data is left as whatever was in the buffer before.
+*/
+#define BCACHE_NOREAD           1
+
+/** \brief  Attach to the buffer cache.
+
+    \param  dev             The block device to cache.
+    \param  block_size      The size of the blocks to cache, in bytes. This
+                            must be a power of two, no smaller than the
+                            device's blocks.
+    \param  base            The device block that cache block 0 starts on.
+    \param  keep            How many of the blocks most recently read with
+                            bcache_read() to keep pinned.
+    \return                 A new handle, or NULL on error with errno set.
+
+    \par    Error Conditions:
+    \em     EINVAL - block_size is no good for the device \n
+    \em     ENOMEM - out of memory
+*/
+bcache_dev_t *bcache_attach(struct kos_blockdev *dev, uint32_t block_size,
+                            uint64_t base, int keep);
+
+/** \brief  Detach from the buffer cache.
+
+    Dirty blocks are written back, and all of the handle's blocks are
+    dropped from the cache. If any of them are still pinned with
+    bcache_get(), nothing is done and the handle stays attached.
+
+    \param  d               The handle to detach.
+    \retval 0               On success.
+    \retval -1              On error, with errno set.
+
+    \par    Error Conditions:
+    \em     EBUSY - some blocks are still pinned \n
+    \em     EIO - some dirty blocks couldn't be written back (the handle is
+                  still gone)
+*/
+int bcache_detach(bcache_dev_t *d);
+
+/** \brief  Get a block, pinned in the cache.
+
+    \param  d               The handle to get the block through.
+    \param  block           The block to get.
+    \param  flags           0, or BCACHE_NOREAD.
+    \return                 The block, or NULL on error with errno set. It
+                            must be handed back with bcache_put().
+
+    \par    Error Conditions:
+    \em     EIO - the block couldn't be read, or another block couldn't be
+                  written back to make room for it \n
+    \em     ENOMEM - out of memory
+*/
+bcache_buf_t *bcache_get(bcache_dev_t *d, uint64_t block, int flags);
+
+/** \brief  Unpin a block got with bcache_get().
+
+    \param  b               The block, which shouldn't be used after this.
+*/
+void bcache_put(bcache_buf_t *b);
+
+/** \brief  Mark a block as changed, so that it gets written back.
+
+    \param  b               The block, which must be pinned.
+*/
+void bcache_mark_dirty(bcache_buf_t *b);
+
+/** \brief  Read a block, keeping it pinned for a while.
+
+    This is for code that expects pointers into the cache to stay good for a
+    while without having to hand them back. The block is kept pinned until
+    the number of other blocks given to bcache_attach() have been read
+    through the same handle after it.
+
+    \param  d               The handle to read the block through.
+    \param  block           The block to read.
+    \param  flags           0, or BCACHE_NOREAD.
+    \return                 The block's data, or NULL on error with errno
+                            set, as for bcache_get().
+*/
+uint8_t *bcache_read(bcache_dev_t *d, uint64_t block, int flags);
+
+/** \brief  Mark a block read with bcache_read() as changed.
+
+    \param  d               The handle the block was read through.
+    \param  block           The block.
+    \retval 0               On success.
+    \retval -1              If the block isn't in the cache (errno is set to
+                            EINVAL).
+*/
+int bcache_mark_dirty_block(bcache_dev_t *d, uint64_t block);
+
+/** \brief  Check whether a block is in the cache.
+
+    \param  d               The handle to look through.
+    \param  block           The block to look for.
+    \return                 Non-zero if the block is in the cache.
+*/
+int bcache_cached(bcache_dev_t *d, uint64_t block);
+
+/** \brief  Read a run of blocks into the cache ahead of time.
+
+    Blocks in the run that aren't in the cache already are read with as few
+    requests to the device as possible. Blocks that have been read ahead and
+    not got since can only take up half of the budget left over by pinned
+    blocks, so that they don't push each other out before they're used; the
+    run is cut short if need be.
+
+    \param  d               The handle to read through.
+    \param  block           The first block of the run.
+    \param  count           The number of blocks in the run.
+    \return                 How many blocks from the start of the run are in
+                            the cache now, or -1 on error with errno set.
+*/
+int bcache_prefetch(bcache_dev_t *d, uint64_t block, size_t count);
+
+/** \brief  Write back all of a handle's dirty blocks.
+
+    \param  d               The handle to write back the blocks of.
+    \retval 0               On success.
+    \retval -1              On error, with errno set. Blocks that couldn't
+                            be written stay dirty.
+*/
+int bcache_flush(bcache_dev_t *d);
+
+/** \brief  Set how much memory unpinned blocks may use.
+
+    The budget is shared by all handles. Pinned blocks count towards it, but
+    are never dropped to keep to it. The default is BCACHE_BUDGET (see
+    kos/opts.h).
+
+    \param  bytes           The new budget, in bytes.
+    \return                 The old budget.
+*/
+size_t bcache_set_budget(size_t bytes);
+
+/** \brief  Get a handle's counters.
+
+    \param  d               The handle, or NULL for the whole cache.
+    \param  st              Where to store the counters.
+*/
+void bcache_get_stats(const bcache_dev_t *d, bcache_stats_t *st);
+
+/** \brief  Set a handle's counters back to zero.
+
+    \param  d               The handle, or NULL for the whole cache.
+*/
+void bcache_reset_stats(bcache_dev_t *d);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_BCACHE_H */
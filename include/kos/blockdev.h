@@ -38,6 +38,14 @@ __BEGIN_DECLS
     @{
 */
 
+/** \brief  Completion callback for a block device's submit function.
+
+    \param  err             0 if the transfer went through, or an errno value
+                            if it didn't.
+    \param  data            The data pointer that was given with the request.
+*/
+typedef void (*kos_blockdev_cb_t)(int err, void *data);
+
 /** \brief  A simple block device.
 
     This structure represents a single block device. Each block device should be
@@ -129,6 +137,32 @@ typedef struct kos_blockdev {
         \retval -1          On failure. Set errno as appropriate.
     */
     int (*flush)(struct kos_blockdev *d);
+
+    /** \brief  Start reading or writing a number of blocks, without waiting.
+
+        This function is optional, and is NULL for devices that can't have
+        more than one transfer going at a time. Requests made with it may be
+        merged together and done in a different order than they were made in,
+        except that a request is never done before an earlier one that
+        overlaps it, if either of them is a write. The buffer cache (see
+        kos/bcache.h) uses this, when it's there, to start several reads or
+        writes at once when flushing and reading ahead.
+
+        \param  d           The device.
+        \param  write       Non-zero to write the blocks, zero to read them.
+        \param  block       The first block.
+        \param  count       The number of blocks.
+        \param  buf         The buffer to read into or write from. It must
+                            not be touched until cb has been called.
+        \param  cb          The function to call when the transfer is done.
+                            This may be called from an interrupt handler, so it
+                            must not block.
+        \param  data        Passed on to cb.
+        \retval 0           If the request was made.
+        \retval -1          On failure, with errno set. cb is not called.
+    */
+    int (*submit)(const struct kos_blockdev *d, int write, uint64_t block,
+                  size_t count, void *buf, kos_blockdev_cb_t cb, void *data);
 } kos_blockdev_t;
 
 /** @} */
@@ -42,15 +42,41 @@ typedef struct export_sym {
     uintptr_t ptr;        /**< \brief A pointer to the symbol. */
 } export_sym_t;
 
+/** \brief  A hash table for looking up symbols in a table of exports.
+
+    genexports.sh writes one of these out next to each symbol table it makes,
+    named after the table with _hash on the end. It works the same way as the
+    GNU hash section of an ELF file: the symbols in the table are sorted by
+    bucket, each bucket gives the first symbol in it, and each symbol's hash
+    value is kept alongside it, with the lowest bit set on the last symbol in
+    a bucket. A Bloom filter in front of it all lets most lookups for names
+    that aren't in the table give up without looking at any of them.
+
+    \headerfile kos/exports.h
+*/
+typedef struct export_hash {
+    uint32_t count;             /**< \brief Number of symbols in the table */
+    uint32_t nbuckets;          /**< \brief Number of buckets (a power of 2) */
+    uint32_t bloom_words;       /**< \brief Size of the filter (a power of 2) */
+    uint32_t bloom_shift;       /**< \brief Shift for the filter's second bit */
+    const uint32_t *bloom;      /**< \brief The Bloom filter */
+    const uint32_t *buckets;    /**< \brief First symbol in each bucket, or
+                                             count if it's empty */
+    const uint32_t *chain;      /**< \brief Hash value of each symbol */
+} export_hash_t;
+
 /** \cond */
 /* These are the platform-independent exports */
 extern export_sym_t kernel_symtab[];
+extern const export_hash_t kernel_symtab_hash;
 
 /* And these are the arch-specific exports */
 extern export_sym_t arch_symtab[];
+extern const export_hash_t arch_symtab_hash;
 
 /* And these are the subarch-specific exports */
 extern export_sym_t subarch_symtab[];
+extern const export_hash_t subarch_symtab_hash;
 /** \endcond */
 
 #ifndef __EXPORTS_FILE
@@ -62,13 +88,37 @@ extern export_sym_t subarch_symtab[];
 typedef struct symtab_handler {
     struct nmmgr_handler nmmgr;   /**< \brief Name manager handler header */
     export_sym_t *table;          /**< \brief Location of the first entry */
+    const export_hash_t *hash;    /**< \brief Hash table for the entries, or
+                                               NULL to search them in order */
 } symtab_handler_t;
 #endif
 
 /** \brief  Setup initial kernel exports. */
 void export_init(void);
 
+/** \brief  Hash a symbol name.
+
+    This is the hash function used for export_hash_t (the same one as for GNU
+    hash sections in ELF files).
+
+    \param  name            The symbol name to hash
+    \return                 The hash value
+*/
+static inline uint32_t export_hash_name(const char *name) {
+    uint32_t h = 5381;
+
+    while(*name)
+        h = h * 33 + (unsigned char)*name++;
+
+    return h;
+}
+
 /** \brief  Look up a symbol by name.
+
+    The symbol tables are searched from the newest to the oldest. Symbols
+    that have been found recently are remembered, so looking them up again
+    (when another library needs them, say) is quick.
+
     \param  name            The symbol to look up
     \return                 The export structure, or NULL on failure
 */
@@ -17,6 +17,16 @@
 
     You only have one ramdisk available, and its mounted on /ram.
 
+    File data is kept in a number of blocks that get bigger as the file does,
+    so that growing a file never moves what is already in it. Calling mmap()
+    on a file in more than one block joins them into one first; the pointer it
+    gives stays good until the file is closed, even if more is written to it,
+    but it only covers what was in the file at the time. While any open
+    handle still has the file mapped (the one calling mmap() included), it
+    can't be joined up again, as that would free the block that was handed
+    out. So mmap() fails with EBUSY if the file has grown into more than one
+    block since it was mapped, until all of those handles are closed.
+
     \author Megan Potter
 */
 
@@ -45,13 +55,18 @@ void fs_ramdisk_shutdown(void);
     This function takes a block of memory and associates it with a file on the
     ramdisk. This memory should be allocated with malloc(), as an unlink() of
     the file will call free on the block of memory. The ramdisk then effectively
-    takes control of the block, and is responsible for it at that point.
+    takes control of the block, and is responsible for it at that point. The
+    block isn't copied, so mmap() on the file gives obj back until the file is
+    written past its end.
+
+    If this fails, the ramdisk doesn't take the block, and obj is still yours
+    to free.
 
     \param  fn              The name to give the new file
     \param  obj             The block of memory to associate
     \param  size            The size of the block of memory
     \retval 0               On success
-    \retval -1              On failure
+    \retval -1              On failure (obj is left alone)
 */
 int fs_ramdisk_attach(const char *fn, void *obj, size_t size);
 
@@ -59,7 +74,8 @@ int fs_ramdisk_attach(const char *fn, void *obj, size_t size);
 
     This function retrieves the block of memory associated with the file,
     removing it from the ramdisk. You are responsible for freeing obj when you
-    are done with it.
+    are done with it. A file that is in more than one block is copied into one
+    first, which can fail if there isn't enough memory for it.
 
     \param  fn              The name of the file to look for.
     \param  obj             A pointer to return the address of the object in.
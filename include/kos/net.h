@@ -25,6 +25,7 @@
 __BEGIN_DECLS
 
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 /* All functions in this header return < 0 on failure, and 0 on success. */
@@ -181,6 +182,23 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Queue a packet made up of several pieces for transmission.
+
+        This is optional, and may be NULL if the device can't do any better
+        than the stack gathering the pieces into one buffer and calling
+        if_tx(). The pieces only need to stay valid until this returns.
+
+        \param  self        The network device in question.
+        \param  iov         The pieces of the packet, in order.
+        \param  iovcnt      The number of pieces.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \retval NETIF_TX_OK     On success.
+        \retval NETIF_TX_ERROR  On general failure.
+        \retval NETIF_TX_AGAIN  If non-blocking and we must block to send.
+    */
+    int (*if_tx_sg)(struct knetif *self, const struct iovec *iov, int iovcnt,
+                    int blocking);
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -871,6 +889,75 @@ uint32_t __pure net_crc32be(const uint8_t *data, int size);
 */
 uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start);
 
+/** \brief  Start an incremental "little-endian" CRC-32.
+
+    The incremental functions allow a CRC to be calculated over data that isn't
+    all available at once. Start with the value returned by this function, pass
+    each piece of data to net_crc32le_update() in turn, and pass the result to
+    net_crc32le_final() to get the same value that net_crc32le() would give.
+
+    \return                 The initial running value.
+*/
+uint32_t net_crc32le_init(void);
+
+/** \brief  Add data to an incremental "little-endian" CRC-32.
+
+    \param  crc             The running value so far.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The new running value.
+*/
+uint32_t net_crc32le_update(uint32_t crc, const void *data, size_t size);
+
+/** \brief  Finish an incremental "little-endian" CRC-32.
+
+    \param  crc             The running value.
+
+    \return                 The calculated CRC-32.
+*/
+uint32_t net_crc32le_final(uint32_t crc);
+
+/** \brief  Start an incremental "big-endian" CRC-32.
+
+    This works the same way as net_crc32le_init(), but the result matches
+    net_crc32be().
+
+    \return                 The initial running value.
+*/
+uint32_t net_crc32be_init(void);
+
+/** \brief  Add data to an incremental "big-endian" CRC-32.
+
+    \param  crc             The running value so far.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The new running value.
+*/
+uint32_t net_crc32be_update(uint32_t crc, const void *data, size_t size);
+
+/** \brief  Finish an incremental "big-endian" CRC-32.
+
+    \param  crc             The running value.
+
+    \return                 The calculated CRC-32.
+*/
+uint32_t net_crc32be_final(uint32_t crc);
+
+/** \brief  Add data to an incremental CRC16-CCITT.
+
+    The CRC16-CCITT has no separate start or finish step, so this is the same
+    as net_crc16ccitt(), but takes a size_t.
+
+    \param  crc             The value so far, or the initial seed value.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The calculated CRC16-CCITT.
+*/
+uint16_t net_crc16ccitt_update(uint16_t crc, const void *data, size_t size);
+
 /** @} */
 
 /***** net_multicast.c ****************************************************/
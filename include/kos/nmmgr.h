@@ -129,7 +129,10 @@ typedef struct alias_handler {
 /** \brief   Retrieve a name handler by name.
     \ingroup system_namemgr
 
-    This function will retrieve a name handler by its pathname.
+    This function will retrieve the handler for a path name: the one whose
+    path name matches the most components at the start of the given path,
+    ignoring case. If that handler is an alias, the handler it refers to is
+    returned instead.
 
     \param  name            The handler to look up
 
@@ -151,11 +154,14 @@ nmmgr_list_t * nmmgr_get_list(void);
 /** \brief   Add a name handler.
     \ingroup system_namemgr
 
-    This function adds a new name handler to the list in the kernel.
+    This function adds a new name handler to the list in the kernel. If there
+    is already a handler with the same path name, the new one takes its place
+    until it is removed.
 
     \param  hnd             The handler to add
 
     \retval 0               On success
+    \retval -1              If there wasn't enough memory to add it
 */
 int nmmgr_handler_add(nmmgr_handler_t *hnd);
 
@@ -137,6 +137,57 @@ __BEGIN_DECLS
 #define FD_SETSIZE 1024
 #endif
 
+/** \brief  The number of lookup tables used by each of the CRC functions in
+            net_crc.c. Each CRC-32 table takes 1KiB and each CRC-16 table 512
+            bytes; more tables let more bytes be processed per step. Must be 8,
+            4, 1 or 0 (which does without tables and works a bit at a time). */
+#ifndef NET_CRC_SLICES
+#define NET_CRC_SLICES 8
+#endif
+
+/** \brief  The number of paths the ISO9660 driver remembers the result of
+            looking up, including ones that don't exist. Each one takes about
+            32 bytes plus the length of the path. Set to 0 to disable the
+            cache. */
+#ifndef ISO9660_DCACHE_SIZE
+#define ISO9660_DCACHE_SIZE 256
+#endif
+
+/** \brief  The size of each of the two read-ahead buffers the ISO9660 driver
+            gives a file that has been hinted as read in order, in 2048 byte
+            sectors. Set to 0 to ignore such hints. */
+#ifndef ISO9660_READAHEAD
+#define ISO9660_READAHEAD 16
+#endif
+
+/** \brief  The number of files and directories a romdisk image needs to have
+            for a hashed index of it to be built on the first lookup, rather
+            than each lookup going through the directories one entry at a
+            time. The index takes about 16 bytes per entry. */
+#ifndef ROMDISK_INDEX_MIN
+#define ROMDISK_INDEX_MIN 64
+#endif
+
+/** \brief  The default memory budget of the buffer cache shared by block
+            device filesystems, in bytes. See kos/bcache.h. */
+#ifndef BCACHE_BUDGET
+#define BCACHE_BUDGET (256 * 1024)
+#endif
+
+/** \brief  The most the buffer cache reads or writes in one request when
+            reading ahead or writing back runs of blocks, in bytes. */
+#ifndef BCACHE_RUN_BYTES
+#define BCACHE_RUN_BYTES 65536
+#endif
+
+/** \brief  The biggest extent the ramdisk adds to a file when it grows, in
+            bytes. Each new extent is as big as the file already is, up to
+            this, so that big files don't take many extents, without leaving
+            too much memory allocated but unused at the end of them. */
+#ifndef RAMDISK_MAX_EXTENT
+#define RAMDISK_MAX_EXTENT (256 * 1024)
+#endif
+
 /** @} */
 
 __END_DECLS
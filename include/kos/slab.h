@@ -0,0 +1,197 @@
+/* KallistiOS ##version##
+
+   kos/slab.h
+
+*/
+
+/** \file    kos/slab.h
+    \brief   Pools of fixed-size objects.
+    \ingroup system_slab
+
+    This file contains an allocator for objects that are all the same size,
+    for parts of the kernel that make and throw away a lot of small objects
+    of one type (ARP entries, address lists and so on). Rather than going to
+    malloc() each time, taking its lock and paying for a chunk header on every
+    object, objects are carved out of bigger blocks (slabs) that are got from
+    malloc() a few at a time and given back once they're empty.
+
+    Each type of object gets a cache, made with slab_cache_create(), and its
+    objects are got with slab_alloc() and given back with slab_free(). A
+    cache can be given a constructor, which is called on each object when a
+    slab is made, and a destructor, which is called on each object when a slab
+    is given back. Objects keep whatever state they were freed in, so a
+    constructor can set up something that stays set up (a mutex, a buffer)
+    while the object goes back and forth between the cache and its users.
+
+    Caches are locked with a mutex, unless they're made with SLAB_IRQSAFE, in
+    which case interrupts are disabled instead while the cache is being
+    changed, and objects can be got and given back from inside an IRQ handler.
+    Getting a new slab from inside an IRQ handler only works when malloc()
+    can be used there (see malloc_irq_safe()), so a cache that has to be used
+    in one should be kept topped up from outside of it.
+
+    Every cache keeps counts of how it's being used, which can be got with
+    slab_cache_get_stats(), and slab_print_stats() prints them for every
+    cache there is.
+*/
+
+#ifndef __KOS_SLAB_H
+#define __KOS_SLAB_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup system_slab   Slab Allocator
+    \brief                  Pools of fixed-size objects
+    \ingroup                system_allocator
+
+    @{
+*/
+
+/** \brief  A cache of objects of one size.
+
+    This is an opaque structure, returned by slab_cache_create().
+*/
+typedef struct slab_cache slab_cache_t;
+
+/** \brief  Constructor or destructor for the objects in a cache.
+
+    \param  obj             The object to set up or tear down.
+*/
+typedef void (*slab_ctor_t)(void *obj);
+
+/** \brief  Make a cache that can be used from inside IRQ handlers. */
+#define SLAB_IRQSAFE    0x00000001
+
+/** \brief  Counts kept for a cache.
+
+    \headerfile kos/slab.h
+*/
+typedef struct slab_stats {
+    const char *name;           /**< \brief Name the cache was made with */
+    size_t obj_size;            /**< \brief Size of each object, padded out */
+    size_t slab_size;           /**< \brief Bytes got from malloc() per slab */
+    size_t objs_per_slab;       /**< \brief Objects in each slab */
+    size_t slabs;               /**< \brief Slabs the cache has now */
+    size_t in_use;              /**< \brief Objects allocated now */
+    size_t peak;                /**< \brief Most objects ever allocated at once */
+    uint64_t allocs;            /**< \brief Calls to slab_alloc() that worked */
+    uint64_t frees;             /**< \brief Calls to slab_free() */
+    uint64_t failures;          /**< \brief Calls to slab_alloc() that failed */
+    uint64_t grows;             /**< \brief Slabs got from malloc() */
+    uint64_t shrinks;           /**< \brief Slabs given back to malloc() */
+} slab_stats_t;
+
+/** \brief  Make a cache of objects.
+
+    \param  name            Name to show for the cache in its stats. It is
+                            copied, and cut short if it's very long.
+    \param  size            Size of each object.
+    \param  align           Alignment each object needs (a power of two), or
+                            0 for the same alignment malloc() gives.
+    \param  ctor            Called on each object when a slab is made, or
+                            NULL.
+    \param  dtor            Called on each object when a slab is given back,
+                            or NULL.
+    \param  flags           SLAB_IRQSAFE, or 0.
+
+    \return                 The new cache, or NULL on failure (with errno
+                            set to EINVAL or ENOMEM).
+
+    \sa slab_cache_create_type(), slab_cache_destroy()
+*/
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, slab_ctor_t dtor,
+                                uint32_t flags);
+
+/** \brief  Make a cache of objects of a type.
+
+    This is slab_cache_create() with the size and alignment of a type.
+
+    \param  name            Name to show for the cache in its stats.
+    \param  type            Type of the objects.
+    \param  ctor            Constructor, or NULL.
+    \param  dtor            Destructor, or NULL.
+    \param  flags           SLAB_IRQSAFE, or 0.
+
+    \return                 The new cache, or NULL on failure.
+*/
+#define slab_cache_create_type(name, type, ctor, dtor, flags) \
+    slab_cache_create((name), sizeof(type), _Alignof(type), (ctor), (dtor), \
+                      (flags))
+
+/** \brief  Destroy a cache.
+
+    All of the cache's objects must have been freed. This can't be called
+    from inside an IRQ handler.
+
+    \param  cache           The cache to destroy.
+
+    \retval 0               On success.
+    \retval -1              If objects are still allocated (errno is set to
+                            EBUSY), in which case the cache is left alone.
+*/
+int slab_cache_destroy(slab_cache_t *cache);
+
+/** \brief  Allocate an object from a cache.
+
+    The object is left as it was when it was last freed, or as the
+    constructor left it if it's never been used (which means whatever
+    malloc() left it as, if there's no constructor).
+
+    \param  cache           The cache to allocate from.
+
+    \return                 The object, or NULL if there's no memory for it
+                            (with errno set to ENOMEM).
+*/
+void *slab_alloc(slab_cache_t *cache);
+
+/** \brief  Give an object back to its cache.
+
+    \param  cache           The cache it was allocated from.
+    \param  obj             The object, or NULL to do nothing.
+*/
+void slab_free(slab_cache_t *cache, void *obj);
+
+/** \brief  Give a cache's empty slabs back to malloc().
+
+    A cache keeps a few empty slabs around when its objects are freed (up to
+    16 KiB's worth, or one if they're bigger than that), so that it doesn't
+    have to go straight back to malloc() if more are needed, and slabs that
+    empty out inside an IRQ handler are kept until the next time an object is
+    freed outside of one. This gives all of them back. It can't be called
+    from inside an IRQ handler.
+
+    \param  cache           The cache to shrink.
+
+    \return                 The number of bytes given back.
+*/
+size_t slab_cache_shrink(slab_cache_t *cache);
+
+/** \brief  Get the counts kept for a cache.
+
+    \param  cache           The cache to look at.
+    \param  stats           Where to put the counts.
+*/
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+/** \brief  Print the counts for every cache using the given print function.
+
+    One line is printed for each cache, with the size of its objects, how
+    many are in use now and at most, how much memory its slabs take up, and
+    how many allocations have been done and have failed.
+
+    \param  pf              The printf-like function to print with.
+
+    \retval 0               On success.
+*/
+int slab_print_stats(int (*pf)(const char *fmt, ...)) __nonnull_all;
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __KOS_SLAB_H */
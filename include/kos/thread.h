@@ -53,11 +53,11 @@ __BEGIN_DECLS
     \ingroup            threading
 
     The thread scheduler itself is a relatively simplistic priority scheduler.
-    There is no provision for priorities to erode over time, so keep that in
-    mind. That practically means that if you have 2 high priority threads that
-    are always runnable and one low priority thread that is always runnable, the
-    low priority thread will never actually run (since it will never get to the
-    front of the run queue because of the high priority threads).
+    Runnable threads are kept in a set of per-priority buckets indexed by a
+    bitmap, so picking the next thread to run does not depend on the number of
+    threads in the system. To keep low priority threads from starving, a thread
+    that has been waiting in the run queue for a while gets its effective
+    priority doubled (ageing); this is undone as soon as it gets to run.
 
     The scheduler supports two distinct types of threads: joinable and detached
     threads. A joinable thread is one that can return a value to the creating
@@ -174,8 +174,11 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Run/Wait queue handle. Once again, not a function. */
     TAILQ_ENTRY(kthread) thdq;
 
-    /** \brief  Timer queue handle (if applicable). Also not a function. */
-    TAILQ_ENTRY(kthread) timerq;
+    /** \brief  Timer wheel handle (if applicable). Also not a function. */
+    LIST_ENTRY(kthread) timerq;
+
+    /** \brief  Ageing queue handle (if runnable). Still not a function. */
+    TAILQ_ENTRY(kthread) ageq;
 
     /** \brief  Kernel thread id. */
     tid_t tid;
@@ -186,6 +189,15 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Static priority: 0..PRIO_MAX (higher means lower priority). */
     prio_t real_prio;
 
+    /** \brief  Number of times the priority was doubled by ageing. */
+    uint8_t age;
+
+    /** \brief  Run queue bucket, if queued. */
+    uint8_t runq;
+
+    /** \brief  Time of the last enqueue or ageing step, in milliseconds. */
+    uint32_t age_time;
+
     /** \brief  Thread flags. */
     kthread_flags_t flags;
 
@@ -254,6 +266,12 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief Compiler-level thread-local storage. */
     void *tls_hnd;
 
+    /** \brief  Small blocks cached for the thread by malloc().
+
+        \see    malloc_thread_flush()
+    */
+    struct malloc_tcache *malloc_cache;
+
     /** \brief  Return value of the thread function.
 
         This is only used in joinable threads.
@@ -62,6 +62,22 @@ int mem_check_block(void *p);
  */
 int mem_check_all(void);
 
+/** \brief  Give the current thread's cached blocks back to the allocator.
+
+    Small blocks that a thread frees are kept in a cache of its own, so that
+    it can allocate blocks of the same size again without taking the
+    allocator's lock. Those blocks still count as in use in mallinfo() and
+    malloc_stats(), until the thread is destroyed or calls this function.
+    The cache is not used when KM_DBG is enabled, or from an IRQ.
+*/
+void malloc_thread_flush(void);
+
+/** \cond */
+/* Called by thd_destroy() to give a thread's cached blocks back. */
+struct kthread;
+void __malloc_thread_destroy(struct kthread *thd);
+/** \endcond */
+
 /** @} */
 
 __END_DECLS
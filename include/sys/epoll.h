@@ -0,0 +1,149 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+
+*/
+
+/** \file    sys/epoll.h
+    \brief   Scalable I/O event notification.
+    \ingroup threading_polling
+
+    This file contains an epoll-style interface for waiting on events on a
+    large number of file descriptors. Unlike poll() and select(), the set of
+    file descriptors of interest is registered once with epoll_ctl(), and
+    epoll_wait() only has to look at the ones that something has actually
+    happened to since the last call.
+
+    The interface follows the one found on Linux. The same caveats as for
+    poll() apply, in that only sockets will ever wake up a waiting thread.
+    Registrations are dropped when the file descriptor they were made for is
+    closed, even if it has been duplicated.
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <poll.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup threading_polling
+    @{
+*/
+
+/** \defgroup epoll_events              Events for epoll
+    \brief                              Event masks for epoll_ctl() and
+                                        epoll_wait()
+
+    The basic events are the same as the ones used by poll(), so the two can
+    be used interchangeably.
+
+    @{
+*/
+#define EPOLLIN         POLLIN          /**< \brief Data may be read */
+#define EPOLLRDNORM     POLLRDNORM      /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND      /**< \brief Priority data may be read */
+#define EPOLLPRI        POLLPRI         /**< \brief Urgent data may be read */
+#define EPOLLOUT        POLLOUT         /**< \brief Data may be written */
+#define EPOLLWRNORM     POLLWRNORM      /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND      /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR         /**< \brief Error (always reported) */
+#define EPOLLHUP        POLLHUP         /**< \brief Hang up (always reported) */
+
+/** \brief  Only report a file descriptor once per event, rather than for as
+            long as it stays ready. */
+#define EPOLLET         (1U << 31)
+
+/** \brief  Disable the file descriptor after one event has been reported on
+            it, until it is re-armed with EPOLL_CTL_MOD. */
+#define EPOLLONESHOT    (1U << 30)
+/** @} */
+
+/** \defgroup epoll_ctl_ops             Operations for epoll_ctl()
+    @{
+*/
+#define EPOLL_CTL_ADD   1   /**< \brief Register a file descriptor */
+#define EPOLL_CTL_DEL   2   /**< \brief Unregister a file descriptor */
+#define EPOLL_CTL_MOD   3   /**< \brief Change the registered events */
+/** @} */
+
+/** \brief  Flag for epoll_create1(), accepted for compatibility. */
+#define EPOLL_CLOEXEC   0x1
+
+/** \brief  User data associated with a registered file descriptor. */
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+/** \brief  An event, as passed to epoll_ctl() and returned by epoll_wait().
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;        /**< \brief Event mask */
+    epoll_data_t data;      /**< \brief User data */
+};
+
+/** \brief   Create an epoll instance.
+
+    \param  size        Ignored, other than needing to be positive.
+
+    \return             A file descriptor for the instance, or -1 on error
+                        (sets errno as appropriate). Close it with close() when
+                        done with it.
+*/
+int epoll_create(int size);
+
+/** \brief   Create an epoll instance.
+
+    \param  flags       0 or EPOLL_CLOEXEC (which has no effect).
+
+    \return             A file descriptor for the instance, or -1 on error
+                        (sets errno as appropriate).
+*/
+int epoll_create1(int flags);
+
+/** \brief   Add, change or remove a file descriptor in an epoll instance.
+
+    \param  epfd        The epoll instance.
+    \param  op          One of the \ref epoll_ctl_ops.
+    \param  fd          The file descriptor to operate on.
+    \param  event       The events of interest and the user data to return
+                        with them. Ignored for EPOLL_CTL_DEL.
+
+    \return             0 on success, -1 on error (sets errno as appropriate).
+
+    \par    Error Conditions:
+    \em     EBADF - epfd or fd is not a valid file descriptor \n
+    \em     EINVAL - epfd is not an epoll instance, or fd is epfd \n
+    \em     EEXIST - fd is already registered (EPOLL_CTL_ADD) \n
+    \em     ENOENT - fd is not registered (EPOLL_CTL_MOD, EPOLL_CTL_DEL) \n
+    \em     ENOMEM - out of memory
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief   Wait for events on an epoll instance.
+
+    \param  epfd        The epoll instance.
+    \param  events      Where to store the events.
+    \param  maxevents   The maximum number of events to return.
+    \param  timeout     Maximum amount of time to block, in milliseconds. Pass
+                        0 to return immediately and -1 to block until an event
+                        occurs.
+
+    \return             The number of events stored, or -1 on error (sets errno
+                        as appropriate).
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
@@ -242,6 +242,19 @@ static void bgrad_cache(cache_block_t **cache, int block) {
     cache[NUM_CACHE_BLOCKS - 1] = tmp;
 }
 
+static iso_stats_t iso_stats;
+
+/* Where the drive will be once it's done with the last thing it was asked
+   to read, to tell which reads need it to seek. */
+static uint32_t cd_head;
+
+static void iso_note_read(uint32_t sector, uint32_t cnt) {
+    if(sector != cd_head)
+        ++iso_stats.seeks;
+
+    cd_head = sector + cnt;
+}
+
 /* Pulls the requested sector into a cache block and returns the cache
    block index. Note that the sector in question may already be in the
    cache, in which case it just returns the containing block. */
@@ -276,6 +289,7 @@ static int bread_cache(cache_block_t **cache, uint32_t sector) {
     // dbglog(DBG_DEBUG, "Stream stop for %s read\n", cache == icache ? "cached" : "inode");
 
     /* Load the requested block */
+    iso_note_read(sector, 1);
     j = cdrom_read_sectors_ex(cache[i]->data, sector + 150, 1, true);
 
     if(j != ERR_OK) {
@@ -428,7 +442,9 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
    dir_size:    directory size (in bytes)
 
    It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
+   expect this buffer to stay around much longer than the call itself), or
+   NULL with errno set to ENOENT if there is no such object or EIO if the
+   directory couldn't be read.
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32_t dir_extent, uint32_t dir_size) {
@@ -455,7 +471,10 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     while(size_left > 0) {
         c = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(c < 0) {
+            errno = EIO;
+            return NULL;
+        }
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
@@ -526,54 +545,262 @@ static iso_dirent_t *find_object(const char *fn, int dir,
         size_left -= 2048;
     }
 
+    errno = ENOENT;
     return NULL;
 }
 
-/* Locate an ISO9660 object anywhere on the disc, starting at the root,
-   and expecting a fully qualified path name. This is analogous to find_object
-   but it searches with the path in mind.
+/********************************************************************************/
+/* Path lookup cache. Every path that has been looked up (and every directory
+   on the way to it) is remembered with what it led to, including when it led
+   nowhere, so that opening a file that has been opened before, or one in a
+   directory that has been seen before, doesn't need to go back to the disc.
+   Paths are compared without regard to case, just as they are on the disc.
+   Everything in here is thrown away when the disc changes. */
+
+typedef struct iso_dentry {
+    LIST_ENTRY(iso_dentry) bucket;  /* Hash chain */
+    TAILQ_ENTRY(iso_dentry) lru;    /* Most recently used first */
+    uint32_t hash;
+    uint32_t extent;                /* First sector, if found */
+    uint32_t size;                  /* Size in bytes, if found */
+    uint16_t len;                   /* Length of path */
+    bool dir;                       /* Looked up as a directory */
+    bool found;                     /* False for a negative entry */
+    char path[];                    /* No leading slash, not terminated */
+} iso_dentry_t;
+
+#define DENTRY_BUCKETS  (ISO9660_DCACHE_SIZE > 0 ? ISO9660_DCACHE_SIZE : 1)
+
+static LIST_HEAD(iso_dentry_list, iso_dentry) dentry_tab[DENTRY_BUCKETS];
+static TAILQ_HEAD(iso_dentry_lru, iso_dentry) dentry_lru;
+static size_t dentry_count;
+
+/* Bumped whenever the cache is emptied, so that a lookup that was under way
+   at the time doesn't add something from the old disc afterwards. */
+static uint32_t dentry_gen;
+
+/* Never held while reading the disc, since a disc change found by a read
+   ends up back in here to clear things out. */
+static mutex_t dentry_mutex;
+
+static uint32_t dentry_hash(const char *path, size_t len, bool dir) {
+    uint32_t h = 2166136261U ^ dir;
+
+    while(len--) {
+        h ^= (uint8_t)tolower((uint8_t)*path++);
+        h *= 16777619U;
+    }
 
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+    return h;
+}
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
+static iso_dentry_t *dentry_find(const char *path, size_t len, bool dir,
+                                 uint32_t hash) {
+    iso_dentry_t *e;
+
+    LIST_FOREACH(e, &dentry_tab[hash % DENTRY_BUCKETS], bucket) {
+        if(e->hash == hash && e->len == len && e->dir == dir &&
+           !strncasecmp(e->path, path, len))
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Look for a path in the cache. Returns true if it was there, filling in what
+   it led to, or false (and the generation to add it with later) if not. */
+static bool dentry_lookup(const char *path, size_t len, bool dir, bool *found,
+                          uint32_t *extent, uint32_t *size, uint32_t *gen) {
+    iso_dentry_t *e;
+
+    mutex_lock_scoped(&dentry_mutex);
+
+    *gen = dentry_gen;
+
+    if(!(e = dentry_find(path, len, dir, dentry_hash(path, len, dir))))
+        return false;
+
+    TAILQ_REMOVE(&dentry_lru, e, lru);
+    TAILQ_INSERT_HEAD(&dentry_lru, e, lru);
+
+    *found = e->found;
+    *extent = e->extent;
+    *size = e->size;
+    return true;
+}
+
+/* Add a path to the cache, unless it's already there. When the cache is full,
+   the least recently used entry makes room, unless evict is false. Returns
+   false if the path couldn't be added. */
+static bool dentry_insert(const char *path, size_t len, bool dir, bool found,
+                          uint32_t extent, uint32_t size, uint32_t gen,
+                          bool evict) {
+    uint32_t hash = dentry_hash(path, len, dir);
+    iso_dentry_t *e;
+
+    if(ISO9660_DCACHE_SIZE <= 0 || len > UINT16_MAX)
+        return false;
+
+    mutex_lock_scoped(&dentry_mutex);
+
+    if(gen != dentry_gen)
+        return false;
+
+    if(dentry_find(path, len, dir, hash))
+        return true;
+
+    if(dentry_count >= ISO9660_DCACHE_SIZE) {
+        if(!evict)
+            return false;
+
+        e = TAILQ_LAST(&dentry_lru, iso_dentry_lru);
+        TAILQ_REMOVE(&dentry_lru, e, lru);
+        LIST_REMOVE(e, bucket);
+        free(e);
+        --dentry_count;
+    }
+
+    if(!(e = malloc(sizeof(*e) + len)))
+        return false;
+
+    e->hash = hash;
+    e->extent = extent;
+    e->size = size;
+    e->len = len;
+    e->dir = dir;
+    e->found = found;
+    memcpy(e->path, path, len);
+
+    LIST_INSERT_HEAD(&dentry_tab[hash % DENTRY_BUCKETS], e, bucket);
+    TAILQ_INSERT_HEAD(&dentry_lru, e, lru);
+    ++dentry_count;
+
+    return true;
+}
+
+static uint32_t dentry_generation(void) {
+    mutex_lock_scoped(&dentry_mutex);
+    return dentry_gen;
+}
+
+static void dentry_clear(void) {
+    iso_dentry_t *e, *tmp;
+
+    mutex_lock_scoped(&dentry_mutex);
+
+    TAILQ_FOREACH_SAFE(e, &dentry_lru, lru, tmp)
+        free(e);
+
+    for(size_t i = 0; i < DENTRY_BUCKETS; i++)
+        LIST_INIT(&dentry_tab[i]);
+
+    TAILQ_INIT(&dentry_lru);
+    dentry_count = 0;
+    ++dentry_gen;
+}
+
+/* Locate an ISO9660 object anywhere on the disc, starting at the root, given
+   the first len characters of a fully qualified path name. Pass in:
+
+   path:    the path (a trailing slash only works for a directory)
+   len:     length of the path
+   dir:     false if looking for a file, true if looking for a dir
+
+   Returns 0 and fills in the extent and size (in bytes) of the object, or
+   returns -1 with errno set to ENOENT if there is no such thing or EIO if it
+   couldn't be read from the disc.
  */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
-    char        *cur;
-
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory */
-    while((cur = strchr(fn, '/'))) {
-        if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
-
-            if(start == NULL) return NULL;
+static int iso_lookup(const char *path, size_t len, bool dir,
+                      uint32_t *extent, uint32_t *size) {
+    uint32_t pextent, psize, gen;
+    iso_dirent_t *de;
+    size_t plen;
+    bool found;
+
+    /* Leading (and doubled) slashes don't change where a path leads */
+    while(len && *path == '/') {
+        ++path;
+        --len;
+    }
+
+    if(!len) {
+        if(!dir) {
+            errno = ENOENT;
+            return -1;
         }
 
-        fn = cur + 1;
+        *extent = root_extent;
+        *size = root_size;
+        return 0;
     }
 
-    /* Locate the file in the resulting directory */
-    if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
-        return start;
+    if(dentry_lookup(path, len, dir, &found, extent, size, &gen)) {
+        if(found)
+            return 0;
+
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Find the directory it's in first, which will usually be cached */
+    for(plen = len; plen && path[plen - 1] != '/'; plen--)
+        ;
+
+    if(plen) {
+        if(iso_lookup(path, plen - 1, true, &pextent, &psize) < 0)
+            goto not_found;
     }
     else {
-        if(!dir)
-            return NULL;
-        else
-            return start;
+        pextent = root_extent;
+        psize = root_size;
     }
+
+    /* A trailing slash is only fine on a directory */
+    if(plen == len) {
+        if(!dir) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        *extent = pextent;
+        *size = psize;
+        return 0;
+    }
+
+    /* Note: the name may be followed by more of the path, but find_object
+       only compares up to the next slash. */
+    if(!(de = find_object(path + plen, dir, pextent, psize)))
+        goto not_found;
+
+    *extent = iso_733(de->extent);
+    *size = iso_733(de->size);
+    dentry_insert(path, len, dir, true, *extent, *size, gen, true);
+    return 0;
+
+not_found:
+    if(errno == ENOENT)
+        dentry_insert(path, len, dir, false, 0, 0, gen, true);
+
+    return -1;
 }
 
 /********************************************************************************/
 /* File primitives */
 
+/* One of the two read-ahead buffers of a file */
+typedef enum {
+    RA_EMPTY,                   /* Nothing in it */
+    RA_PENDING,                 /* Being filled by DMA */
+    RA_READY                    /* Filled */
+} ra_state_t;
+
+typedef struct {
+    uint32_t sector;            /* First sector in it, in the file */
+    uint32_t count;             /* Number of sectors in it */
+    ra_state_t state;
+    bool demand;                /* Filled because a read needed it right away */
+} ra_buf_t;
+
 typedef struct iso_fd {
     TAILQ_ENTRY(iso_fd) next;   /* Next handle in the linked list */
     uint32_t first_extent;      /* First sector */
@@ -582,7 +809,13 @@ typedef struct iso_fd {
     uint32_t size;              /* Length of file in bytes */
     dirent_t dirent;            /* A static dirent to pass back to clients */
     bool broken;                /* True if the CD has been swapped out since open */
+    bool streamed;              /* True once a stream has been started for it */
+    int advice;                 /* Last ISO_FADV_* hint given */
     size_t stream_part;         /* Stream DMA part of 32 bytes */
+    uint32_t stream_next;       /* Next sector the stream will give us */
+    uint8_t *ra_data;           /* Read-ahead buffers, if reading ahead */
+    uint32_t ra_next;           /* Next sector to read ahead */
+    ra_buf_t ra_buf[2];
     uint8_t alignas(32) stream_data[32];
 } iso_fd_t;
 
@@ -592,6 +825,8 @@ static TAILQ_HEAD(iso_fd_queue, iso_fd) iso_fd_queue;
 static mutex_t fh_mutex;
 static iso_fd_t *stream_fd = NULL;
 
+static void ra_finish(void);
+
 /* Break all of our open file descriptor. This is necessary when the disc
    is changed so that we don't accidentally try to keep on doing stuff
    with the old info. As files are closed and re-opened, the broken flag
@@ -612,6 +847,8 @@ static inline void iso_abort_stream(bool lock) {
         if(lock)
             mutex_lock(&fh_mutex);
 
+        /* Don't lose a read-ahead that's under way */
+        ra_finish();
         cdrom_stream_stop(false);
         stream_fd->stream_part = 0;
         stream_fd = NULL;
@@ -623,7 +860,7 @@ static inline void iso_abort_stream(bool lock) {
 
 /* Open a file or directory */
 static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
-    iso_dirent_t    *de;
+    uint32_t extent, size;
     iso_fd_t *fd;
 
     (void)vfs;
@@ -643,12 +880,8 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     percd_done = true;
 
     /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
-
-    if(!de) {
-        errno = ENOENT;
+    if(iso_lookup(fn, strlen(fn), (mode & O_DIR) != 0, &extent, &size) < 0)
         return 0;
-    }
 
     fd = aligned_alloc(32, sizeof(*fd));
     if(!fd) {
@@ -658,9 +891,9 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
 
     /* Fill in the file handle and return the fd */
     *fd = (iso_fd_t){
-        .first_extent = iso_733(de->extent),
+        .first_extent = extent,
         .dir = (mode & O_DIR) != 0,
-        .size = iso_733(de->size),
+        .size = size,
         .broken = false,
         .stream_part = 0,
         .stream_data = {0},
@@ -685,6 +918,7 @@ static int iso_close(void * h) {
     }
 
     TAILQ_REMOVE(&iso_fd_queue, fd, next);
+    free(fd->ra_data);
     free(fd);
 
     return 0;
@@ -694,12 +928,345 @@ static int iso_stream_done(size_t *remain_size) {
     return cdrom_stream_progress(remain_size) != 1;
 }
 
+static inline uint32_t fd_sectors(const iso_fd_t *fd) {
+    return (fd->size + 2047) / 2048;
+}
+
+/* Start streaming a file from the given sector (in the file) to its end. */
+static int iso_start_stream(iso_fd_t *fd, uint32_t sector) {
+    uint32_t cnt = fd_sectors(fd) - sector;
+
+    iso_note_read(fd->first_extent + sector, cnt);
+
+    if(cdrom_stream_start(fd->first_extent + sector + 150, cnt, true))
+        return -1;
+
+    ++iso_stats.stream_starts;
+
+    if(fd->streamed)
+        ++iso_stats.stream_restarts;
+
+    fd->streamed = true;
+    fd->stream_part = 0;
+    fd->stream_next = sector;
+    stream_fd = fd;
+    // dbglog(DBG_DEBUG, "Stream start: lba=%ld cnt=%d fd=%p\n",
+    //     fd->first_extent + sector + 150, cnt, fd);
+    return 0;
+}
+
+/********************************************************************************/
+/* Read-ahead. A file that has been hinted as read in order gets two buffers of
+   ISO9660_READAHEAD sectors, which are filled with stream requests that don't
+   wait for the transfer to finish, so the disc is being read while the
+   program gets on with what it read last. The drive can only stream one thing
+   at a time, so there is never more than one transfer under way, into one of
+   the buffers of stream_fd.
+
+   Whenever the drive is free, ra_schedule() picks the next file to top up:
+   the one that's streaming already if it can just carry on, otherwise the
+   first one further up the disc from where the drive is, wrapping around to
+   the start of the disc after the last one. Everything in here is done with
+   fh_mutex held. */
+
+#define RA_SECTORS  ISO9660_READAHEAD
+
+static inline uint8_t *ra_buf_data(const iso_fd_t *fd, int i) {
+    return fd->ra_data + i * RA_SECTORS * 2048;
+}
+
+/* Wait for the transfer that's under way, if there is one. */
+static void ra_finish(void) {
+    size_t remain;
+    int i;
+
+    if(!stream_fd || !stream_fd->ra_data)
+        return;
+
+    for(i = 0; i < 2; i++) {
+        if(stream_fd->ra_buf[i].state == RA_PENDING) {
+            thd_poll((thd_cb_t)iso_stream_done, &remain, 0);
+            stream_fd->ra_buf[i].state = RA_READY;
+        }
+    }
+}
+
+/* Check whether the drive is free for another transfer, without waiting. */
+static bool ra_idle(void) {
+    size_t remain;
+    int i;
+
+    if(!stream_fd || !stream_fd->ra_data)
+        return true;
+
+    for(i = 0; i < 2; i++) {
+        if(stream_fd->ra_buf[i].state == RA_PENDING) {
+            if(!iso_stream_done(&remain))
+                return false;
+
+            stream_fd->ra_buf[i].state = RA_READY;
+        }
+    }
+
+    return true;
+}
+
+static int ra_find(const iso_fd_t *fd, uint32_t sector) {
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        if(fd->ra_buf[i].state != RA_EMPTY && sector >= fd->ra_buf[i].sector &&
+           sector < fd->ra_buf[i].sector + fd->ra_buf[i].count)
+            return i;
+    }
+
+    return -1;
+}
+
+static int ra_free_buf(const iso_fd_t *fd) {
+    if(fd->ra_buf[0].state == RA_EMPTY)
+        return 0;
+    else if(fd->ra_buf[1].state == RA_EMPTY)
+        return 1;
+
+    return -1;
+}
+
+/* Throw away whatever has been read ahead for a file. */
+static void ra_drop(iso_fd_t *fd) {
+    if(fd == stream_fd)
+        ra_finish();
+
+    fd->ra_buf[0].state = RA_EMPTY;
+    fd->ra_buf[1].state = RA_EMPTY;
+}
+
+/* Start filling buffer i of a file from fd->ra_next. */
+static int ra_fill(iso_fd_t *fd, int i, bool demand) {
+    uint32_t cnt = fd_sectors(fd) - fd->ra_next;
+
+    if(cnt > RA_SECTORS)
+        cnt = RA_SECTORS;
+
+    if(stream_fd != fd || fd->stream_next != fd->ra_next) {
+        iso_abort_stream(false);
+
+        if(iso_start_stream(fd, fd->ra_next) < 0)
+            return -1;
+    }
+
+    if(cdrom_stream_request(ra_buf_data(fd, i), cnt * 2048, false)) {
+        iso_abort_stream(false);
+        return -1;
+    }
+
+    fd->ra_buf[i].sector = fd->ra_next;
+    fd->ra_buf[i].count = cnt;
+    fd->ra_buf[i].state = RA_PENDING;
+    fd->ra_buf[i].demand = demand;
+    fd->ra_next += cnt;
+    fd->stream_next += cnt;
+    ++iso_stats.ra_fills;
+
+    return 0;
+}
+
+static void ra_schedule(void) {
+    iso_fd_t *fd, *best = NULL;
+    uint32_t dist, best_dist = UINT32_MAX;
+
+    if(!ra_idle())
+        return;
+
+    /* Don't take the drive away from a file that's streaming straight into
+       the program's buffers; it will want it back on its next read. */
+    if(stream_fd && !stream_fd->ra_data)
+        return;
+
+    TAILQ_FOREACH(fd, &iso_fd_queue, next) {
+        if(!fd->ra_data || fd->broken || fd->ra_next >= fd_sectors(fd) ||
+           ra_free_buf(fd) < 0)
+            continue;
+
+        if(fd == stream_fd && fd->stream_next == fd->ra_next) {
+            best = fd;
+            break;
+        }
+
+        /* Anything before the drive comes out as far away */
+        dist = fd->first_extent + fd->ra_next - cd_head;
+
+        if(dist < best_dist) {
+            best = fd;
+            best_dist = dist;
+        }
+    }
+
+    /* If this fails, the read that needs the data will find out. */
+    if(best)
+        ra_fill(best, ra_free_buf(best), false);
+}
+
+static int ra_enable(iso_fd_t *fd) {
+#if ISO9660_READAHEAD > 0
+    if(fd->ra_data)
+        return 0;
+
+    if(!(fd->ra_data = aligned_alloc(32, 2 * RA_SECTORS * 2048))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Streaming straight into the program's buffers doesn't mix with this */
+    if(fd == stream_fd)
+        iso_abort_stream(false);
+
+    fd->ra_buf[0].state = RA_EMPTY;
+    fd->ra_buf[1].state = RA_EMPTY;
+    fd->ra_next = fd->ptr / 2048;
+#else
+    (void)fd;
+#endif
+
+    return 0;
+}
+
+static void ra_disable(iso_fd_t *fd) {
+    if(!fd->ra_data)
+        return;
+
+    if(fd == stream_fd)
+        iso_abort_stream(false);
+
+    free(fd->ra_data);
+    fd->ra_data = NULL;
+}
+
+/* Read from a file that's being read ahead. */
+static ssize_t iso_read_ra(iso_fd_t *fd, uint8_t *outbuf, size_t bytes) {
+    ssize_t rv = 0;
+    size_t toread, off, avail;
+    ra_buf_t *rb;
+    int i;
+
+    while(bytes > 0) {
+        toread = (bytes > (fd->size - fd->ptr)) ? fd->size - fd->ptr : bytes;
+
+        if(toread == 0) break;
+
+        if((i = ra_find(fd, fd->ptr / 2048)) < 0) {
+            /* Not read ahead; start again from here */
+            ra_drop(fd);
+            fd->ra_next = fd->ptr / 2048;
+
+            if(ra_fill(fd, 0, true) < 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            continue;
+        }
+
+        rb = &fd->ra_buf[i];
+
+        /* Get the other buffer going before copying out of this one */
+        if(rb->state == RA_PENDING) {
+            ra_finish();
+            ra_schedule();
+        }
+
+        off = fd->ptr - rb->sector * 2048;
+        avail = rb->count * 2048 - off;
+
+        if(toread > avail)
+            toread = avail;
+
+        memcpy(outbuf, ra_buf_data(fd, i) + off, toread);
+
+        if(!rb->demand)
+            iso_stats.ra_bytes += toread;
+
+        outbuf += toread;
+        fd->ptr += toread;
+        bytes -= toread;
+        rv += toread;
+
+        if(toread == avail) {
+            rb->state = RA_EMPTY;
+            ra_schedule();
+        }
+    }
+
+    return rv;
+}
+
+static int iso_advise(iso_fd_t *fd, const iso_fadvise_t *adv) {
+    uint32_t sector;
+
+    if(!fd->first_extent || fd->dir || fd->broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!adv || adv->offset < 0 || adv->len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock_scoped(&fh_mutex);
+
+    switch(adv->advice) {
+        case ISO_FADV_NORMAL:
+        case ISO_FADV_RANDOM:
+            ra_disable(fd);
+            fd->advice = adv->advice;
+            break;
+
+        case ISO_FADV_SEQUENTIAL:
+        case ISO_FADV_NOREUSE:
+            if(ra_enable(fd) < 0)
+                return -1;
+
+            fd->advice = adv->advice;
+            break;
+
+        case ISO_FADV_WILLNEED:
+            if(ra_enable(fd) < 0)
+                return -1;
+
+            sector = adv->offset / 2048;
+
+            if(fd->ra_data && sector < fd_sectors(fd) &&
+               ra_find(fd, sector) < 0) {
+                ra_drop(fd);
+                fd->ra_next = sector;
+            }
+
+            ra_schedule();
+            break;
+
+        case ISO_FADV_DONTNEED:
+            if(fd->ra_data) {
+                ra_drop(fd);
+                fd->ra_next = fd->ptr / 2048;
+            }
+
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    return 0;
+}
+
 /* Read from a file */
 static ssize_t iso_read(void *h, void *buf, size_t bytes) {
     int rv, c;
     size_t toread, thissect;
     uint8_t *outbuf;
-    size_t remain_size = 0, req_size;
+    size_t remain_size = 0;
     uint32_t sector;
     iso_fd_t *fd = (iso_fd_t *)h;
 
@@ -713,6 +1280,12 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
     outbuf = (uint8_t *)buf;
     mutex_lock(&fh_mutex);
 
+    if(fd->ra_data) {
+        rv = iso_read_ra(fd, outbuf, bytes);
+        mutex_unlock(&fh_mutex);
+        return rv;
+    }
+
     /* Read zero or more sectors into the buffer from the current pos */
     while(bytes > 0) {
         /* Figure out how much we still need to read */
@@ -741,7 +1314,8 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
         thissect = 2048 - (fd->ptr % 2048);
         sector = fd->first_extent + (fd->ptr / 2048);
 
-        if((thissect & 31) == 0 && toread >= 32 && (((uintptr_t)outbuf) & 31) == 0) {
+        if((thissect & 31) == 0 && toread >= 32 &&
+           (((uintptr_t)outbuf) & 31) == 0 && fd->advice != ISO_FADV_RANDOM) {
 
             if(stream_fd == fd) {
                 toread &= ~31;
@@ -755,24 +1329,14 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
                 //         toread, remain_size, outbuf, fd);
             }
             else if(thissect == 2048) {
-                req_size = (fd->size - fd->ptr);
-
-                if(req_size & 2047) {
-                    req_size = (req_size + 2048) & ~2047;
-                }
                 if(stream_fd) {
                     iso_abort_stream(false);
                     // dbglog(DBG_DEBUG, "Stream stop for file fd: %p -> %p\n", stream_fd, fd);
                 }
-                c = cdrom_stream_start(sector + 150, req_size / 2048, true);
 
-                if(c) {
+                if(iso_start_stream(fd, fd->ptr / 2048) < 0) {
                     goto read_loop;
                 }
-                fd->stream_part = 0;
-                stream_fd = fd;
-                // dbglog(DBG_DEBUG, "Stream start: lba=%ld cnt=%d fd=%p\n",
-                //     sector + 150, req_size / 2048, fd);
 
                 toread &= ~31;
                 c = cdrom_stream_request(outbuf, toread, 1);
@@ -826,6 +1390,12 @@ read_loop:
             /* Round it off to an even sector count. */
             thissect = toread / 2048;
             toread = thissect * 2048;
+
+            /* The drive can't be reading ahead for a file meanwhile */
+            if(stream_fd && stream_fd->ra_data)
+                iso_abort_stream(false);
+
+            iso_note_read(sector, thissect);
             c = cdrom_read_sectors_ex(outbuf, sector + 150, thissect, true);
 
             if(c) {
@@ -850,6 +1420,9 @@ end_loop:
         rv += toread;
     }
 
+    /* Let files that are reading ahead top up while the drive is free */
+    ra_schedule();
+
     mutex_unlock(&fh_mutex);
     return rv;
 
@@ -908,7 +1481,8 @@ static off_t iso_seek(void * h, off_t offset, int whence) {
     /* Check bounds */
     if(fd->ptr > fd->size) fd->ptr = fd->size;
 
-    if(fd == stream_fd && old_ptr != fd->ptr) {
+    /* Anything read ahead stays around in case it's wanted after all */
+    if(fd == stream_fd && old_ptr != fd->ptr && !fd->ra_data) {
         iso_abort_stream(true);
         // dbglog(DBG_DEBUG, "Stream stop on seek: %ld != %ld\n", old_ptr, fd->ptr);
     }
@@ -958,15 +1532,46 @@ static void fn_postprocess(char *fnin) {
     }
 }
 
+/* Work out the name of a directory entry as readdir shows it: the Joliet name,
+   the Rock Ridge name, or failing those the tidied up ISO9660 name. */
+static void get_dirent_name(const iso_dirent_t *de, char *name) {
+    /* RockRidge */
+    int     len;
+    const uint8_t *pnt;
+
+    if(joliet) {
+        ucs2utfn((uint8_t *)name, (const uint8_t *)de->name, de->name_len);
+        return;
+    }
+
+    strncpy(name, de->name, de->name_len);
+    name[de->name_len] = 0;
+    fn_postprocess(name);
+
+    /* Check for Rock Ridge NM extension */
+    len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
+    pnt = (const uint8_t *)de + sizeof(iso_dirent_t) - sizeof(de->name) + de->name_len;
+
+    if((de->name_len & 1) == 0) {
+        pnt++;
+        len--;
+    }
+
+    while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+        if(strncmp((const char *)pnt, "NM", 2) == 0) {
+            strncpy(name, (const char *)(pnt + 5), pnt[2] - 5);
+            name[pnt[2] - 5] = 0;
+        }
+
+        len -= pnt[2];
+        pnt += pnt[2];
+    }
+}
+
 /* Read a directory entry */
 static const dirent_t *iso_readdir(void * h) {
     int     c;
     iso_dirent_t    *de;
-
-    /* RockRidge */
-    int     len;
-    uint8_t       *pnt;
-
     iso_fd_t *fd = (iso_fd_t *)h;
 
     if(fd->first_extent == 0 || !fd->dir || fd->broken) {
@@ -1005,34 +1610,7 @@ static const dirent_t *iso_readdir(void * h) {
         if(!de->length) return NULL;
     }
 
-    if(joliet) {
-        ucs2utfn((uint8_t *)fd->dirent.name, (uint8_t *)de->name, de->name_len);
-    }
-    else {
-        /* Fill out the VFS dirent */
-        strncpy(fd->dirent.name, de->name, de->name_len);
-        fd->dirent.name[de->name_len] = 0;
-        fn_postprocess(fd->dirent.name);
-
-        /* Check for Rock Ridge NM extension */
-        len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
-        pnt = (uint8_t *)de + sizeof(iso_dirent_t) - sizeof(de->name) + de->name_len;
-
-        if((de->name_len & 1) == 0) {
-            pnt++;
-            len--;
-        }
-
-        while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
-            if(strncmp((char *)pnt, "NM", 2) == 0) {
-                strncpy(fd->dirent.name, (char *)(pnt + 5), pnt[2] - 5);
-                fd->dirent.name[pnt[2] - 5] = 0;
-            }
-
-            len -= pnt[2];
-            pnt += pnt[2];
-        }
-    }
+    get_dirent_name(de, fd->dirent.name);
 
     if(de->flags & 2) {
         fd->dirent.size = -1;
@@ -1057,10 +1635,15 @@ static int iso_ioctl(void *h, int cmd, va_list ap) {
             if(arg != NULL) {
                 *(uint32_t *)arg = 32;
             }
+            if(fd->ra_data) {
+                return -1;
+            }
             if(stream_fd == fd) {
                 return (fd->ptr & 31) ? -1 : 0;
             }
             return (fd->ptr & 2047) ? -1 : 0;
+        case IOCTL_ISO9660_FADVISE:
+            return iso_advise(fd, (const iso_fadvise_t *)arg);
         default:
             errno = EINVAL;
             return -1;
@@ -1083,11 +1666,141 @@ static int iso_rewinddir(void * h) {
 int iso_reset(void) {
     iso_break_all();
     bclear();
+    dentry_clear();
     iso_abort_stream(false);
     percd_done = false;
     return 0;
 }
 
+void iso_get_stats(iso_stats_t *stats) {
+    mutex_lock_scoped(&fh_mutex);
+    *stats = iso_stats;
+}
+
+void iso_reset_stats(void) {
+    mutex_lock_scoped(&fh_mutex);
+    memset(&iso_stats, 0, sizeof(iso_stats));
+}
+
+/* A directory still to be scanned by iso_dcache_preload() */
+typedef struct preload_dir {
+    STAILQ_ENTRY(preload_dir) next;
+    uint32_t extent, size;
+    size_t len;
+    char path[];
+} preload_dir_t;
+
+int iso_dcache_preload(void) {
+    STAILQ_HEAD(, preload_dir) dirs;
+    preload_dir_t *d, *sub;
+    iso_dirent_t *de;
+    uint32_t gen, ptr;
+    bool full = false;
+    char name[NAME_MAX];
+    size_t nlen;
+    int c, rv = 0;
+
+    if(!percd_done && init_percd() < 0) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    percd_done = true;
+
+    gen = dentry_generation();
+    STAILQ_INIT(&dirs);
+
+    if(!(d = malloc(sizeof(*d)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    d->extent = root_extent;
+    d->size = root_size;
+    d->len = 0;
+    STAILQ_INSERT_TAIL(&dirs, d, next);
+
+    /* Go through the tree a directory at a time, in the same order that
+       find_object() would look at the entries in, so that where two of them
+       have the same name, the first one is the one that gets cached. */
+    while(!full && rv >= 0 && (d = STAILQ_FIRST(&dirs))) {
+        STAILQ_REMOVE_HEAD(&dirs, next);
+
+        for(ptr = 0; ptr < d->size;) {
+            if((c = biread(d->extent + ptr / 2048)) < 0) {
+                errno = EIO;
+                rv = -1;
+                break;
+            }
+
+            de = (iso_dirent_t *)(icache[c]->data + (ptr % 2048));
+
+            if(!de->length) {
+                ptr += 2048 - (ptr % 2048);
+                continue;
+            }
+
+            ptr += de->length;
+
+            /* Skip . and .., and anything find_object() would never match */
+            if(de->name_len == 1 && (uint8_t)de->name[0] <= 1)
+                continue;
+
+            if(de->flags != 0 && de->flags != 2)
+                continue;
+
+            get_dirent_name(de, name);
+            nlen = strlen(name);
+
+            if(!nlen || strchr(name, '/') || d->len + nlen + 1 > PATH_MAX)
+                continue;
+
+            if(!(sub = malloc(sizeof(*sub) + d->len + nlen + 1))) {
+                errno = ENOMEM;
+                rv = -1;
+                break;
+            }
+
+            sub->extent = iso_733(de->extent);
+            sub->size = iso_733(de->size);
+            sub->len = 0;
+
+            if(d->len) {
+                memcpy(sub->path, d->path, d->len);
+                sub->path[d->len] = '/';
+                sub->len = d->len + 1;
+            }
+
+            memcpy(sub->path + sub->len, name, nlen);
+            sub->len += nlen;
+
+            if(!dentry_insert(sub->path, sub->len, de->flags == 2, true,
+                              sub->extent, sub->size, gen, false)) {
+                full = true;
+                free(sub);
+                break;
+            }
+
+            ++rv;
+
+            if(de->flags == 2)
+                STAILQ_INSERT_TAIL(&dirs, sub, next);
+            else
+                free(sub);
+        }
+
+        free(d);
+    }
+
+    /* Anything left over didn't fit, or there was an error */
+    while((d = STAILQ_FIRST(&dirs))) {
+        STAILQ_REMOVE_HEAD(&dirs, next);
+        free(d);
+    }
+
+    return rv;
+}
+
 /* This handler will be called during every vblank. We have to
    be careful about modifying variables that are in use in the
    foreground, so instead we'll just set a "dead" flag and next
@@ -1116,7 +1829,7 @@ static void iso_vblank(uint32_t evt, void *data) {
 static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
                     int flag) {
     mode_t md;
-    iso_dirent_t *de;
+    uint32_t extent, size;
     size_t len = strlen(path);
 
     (void)vfs;
@@ -1142,26 +1855,23 @@ static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
 
     percd_done = true;
 
-    /* First try opening as a file */
-    de = find_object_path(path, 0, &root_dirent);
+    /* First try opening as a file, and if we couldn't get it as a file, try
+       as a directory. If we still don't have it, then we're not going to
+       get it. */
     md = S_IFREG;
 
-    /* If we couldn't get it as a file, try as a directory */
-    if(!de) {
-        de = find_object_path(path, 1, &root_dirent);
-        md = S_IFDIR;
-    }
+    if(iso_lookup(path, len, false, &extent, &size) < 0) {
+        if(errno != ENOENT ||
+           iso_lookup(path, len, true, &extent, &size) < 0)
+            return -1;
 
-    /* If we still don't have it, then we're not going to get it. */
-    if(!de) {
-        errno = ENOENT;
-        return -1;
+        md = S_IFDIR;
     }
 
     memset(st, 0, sizeof(struct stat));
     st->st_dev = (dev_t)('c' | ('d' << 8));
     st->st_mode = md | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH;
-    st->st_size = (md == S_IFDIR) ? -1 : (int)iso_733(de->size);
+    st->st_size = (md == S_IFDIR) ? -1 : (int)size;
     st->st_nlink = (md == S_IFDIR) ? 2 : 1;
     st->st_blksize = 512;
 
@@ -1272,6 +1982,11 @@ void fs_iso9660_init(void) {
     /* Init thread mutexes */
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&dentry_mutex, MUTEX_TYPE_NORMAL);
+
+    /* Start off with an empty path cache */
+    TAILQ_INIT(&dentry_lru);
+    dentry_clear();
 
     /* Allocate cache block space, properly aligned for DMA access */
     cache_data = aligned_alloc(32, 2 * NUM_CACHE_BLOCKS * 2048);
@@ -1304,10 +2019,12 @@ void fs_iso9660_shutdown(void) {
     /* Dealloc cache block space */
     free(cache_data);
     free(caches);
+    dentry_clear();
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&dentry_mutex);
 
     nmmgr_handler_remove(&vh.nmmgr);
 }
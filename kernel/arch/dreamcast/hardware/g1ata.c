@@ -23,6 +23,8 @@
 
 #include <arch/arch.h>
 
+#include "g1ata_queue.h"
+
 /*
    This file implements support for accessing devices over the G1 bus by the
    AT Attachment (aka ATA, PATA, or IDE) protocol. See, the GD-ROM drive is
@@ -184,6 +186,19 @@ static uint64_t dma_sector = 0;
 static semaphore_t dma_done = SEM_INITIALIZER(0);
 static asic_evt_handler_entry_t old_dma_irq;
 
+/* The queue of DMA transfers (see g1ata_queue.c). While there's anything in
+   it, the queue holds the G1 ATA mutex, and each transfer is started from the
+   DMA IRQ handler as the last one finishes. */
+#define G1_ATA_QUEUE_DEPTH  32
+
+static ata_req_t queue_reqs[G1_ATA_QUEUE_DEPTH];
+static ata_queue_t queue;
+static semaphore_t queue_slots = SEM_INITIALIZER(G1_ATA_QUEUE_DEPTH);
+static int queue_running = 0;
+static int dma_queued = 0;
+
+static void queue_done(int err);
+
 /* From cdrom.c */
 extern semaphore_t _g1_ata_sem;
 
@@ -239,6 +254,17 @@ static void g1_ata_set_sector_and_count(uint64_t sector, size_t count, int lba28
 }
 
 static void g1_dma_done(void) {
+    uint8_t status;
+
+    /* Finish off a queued transfer and start the next one, if there is one.
+       The IRQ hasn't been acked for these yet. */
+    if(dma_queued) {
+        dma_in_progress = 0;
+        status = IN8(G1_ATA_STATUS_REG);
+        queue_done((status & (G1_ATA_SR_ERR | G1_ATA_SR_DF)) ? EIO : 0);
+        return;
+    }
+
     /* Signal the calling thread to continue, if it is blocking. */
     if(dma_blocking) {
         sem_signal(&dma_done);
@@ -398,6 +424,207 @@ static int dma_common(uint8_t cmd, size_t nsects, uint32_t addr, int dir,
     return 0;
 }
 
+/* Send the command for a LBA DMA transfer and start it. The dma_* variables
+   for it must be set already. */
+static int dma_start(uint64_t sector, size_t count, uintptr_t addr, int write,
+                     int block) {
+    int lba28, can_lba48 = CAN_USE_LBA48();
+    uint8_t cmd;
+
+    /* Anything more than this gets chained on by the IRQ handler. */
+    if(!can_lba48 && count > ATA_MAX_SECTORS_LBA28)
+        count = ATA_MAX_SECTORS_LBA28;
+
+    /* Wait for the device to signal it is ready. */
+    g1_ata_wait_bsydrq();
+
+    /* Which mode are we using: LBA28 or LBA48? */
+    lba28 = !can_lba48 || use_lba28(sector, count);
+    if(lba28) {
+        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE |
+                             ((sector >> 24) & 0x0F));
+        cmd = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+    else {
+        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE);
+        cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+
+    /* Write out the number of sectors we want and the LBA. */
+    g1_ata_set_sector_and_count(sector, count, lba28);
+
+    /* Do the rest of the work... */
+    return dma_common(cmd, count, addr,
+                      write ? G1_DMA_TO_DEVICE : G1_DMA_TO_MEMORY, block);
+}
+
+/* Start the next transfer in the queue, if there is one. This is called with
+   the G1 ATA mutex held, either from the DMA IRQ handler or from a thread. */
+static int queue_start_next(void) {
+    ata_req_t *r;
+    size_t count;
+    int old;
+
+    old = irq_disable();
+
+    if((r = ata_queue_start(&queue, &count))) {
+        dma_queued = 1;
+        dma_blocking = 0;
+        dma_in_progress = 1;
+        dma_nb_sectors = count;
+        dma_sector = r->sector;
+    }
+
+    irq_restore(old);
+
+    if(!r)
+        return 0;
+
+    dma_start(r->sector, count, r->addr, r->write, 0);
+    return 1;
+}
+
+/* Hand back the requests of a transfer and call their callbacks. */
+static void queue_complete(ata_req_t *r, int err) {
+    ata_req_t *next;
+    kos_blockdev_cb_t cb;
+    void *data;
+
+    for(; r; r = next) {
+        next = r->next;
+        cb = r->cb;
+        data = r->data;
+
+        ata_queue_release(&queue, r);
+        sem_signal(&queue_slots);
+        cb(err, data);
+    }
+}
+
+/* Called from the DMA IRQ handler when a queued transfer is done. When there's
+   nothing left to do, the G1 ATA mutex is let go. */
+static void queue_done(int err) {
+    dma_queued = 0;
+    queue_complete(ata_queue_finish(&queue), err);
+
+    if(!queue_start_next()) {
+        queue_running = 0;
+        g1_ata_mutex_unlock();
+    }
+}
+
+static int queue_submit(uint64_t sector, size_t count, const void *buf,
+                        int write, kos_blockdev_cb_t cb, void *data) {
+    uintptr_t addr = (uintptr_t)buf;
+    ata_req_t *r;
+    size_t count_left;
+    int old, start;
+
+    if(!count || !cb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!buf || (addr & 0x1F)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* Make sure that we've been initialized and there's a disk attached. */
+    if(!devices) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    /* Make sure the disk supports LBA mode. */
+    if(!device.max_lba) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /* Make sure the disk supports Multi-Word DMA mode 2. */
+    if(!device.wdma_modes) {
+        errno = EPERM;
+        return -1;
+    }
+
+    /* Make sure the range of sectors is valid. */
+    if(count > ATA_MAX_SECTORS_LBA48 || (sector + count) > device.max_lba) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    /* Wait for a free request. From an IRQ, there's no waiting, and nothing
+       can be done if the queue isn't already going. */
+    if(irq_inside_int()) {
+        if(!queue_running || sem_trywait(&queue_slots)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    else if(sem_wait(&queue_slots)) {
+        return -1;
+    }
+
+    /* Only bother with the cache for cacheable memory areas, as in
+       g1_ata_read_lba_dma() and g1_ata_write_lba_dma(). */
+    if((addr & MEM_AREA_P2_BASE) != MEM_AREA_P2_BASE) {
+        if(write)
+            dcache_wback_range(addr, count * 512);
+        else
+            dcache_inval_range(addr, count * 512);
+    }
+
+    old = irq_disable();
+
+    r = ata_queue_alloc(&queue);
+    r->sector = sector;
+    r->count = count;
+    r->addr = addr & MEM_AREA_CACHE_MASK;
+    r->write = write;
+    r->cb = cb;
+    r->data = data;
+    ata_queue_add(&queue, r);
+
+    start = !queue_running;
+    queue_running = 1;
+
+    irq_restore(old);
+
+    /* If the queue wasn't going, get it going. It's up to the IRQ handler to
+       keep it going from here. If the mutex can't be had, everything that's
+       been queued up fails. */
+    if(start) {
+        if(g1_ata_mutex_lock()) {
+            old = irq_disable();
+
+            while((r = ata_queue_start(&queue, &count_left)))
+                queue_complete(ata_queue_finish(&queue), EIO);
+
+            queue_running = 0;
+            irq_restore(old);
+            return 0;
+        }
+
+        if(!queue_start_next()) {
+            queue_running = 0;
+            g1_ata_mutex_unlock();
+        }
+    }
+
+    return 0;
+}
+
+int g1_ata_queue_read(uint64_t sector, size_t count, void *buf,
+                      kos_blockdev_cb_t cb, void *data) {
+    return queue_submit(sector, count, buf, 0, cb, data);
+}
+
+int g1_ata_queue_write(uint64_t sector, size_t count, const void *buf,
+                       kos_blockdev_cb_t cb, void *data) {
+    return queue_submit(sector, count, buf, 1, cb, data);
+}
+
 int g1_ata_read_chs(uint16_t c, uint8_t h, uint8_t s, size_t count,
                     void *buf) {
     int rv = 0;
@@ -645,9 +872,8 @@ out:
 
 int g1_ata_read_lba_dma(uint64_t sector, size_t count, void *buf,
                         int block) {
-    int lba28, old, can_lba48 = CAN_USE_LBA48();
+    int old;
     uintptr_t addr;
-    uint8_t cmd;
 
     /* Make sure we're actually being asked to do work... */
     if(!count)
@@ -733,29 +959,7 @@ int g1_ata_read_lba_dma(uint64_t sector, size_t count, void *buf,
     dma_sector = sector;
     irq_restore(old);
 
-    if(!can_lba48 && count > ATA_MAX_SECTORS_LBA28)
-        count = ATA_MAX_SECTORS_LBA28;
-
-    /* Wait for the device to signal it is ready. */
-    g1_ata_wait_bsydrq();
-
-    /* Which mode are we using: LBA28 or LBA48? */
-    lba28 = !can_lba48 || use_lba28(sector, count);
-    if(lba28) {
-        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE |
-                             ((sector >> 24) & 0x0F));
-        cmd = ATA_CMD_READ_DMA;
-    }
-    else {
-        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE);
-        cmd = ATA_CMD_READ_DMA_EXT;
-    }
-
-    /* Write out the number of sectors we want and the LBA. */
-    g1_ata_set_sector_and_count(sector, count, lba28);
-
-    /* Do the rest of the work... */
-    return dma_common(cmd, count, addr, G1_DMA_TO_MEMORY, block);
+    return dma_start(sector, count, addr, 0, block);
 }
 
 int g1_ata_write_lba(uint64_t sector, size_t count, const void *buf) {
@@ -837,7 +1041,7 @@ int g1_ata_write_lba(uint64_t sector, size_t count, const void *buf) {
 
 int g1_ata_write_lba_dma(uint64_t sector, size_t count, const void *buf,
                          int block) {
-    int cmd, lba28, old, can_lba48 = CAN_USE_LBA48();
+    int old;
     uintptr_t addr;
 
     /* Make sure we're actually being asked to do work... */
@@ -924,29 +1128,7 @@ int g1_ata_write_lba_dma(uint64_t sector, size_t count, const void *buf,
     dma_sector = sector;
     irq_restore(old);
 
-    /* Wait for the device to signal it is ready. */
-    g1_ata_wait_bsydrq();
-
-    /* Which mode are we using: LBA28 or LBA48? */
-    lba28 = !can_lba48 || use_lba28(sector, count);
-    if(lba28) {
-        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE |
-                             ((sector >> 24) & 0x0F));
-        cmd = ATA_CMD_WRITE_DMA;
-        if(count > ATA_MAX_SECTORS_LBA28) {
-            count = ATA_MAX_SECTORS_LBA28;
-        }
-    }
-    else {
-        g1_ata_select_device(G1_ATA_SLAVE | G1_ATA_LBA_MODE);
-        cmd = ATA_CMD_WRITE_DMA_EXT;
-    }
-
-    /* Write out the number of sectors we want and the LBA. */
-    g1_ata_set_sector_and_count(sector, count, lba28);
-
-    /* Do the rest of the work... */
-    return dma_common(cmd, count, addr, G1_DMA_TO_DEVICE, block);
+    return dma_start(sector, count, addr, 1, block);
 }
 
 int g1_ata_flush(void) {
@@ -1159,6 +1341,41 @@ static int atab_read_blocks(const kos_blockdev_t *d, uint64_t block, size_t coun
     return g1_ata_read_lba(block + data->start_block, count, (uint16_t *)buf);
 }
 
+/* The DMA block device goes through the queue even when it waits, so that
+   requests from different threads can be merged and sorted. */
+typedef struct atab_wait {
+    semaphore_t done;
+    int err;
+} atab_wait_t;
+
+static void atab_wait_cb(int err, void *d) {
+    atab_wait_t *w = (atab_wait_t *)d;
+
+    w->err = err;
+    sem_signal(&w->done);
+}
+
+static int atab_queue_wait(uint64_t sector, size_t count, void *buf,
+                           int write) {
+    atab_wait_t w;
+    int rv;
+
+    sem_init(&w.done, 0);
+    w.err = 0;
+
+    if((rv = queue_submit(sector, count, buf, write, &atab_wait_cb, &w)) == 0) {
+        sem_wait(&w.done);
+
+        if(w.err) {
+            errno = w.err;
+            rv = -1;
+        }
+    }
+
+    sem_destroy(&w.done);
+    return rv;
+}
+
 static int atab_read_blocks_dma(const kos_blockdev_t *d, uint64_t block, size_t count,
                                 void *buf) {
     ata_devdata_t *data = (ata_devdata_t *)d->dev_data;
@@ -1168,7 +1385,7 @@ static int atab_read_blocks_dma(const kos_blockdev_t *d, uint64_t block, size_t
         return -1;
     }
 
-    return g1_ata_read_lba_dma(block + data->start_block, count, buf, 1);
+    return atab_queue_wait(block + data->start_block, count, buf, 0);
 }
 
 static int atab_write_blocks(const kos_blockdev_t *d, uint64_t block, size_t count,
@@ -1192,7 +1409,21 @@ static int atab_write_blocks_dma(const kos_blockdev_t *d, uint64_t block,
         return -1;
     }
 
-    return g1_ata_write_lba_dma(block + data->start_block, count, buf, 1);
+    return atab_queue_wait(block + data->start_block, count, (void *)buf, 1);
+}
+
+static int atab_submit_dma(const kos_blockdev_t *d, int write, uint64_t block,
+                           size_t count, void *buf, kos_blockdev_cb_t cb,
+                           void *cb_data) {
+    ata_devdata_t *data = (ata_devdata_t *)d->dev_data;
+
+    if(block + count > data->end_block) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    return queue_submit(block + data->start_block, count, buf, !!write, cb,
+                        cb_data);
 }
 
 static int atab_read_blocks_chs(const kos_blockdev_t *d, uint64_t block, size_t count,
@@ -1254,7 +1485,8 @@ static kos_blockdev_t ata_blockdev = {
     &atab_read_blocks,      /* read_blocks */
     &atab_write_blocks,     /* write_blocks */
     &atab_count_blocks,     /* count_blocks */
-    &atab_flush             /* flush */
+    &atab_flush,            /* flush */
+    NULL                    /* submit */
 };
 
 static kos_blockdev_t ata_blockdev_dma = {
@@ -1265,7 +1497,8 @@ static kos_blockdev_t ata_blockdev_dma = {
     &atab_read_blocks_dma,  /* read_blocks */
     &atab_write_blocks_dma, /* write_blocks */
     &atab_count_blocks,     /* count_blocks */
-    &atab_flush             /* flush */
+    &atab_flush,            /* flush */
+    &atab_submit_dma        /* submit */
 };
 
 static kos_blockdev_t ata_blockdev_chs = {
@@ -1276,7 +1509,8 @@ static kos_blockdev_t ata_blockdev_chs = {
     &atab_read_blocks_chs,  /* read_blocks */
     &atab_write_blocks_chs, /* write_blocks */
     &atab_count_blocks,     /* count_blocks */
-    &atab_flush             /* flush */
+    &atab_flush,            /* flush */
+    NULL                    /* submit */
 };
 
 int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
@@ -1417,6 +1651,10 @@ int g1_ata_init(void) {
         return -1;
     }
 
+    ata_queue_init(&queue, queue_reqs, G1_ATA_QUEUE_DEPTH,
+                   CAN_USE_LBA48() ? ATA_MAX_SECTORS_LBA48 :
+                   ATA_MAX_SECTORS_LBA28);
+
     /* Hook all the DMA related events. */
     old_dma_irq = asic_evt_set_handler(ASIC_EVT_GD_DMA, g1_dma_irq_hnd, NULL);
     asic_evt_set_handler(ASIC_EVT_GD_DMA_OVERRUN, g1_dma_irq_hnd, NULL);
@@ -1433,7 +1671,16 @@ int g1_ata_init(void) {
     return 0;
 }
 
+static int queue_idle(void *d) {
+    (void)d;
+    return !queue_running;
+}
+
 void g1_ata_shutdown(void) {
+    /* Let anything still in the queue finish. */
+    if(devices)
+        thd_poll(&queue_idle, NULL, 0);
+
     /* Make sure to flush any cached data out. */
     if(devices)
         g1_ata_flush();
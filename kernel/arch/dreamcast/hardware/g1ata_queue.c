@@ -0,0 +1,155 @@
+/* KallistiOS ##version##
+
+   hardware/g1ata_queue.c
+
+*/
+
+#include "g1ata_queue.h"
+
+/* Requests are kept sorted by sector, and picked in one-way elevator order
+   (C-LOOK): the first one at or past where the last transfer ended, or if
+   there isn't one, the lowest. Once one is picked, any requests that carry
+   straight on from it, both on the disk and in memory, and go the same way,
+   are merged in, as are any that lead straight into it.
+
+   Going out of order can't be allowed to change what gets read or written,
+   so a request can't be picked until every request made before it that
+   overlaps it has been, if either of them is a write. */
+
+static int overlaps(const ata_req_t *a, const ata_req_t *b) {
+    return a->sector < b->sector + b->count && b->sector < a->sector + a->count;
+}
+
+static int ready(const ata_queue_t *q, const ata_req_t *r) {
+    const ata_req_t *i;
+
+    TAILQ_FOREACH(i, &q->pending, link) {
+        if(i->seq < r->seq && (i->write || r->write) && overlaps(i, r))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int joins(const ata_req_t *a, const ata_req_t *b, size_t total,
+                 size_t max) {
+    return a->sector + a->count == b->sector &&
+           a->addr + a->count * 512 == b->addr &&
+           a->write == b->write && total + b->count <= max;
+}
+
+void ata_queue_init(ata_queue_t *q, ata_req_t *reqs, int nreqs,
+                    size_t max_count) {
+    int i;
+
+    TAILQ_INIT(&q->pending);
+    TAILQ_INIT(&q->free);
+    q->active = NULL;
+    q->head = 0;
+    q->max_count = max_count;
+    q->seq = 0;
+    q->requests = q->transfers = 0;
+
+    for(i = 0; i < nreqs; ++i)
+        TAILQ_INSERT_TAIL(&q->free, &reqs[i], link);
+}
+
+ata_req_t *ata_queue_alloc(ata_queue_t *q) {
+    ata_req_t *r = TAILQ_FIRST(&q->free);
+
+    if(r)
+        TAILQ_REMOVE(&q->free, r, link);
+
+    return r;
+}
+
+void ata_queue_add(ata_queue_t *q, ata_req_t *r) {
+    ata_req_t *i;
+
+    r->seq = q->seq++;
+    r->next = NULL;
+    ++q->requests;
+
+    /* Keep requests for the same sector in the order they were made. */
+    TAILQ_FOREACH(i, &q->pending, link) {
+        if(i->sector > r->sector) {
+            TAILQ_INSERT_BEFORE(i, r, link);
+            return;
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&q->pending, r, link);
+}
+
+ata_req_t *ata_queue_start(ata_queue_t *q, size_t *count) {
+    ata_req_t *r, *first = NULL, *last, *i;
+    size_t total;
+
+    /* Look for the first request past the head that can go, then wrap. */
+    TAILQ_FOREACH(r, &q->pending, link) {
+        if(r->sector >= q->head && ready(q, r)) {
+            first = r;
+            break;
+        }
+    }
+
+    if(!first) {
+        TAILQ_FOREACH(r, &q->pending, link) {
+            if(ready(q, r)) {
+                first = r;
+                break;
+            }
+        }
+    }
+
+    if(!first)
+        return NULL;
+
+    /* Merge in what comes after it, then what comes before it. Requests
+       that are in the way (at the same sector, but in a different place in
+       memory, say) are stepped over. A long request can end right where
+       this one starts from a long way back, so all of those are looked at. */
+    total = first->count;
+    last = first;
+
+    for(i = TAILQ_NEXT(first, link); i; i = TAILQ_NEXT(i, link)) {
+        if(i->sector > last->sector + last->count)
+            break;
+
+        if(joins(last, i, total, q->max_count) && ready(q, i)) {
+            last->next = i;
+            last = i;
+            total += i->count;
+        }
+    }
+
+    for(i = TAILQ_PREV(first, ata_req_list, link); i;
+        i = TAILQ_PREV(i, ata_req_list, link)) {
+        if(joins(i, first, total, q->max_count) && ready(q, i)) {
+            i->next = first;
+            first = i;
+            total += i->count;
+        }
+    }
+
+    for(r = first; r; r = r->next)
+        TAILQ_REMOVE(&q->pending, r, link);
+
+    q->active = first;
+    q->head = last->sector + last->count;
+    ++q->transfers;
+    *count = total;
+
+    return first;
+}
+
+ata_req_t *ata_queue_finish(ata_queue_t *q) {
+    ata_req_t *r = q->active;
+
+    q->active = NULL;
+    return r;
+}
+
+void ata_queue_release(ata_queue_t *q, ata_req_t *r) {
+    TAILQ_INSERT_HEAD(&q->free, r, link);
+}
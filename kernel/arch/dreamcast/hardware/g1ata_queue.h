@@ -0,0 +1,76 @@
+/* KallistiOS ##version##
+
+   hardware/g1ata_queue.h
+
+*/
+
+#ifndef __G1ATA_QUEUE_H
+#define __G1ATA_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+#include <kos/blockdev.h>
+
+/* The request queue for DMA transfers to and from the ATA device. None of
+   this touches the hardware: g1ata.c asks the queue for the next transfer to
+   do and tells it when that transfer is done, and calls the callbacks. It
+   doesn't do any locking of its own either; g1ata.c only uses it with IRQs
+   disabled or from inside the DMA IRQ handler. */
+
+typedef struct ata_req {
+    TAILQ_ENTRY(ata_req) link;      /* In the pending or the free list */
+    struct ata_req *next;           /* Next request in the same transfer */
+    uint64_t sector;
+    size_t count;
+    uintptr_t addr;                 /* Physical address of the buffer */
+    int write;
+    uint32_t seq;                   /* Order the requests were made in */
+    kos_blockdev_cb_t cb;
+    void *data;
+} ata_req_t;
+
+TAILQ_HEAD(ata_req_list, ata_req);
+
+typedef struct ata_queue {
+    struct ata_req_list pending;    /* Sorted by sector */
+    struct ata_req_list free;
+    ata_req_t *active;              /* The transfer going on, if any */
+    uint64_t head;                  /* The sector after the last transfer */
+    size_t max_count;               /* Most sectors in one transfer */
+    uint32_t seq;
+
+    uint32_t requests;              /* Requests added */
+    uint32_t transfers;             /* Transfers started */
+} ata_queue_t;
+
+/* Set up a queue with the given array of requests to hand out. */
+void ata_queue_init(ata_queue_t *q, ata_req_t *reqs, int nreqs,
+                    size_t max_count);
+
+/* Get a free request to fill in and add, or NULL if they're all in use. */
+ata_req_t *ata_queue_alloc(ata_queue_t *q);
+
+/* Add a filled in request to the queue. */
+void ata_queue_add(ata_queue_t *q, ata_req_t *r);
+
+/* Is there anything waiting to be started? */
+static inline int ata_queue_pending(const ata_queue_t *q) {
+    return !TAILQ_EMPTY(&q->pending);
+}
+
+/* Pick the next transfer to do, and take it out of the queue. Requests next
+   to it on the disk and in memory, going the same way, are merged into it
+   and chained on with their next pointers. The first request is returned,
+   with the total number of sectors in *count, or NULL if nothing is
+   pending. Only one transfer may be going at a time. */
+ata_req_t *ata_queue_start(ata_queue_t *q, size_t *count);
+
+/* Finish the transfer going on, and return its first request. */
+ata_req_t *ata_queue_finish(ata_queue_t *q);
+
+/* Give a finished request back to the queue to be used again. */
+void ata_queue_release(ata_queue_t *q, ata_req_t *r);
+
+#endif /* __G1ATA_QUEUE_H */
@@ -472,12 +472,18 @@ static int w5500_hw_init(void) {
     return 0;
 }
 
-/* Transmission */
-static int w5500_tx(const uint8_t *pkt, int len, int blocking) {
+/* Transmission. The packet can be in several pieces, which are written one
+   after another into the socket's TX buffer before a single send command. */
+static int w5500_txv(const struct iovec *iov, int iovcnt, int blocking) {
     uint16_t fsr, wr_ptr;
+    size_t len = 0;
+    int i;
 
     (void)blocking;
 
+    for(i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
     /* Check PHY Link */
     if(w5500_wait_link(false) != 0) {
         return -1;
@@ -492,10 +498,14 @@ static int w5500_tx(const uint8_t *pkt, int len, int blocking) {
 
     /* Write Data */
     wr_ptr = w5500_read_reg16(W5500_S0_REG_BLOCK, Sn_TX_WR);
-    w5500_write_buf(W5500_S0_TX_BLOCK, wr_ptr, (uint8_t *)pkt, len);
+
+    for(i = 0; i < iovcnt; i++) {
+        w5500_write_buf(W5500_S0_TX_BLOCK, wr_ptr, (uint8_t *)iov[i].iov_base,
+                        iov[i].iov_len);
+        wr_ptr += iov[i].iov_len;
+    }
 
     /* Update Write Pointer */
-    wr_ptr += len;
     w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_TX_WR, wr_ptr);
 
     /* Issue Send Command */
@@ -506,6 +516,12 @@ static int w5500_tx(const uint8_t *pkt, int len, int blocking) {
     return 0;
 }
 
+static int w5500_tx(const uint8_t *pkt, int len, int blocking) {
+    struct iovec iov = { (void *)pkt, len };
+
+    return w5500_txv(&iov, 1, blocking);
+}
+
 static int w5500_rx_poll(netif_t *self) {
     uint16_t rsr, rd_ptr, data_len;
     uint8_t head[2];
@@ -682,6 +698,17 @@ static int w5500_if_tx(netif_t *self, const uint8_t *data, int len, int blocking
     return NETIF_TX_OK;
 }
 
+static int w5500_if_tx_sg(netif_t *self, const struct iovec *iov, int iovcnt,
+                          int blocking) {
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    if(w5500_txv(iov, iovcnt, blocking) < 0)
+        return NETIF_TX_ERROR;
+
+    return NETIF_TX_OK;
+}
+
 static void w5500_update_mac_filter(netif_t *self) {
     uint8_t mode;
 
@@ -798,6 +825,7 @@ int w5500_adapter_init(const uint8_t *mac_addr, bool use_thread) {
     w5500_if.if_start = w5500_if_start;
     w5500_if.if_stop = w5500_if_stop;
     w5500_if.if_tx = w5500_if_tx;
+    w5500_if.if_tx_sg = w5500_if_tx_sg;
     w5500_if.if_tx_commit = NULL; // Auto commit
     w5500_if.if_rx_poll = w5500_rx_poll;
     w5500_if.if_set_flags = w5500_if_set_flags;
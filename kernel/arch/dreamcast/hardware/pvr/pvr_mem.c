@@ -9,35 +9,25 @@
 #include <dc/pvr.h>
 #include <stdio.h>
 
-#include <malloc.h> /* For the struct mallinfo defs */
-
 #include <kos/opts.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
+#include <kos/slab.h>
 
 #include <arch/stack.h>
 
+#include "pvr_mem_core.h"
+
 /*
 
 This module basically serves as a KOS-friendly front end and support routines
-for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
-
-I was originally going to make a totally separate thing that could be used
-to generically manage any memory pool, but then I realized what a gruelling
-and thankless task that would be when starting with dlmalloc, so we have this
-instead. ^_^;
+for the pvr_mem_core module, which hands out blocks of the PVR memory pool and
+keeps track of them in main RAM, and knows nothing about the PVR itself. The
+core doesn't lock anything, so every entry point here holds pvr_mem_mutex
+while it uses it.
 
 */
 
-/* Bring in some prototypes from pvr_mem_core.c */
-/* We can't directly include its header because of name clashes with
-   the real malloc header */
-extern void * pvr_int_malloc(size_t bytes);
-extern void pvr_int_free(void *ptr);
-extern struct mallinfo pvr_int_mallinfo(void);
-extern void pvr_int_mem_reset(void);
-extern void pvr_int_malloc_stats(void);
-
 
 #include <kos/thread.h>
 #include <arch/arch.h>
@@ -52,33 +42,30 @@ typedef struct memctl {
 } memctl_t;
 
 static LIST_HEAD(memctl_list, memctl) block_list;
+static slab_cache_t *memctl_slab;
 
 
-/* PVR RAM base; NULL is considered invalid */
+/* PVR RAM base and size; NULL is considered invalid */
 static pvr_ptr_t pvr_mem_base = NULL;
-static pvr_ptr_t pvr_mem_sbrk = NULL;
-#define CHECK_MEM_SBRK \
-    assert_msg(pvr_mem_sbrk != NULL, \
+static size_t pvr_mem_size;
+static int pvr_mem_ready;
+#define CHECK_MEM_READY \
+    assert_msg(pvr_mem_ready, \
                "pvr_mem_* used, but PVR hasn't been initialized yet")
 
-/* Used in pvr_mem_core.c */
-void *pvr_int_sbrk(size_t amt) {
-    uint32_t old, n;
-
-    /* Are we valid? */
-    CHECK_MEM_SBRK;
+/* Because spin locks can cause priority inversion, we use a mutex here. It
+   can be taken from inside an IRQ, as long as nobody else has it. */
+static mutex_t pvr_mem_mutex = MUTEX_INITIALIZER;
 
-    /* Try to increment it */
-    old = (uint32_t)pvr_mem_sbrk;
-    n = old + amt;
+static inline void pvr_mem_lock(void) {
+    int rv = mutex_lock_irqsafe(&pvr_mem_mutex);
 
-    /* Did we run over? */
-    if(n > PVR_RAM_INT_TOP)
-        return (void *) - 1;
+    assert(rv == 0);
+    (void)rv;
+}
 
-    /* Nope, everything's cool */
-    pvr_mem_sbrk = (pvr_ptr_t)n;
-    return (pvr_ptr_t)old;
+static inline void pvr_mem_unlock(void) {
+    mutex_unlock(&pvr_mem_mutex);
 }
 
 /* Allocate a chunk of memory from texture space; the returned value
@@ -86,18 +73,25 @@ void *pvr_int_sbrk(size_t amt) {
 pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
     uint32_t rv32;
     memctl_t    *ctl;
+    pvr_mem_block_t *blk;
+
+    CHECK_MEM_READY;
 
-    CHECK_MEM_SBRK;
+    pvr_mem_lock();
 
-    rv32 = (uint32_t)pvr_int_malloc(size);
-    assert_msg((rv32 & 0x1f) == 0,
-               "dlmalloc's alignment is broken; "
-               "please make a bug report");
+    if(!(blk = pvr_mem_core_alloc(size, 0))) {
+        pvr_mem_unlock();
+        return NULL;
+    }
+
+    rv32 = blk->addr;
 
     if(__is_defined(PVR_KM_DBG)) {
-        ctl = malloc(sizeof(memctl_t));
-        if(!ctl)
+        ctl = memctl_slab ? (memctl_t *)slab_alloc(memctl_slab) : NULL;
+        if(!ctl) {
+            pvr_mem_unlock();
             return (pvr_ptr_t)rv32;
+        }
 
         ctl->size = size;
         ctl->thread = thd_current->tid;
@@ -111,6 +105,8 @@ pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
                ctl->thread, ctl->addr, ctl->size, rv32);
     }
 
+    pvr_mem_unlock();
+
     return (pvr_ptr_t)rv32;
 }
 
@@ -118,25 +114,31 @@ pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
 void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
     uint32_t    ra;
     memctl_t    *ctl, *tmp;
+    pvr_mem_block_t *blk;
     int     found;
 
     if(__is_defined(PVR_KM_DBG))
         ra = arch_get_ret_addr();
 
-    CHECK_MEM_SBRK;
+    CHECK_MEM_READY;
+
+    if(chunk == NULL)
+        return;
 
     if(__is_defined(PVR_KM_DBG_VERBOSE)) {
         printf("Thread %d/%08lx freeing block @ %08lx\n",
                thd_current->tid, ra, (uint32_t)chunk);
     }
 
+    pvr_mem_lock();
+
     if(__is_defined(PVR_KM_DBG)) {
         found = 0;
 
         LIST_FOREACH_SAFE(ctl, &block_list, list, tmp) {
             if(ctl->block == chunk) {
                 LIST_REMOVE(ctl, list);
-                free(ctl);
+                slab_free(memctl_slab, ctl);
                 found = 1;
                 break;
             }
@@ -150,16 +152,105 @@ void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
         }
     }
 
-    pvr_int_free((void *)chunk);
+    if(!(blk = pvr_mem_core_find((uint32_t)chunk))) {
+        pvr_mem_unlock();
+        dbglog(DBG_ERROR, "pvr_mem_free: %08lx isn't an allocated block\n",
+               (uint32_t)chunk);
+        return;
+    }
+
+    pvr_mem_core_free(blk);
+    pvr_mem_unlock();
 }
 
-/* Check the memory block list to see what's allocated */
-void __weak_symbol pvr_mem_print_list(void) {
-    memctl_t    *ctl;
+pvr_mem_handle_t __weak_symbol pvr_mem_handle_alloc(size_t size) {
+    pvr_mem_block_t *blk;
 
-    if(!__is_defined(PVR_KM_DBG))
+    CHECK_MEM_READY;
+
+    pvr_mem_lock();
+    blk = pvr_mem_core_alloc(size, 1);
+    pvr_mem_unlock();
+
+    if(__is_defined(PVR_KM_DBG_VERBOSE) && blk) {
+        printf("Thread %d/%08lx allocated %lu movable bytes at %08lx, "
+               "handle %p\n", thd_current->tid, arch_get_ret_addr(),
+               (unsigned long)size, blk->addr, (void *)blk);
+    }
+
+    return blk;
+}
+
+pvr_ptr_t __weak_symbol pvr_mem_handle_ptr(pvr_mem_handle_t handle) {
+    pvr_ptr_t rv;
+
+    CHECK_MEM_READY;
+
+    if(handle == NULL)
+        return NULL;
+
+    /* Don't catch it halfway through being moved. */
+    pvr_mem_lock();
+    rv = (pvr_ptr_t)handle->addr;
+    pvr_mem_unlock();
+
+    return rv;
+}
+
+void __weak_symbol pvr_mem_handle_free(pvr_mem_handle_t handle) {
+    CHECK_MEM_READY;
+
+    if(handle == NULL)
         return;
 
+    if(__is_defined(PVR_KM_DBG_VERBOSE)) {
+        printf("Thread %d/%08lx freeing handle %p\n",
+               thd_current->tid, arch_get_ret_addr(), (void *)handle);
+    }
+
+    pvr_mem_lock();
+    pvr_mem_core_free(handle);
+    pvr_mem_unlock();
+}
+
+/* Copy a block down to where pvr_mem_core_compact() is moving it. The two
+   can overlap, but the destination is always lower, so going forwards a
+   word at a time is safe (and VRAM can't be written a byte at a time). */
+static void pvr_mem_move(uint32_t dst, uint32_t src, size_t size) {
+    uint32_t *d = (uint32_t *)dst;
+    const uint32_t *s = (const uint32_t *)src;
+
+    for(size /= 4; size; size--)
+        *d++ = *s++;
+}
+
+size_t __weak_symbol pvr_mem_compact(void) {
+    size_t moved;
+
+    CHECK_MEM_READY;
+
+    /* Nothing else can be allocated or freed until every block has got to
+       where the core has moved it. */
+    pvr_mem_lock();
+    moved = pvr_mem_core_compact(pvr_mem_move);
+    pvr_mem_unlock();
+
+    if(__is_defined(PVR_KM_DBG_VERBOSE))
+        printf("pvr_mem_compact: moved %lu bytes\n", (unsigned long)moved);
+
+    return moved;
+}
+
+void __weak_symbol pvr_mem_get_info(pvr_mem_info_t *info) {
+    pvr_mem_lock();
+    pvr_mem_core_get_info(info);
+    pvr_mem_unlock();
+}
+
+/* Print the memory block list, with the lock held. */
+static void pvr_mem_print_list_locked(void) {
+    memctl_t    *ctl;
+
     printf("pvr_mem_print_list block list:\n");
     LIST_FOREACH(ctl, &block_list, list) {
         printf("  unfreed block at %08lx size %lu, "
@@ -170,43 +261,94 @@ void __weak_symbol pvr_mem_print_list(void) {
     printf("pvr_mem_print_list end block list\n");
 }
 
-/* Return the number of bytes available still in the memory pool */
-static size_t pvr_mem_available_int(void) {
-    struct mallinfo mi = pvr_int_mallinfo();
+/* Check the memory block list to see what's allocated */
+void __weak_symbol pvr_mem_print_list(void) {
+    if(!__is_defined(PVR_KM_DBG))
+        return;
 
-    /* This magic formula is modeled after mstats() */
-    return mi.arena - mi.uordblks;
+    pvr_mem_lock();
+    pvr_mem_print_list_locked();
+    pvr_mem_unlock();
 }
 
+/* Return the number of bytes available still in the memory pool */
 size_t __weak_symbol pvr_mem_available(void) {
-    if(!pvr_mem_sbrk)
+    pvr_mem_info_t info;
+
+    if(!pvr_mem_ready)
         return 0;
 
-    return pvr_mem_available_int() + 
-        (PVR_RAM_INT_TOP - (size_t)pvr_mem_sbrk);
+    pvr_mem_lock();
+    pvr_mem_core_get_info(&info);
+    pvr_mem_unlock();
+
+    return info.total - info.used;
 }
 
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
-void __weak_symbol pvr_mem_reset(void) {    
+void __weak_symbol pvr_mem_reset(void) {
+    memctl_t *ctl;
+
+    pvr_mem_lock();
+
+    if(__is_defined(PVR_KM_DBG)) {
+        while((ctl = LIST_FIRST(&block_list))) {
+            LIST_REMOVE(ctl, list);
+            slab_free(memctl_slab, ctl);
+        }
+    }
+
     if (pvr_mem_base != NULL) {
-        pvr_mem_sbrk = pvr_mem_base;
-        pvr_int_mem_reset();
+        pvr_mem_ready = !pvr_mem_core_init((uint32_t)pvr_mem_base,
+                                           pvr_mem_size);
+        assert_msg(pvr_mem_ready, "no memory to set up the PVR memory pool");
     } else {
-        pvr_mem_sbrk = NULL;
+        pvr_mem_core_shutdown();
+        pvr_mem_ready = 0;
     }
+
+    pvr_mem_unlock();
 }
 
 void __weak_symbol pvr_mem_initialize(pvr_ptr_t pvr_texture_base, size_t available_memory) {
-    (void)available_memory;
+    pvr_mem_lock();
+
     pvr_mem_base = pvr_texture_base;
+    pvr_mem_size = available_memory;
+
+    if(__is_defined(PVR_KM_DBG) && !memctl_slab)
+        memctl_slab = slab_cache_create_type("pvr_memctl", memctl_t, NULL,
+                                             NULL, 0);
+
+    pvr_mem_unlock();
 }
 
 /* Print some statistics (like mallocstats) */
 void __weak_symbol pvr_mem_stats(void) {
+    pvr_mem_info_t info;
+
+    pvr_mem_lock();
+    pvr_mem_core_get_info(&info);
+
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32_t)pvr_mem_sbrk);
-    pvr_mem_print_list();
+    printf("pool:   %8lu bytes at %08lx\n", (unsigned long)info.total,
+           (uint32_t)pvr_mem_base);
+    printf("in use: %8lu bytes in %lu blocks (%lu movable), at most %lu\n",
+           (unsigned long)info.used, (unsigned long)info.blocks,
+           (unsigned long)info.movable, (unsigned long)info.peak);
+    printf("free:   %8lu bytes in %lu pieces, biggest %lu, %u%% fragmented\n",
+           (unsigned long)(info.total - info.used),
+           (unsigned long)info.free_blocks, (unsigned long)info.largest_free,
+           info.fragmentation);
+    printf("allocs: %llu, frees: %llu, failed: %llu (%llu from fragmentation)\n",
+           info.allocs, info.frees, info.failures, info.frag_failures);
+    printf("compactions: %llu, %llu bytes moved\n", info.compactions,
+           info.moved);
+
+    if(__is_defined(PVR_KM_DBG))
+        pvr_mem_print_list_locked();
+
+    pvr_mem_unlock();
 }
@@ -7,12 +7,14 @@
  */
 
 #include <assert.h>
+#include <stdalign.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
 #include <kos/dbglog.h>
 #include <kos/regfield.h>
 #include <string.h>
 #include "pvr_internal.h"
+#include "pvr_twiddle.h"
 
 /*
 
@@ -42,123 +44,106 @@ size_t pvr_txr_get_stride(void) {
     return FIELD_GET(reg, PVR_TXR_STRIDE_MULT) * 32;
 }
 
+/* Copy count bytes of 16-bit texels to PVR RAM. The store queues can only be
+   used for whole 32-byte blocks going to a 32-byte aligned address, so the
+   tail, or the whole lot if dst isn't aligned, is written 16 bits at a time
+   (which is also the narrowest write that VRAM takes). */
+static void txr_copy(uint16_t *dst, const uint16_t *src, size_t count) {
+    size_t i = 0;
+
+    assert_msg(!((uintptr_t)dst & 1) && !((uintptr_t)src & 1),
+               "Texture data must be at least 16-bit aligned");
+
+    if(!((uintptr_t)dst & 31) && !((uintptr_t)src & 3)) {
+        i = count & ~31;
+
+        if(i)
+            pvr_sq_load(dst, src, i, PVR_DMA_VRAM64);
+    }
+
+    for(i /= 2; i < count / 2; ++i)
+        dst[i] = src[i];
+}
+
 /* Load raw texture data from an SH-4 buffer into PVR RAM */
 void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count) {
     count = __align_up(count, 4);
-    pvr_sq_load((uint32_t *)dst, (const uint32_t *)src, count, PVR_DMA_VRAM64);
+    txr_copy((uint16_t *)dst, (const uint16_t *)src, count);
 }
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+/* Twiddled output is built this many 32-byte blocks at a time in a buffer that
+   stays in the cache, and then copied out to VRAM with txr_copy(). */
+#define TWIDDLE_STAGE_BLOCKS    32
 
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
+/* Size of the codebook at the start of a VQ texture */
+#define VQ_CODEBOOK_SIZE        2048
 
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
    in the process.
 
-   This is a modified version of Vincent Penne's general twiddling
-   function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
-   The rectangle does not need to be a square (not tested with h>w, but
-   this is just a matter of a rotation by PI/2 and UV swapping).
+   The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted). The rectangle
+   does not need to be a square. See pvr_twiddle.c for how it's done.
 
    - w and h must be a power of 2
    - flags must be a logical OR of the various texture loading
      flags available:
-       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
-       PVR_TXRLOAD_VQ (not supported yet)
-       PVR_TXRLOAD_INVERT
+       PVR_TXRLOAD_4BPP, _8BPP, _16BPP
+       PVR_TXRLOAD_FMT_VQ (codebook followed by untwiddled indices)
+       PVR_TXRLOAD_INVERT_Y
 
 */
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
                      uint32_t flags) {
-    uint32_t x, y, yout, min, mask, bpp, invert;
-
-    /* Make sure we're attempting something we can do */
-    switch(flags & PVR_TXRLOAD_FMT_MASK) {
-        case PVR_TXRLOAD_4BPP:
-            bpp = 4;
-            break;
-        case PVR_TXRLOAD_8BPP:
-            bpp = 8;
-            break;
-        case PVR_TXRLOAD_16BPP:
-            bpp = 16;
-            break;
-        default:
-            assert_msg(0, "Invalid format specifier in `flags'");
-            bpp = 8;
-    }
+    alignas(32) uint16_t stage[TWIDDLE_STAGE_BLOCKS * 16];
+    uint16_t *out = (uint16_t *)dst;
+    pvr_twiddle_t t;
+    uint32_t bpp, invert;
+    size_t pos, n;
 
     assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
     invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
 
-    min = MIN(w, h);
-    mask = min - 1;
-
-    switch(bpp) {
-        case 4: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x += 2) {
-                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
-                         (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
-                }
-            }
-        }
-        break;
-        case 8: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
-                         (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
-                }
-            }
-        }
-        break;
-        case 16: {
-            uint16_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint16_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y++) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT(x & mask, yout & mask) +
-                         (x / min + yout / min)*min * min] = pixels[y * w + x];
-                }
-            }
+    if(flags & PVR_TXRLOAD_FMT_VQ) {
+        /* The codebook goes across as it is. Each index covers 2x2 texels and
+           the indices get twiddled just like an 8bpp texture would. */
+        assert_msg(!invert, "Inverted VQ loading not supported");
+
+        pvr_txr_load(src, dst, VQ_CODEBOOK_SIZE);
+        src = (const uint8_t *)src + VQ_CODEBOOK_SIZE;
+        out += VQ_CODEBOOK_SIZE / 2;
+        w /= 2;
+        h /= 2;
+        bpp = 8;
+    }
+    else {
+        /* Make sure we're attempting something we can do */
+        switch(flags & PVR_TXRLOAD_FMT_MASK) {
+            case PVR_TXRLOAD_4BPP:
+                bpp = 4;
+                break;
+            case PVR_TXRLOAD_8BPP:
+                bpp = 8;
+                break;
+            case PVR_TXRLOAD_16BPP:
+                bpp = 16;
+                break;
+            default:
+                assert_msg(0, "Invalid format specifier in `flags'");
+                bpp = 8;
         }
-        break;
+    }
+
+    pvr_twiddle_init(&t, src, w, h, bpp, invert);
+
+    for(pos = 0; pos < t.words; pos += n) {
+        n = t.words - pos;
+
+        if(n > TWIDDLE_STAGE_BLOCKS * 16)
+            n = TWIDDLE_STAGE_BLOCKS * 16;
+
+        pvr_twiddle(&t, stage, pos, n);
+        txr_copy(out + pos, stage, n * 2);
     }
 }
 
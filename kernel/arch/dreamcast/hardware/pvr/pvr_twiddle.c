@@ -0,0 +1,167 @@
+/* KallistiOS ##version##
+
+   pvr_twiddle.c
+
+ */
+
+#include "pvr_twiddle.h"
+
+/*
+
+   Texture twiddling
+
+   In the PVR's twiddled layout, the bits of the Y coordinate of a texel go in
+   the even bits of its index and the bits of X go in the odd ones. Textures
+   that aren't square are made up of squares of the shorter side, one after the
+   other.
+
+   Each 32-byte block of output is therefore a small tile of the texture (4x4
+   texels at 16bpp, 4x8 at 8bpp and 8x8 at 4bpp), and the blocks themselves are
+   in twiddled order. Rather than working out where every texel goes, we work
+   out which tile each block is and gather it from a handful of source rows.
+
+*/
+
+/* Word n of a block is at (tile_r[n], tile_c[n]) within its 4x4 tile of
+   words, where r is the coordinate in the even bits of the index. */
+static const uint8_t tile_r[16] = {
+    0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3
+};
+static const uint8_t tile_c[16] = {
+    0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 3, 3, 2, 2, 3, 3
+};
+
+/* Gather the even bits of x together, undoing the interleave. */
+static inline uint32_t untwiddle(uint32_t x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+/* Find the source row that ends up as row y of the output. */
+static inline const uint8_t *src_row(const pvr_twiddle_t *t, uint32_t y) {
+    if(t->invert)
+        y = t->bpp == 16 ? t->h - 1 - y : (t->h - 1 - y) ^ 1;
+
+    return t->src + y * (t->w * t->bpp / 8);
+}
+
+/* Find where square part s of the texture starts. */
+static inline void square_origin(const pvr_twiddle_t *t, uint32_t s,
+                                 uint32_t *x, uint32_t *y) {
+    if(t->w >= t->h) {
+        *x = s * t->min;
+        *y = 0;
+    }
+    else {
+        *x = 0;
+        *y = s * t->min;
+    }
+}
+
+static inline uint16_t pack_4bpp(uint8_t p0, uint8_t p1) {
+    return (p0 & 15) | ((p1 & 15) << 4) | ((p0 >> 4) << 8) |
+           ((p1 >> 4) << 12);
+}
+
+/* Work out a single word. Only used for textures too small to have whole
+   blocks in them. */
+static uint16_t twiddle_word(const pvr_twiddle_t *t, size_t i) {
+    uint32_t j = i % t->sq_words, r = untwiddle(j), c = untwiddle(j >> 1);
+    uint32_t x, y;
+    const uint8_t *r0, *r1;
+
+    square_origin(t, i / t->sq_words, &x, &y);
+
+    switch(t->bpp) {
+        case 16:
+            return ((const uint16_t *)src_row(t, y + r))[x + c];
+
+        case 8:
+            r0 = src_row(t, y + 2 * c);
+            r1 = src_row(t, y + 2 * c + 1);
+            return r0[x + r] | (r1[x + r] << 8);
+
+        default:
+            r0 = src_row(t, y + 2 * r);
+            r1 = src_row(t, y + 2 * r + 1);
+            return pack_4bpp(r0[x / 2 + c], r1[x / 2 + c]);
+    }
+}
+
+/* Build one 32-byte block. */
+static void twiddle_block(const pvr_twiddle_t *t, uint16_t *out, size_t blk) {
+    size_t first = blk * 16;
+    uint32_t j = (first % t->sq_words) >> 4;
+    uint32_t r = untwiddle(j) * 4, c = untwiddle(j >> 1) * 4;
+    uint32_t x, y, n;
+    const uint16_t *row16[4];
+    const uint8_t *row[8];
+
+    square_origin(t, first / t->sq_words, &x, &y);
+
+    switch(t->bpp) {
+        case 16:
+            /* r is the row and c the column */
+            for(n = 0; n < 4; ++n)
+                row16[n] = (const uint16_t *)src_row(t, y + r + n) + x + c;
+
+            for(n = 0; n < 16; ++n)
+                out[n] = row16[tile_r[n]][tile_c[n]];
+
+            break;
+
+        case 8:
+            /* r is the column and c the pair of rows */
+            for(n = 0; n < 8; ++n)
+                row[n] = src_row(t, y + 2 * c + n) + x + r;
+
+            for(n = 0; n < 16; ++n)
+                out[n] = row[tile_c[n] * 2][tile_r[n]] |
+                         (row[tile_c[n] * 2 + 1][tile_r[n]] << 8);
+
+            break;
+
+        default:
+            /* r is the pair of rows and c the pair of columns */
+            for(n = 0; n < 8; ++n)
+                row[n] = src_row(t, y + 2 * r + n) + x / 2 + c;
+
+            for(n = 0; n < 16; ++n)
+                out[n] = pack_4bpp(row[tile_r[n] * 2][tile_c[n]],
+                                   row[tile_r[n] * 2 + 1][tile_c[n]]);
+
+            break;
+    }
+}
+
+void pvr_twiddle_init(pvr_twiddle_t *t, const void *src, uint32_t w,
+                      uint32_t h, uint32_t bpp, int invert) {
+    t->src = (const uint8_t *)src;
+    t->w = w;
+    t->h = h;
+    t->bpp = bpp;
+    t->invert = invert;
+    t->min = w < h ? w : h;
+    t->sq_words = (size_t)t->min * t->min * bpp / 16;
+    t->words = (size_t)w * h * bpp / 16;
+}
+
+void pvr_twiddle(const pvr_twiddle_t *t, uint16_t *out, size_t first,
+                 size_t count) {
+    while(count) {
+        if(t->sq_words >= 16 && !(first & 15) && count >= 16) {
+            twiddle_block(t, out, first >> 4);
+            out += 16;
+            first += 16;
+            count -= 16;
+        }
+        else {
+            *out++ = twiddle_word(t, first++);
+            --count;
+        }
+    }
+}
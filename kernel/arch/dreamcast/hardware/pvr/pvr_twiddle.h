@@ -0,0 +1,42 @@
+/* KallistiOS ##version##
+
+   pvr_twiddle.h
+
+   Internal texture twiddling. This is kept apart from the rest of the PVR code
+   (and doesn't depend on any of it) so that it can be built and tested on a PC.
+
+ */
+
+#ifndef __PVR_TWIDDLE_H
+#define __PVR_TWIDDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A texture being twiddled. The output is produced as 16-bit words, since
+   that's the unit the PVR's twiddled layout works in for all of the formats:
+   one 16bpp texel, two 8bpp texels from a pair of rows, or a 2x2 group of
+   4bpp texels. */
+typedef struct pvr_twiddle {
+    const uint8_t *src;         /* Linear source texels */
+    uint32_t w, h;              /* Dimensions in texels */
+    uint32_t bpp;               /* 4, 8 or 16 */
+    int invert;                 /* Flip the Y axis */
+    uint32_t min;               /* Side of each square part, in texels */
+    size_t sq_words;            /* Size of each square part, in words */
+    size_t words;               /* Size of the output, in words */
+} pvr_twiddle_t;
+
+/* Set up to twiddle a w x h texture (both powers of two) with the given bits
+   per texel. With invert set, rows are flipped vertically (for 4bpp and 8bpp
+   the flip works on pairs of rows, as it always has). */
+void pvr_twiddle_init(pvr_twiddle_t *t, const void *src, uint32_t w,
+                      uint32_t h, uint32_t bpp, int invert);
+
+/* Produce count words of twiddled output, starting with word first. Whole
+   32-byte blocks (16 words, starting on a multiple of 16) are built a block at
+   a time. */
+void pvr_twiddle(const pvr_twiddle_t *t, uint16_t *out, size_t first,
+                 size_t count);
+
+#endif /* __PVR_TWIDDLE_H */
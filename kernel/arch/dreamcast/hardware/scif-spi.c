@@ -195,11 +195,25 @@ void scif_spi_write_data(const uint8_t *buffer, size_t len) {
         /* Swap so the MSB-first loop sends the lowest-address byte first. */
         data = __builtin_bswap32(*ptr++);
 
-        for(uint32_t i = 0; i < 32; i++) {
-            bit = data >> 31;
-            SCSPTR2 = tmp | bit;
+        /* Unrolled a byte at a time, as in scif_spi_read_data() below. */
+        for(uint32_t i = 0; i < 4; i++) {
+            SCSPTR2 = tmp | (bit = data >> 31);         /* 7 */
             SCSPTR2 = tmp | bit | PTR2_CTSDT;
-            data <<= 1;
+            SCSPTR2 = tmp | (bit = (data >> 30) & 1);   /* 6 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 29) & 1);   /* 5 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 28) & 1);   /* 4 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 27) & 1);   /* 3 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 26) & 1);   /* 2 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 25) & 1);   /* 1 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            SCSPTR2 = tmp | (bit = (data >> 24) & 1);   /* 0 */
+            SCSPTR2 = tmp | bit | PTR2_CTSDT;
+            data <<= 8;
         }
 
         SCSPTR2 = tmp;
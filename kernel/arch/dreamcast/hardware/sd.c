@@ -43,6 +43,18 @@ static bool initted = false;
 static bool check_crc = true;
 static sd_interface_t current_interface = SD_IF_SCIF;
 
+/* A multi-block read (CMD18) is left running at the end of sd_read_blocks(),
+   with the card still selected, so that a read that carries on from where it
+   stopped can just keep taking blocks off the card instead of stopping the
+   transfer and sending another command. stream_next is the address of the
+   block after the last one read, in the units the card is addressed in, which
+   is the next one the card will send if there is a transfer running. A single
+   block is read on its own with CMD17, unless it follows on from the last
+   read, in which case it starts a transfer too. Anything else that wants the
+   card has to call sd_stop_stream() first. */
+static bool streaming = false;
+static uint32_t stream_next = 0xFFFFFFFF;
+
 /* Unified function pointers for both interfaces */
 static uint8_t (*spi_rw_byte)(uint8_t data) = NULL;
 static void (*spi_set_cs)(bool enabled) = NULL;
@@ -208,8 +220,9 @@ static int sd_send_cmd(uint8_t cmd, uint32_t arg) {
     uint8_t pkt[6];
 
     /* Wait for the SD card to be ready to accept our command. If it never
-       becomes ready, something's wrong... bail out */
-    if(sd_wait_ready())
+       becomes ready, something's wrong... bail out. CMD12 is sent while the
+       card is still sending data, so there's no point waiting for that. */
+    if(cmd != CMD(12) && sd_wait_ready())
         return -1;
 
     /* Pack up the packet */
@@ -245,6 +258,18 @@ static int sd_send_cmd(uint8_t cmd, uint32_t arg) {
     return (int)rv;
 }
 
+/* Stop the multi-block read left open by sd_read_blocks(), if there is one,
+   and deselect the card. */
+static void sd_stop_stream(void) {
+    if(!streaming)
+        return;
+
+    streaming = false;
+    sd_send_cmd(CMD(12), 0);
+    spi_set_cs(false);
+    spi_rw_byte(0xFF);
+}
+
 static int acmd41_loop(uint32_t arg) {
     int i = 0, rv;
 
@@ -302,6 +327,7 @@ static int sd_reinit(void) {
         .check_crc = check_crc
     };
 
+    streaming = false;
     spi_set_cs(false);
     spi_rw_byte(0xFF);
 
@@ -455,6 +481,8 @@ int sd_shutdown(void) {
     if(!initted)
         return -1;
 
+    sd_stop_stream();
+
     /* Select, wait for ready, deselect, and make sure it releases the data
        line. */
     spi_set_cs(true);
@@ -474,7 +502,7 @@ static int read_data(size_t bytes, uint8_t *buf) {
 
     /* This should come back in 100ms at worst... */
     do {
-        byte = spi_rw_byte(0xFF);
+        byte = spi_read_byte();
         ++i;
     } while(byte == 0xFF && i < READ_RETRIES);
 
@@ -513,50 +541,70 @@ int sd_read_blocks(uint32_t block, size_t count, uint8_t *buf) {
     if(byte_mode)
         block <<= 9;
 
+    /* If there's a transfer open from the last read, it's only any use if this
+       read starts where that one finished. */
+    if(streaming && block != stream_next)
+        sd_stop_stream();
+
 read_blocks:
     read_count = count;
     read_buf = buf;
     rv = 0;
-    spi_set_cs(true);
 
-    if(read_count == 1) {
-        /* Ask the card for the block */
-        if(sd_send_cmd(CMD(17), block)) {
-            rv = -1;
-            errno = EIO;
+    if(!streaming) {
+        spi_set_cs(true);
+
+        if(read_count == 1 && block != stream_next) {
+            /* Ask the card for the block */
+            if(sd_send_cmd(CMD(17), block)) {
+                rv = -1;
+                errno = EIO;
+                goto out;
+            }
+
+            /* Read the block back */
+            if(read_data(512, read_buf)) {
+                rv = -1;
+                errno = EIO;
+            }
+            else {
+                stream_next = block + (byte_mode ? 512 : 1);
+            }
+
             goto out;
         }
 
-        /* Read the block back */
-        if(read_data(512, read_buf)) {
+        /* Set up the multi-block read */
+        if(sd_send_cmd(CMD(18), block)) {
             rv = -1;
             errno = EIO;
             goto out;
         }
+
+        streaming = true;
     }
-    else {
-        /* Set up the multi-block read */
-        if(sd_send_cmd(CMD(18), block)) {
+
+    while(read_count--) {
+        if(read_data(512, read_buf)) {
             rv = -1;
             errno = EIO;
             goto out;
         }
 
-        while(read_count--) {
-            if(read_data(512, read_buf)) {
-                rv = -1;
-                errno = EIO;
-                goto out;
-            }
+        read_buf += 512;
+    }
 
-            read_buf += 512;
-        }
+    /* Leave the transfer running, in case the next read follows on. */
+    stream_next = block + (byte_mode ? count << 9 : count);
+    return 0;
 
-        /* Stop the data transfer */
+out:
+    /* Stop the data transfer, if one got started. */
+    if(streaming) {
+        streaming = false;
         sd_send_cmd(CMD(12), 0);
     }
 
-out:
     spi_set_cs(false);
     if(rv && !retried) {
         retried = true;
@@ -573,6 +621,10 @@ static int write_data(uint8_t tag, size_t bytes, const uint8_t *buf) {
     uint8_t rv;
     uint16_t crc;
 
+    /* Work out the CRC first, so that in a multi-block write it gets done
+       while the card is still busy programming the last block. */
+    crc = net_crc16ccitt(buf, bytes, 0);
+
     /* Wait for the card to be ready for our data */
     if(sd_wait_ready())
         return -1;
@@ -580,7 +632,6 @@ static int write_data(uint8_t tag, size_t bytes, const uint8_t *buf) {
     spi_write_byte(tag);
 
     /* Send the data. */
-    crc = net_crc16ccitt(buf, bytes, 0);
     if(spi_write_data(buf, bytes)) {
         return -1;
     }
@@ -612,6 +663,8 @@ int sd_write_blocks(uint32_t block, size_t count, const uint8_t *buf) {
     if(byte_mode)
         block <<= 9;
 
+    sd_stop_stream();
+
 write_blocks:
     write_count = count;
     write_buf = buf;
@@ -700,6 +753,8 @@ uint64_t sd_get_size(void) {
        size. The procedure here is described on pages 96-105 of the SD Physical
        Layer Simplified Specification v3.01. */
 
+    sd_stop_stream();
+
     /* Prepare the CSD send */
     spi_set_cs(true);
     if(sd_send_cmd(CMD(9), 0)) {
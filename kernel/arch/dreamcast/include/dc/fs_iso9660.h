@@ -18,6 +18,20 @@
     The implementation was originally based on a simple ISO9660 implementation
     by Marcus Comstedt.
 
+    Paths that have been looked up are cached along with what they led to
+    (see ISO9660_DCACHE_SIZE in kos/opts.h), so that opening a file again, or
+    opening another file in a directory that has already been seen, doesn't
+    have to go back to the disc. The cache can also be filled with the whole
+    directory tree up front with iso_dcache_preload().
+
+    Files that are going to be read through in order (music, video, big
+    archives) can be given a hint with iso_fadvise(). Those are then read
+    ahead into buffers of their own while the program does other things, so
+    that reading other files at the same time only costs them a restart of
+    the stream once their buffers run dry, rather than on every read. Read
+    ahead for several files is carried out in order of where they are on the
+    disc, to keep seeking down.
+
     \author Megan Potter
     \author Andrew Kieschnick
     \author Bero
@@ -29,13 +43,17 @@
 #include <kos/cdefs.h>
 __BEGIN_DECLS
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <kos/fs.h>
+
 /** \addtogroup gdrom
     @{
 */
 
 /** \brief  Reset the internal ISO9660 cache.
 
-    This function resets the cache of the ISO9660 driver, breaking connections
+    This function resets the caches of the ISO9660 driver, breaking connections
     to all files. This generally assumes that a new disc has been or will be
     inserted.
 
@@ -43,6 +61,107 @@ __BEGIN_DECLS
 */
 int iso_reset(void);
 
+/** \brief  Fill the path lookup cache with the whole disc.
+
+    This function reads every directory on the disc, adding each file and
+    directory found to the path lookup cache until it is full, so that later
+    opens don't have to go looking for them. This is mostly worthwhile for a
+    disc with many files in many directories, along with a bigger
+    ISO9660_DCACHE_SIZE. The cache is emptied again when the disc changes or
+    iso_reset() is called.
+
+    \return                 The number of entries added, or -1 on error with
+                            errno set.
+
+    \par    Error Conditions:
+    \em     ENODEV - no usable disc \n
+    \em     EIO - a directory couldn't be read \n
+    \em     ENOMEM - out of memory
+*/
+int iso_dcache_preload(void);
+
+/** \defgroup iso_fadv     Read hints
+    \brief                  Advice for iso_fadvise()
+
+    These have the same values and meanings as the POSIX_FADV_* ones for
+    posix_fadvise().
+
+    @{
+*/
+#define ISO_FADV_NORMAL         0   /**< \brief No particular pattern (default) */
+#define ISO_FADV_RANDOM         1   /**< \brief Reads jump around; don't stream */
+#define ISO_FADV_SEQUENTIAL     2   /**< \brief Reads go through in order; read ahead */
+#define ISO_FADV_WILLNEED       3   /**< \brief Start reading ahead at offset now */
+#define ISO_FADV_DONTNEED       4   /**< \brief Drop anything read ahead */
+#define ISO_FADV_NOREUSE        5   /**< \brief Treated like ISO_FADV_SEQUENTIAL */
+/** @} */
+
+/** \brief  Arguments for IOCTL_ISO9660_FADVISE. */
+typedef struct iso_fadvise {
+    off_t offset;               /**< \brief Start of the range */
+    off_t len;                  /**< \brief Length of the range (0 for to the end) */
+    int advice;                 /**< \brief One of the \ref iso_fadv */
+} iso_fadvise_t;
+
+/* \cond */
+#define IOCTL_ISO9660_FADVISE   0x49534f41 /* "ISOA" */
+/* \endcond */
+
+/** \brief  Tell the driver how a file is going to be read.
+
+    With ISO_FADV_SEQUENTIAL (or ISO_FADV_WILLNEED, which also starts reading
+    at offset straight away), the file gets two staging buffers of
+    ISO9660_READAHEAD sectors each (see kos/opts.h). One is filled by DMA in
+    the background while reads are served from the other. Reads are then
+    copied out of those buffers, so a file read like this can't be read
+    straight into SPU or PVR RAM by DMA. ISO_FADV_NORMAL and ISO_FADV_RANDOM
+    free the buffers again, and ISO_FADV_RANDOM also stops reads of the file
+    from starting a stream at all.
+
+    \param  fd              A file on /cd, opened for reading.
+    \param  offset          Where the reads will start.
+    \param  len             How much will be read, or 0 for all of the rest.
+    \param  advice          One of the \ref iso_fadv.
+
+    \retval 0               On success.
+    \retval -1              On error, with errno set.
+
+    \par    Error Conditions:
+    \em     EBADF - fd isn't an open file on /cd \n
+    \em     EINVAL - advice or the range is invalid \n
+    \em     ENOMEM - the buffers couldn't be allocated
+*/
+static inline int iso_fadvise(file_t fd, off_t offset, off_t len, int advice) {
+    iso_fadvise_t adv = { offset, len, advice };
+
+    return fs_ioctl(fd, IOCTL_ISO9660_FADVISE, &adv);
+}
+
+/** \brief  Disc access counters.
+
+    These count since the driver started, or since the last call to
+    iso_reset_stats().
+*/
+typedef struct iso_stats {
+    uint32_t seeks;             /**< \brief Reads that didn't start where the
+                                             last one ended */
+    uint32_t stream_starts;     /**< \brief Streams started */
+    uint32_t stream_restarts;   /**< \brief Streams started for a file that
+                                             had been streamed before */
+    uint32_t ra_fills;          /**< \brief Read-ahead buffers filled */
+    uint64_t ra_bytes;          /**< \brief Bytes served from read-ahead that
+                                             was already under way */
+} iso_stats_t;
+
+/** \brief  Get the disc access counters.
+
+    \param  stats           Where to store the counters.
+*/
+void iso_get_stats(iso_stats_t *stats);
+
+/** \brief  Set all of the disc access counters back to zero. */
+void iso_reset_stats(void);
+
 /* \cond */
 void fs_iso9660_init(void);
 void fs_iso9660_shutdown(void);
@@ -417,6 +417,68 @@ int g1_ata_write_lba(uint64_t sector, size_t count, const void *buf);
 int g1_ata_write_lba_dma(uint64_t sector, size_t count, const void *buf,
                          int block);
 
+/** \brief   Queue a DMA read of disk sectors, without waiting for it.
+    \ingroup g1ata
+
+    This function adds a read to the queue of DMA transfers to and from the
+    slave device, and returns straight away. Transfers in the queue are done
+    in order of where they are on the disk, sweeping across it in one
+    direction, rather than in the order they were queued, and requests for
+    sectors next to each other that go into memory next to each other are
+    merged into one transfer. A request is never done before one queued
+    earlier that overlaps it, if either of them is a write.
+
+    The callback is called when the read is done, from inside the DMA
+    interrupt handler, so it must not block. It may queue more transfers.
+
+    \param  sector          The sector to start reading from.
+    \param  count           The number of disk sectors to read.
+    \param  buf             Storage for the read-in disk sectors, as for
+                            g1_ata_read_lba_dma(). It must not be touched until
+                            the callback has been called.
+    \param  cb              The function to call when the read is done, with
+                            0 or an errno value.
+    \param  data            Passed on to cb.
+    \return                 0 if the read was queued. < 0 on failure, setting
+                            errno as appropriate, in which case cb is never
+                            called.
+
+    \par    Error Conditions:
+    \em     EAGAIN - called from an interrupt with the queue full, or with it
+                     stopped \n
+    \em     EFAULT - buf is NULL or not 32-byte aligned \n
+    \em     ENXIO - ATA support not initialized or no device attached \n
+    \em     EOVERFLOW - one or more of the requested sectors is out of the
+                        range of the disk \n
+    \em     ENOTSUP - LBA mode not supported by the device \n
+    \em     EPERM - device does not support DMA
+*/
+int g1_ata_queue_read(uint64_t sector, size_t count, void *buf,
+                      kos_blockdev_cb_t cb, void *data);
+
+/** \brief   Queue a DMA write of disk sectors, without waiting for it.
+    \ingroup g1ata
+
+    This is the same as g1_ata_queue_read(), but for writes.
+
+    \param  sector          The sector to start writing to.
+    \param  count           The number of disk sectors to write.
+    \param  buf             The data to write to the disk, as for
+                            g1_ata_write_lba_dma(). It must not be changed
+                            until the callback has been called.
+    \param  cb              The function to call when the write is done, with
+                            0 or an errno value.
+    \param  data            Passed on to cb.
+    \return                 0 if the write was queued. < 0 on failure, setting
+                            errno as appropriate, in which case cb is never
+                            called.
+
+    \par    Error Conditions:
+    \em     As for g1_ata_queue_read().
+*/
+int g1_ata_queue_write(uint64_t sector, size_t count, const void *buf,
+                       kos_blockdev_cb_t cb, void *data);
+
 /** \brief   Flush the write cache on the attached disk.
     \ingroup g1ata
 
@@ -453,7 +515,9 @@ int g1_ata_lba_mode(void);
 
     \param  partition       The partition number (0-3) to use.
     \param  dma             Set to 1 to use DMA for reads/writes on the device,
-                            if available.
+                            if available. Reads and writes then go through the
+                            queue (see g1_ata_queue_read()), and the block
+                            device's submit function can be used as well.
     \param  rv              Used to return the block device. Must be non-NULL.
     \param  partition_type  Used to return the partition type. Must be non-NULL.
     \retval 0               On success.
@@ -480,7 +544,8 @@ int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
     This function creates a block device descriptor for the attached ATA device.
 
     \param  dma             Set to 1 to use DMA for reads/writes on the device,
-                            if available.
+                            if available, as for
+                            g1_ata_blockdev_for_partition().
     \param  rv              Used to return the block device. Must be non-NULL.
     \retval 0               On success.
     \retval -1              On error, errno will be set as appropriate.
@@ -24,6 +24,7 @@
 #ifndef __DC_PVR_PVR_MEM_H
 #define __DC_PVR_PVR_MEM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <kos/cdefs.h>
@@ -48,10 +49,59 @@ typedef void *pvr_ptr_t;
     \brief                   Memory management API for VRAM
     \ingroup                 pvr_vram
 
-    PVR memory management in KOS uses a modified dlmalloc; see the
-    source file pvr_mem_core.c for more info.
+    VRAM is handed out in blocks of 32-byte units, from free lists kept by
+    power-of-two size, with everything the allocator needs to know about each
+    block kept in main RAM rather than in VRAM; see the source file
+    pvr_mem_core.c for more info.
+
+    Blocks from pvr_mem_malloc() stay where they are until they're freed.
+    When textures are streamed in and out over a long time, the free memory
+    between them can end up in pieces too small for big textures even though
+    there's plenty of it in all. Textures that can be moved should be
+    allocated with pvr_mem_handle_alloc() instead: their address is got from
+    the handle with pvr_mem_handle_ptr() whenever it's needed, and
+    pvr_mem_compact() can then move them together to put the free memory back
+    in one piece. pvr_mem_get_info() tells how much memory is in use and how
+    broken up the rest is.
 */
 
+/** \brief   Handle to a block of VRAM that can be moved.
+    \ingroup pvr_mem_mgmt
+
+    This is an opaque type, returned by pvr_mem_handle_alloc().
+*/
+typedef struct pvr_mem_block *pvr_mem_handle_t;
+
+/** \brief   Counts about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \headerfile dc/pvr/pvr_mem.h
+*/
+typedef struct pvr_mem_info {
+    size_t total;               /**< \brief Bytes in the pool */
+    size_t used;                /**< \brief Bytes allocated now */
+    size_t peak;                /**< \brief Most bytes ever allocated at once */
+    size_t movable;             /**< \brief Bytes allocated through handles */
+    size_t blocks;              /**< \brief Blocks allocated now */
+    size_t free_blocks;         /**< \brief Pieces the free memory is in */
+    size_t largest_free;        /**< \brief Size of the biggest free piece */
+
+    /** \brief  How broken up the free memory is, as the percentage of it
+                that's outside of the biggest free piece. */
+    unsigned int fragmentation;
+
+    uint64_t allocs;            /**< \brief Allocations that worked */
+    uint64_t frees;             /**< \brief Blocks freed */
+    uint64_t failures;          /**< \brief Allocations that failed */
+
+    /** \brief  Failed allocations that there was enough free memory for, if
+                it had been in one piece. */
+    uint64_t frag_failures;
+
+    uint64_t compactions;       /**< \brief Calls to pvr_mem_compact() */
+    uint64_t moved;             /**< \brief Bytes moved by pvr_mem_compact() */
+} pvr_mem_info_t;
+
 /** \brief   Allocate a chunk of memory from texture space.
     \ingroup pvr_mem_mgmt
 
@@ -75,6 +125,65 @@ pvr_ptr_t pvr_mem_malloc(size_t size);
 */
 void pvr_mem_free(pvr_ptr_t chunk);
 
+/** \brief   Allocate a block of texture memory that can be moved.
+    \ingroup pvr_mem_mgmt
+
+    This allocates from the same pool as pvr_mem_malloc(), but the block may
+    be moved by pvr_mem_compact(), so its address has to be got again with
+    pvr_mem_handle_ptr() after that (and anything that holds on to it, like
+    a compiled polygon header, has to be made again). All allocations will be
+    aligned to a 32-byte boundary.
+
+    \param  size            The amount of memory to allocate
+
+    \return                 A handle to the block on success, NULL on error
+*/
+pvr_mem_handle_t pvr_mem_handle_alloc(size_t size);
+
+/** \brief   Get the address of a block allocated with a handle.
+    \ingroup pvr_mem_mgmt
+
+    \param  handle          The handle to the block
+
+    \return                 Where the block is now, or NULL if handle is
+                            NULL
+*/
+pvr_ptr_t pvr_mem_handle_ptr(pvr_mem_handle_t handle);
+
+/** \brief   Free a block allocated with a handle.
+    \ingroup pvr_mem_mgmt
+
+    \param  handle          The handle to the block, or NULL to do nothing
+*/
+void pvr_mem_handle_free(pvr_mem_handle_t handle);
+
+/** \brief   Move blocks allocated with handles to put free memory together.
+    \ingroup pvr_mem_mgmt
+
+    Blocks allocated through handles are moved down into the free memory
+    below them, so that all of the free memory between each pair of blocks
+    from pvr_mem_malloc() ends up in one piece. Their contents are copied
+    with the CPU.
+
+    This must only be done when nothing is going to be read from the blocks
+    at their old addresses: not while a scene that uses them is being
+    rendered, or has been submitted to be, and not while a DMA to or from
+    them is going on. A good time is when an allocation fails, or when a
+    level has been loaded, after the last scene has been finished and
+    pvr_wait_render_done() has returned, and before the next
+    pvr_scene_begin().
+
+    \return                 The number of bytes moved
+*/
+size_t pvr_mem_compact(void);
+
+/** \brief   Get counts about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \param  info            Where to put the counts
+*/
+void pvr_mem_get_info(pvr_mem_info_t *info);
+
 /** \brief   Return the number of bytes available still in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
@@ -85,8 +194,9 @@ size_t pvr_mem_available(void);
 /** \brief   Reset the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This will essentially free any blocks allocated within the pool. There's
-    generally not many good reasons for doing this.
+    This will essentially free any blocks allocated within the pool, including
+    the ones allocated with handles, whose handles can't be used any more.
+    There's generally not many good reasons for doing this.
 */
 void pvr_mem_reset(void);
 
@@ -108,8 +218,8 @@ void pvr_mem_print_list(void);
 /** \brief   Print statistics about the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This prints out statistics like what malloc_stats() provides. Also, if
-    KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
+    This prints out the counts from pvr_mem_get_info(). Also, if KM_DBG is
+    enabled in pvr_mem.c, it prints the list of allocated blocks.
 */
 void pvr_mem_stats(void);
 
@@ -88,10 +88,15 @@ size_t pvr_txr_get_stride(void);
     This essentially just acts as a memcpy() from main RAM to PVR RAM, using
     the Store Queues and 64-bit TA bus.
 
+    The Store Queues are only used when dst is 32-byte aligned and src is
+    4-byte aligned, and only for whole 32-byte blocks. Anything else is written
+    with (much slower) 16-bit stores, so both pointers must be at least 16-bit
+    aligned.
+
     \param  src             The location in main RAM holding the texture.
     \param  dst             The location in PVR RAM to copy to.
-    \param  count           The size of the texture in bytes (must be a multiple
-                            of 32).
+    \param  count           The size of the texture in bytes (rounded up to a
+                            multiple of 4).
 */
 void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 
@@ -126,11 +131,16 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
     This function loads a texture to the PVR's RAM with the specified set of
     flags. It will currently always twiddle the data, whether you ask it to or
     not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
+    Pretty much the only supported flags, other than the format ones, are
+    PVR_TXRLOAD_INVERT_Y and PVR_TXRLOAD_FMT_VQ. With the latter, the source
+    is a 2048 byte codebook followed by one index byte per 2x2 block of texels
+    in plain row order, and only the indices get twiddled.
 
-    This will be slower than using pvr_txr_load() in pretty much all cases, so
-    unless you need to twiddle your texture, just use that instead.
+    The twiddled data is built up in the cache and written out with the Store
+    Queues if dst is 32-byte aligned, or with 16-bit stores if it isn't (dst
+    must be at least 16-bit aligned). This will still be slower than
+    using pvr_txr_load() on an already twiddled texture, so if you can twiddle
+    your textures ahead of time, do that instead.
 
     \param  src             The location to copy from.
     \param  dst             The location to copy to.
@@ -168,9 +178,8 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                             \ref PVR_TXRLOAD_FMT_NOTWIDDLE (or equivalently
                             \ref PVR_TXRLOAD_FMT_TWIDDLED) and
                             \ref PVR_TXRLOAD_INVERT_Y in the flags.
-    \note                   DMA and Store Queue based loading is not available
-                            from this function if it twiddles the texture while
-                            loading.
+    \note                   DMA based loading is not available from this
+                            function if it twiddles the texture while loading.
 */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags);
 
@@ -125,6 +125,11 @@ int sd_shutdown(void);
     responsibility to allocate the buffer properly for the number of bytes that
     is to be read (512 * the number of blocks requested).
 
+    A read of more than one block, or of the block straight after the last
+    one read, leaves the card sending blocks, so that a read of the blocks
+    after it can carry on without sending another command to the card. Any
+    other access to the card stops it first.
+
     \param  block           The starting block number to read from.
     \param  count           The number of 512 byte blocks of data to read.
     \param  buf             The buffer to read into.
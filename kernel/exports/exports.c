@@ -9,17 +9,32 @@
 /*
 
 Just a quick interface to actually make use of all those nifty kernel
-export tables. This just does a linear search through the two tables
-to look for a symbol, for now. This should be optimized later with a
-binary search or something, but loading a new program is generally expected
-to be a somewhat slow process anyway.
+export tables. Tables made by genexports.sh come with a hash table, which
+is used to look symbols up in them; any others are searched from start to
+end. Symbols that have been found are kept in a small cache, since each
+library that's loaded tends to want the same ones as the last.
 
 */
 
 #include <string.h>
 #include <kos/nmmgr.h>
+#include <kos/mutex.h>
 #include <kos/exports.h>
 
+/* Bumped by nmmgr.c whenever a symbol table is added or removed, which
+   empties the cache. */
+extern unsigned int __nmmgr_symtab_gen;
+
+#define CACHE_SIZE  512
+
+static struct {
+    uint32_t hash;
+    export_sym_t *sym;
+} cache[CACHE_SIZE];
+
+static unsigned int cache_gen;
+static mutex_t cache_mutex = MUTEX_INITIALIZER;
+
 static symtab_handler_t st_kern = {
     {
         "sym/kernel/kernel",
@@ -29,7 +44,8 @@ static symtab_handler_t st_kern = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    kernel_symtab
+    kernel_symtab,
+    &kernel_symtab_hash
 };
 
 static symtab_handler_t st_arch = {
@@ -41,7 +57,8 @@ static symtab_handler_t st_arch = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    arch_symtab
+    arch_symtab,
+    &arch_symtab_hash
 };
 
 static symtab_handler_t st_subarch = {
@@ -53,7 +70,8 @@ static symtab_handler_t st_subarch = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    subarch_symtab
+    subarch_symtab,
+    &subarch_symtab_hash
 };
 
 void export_init(void) {
@@ -63,11 +81,67 @@ void export_init(void) {
     nmmgr_handler_add(&st_subarch.nmmgr);
 }
 
+static export_sym_t *hash_lookup(symtab_handler_t *sth, const char *name,
+                                 uint32_t h) {
+    const export_hash_t *eh = sth->hash;
+    uint32_t word, i, c;
+
+    /* Both of the name's bits have to be set in the filter for it to be
+       worth looking any further. */
+    word = eh->bloom[(h / 32) & (eh->bloom_words - 1)];
+
+    if(!((word >> (h % 32)) & (word >> ((h >> eh->bloom_shift) % 32)) & 1))
+        return NULL;
+
+    i = eh->buckets[h & (eh->nbuckets - 1)];
+
+    for(; i < eh->count; i++) {
+        c = eh->chain[i];
+
+        if((c | 1) == (h | 1) && !strcmp(name, sth->table[i].name))
+            return sth->table + i;
+
+        if(c & 1)
+            break;
+    }
+
+    return NULL;
+}
+
+static export_sym_t *table_lookup(symtab_handler_t *sth, const char *name,
+                                  uint32_t h) {
+    int i;
+
+    if(sth->hash)
+        return hash_lookup(sth, name, h);
+
+    for(i = 0; sth->table[i].name; i++) {
+        if(!strcmp(name, sth->table[i].name))
+            return sth->table + i;
+    }
+
+    return NULL;
+}
+
 export_sym_t *export_lookup(const char *name) {
     nmmgr_handler_t *nmmgr;
     nmmgr_list_t *nmmgrs;
-    int i;
-    symtab_handler_t *sth;
+    export_sym_t *sym = NULL;
+    uint32_t h = export_hash_name(name);
+    int slot = h & (CACHE_SIZE - 1);
+
+    mutex_lock(&cache_mutex);
+
+    if(cache_gen != __nmmgr_symtab_gen) {
+        memset(cache, 0, sizeof(cache));
+        cache_gen = __nmmgr_symtab_gen;
+    }
+
+    if(cache[slot].sym && cache[slot].hash == h &&
+       !strcmp(name, cache[slot].sym->name)) {
+        sym = cache[slot].sym;
+        goto out;
+    }
 
     /* Get the name manager list */
     nmmgrs = nmmgr_get_list();
@@ -78,25 +152,22 @@ export_sym_t *export_lookup(const char *name) {
         if(nmmgr->type != NMMGR_TYPE_SYMTAB)
             continue;
 
-        sth = (symtab_handler_t *)nmmgr;
-
-        /* First look through the kernel table */
-        for(i = 0; /* */; i++) {
-            if(sth->table[i].name == NULL)
-                break;
+        if((sym = table_lookup((symtab_handler_t *)nmmgr, name, h)))
+            break;
+    }
 
-            if(!strcmp(name, sth->table[i].name))
-                return sth->table + i;
-        }
+    if(sym) {
+        cache[slot].hash = h;
+        cache[slot].sym = sym;
     }
 
-    return NULL;
+out:
+    mutex_unlock(&cache_mutex);
+    return sym;
 }
 
 export_sym_t *export_lookup_path(const char *name, const char *path) {
     nmmgr_handler_t *nmmgr;
-    symtab_handler_t *sth;
-    int i;
 
     /* Get the name manager list */
     nmmgr = nmmgr_lookup(path);
@@ -104,14 +175,9 @@ export_sym_t *export_lookup_path(const char *name, const char *path) {
     if(nmmgr == NULL) {
         return NULL;
     }
-    sth = (symtab_handler_t *)nmmgr;
 
-    for(i = 0; sth->table[i].name; i++) {
-        if(!strcmp(name, sth->table[i].name))
-            return sth->table + i;
-    }
-
-    return NULL;
+    return table_lookup((symtab_handler_t *)nmmgr, name,
+                        export_hash_name(name));
 }
 
 export_sym_t *export_lookup_addr(uintptr_t addr) {
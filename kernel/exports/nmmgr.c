@@ -15,6 +15,7 @@ interface at the front of their struct.
 
 */
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,20 +34,130 @@ static mutex_t mutex = MUTEX_INITIALIZER;
    describe how to handle a given path name. */
 static nmmgr_list_t nmmgr_handlers;
 
-/* Locate a name handler for a given path name */
-nmmgr_handler_t * nmmgr_lookup(const char *fn) {
-    nmmgr_handler_t *cur = NULL, *tmp;
-    size_t          cur_len = 0, tmp_len;
+/* Bumped whenever a symbol table comes or goes, so that exports.c knows to
+   forget the symbols it has looked up. */
+unsigned int __nmmgr_symtab_gen;
+
+/* Handlers are looked up through a trie of the components of their path
+   names (compared without regard to case), so finding the handler for a path
+   only means looking at the names at each level that the path goes through,
+   rather than comparing it against every handler there is. The list above is
+   still kept, for anything that wants to go through all of the handlers.
+
+   Lookups don't take the mutex: nodes are only ever added to the trie, each
+   one filled in before it's linked in, and they're never freed until
+   shutdown. Removing a handler just clears it from its node, which is left
+   there to be used again if something is added at the same path later.
+   Names that start with a slash and ones that don't (like the symbol tables)
+   are kept under different roots. */
+typedef struct nm_node {
+    struct nm_node *_Atomic children;
+    struct nm_node *_Atomic next;       /* Next sibling */
+    nmmgr_handler_t *_Atomic hnd;       /* Handler at this path, if any */
+    size_t len;
+    char name[];
+} nm_node_t;
+
+static nm_node_t nm_root, nm_rel_root;
+
+static nm_node_t *root_for(const char *path) {
+    return *path == '/' ? &nm_root : &nm_rel_root;
+}
 
-    /* Scan the handler table and look for the best path match */
-    SLIST_FOREACH(tmp, &nmmgr_handlers, list_ent) {
-        tmp_len = strlen(tmp->pathname);
-        if(!strncasecmp(tmp->pathname, fn, tmp_len)) {
-            if(cur_len < tmp_len) {
-                cur_len = tmp_len;
-                cur = tmp;
-            }
+/* Find the next component of path, skipping over any slashes. */
+static const char *next_component(const char *path, size_t *len) {
+    size_t l = 0;
+
+    while(*path == '/')
+        ++path;
+
+    while(path[l] && path[l] != '/')
+        ++l;
+
+    *len = l;
+    return path;
+}
+
+static nm_node_t *find_child(nm_node_t *n, const char *name, size_t len) {
+    nm_node_t *c = atomic_load_explicit(&n->children, memory_order_acquire);
+
+    for(; c; c = atomic_load_explicit(&c->next, memory_order_acquire)) {
+        if(c->len == len && !strncasecmp(c->name, name, len))
+            break;
+    }
+
+    return c;
+}
+
+/* Find the node for a path, adding it (and its parents) if need be and
+   create is set. Called with the mutex held. */
+static nm_node_t *get_node(const char *path, bool create) {
+    nm_node_t *n = root_for(path), *c;
+    size_t len;
+
+    for(path = next_component(path, &len); len;
+        path = next_component(path + len, &len)) {
+        if(!(c = find_child(n, path, len))) {
+            if(!create || !(c = malloc(sizeof(nm_node_t) + len + 1)))
+                return NULL;
+
+            c->children = NULL;
+            c->hnd = NULL;
+            c->len = len;
+            memcpy(c->name, path, len);
+            c->name[len] = '\0';
+            c->next = n->children;
+            atomic_store_explicit(&n->children, c, memory_order_release);
         }
+
+        n = c;
+    }
+
+    return n;
+}
+
+/* Do two path names lead to the same node? */
+static bool same_path(const char *a, const char *b) {
+    size_t alen, blen;
+
+    if((*a == '/') != (*b == '/'))
+        return false;
+
+    for(;;) {
+        a = next_component(a, &alen);
+        b = next_component(b, &blen);
+
+        if(alen != blen || strncasecmp(a, b, alen))
+            return false;
+
+        if(!alen)
+            return true;
+
+        a += alen;
+        b += blen;
+    }
+}
+
+/* Locate a name handler for a given path name */
+nmmgr_handler_t * nmmgr_lookup(const char *fn) {
+    nm_node_t *n = root_for(fn);
+    nmmgr_handler_t *cur, *tmp;
+    const char *start = fn;
+    size_t len;
+
+    /* Walk down the trie as far as the path goes, keeping the deepest
+       handler along the way. Callers cut the handler's path name off the
+       front of the path, so one that was added with more to its name (a
+       trailing slash, say) than the path has can't be used. */
+    cur = atomic_load_explicit(&n->hnd, memory_order_acquire);
+
+    for(fn = next_component(fn, &len); len && (n = find_child(n, fn, len));
+        fn = next_component(fn + len, &len)) {
+        tmp = atomic_load_explicit(&n->hnd, memory_order_acquire);
+
+        if(tmp && strlen(tmp->pathname) <=
+           (size_t)(fn + len - start) + (fn[len] == '/'))
+            cur = tmp;
     }
 
     if(cur == NULL) {
@@ -68,10 +179,23 @@ nmmgr_list_t * nmmgr_get_list(void) {
 
 /* Add a name handler */
 int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    nm_node_t *n;
+
     mutex_lock(&mutex);
 
+    if(!(n = get_node(hnd->pathname, true))) {
+        mutex_unlock(&mutex);
+        return -1;
+    }
+
     SLIST_INSERT_HEAD(&nmmgr_handlers, hnd, list_ent);
 
+    /* The newest handler for a path wins, as it always has. */
+    atomic_store_explicit(&n->hnd, hnd, memory_order_release);
+
+    if(hnd->type == NMMGR_TYPE_SYMTAB)
+        ++__nmmgr_symtab_gen;
+
     mutex_unlock(&mutex);
 
     return 0;
@@ -80,6 +204,7 @@ int nmmgr_handler_add(nmmgr_handler_t *hnd) {
 /* Remove a name handler */
 int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
     nmmgr_handler_t *tmp;
+    nm_node_t *n;
     int rv = -1;
 
     if(mutex_lock_irqsafe(&mutex) < 0)
@@ -94,6 +219,22 @@ int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
     if(tmp) {
         SLIST_REMOVE(&nmmgr_handlers, hnd, nmmgr_handler, list_ent);
         rv = 0;
+
+        if(hnd->type == NMMGR_TYPE_SYMTAB)
+            ++__nmmgr_symtab_gen;
+
+        /* If it was the handler at its path, fall back to the next newest
+           one there, if there is one. */
+        n = get_node(hnd->pathname, false);
+
+        if(n && n->hnd == hnd) {
+            SLIST_FOREACH(tmp, &nmmgr_handlers, list_ent) {
+                if(same_path(tmp->pathname, hnd->pathname))
+                    break;
+            }
+
+            atomic_store_explicit(&n->hnd, tmp, memory_order_release);
+        }
     }
 
     mutex_unlock(&mutex);
@@ -112,6 +253,19 @@ void nmmgr_init(void) {
     KOS_INIT_FLAG_CALL(export_init);
 }
 
+static void free_nodes(nm_node_t *n) {
+    nm_node_t *c, *next;
+
+    for(c = n->children; c; c = next) {
+        next = c->next;
+        free_nodes(c);
+        free(c);
+    }
+
+    n->children = NULL;
+    n->hnd = NULL;
+}
+
 void nmmgr_shutdown(void) {
     nmmgr_handler_t *c, *n;
 
@@ -125,4 +279,7 @@ void nmmgr_shutdown(void) {
 
         c = n;
     }
+
+    free_nodes(&nm_root);
+    free_nodes(&nm_rel_root);
 }
@@ -0,0 +1,1001 @@
+/* KallistiOS ##version##
+
+   bcache.c
+
+*/
+
+/*
+
+This module implements the buffer cache shared by the filesystems that sit on
+block devices (see kos/bcache.h).
+
+Every buffer belongs to one handle, and holds one block of that handle's size.
+Buffers with data in them are kept in a hash table keyed on the handle and the
+block number. The ones that aren't pinned are also on a single LRU list, and
+that's where buffers are taken from when the memory in use would go over the
+budget. A buffer taken from a handle with the same block size is reused as is,
+otherwise it's freed and a new one allocated. If every buffer is pinned, the
+cache goes over its budget rather than failing.
+
+Each handle also has a list of its dirty buffers, so that flushing doesn't
+have to look through the whole cache, and a list of the buffers bcache_read()
+is keeping pinned for it, most recently read first.
+
+Buffers filled by bcache_prefetch() are flagged until they're got. Between
+them, they can only take up half of what the pinned buffers leave of the
+budget, so that reading ahead never pushes out blocks read ahead earlier.
+
+The lock is let go of while the device is being read or written, so that one
+filesystem waiting on a slow device doesn't hold up the rest. A buffer being
+read is put in the hash table (pinned) before the read starts, and flagged,
+so anyone else after the same block waits for it and then looks again, as
+the buffer is gone if the read failed. Buffers being written are flagged as
+well, and left alone by eviction and by other writes until they're done.
+They're marked clean before the write starts, so that anything that changes
+them in the meantime marks them dirty again.
+
+Flushing and reading ahead go through the device a few runs of blocks at a
+time. If the device has a submit function, all of a batch is started before
+waiting for any of it, so that the device can sort and merge the requests.
+
+This file is also built into the ext2 and FAT libraries when they're built on
+another system (see their Makefile.nonkos), with BCACHE_NOT_IN_KOS defined.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <sys/queue.h>
+
+#include <kos/bcache.h>
+#include <kos/blockdev.h>
+#include <kos/opts.h>
+
+#ifndef BCACHE_NOT_IN_KOS
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/sem.h>
+#include <kos/dbglog.h>
+#else
+/* Everything happens on one thread out there, so there's never anything to
+   wait for. */
+#include <stdio.h>
+typedef int mutex_t;
+typedef int condvar_t;
+#define MUTEX_INITIALIZER       0
+#define COND_INITIALIZER        0
+#define mutex_lock(m)           ((void)(m))
+#define mutex_unlock(m)         ((void)(m))
+#define mutex_lock_scoped(m)    ((void)(m))
+#define cond_wait(cv, m)        ((void)(cv), (void)(m))
+#define cond_broadcast(cv)      ((void)(cv))
+#define DBG_WARNING             0
+#define dbglog(lvl, ...)        printf(__VA_ARGS__)
+#endif
+
+/* Buffer flags */
+#define BUF_VALID   1   /* Holds the block's data, and is in the hash table */
+#define BUF_DIRTY   2   /* On its handle's dirty list */
+#define BUF_KEPT    4   /* On its handle's kept list */
+#define BUF_AHEAD   8   /* Read ahead, and not got since */
+#define BUF_READING 16  /* Being read from the device */
+#define BUF_WRITING 32  /* Being written to the device */
+
+/* Longest run of blocks read or written at once */
+#define RUN_MAX     64
+
+/* Most runs read or written in one go (see dev_io()) */
+#define IO_MAX      8
+
+TAILQ_HEAD(buf_queue, bcache_buf);
+LIST_HEAD(buf_list, bcache_buf);
+
+/* Buffers for a run of contiguous blocks, read into or written from buf with
+   one request, or with one request per buffer if buf is NULL. */
+typedef struct io_run {
+    bcache_buf_t **bufs;
+    size_t count;
+    uint8_t *buf;
+} io_run_t;
+
+struct bcache_dev {
+    kos_blockdev_t *dev;
+    uint32_t block_size;
+    uint32_t shift;             /* log2 of device blocks per cache block */
+    uint64_t base;              /* Device block of cache block 0 */
+    uint64_t head;              /* Block after the last one read or written */
+
+    int keep;                   /* How many buffers bcache_read() keeps */
+    int writing;                /* Buffers with BUF_WRITING set */
+    int nkept;
+    struct buf_queue kept;      /* Most recently read first */
+    struct buf_queue dirty;
+    struct buf_list all;        /* Every buffer belonging to the handle */
+
+    bcache_stats_t stats;
+    LIST_ENTRY(bcache_dev) list;
+};
+
+static mutex_t bcache_mutex = MUTEX_INITIALIZER;
+static condvar_t bcache_cv = COND_INITIALIZER;  /* Reads and writes done */
+static LIST_HEAD(bcache_devs, bcache_dev) devs = LIST_HEAD_INITIALIZER(devs);
+
+/* Unpinned buffers, least recently used first */
+static struct buf_queue lru = TAILQ_HEAD_INITIALIZER(lru);
+
+static struct buf_list *hash;
+static uint32_t hash_mask;
+static uint32_t nbufs;
+
+static size_t budget = BCACHE_BUDGET;
+static size_t used;
+static size_t pinned;           /* Bytes in pinned buffers */
+static size_t ahead;            /* Bytes in buffers with BUF_AHEAD set */
+
+/* Counters for the whole cache */
+static bcache_stats_t totals;
+
+#define COUNT(d, field, n) do { \
+        (d)->stats.field += (n); \
+        totals.field += (n); \
+    } while(0)
+
+static inline uint32_t run_max(const bcache_dev_t *d) {
+    uint32_t n = BCACHE_RUN_BYTES / d->block_size;
+
+    return n < 1 ? 1 : n > RUN_MAX ? RUN_MAX : n;
+}
+
+/* Blocks next to each other on a handle go in buckets next to each other. */
+static inline struct buf_list *bucket(const bcache_dev_t *d, uint64_t block) {
+    uint32_t h = (uint32_t)(block ^ (block >> 32));
+
+    return &hash[(h + ((uint32_t)(uintptr_t)d >> 4) * 0x9e3779b1u) & hash_mask];
+}
+
+static bcache_buf_t *find(const bcache_dev_t *d, uint64_t block) {
+    bcache_buf_t *b;
+
+    LIST_FOREACH(b, bucket(d, block), hash) {
+        if(b->block == block && b->dev == d)
+            return b;
+    }
+
+    return NULL;
+}
+
+/* Make the hash table bigger once there are more buffers than buckets. It
+   isn't the end of the world if there isn't the memory for it. */
+static void grow_hash(void) {
+    struct buf_list *nh, *oh = hash;
+    uint32_t size = hash ? (hash_mask + 1) * 2 : 256, i;
+    bcache_dev_t *d;
+    bcache_buf_t *b;
+
+    if(!(nh = (struct buf_list *)malloc(size * sizeof(*nh))))
+        return;
+
+    for(i = 0; i < size; ++i)
+        LIST_INIT(&nh[i]);
+
+    hash = nh;
+    hash_mask = size - 1;
+
+    LIST_FOREACH(d, &devs, list) {
+        LIST_FOREACH(b, &d->all, all) {
+            if(b->flags & BUF_VALID)
+                LIST_INSERT_HEAD(bucket(d, b->block), b, hash);
+        }
+    }
+
+    free(oh);
+}
+
+static inline void pin(bcache_buf_t *b) {
+    if(b->refcnt++ == 0) {
+        TAILQ_REMOVE(&lru, b, lru);
+        pinned += b->dev->block_size;
+    }
+}
+
+static inline void unpin(bcache_buf_t *b) {
+    if(--b->refcnt == 0) {
+        TAILQ_INSERT_TAIL(&lru, b, lru);
+        pinned -= b->dev->block_size;
+    }
+}
+
+static inline void clear_ahead(bcache_buf_t *b) {
+    if(b->flags & BUF_AHEAD) {
+        b->flags &= ~BUF_AHEAD;
+        ahead -= b->dev->block_size;
+    }
+}
+
+static void set_valid(bcache_buf_t *b, uint64_t block) {
+    b->block = block;
+    b->flags = BUF_VALID;
+    LIST_INSERT_HEAD(bucket(b->dev, block), b, hash);
+}
+
+static void mark_dirty(bcache_buf_t *b) {
+    if(!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        TAILQ_INSERT_TAIL(&b->dev->dirty, b, dirty);
+        ++b->dev->stats.dirty;
+        ++totals.dirty;
+    }
+}
+
+static void mark_clean(bcache_buf_t *b) {
+    if(b->flags & BUF_DIRTY) {
+        b->flags &= ~BUF_DIRTY;
+        TAILQ_REMOVE(&b->dev->dirty, b, dirty);
+        --b->dev->stats.dirty;
+        --totals.dirty;
+    }
+}
+
+/* Move a buffer over to a handle, as far as the counters go. */
+static void give_buf(bcache_buf_t *b, bcache_dev_t *d) {
+    if(b->dev) {
+        LIST_REMOVE(b, all);
+        --b->dev->stats.buffers;
+        b->dev->stats.bytes -= b->dev->block_size;
+    }
+
+    b->dev = d;
+    LIST_INSERT_HEAD(&d->all, b, all);
+    ++d->stats.buffers;
+    d->stats.bytes += d->block_size;
+}
+
+/* Free a buffer that's not in the hash table or on any list but its
+   handle's list of buffers. */
+static void free_buf(bcache_buf_t *b) {
+    bcache_dev_t *d = b->dev;
+
+    clear_ahead(b);
+
+    if(b->refcnt)
+        pinned -= d->block_size;
+
+    LIST_REMOVE(b, all);
+    --d->stats.buffers;
+    d->stats.bytes -= d->block_size;
+    --nbufs;
+    used -= d->block_size;
+    totals.buffers = nbufs;
+    totals.bytes = used;
+
+    free(b->data);
+    free(b);
+}
+
+#ifndef BCACHE_NOT_IN_KOS
+/* Requests started with the device's submit function, if it has one. */
+typedef struct io_wait {
+    semaphore_t done;
+    int err;
+} io_wait_t;
+
+static void io_done(int err, void *data) {
+    io_wait_t *w = (io_wait_t *)data;
+
+    if(err)
+        w->err = err;
+
+    sem_signal(&w->done);
+}
+#endif
+
+/* Read into or write from a number of runs of buffers, letting go of the lock
+   while the device is busy. Whatever buffers are involved have to be flagged
+   first, so that they're left alone in the meantime. If the device has a
+   submit function, every request is started before waiting for any of them,
+   so that the device can sort and merge them; otherwise (or if submitting
+   one fails) they're done one after the other. Fails if any of them do. */
+static int dev_io(bcache_dev_t *d, int write, const io_run_t *runs, int n) {
+    kos_blockdev_t *dev = d->dev;
+    uint64_t block;
+    size_t count, i;
+    uint8_t *buf;
+    int r, err = 0;
+#ifndef BCACHE_NOT_IN_KOS
+    io_wait_t w;
+    int started = 0;
+
+    sem_init(&w.done, 0);
+    w.err = 0;
+#endif
+
+    for(r = 0; r < n; ++r) {
+        if(write) {
+            COUNT(d, write_reqs, runs[r].buf ? 1 : runs[r].count);
+            COUNT(d, blocks_written, runs[r].count);
+        }
+        else {
+            COUNT(d, read_reqs, runs[r].buf ? 1 : runs[r].count);
+            COUNT(d, blocks_read, runs[r].count);
+        }
+    }
+
+    d->head = runs[n - 1].bufs[runs[n - 1].count - 1]->block + 1;
+    mutex_unlock(&bcache_mutex);
+
+    for(r = 0; r < n; ++r) {
+        for(i = 0; i < runs[r].count; i += count) {
+            block = d->base + (runs[r].bufs[i]->block << d->shift);
+
+            if(runs[r].buf) {
+                count = runs[r].count;
+                buf = runs[r].buf;
+            }
+            else {
+                count = 1;
+                buf = runs[r].bufs[i]->data;
+            }
+
+#ifndef BCACHE_NOT_IN_KOS
+            if(dev->submit && !dev->submit(dev, write, block,
+                                           count << d->shift, buf,
+                                           &io_done, &w)) {
+                ++started;
+                continue;
+            }
+#endif
+
+            if(write ? dev->write_blocks(dev, block, count << d->shift, buf) :
+                       dev->read_blocks(dev, block, count << d->shift, buf))
+                err = EIO;
+        }
+    }
+
+#ifndef BCACHE_NOT_IN_KOS
+    while(started--)
+        sem_wait(&w.done);
+
+    sem_destroy(&w.done);
+
+    if(w.err)
+        err = EIO;
+#endif
+
+    mutex_lock(&bcache_mutex);
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void set_writing(bcache_buf_t *b) {
+    b->flags |= BUF_WRITING;
+    ++b->dev->writing;
+}
+
+/* Write out runs of dirty buffers for contiguous blocks, each with one
+   request if there's the memory to put it together. The caller flags them
+   with set_writing() first. If the writes fail, they're all marked dirty
+   again. */
+static int write_runs(bcache_dev_t *d, io_run_t *runs, int n) {
+    size_t i;
+    int r, rv, err;
+
+    for(r = 0; r < n; ++r) {
+        for(i = 0; i < runs[r].count; ++i)
+            mark_clean(runs[r].bufs[i]);
+
+        runs[r].buf = NULL;
+
+        if(runs[r].count > 1 &&
+           (runs[r].buf = (uint8_t *)memalign(32, runs[r].count *
+                                              d->block_size))) {
+            for(i = 0; i < runs[r].count; ++i)
+                memcpy(runs[r].buf + i * d->block_size, runs[r].bufs[i]->data,
+                       d->block_size);
+        }
+    }
+
+    rv = dev_io(d, 1, runs, n);
+    err = errno;
+
+    for(r = 0; r < n; ++r) {
+        free(runs[r].buf);
+
+        for(i = 0; i < runs[r].count; ++i) {
+            runs[r].bufs[i]->flags &= ~BUF_WRITING;
+            --d->writing;
+
+            if(rv)
+                mark_dirty(runs[r].bufs[i]);
+        }
+    }
+
+    cond_broadcast(&bcache_cv);
+    errno = err;
+
+    return rv;
+}
+
+/* Write back a dirty buffer that's about to be evicted, along with any dirty
+   blocks right next to it that aren't being written already. */
+static int write_around(bcache_buf_t *b) {
+    bcache_dev_t *d = b->dev;
+    bcache_buf_t *run[RUN_MAX], *t;
+    io_run_t r;
+    uint64_t first = b->block;
+    uint32_t count = 1, max = run_max(d), i;
+
+    while(count < max / 2 && first > 0 && (t = find(d, first - 1)) &&
+          (t->flags & (BUF_DIRTY | BUF_WRITING)) == BUF_DIRTY) {
+        --first;
+        ++count;
+    }
+
+    while(count < max && (t = find(d, first + count)) &&
+          (t->flags & (BUF_DIRTY | BUF_WRITING)) == BUF_DIRTY)
+        ++count;
+
+    for(i = 0; i < count; ++i) {
+        run[i] = find(d, first + i);
+        set_writing(run[i]);
+    }
+
+    r.bufs = run;
+    r.count = count;
+
+    return write_runs(d, &r, 1);
+}
+
+/* Drop unpinned buffers, least recently used first, until there's room for
+   need more bytes. A buffer of size need is handed back for reuse if one
+   comes up, pinned and no longer valid. Dirty buffers are written back first,
+   which lets go of the lock, so everything is looked at again after that. */
+static bcache_buf_t *make_room(size_t need) {
+    bcache_buf_t *b;
+
+    while(used + need > budget) {
+        /* Skip over whatever is being written back already. */
+        TAILQ_FOREACH(b, &lru, lru) {
+            if(!(b->flags & BUF_WRITING))
+                break;
+        }
+
+        if(!b)
+            break;
+
+        if(b->flags & BUF_DIRTY) {
+            if(!write_around(b))
+                continue;
+
+            /* Leave it for later, and go over budget for now rather than
+               failing because some other device had a problem. */
+            dbglog(DBG_WARNING, "bcache: error writing back block %llu\n",
+                   (unsigned long long)b->block);
+
+            if(!b->refcnt) {
+                TAILQ_REMOVE(&lru, b, lru);
+                TAILQ_INSERT_TAIL(&lru, b, lru);
+            }
+
+            return NULL;
+        }
+
+        TAILQ_REMOVE(&lru, b, lru);
+        LIST_REMOVE(b, hash);
+        clear_ahead(b);
+        b->flags = 0;
+        COUNT(b->dev, evictions, 1);
+
+        if(b->dev->block_size == need) {
+            b->refcnt = 1;
+            pinned += need;
+            return b;
+        }
+
+        free_buf(b);
+    }
+
+    return NULL;
+}
+
+/* Get an empty buffer for a handle, pinned. */
+static bcache_buf_t *alloc_buf(bcache_dev_t *d) {
+    bcache_buf_t *b;
+
+    if((b = make_room(d->block_size))) {
+        give_buf(b, d);
+        return b;
+    }
+
+    if(!(b = (bcache_buf_t *)calloc(1, sizeof(*b))))
+        goto out;
+
+    if(!(b->data = (uint8_t *)memalign(32, d->block_size))) {
+        free(b);
+        goto out;
+    }
+
+    b->refcnt = 1;
+    give_buf(b, d);
+    used += d->block_size;
+    pinned += d->block_size;
+    totals.buffers = ++nbufs;
+    totals.bytes = used;
+
+    if(nbufs > hash_mask + 1)
+        grow_hash();
+
+    return b;
+
+out:
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* Drop buffers that were put in the hash table to be read into, after the
+   read failed. */
+static void drop_bufs(bcache_buf_t **bufs, size_t count) {
+    int err = errno;
+
+    while(count--) {
+        LIST_REMOVE(bufs[count], hash);
+        free_buf(bufs[count]);
+    }
+
+    cond_broadcast(&bcache_cv);
+    errno = err;
+}
+
+static bcache_buf_t *get(bcache_dev_t *d, uint64_t block, int flags) {
+    bcache_buf_t *b;
+    io_run_t r;
+
+again:
+    if((b = find(d, block))) {
+        /* If someone else is reading it in, wait for them, and then look
+           again in case the read failed. */
+        if(b->flags & BUF_READING) {
+            cond_wait(&bcache_cv, &bcache_mutex);
+            goto again;
+        }
+
+        COUNT(d, hits, 1);
+        clear_ahead(b);
+        pin(b);
+        return b;
+    }
+
+    if(!(b = alloc_buf(d)))
+        return NULL;
+
+    /* Someone else might have got the block while room was being made. */
+    if(find(d, block)) {
+        free_buf(b);
+        goto again;
+    }
+
+    COUNT(d, misses, 1);
+    set_valid(b, block);
+
+    if(!(flags & BCACHE_NOREAD)) {
+        b->flags |= BUF_READING;
+        r.bufs = &b;
+        r.count = 1;
+        r.buf = NULL;
+
+        if(dev_io(d, 0, &r, 1)) {
+            drop_bufs(&b, 1);
+            return NULL;
+        }
+
+        b->flags &= ~BUF_READING;
+        cond_broadcast(&bcache_cv);
+    }
+
+    return b;
+}
+
+/* Keep a buffer that has just been got pinned for the handle, in place of the
+   one that was read longest ago. */
+static void keep(bcache_dev_t *d, bcache_buf_t *b) {
+    bcache_buf_t *t;
+
+    if(b->flags & BUF_KEPT) {
+        /* It already has a pin from being kept. */
+        TAILQ_REMOVE(&d->kept, b, kept);
+        TAILQ_INSERT_HEAD(&d->kept, b, kept);
+        unpin(b);
+        return;
+    }
+
+    b->flags |= BUF_KEPT;
+    TAILQ_INSERT_HEAD(&d->kept, b, kept);
+
+    if(++d->nkept > d->keep) {
+        t = TAILQ_LAST(&d->kept, buf_queue);
+        TAILQ_REMOVE(&d->kept, t, kept);
+        t->flags &= ~BUF_KEPT;
+        --d->nkept;
+        unpin(t);
+    }
+}
+
+static int buf_cmp(const void *a, const void *b) {
+    const bcache_buf_t *ba = *(bcache_buf_t *const *)a;
+    const bcache_buf_t *bb = *(bcache_buf_t *const *)b;
+
+    return (ba->block > bb->block) - (ba->block < bb->block);
+}
+
+static int flush(bcache_dev_t *d) {
+    bcache_buf_t **dirty, *b;
+    io_run_t runs[IO_MAX];
+    uint32_t count, start, i, j, max = run_max(d);
+    int n = 0, rv = 0, err = 0;
+
+    /* Anything being written back to make room has to get there before this
+       returns, and might need writing again if it failed. */
+    while(d->writing)
+        cond_wait(&bcache_cv, &bcache_mutex);
+
+    if(!(count = d->stats.dirty))
+        return 0;
+
+    if(!(dirty = (bcache_buf_t **)malloc(count * 2 * sizeof(*dirty)))) {
+        /* Do it one block at a time, then. */
+        while((b = TAILQ_FIRST(&d->dirty))) {
+            if(b->flags & BUF_WRITING) {
+                cond_wait(&bcache_cv, &bcache_mutex);
+                continue;
+            }
+
+            set_writing(b);
+            runs[0].bufs = &b;
+            runs[0].count = 1;
+
+            if(write_runs(d, runs, 1))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    /* Flag them all now, so that none of them are written or evicted by
+       anyone else while the lock is let go of for the ones before them. */
+    i = 0;
+    TAILQ_FOREACH(b, &d->dirty, dirty) {
+        set_writing(b);
+        dirty[i++] = b;
+    }
+
+    qsort(dirty, count, sizeof(*dirty), &buf_cmp);
+
+    /* Sweep up the device from where it was last used, then carry on from
+       the start, like an elevator. The sorted list goes in twice in a row so
+       that the sweep can start anywhere in it. */
+    for(start = 0; start < count && dirty[start]->block < d->head; ++start)
+        ;
+
+    memcpy(dirty + count, dirty, count * sizeof(*dirty));
+
+    for(i = start; i < start + count; i = j) {
+        for(j = i + 1; j < start + count && j - i < max; ++j) {
+            if(dirty[j]->block != dirty[j - 1]->block + 1)
+                break;
+        }
+
+        runs[n].bufs = dirty + i;
+        runs[n].count = j - i;
+
+        /* Write the runs out a few at a time, so that a device that can take
+           more than one request at once gets to. */
+        if(++n < IO_MAX && j < start + count)
+            continue;
+
+        if(write_runs(d, runs, n)) {
+            err = errno;
+            rv = -1;
+        }
+
+        n = 0;
+    }
+
+    free(dirty);
+
+    if(rv)
+        errno = err;
+
+    return rv;
+}
+
+bcache_dev_t *bcache_attach(kos_blockdev_t *dev, uint32_t block_size,
+                            uint64_t base, int keep) {
+    bcache_dev_t *d;
+    uint32_t shift = 0;
+
+    if(!block_size || (block_size & (block_size - 1)) ||
+       block_size < (1U << dev->l_block_size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while((1U << (dev->l_block_size + shift)) < block_size)
+        ++shift;
+
+    if(!(d = (bcache_dev_t *)calloc(1, sizeof(*d)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    d->dev = dev;
+    d->block_size = block_size;
+    d->shift = shift;
+    d->base = base;
+    d->keep = keep > 0 ? keep : 0;
+    TAILQ_INIT(&d->kept);
+    TAILQ_INIT(&d->dirty);
+    LIST_INIT(&d->all);
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    if(!hash) {
+        grow_hash();
+
+        if(!hash) {
+            free(d);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    LIST_INSERT_HEAD(&devs, d, list);
+    return d;
+}
+
+int bcache_detach(bcache_dev_t *d) {
+    bcache_buf_t *b;
+    int rv, err;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    /* Nothing but bcache_read() may still have any of the blocks pinned. */
+    LIST_FOREACH(b, &d->all, all) {
+        if(b->refcnt > !!(b->flags & BUF_KEPT)) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    rv = flush(d);
+    err = errno;
+
+    /* Blocks might have been picked to be written back to make room while the
+       lock was let go of. */
+    while(d->writing)
+        cond_wait(&bcache_cv, &bcache_mutex);
+
+    while((b = TAILQ_FIRST(&d->kept))) {
+        TAILQ_REMOVE(&d->kept, b, kept);
+        b->flags &= ~BUF_KEPT;
+        unpin(b);
+    }
+
+    while((b = LIST_FIRST(&d->all))) {
+        TAILQ_REMOVE(&lru, b, lru);
+        mark_clean(b);
+
+        if(b->flags & BUF_VALID)
+            LIST_REMOVE(b, hash);
+
+        free_buf(b);
+    }
+
+    LIST_REMOVE(d, list);
+    free(d);
+
+    errno = err;
+    return rv;
+}
+
+bcache_buf_t *bcache_get(bcache_dev_t *d, uint64_t block, int flags) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    return get(d, block, flags);
+}
+
+void bcache_put(bcache_buf_t *b) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    unpin(b);
+}
+
+void bcache_mark_dirty(bcache_buf_t *b) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    mark_dirty(b);
+}
+
+uint8_t *bcache_read(bcache_dev_t *d, uint64_t block, int flags) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    if(!(b = get(d, block, flags)))
+        return NULL;
+
+    keep(d, b);
+    return b->data;
+}
+
+int bcache_mark_dirty_block(bcache_dev_t *d, uint64_t block) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    if(!(b = find(d, block))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mark_dirty(b);
+
+    /* Count it as used again, so it stays around a bit longer. */
+    if(b->flags & BUF_KEPT) {
+        TAILQ_REMOVE(&d->kept, b, kept);
+        TAILQ_INSERT_HEAD(&d->kept, b, kept);
+    }
+    else if(!b->refcnt) {
+        TAILQ_REMOVE(&lru, b, lru);
+        TAILQ_INSERT_TAIL(&lru, b, lru);
+    }
+
+    return 0;
+}
+
+int bcache_cached(bcache_dev_t *d, uint64_t block) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    return find(d, block) != NULL;
+}
+
+int bcache_prefetch(bcache_dev_t *d, uint64_t block, size_t count) {
+    bcache_buf_t *bufs[RUN_MAX];
+    io_run_t runs[IO_MAX];
+    size_t room, got, n, i, rv;
+    int nruns, r, err;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    /* Blocks read ahead get half of what the pinned ones leave of the budget
+       between them, so that they don't push each other out before they're
+       used. */
+    room = budget > pinned ? (budget - pinned) / 2 : 0;
+    room = room > ahead ? (room - ahead) / d->block_size : 0;
+
+    if(count > room)
+        count = room;
+
+    rv = count;
+
+    while(count) {
+        /* Put the buffers for the runs of blocks that aren't here yet in the
+           hash table before reading into them, so that anyone else after the
+           same blocks waits. Making room for each one might let go of the
+           lock, so look again after. */
+        for(got = 0, nruns = 0; count && got < RUN_MAX && nruns < IO_MAX;) {
+            if(find(d, block)) {
+                ++block;
+                --count;
+                continue;
+            }
+
+            for(n = 0; n < count && n < run_max(d) && got + n < RUN_MAX &&
+                !find(d, block + n); ++n) {
+                if(!(bufs[got + n] = alloc_buf(d))) {
+                    drop_bufs(bufs, got + n);
+                    return -1;
+                }
+
+                if(find(d, block + n)) {
+                    free_buf(bufs[got + n]);
+                    break;
+                }
+
+                set_valid(bufs[got + n], block + n);
+                bufs[got + n]->flags |= BUF_READING;
+            }
+
+            if(!n)
+                continue;
+
+            runs[nruns].bufs = bufs + got;
+            runs[nruns].count = n;
+            runs[nruns].buf = NULL;
+            ++nruns;
+            got += n;
+            block += n;
+            count -= n;
+        }
+
+        if(!nruns)
+            continue;
+
+        /* Read each run with one request if there's the memory to put it
+           together in, or a block at a time if not. */
+        for(r = 0; r < nruns; ++r) {
+            if(runs[r].count > 1)
+                runs[r].buf = (uint8_t *)memalign(32, runs[r].count *
+                                                  d->block_size);
+        }
+
+        err = dev_io(d, 0, runs, nruns);
+
+        for(r = 0; r < nruns; ++r) {
+            if(!runs[r].buf)
+                continue;
+
+            for(i = 0; !err && i < runs[r].count; ++i)
+                memcpy(runs[r].bufs[i]->data, runs[r].buf + i * d->block_size,
+                       d->block_size);
+
+            free(runs[r].buf);
+        }
+
+        if(err) {
+            drop_bufs(bufs, got);
+            return -1;
+        }
+
+        for(i = 0; i < got; ++i) {
+            bufs[i]->flags &= ~BUF_READING;
+            bufs[i]->flags |= BUF_AHEAD;
+            ahead += d->block_size;
+            unpin(bufs[i]);
+        }
+
+        cond_broadcast(&bcache_cv);
+    }
+
+    return (int)rv;
+}
+
+int bcache_flush(bcache_dev_t *d) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    return flush(d);
+}
+
+size_t bcache_set_budget(size_t bytes) {
+    size_t old;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    old = budget;
+    budget = bytes;
+    make_room(0);
+
+    return old;
+}
+
+void bcache_get_stats(const bcache_dev_t *d, bcache_stats_t *st) {
+    mutex_lock_scoped(&bcache_mutex);
+
+    *st = d ? d->stats : totals;
+}
+
+void bcache_reset_stats(bcache_dev_t *d) {
+    bcache_stats_t *st;
+
+    mutex_lock_scoped(&bcache_mutex);
+
+    st = d ? &d->stats : &totals;
+    st->hits = st->misses = st->evictions = 0;
+    st->read_reqs = st->write_reqs = 0;
+    st->blocks_read = st->blocks_written = 0;
+}
@@ -15,18 +15,45 @@
 #include <kos/exports.h>
 #include <kos/thread.h>
 #include <kos/library.h>
+#include <kos/timer.h>
 #include <kos/dbglog.h>
 
-/* Finds a given symbol in a relocated ELF symbol table */
-static int find_sym(char *name, elf_sym_t *table, int tablelen) {
+/* The entry points every library has to have */
+static const char *const entry_names[] = {
+    ELF_SYM_PREFIX "lib_get_name",
+    ELF_SYM_PREFIX "lib_get_version",
+    ELF_SYM_PREFIX "lib_open",
+    ELF_SYM_PREFIX "lib_close"
+};
+
+#define ENTRY_COUNT (sizeof(entry_names) / sizeof(entry_names[0]))
+
+/* Finds the entry points in a relocated ELF symbol table. Rather than going
+   through the whole table once for each of them, each defined symbol's name
+   is hashed once, and only compared with the names that have the same hash
+   value. */
+static void find_entries(elf_sym_t *table, int tablelen, int *idx) {
+    uint32_t hashes[ENTRY_COUNT], h;
+    size_t j;
     int i;
 
-    for(i = 0; i < tablelen; i++) {
-        if(!strcmp((char*)table[i].name, name))
-            return i;
+    for(j = 0; j < ENTRY_COUNT; j++) {
+        hashes[j] = export_hash_name(entry_names[j]);
+        idx[j] = -1;
     }
 
-    return -1;
+    for(i = 0; i < tablelen; i++) {
+        if(table[i].shndx == SHN_UNDEF)
+            continue;
+
+        h = export_hash_name((char *)table[i].name);
+
+        for(j = 0; j < ENTRY_COUNT; j++) {
+            if(idx[j] < 0 && h == hashes[j] &&
+               !strcmp((char *)table[i].name, entry_names[j]))
+                idx[j] = i;
+        }
+    }
 }
 
 /* This function tests the header to determine if it's valid. It's separated
@@ -74,6 +101,8 @@ int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
     char        *stringtab;
     uint32_t    vma;
     file_t      fd;
+    uint64_t    start = timer_us_gettime64();
+    int         resolved = 0;
 
     (void)shell;
 
@@ -241,6 +270,7 @@ int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
              (const char *)(symtab[i].name),
              sym->ptr);
         symtab[i].value = sym->ptr;
+        resolved++;
     }
 
     /* Process the relocations */
@@ -384,27 +414,32 @@ int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
 
     /* Look for the program entry points and deal with that */
     {
-        int sym;
+        int sym[ENTRY_COUNT];
+
+        find_entries(symtab, symtabsize, sym);
 
-#define DO_ONE(symname, outp) \
-    sym = find_sym(ELF_SYM_PREFIX symname, symtab, symtabsize); \
-    if(sym < 0) { \
-        dbglog(DBG_ERROR, "elf_load: ELF contains no %s()\n", symname); \
+#define DO_ONE(n, outp) \
+    if(sym[n] < 0) { \
+        dbglog(DBG_ERROR, "elf_load: ELF contains no %s()\n", \
+               entry_names[n] + ELF_SYM_PREFIX_LEN); \
         goto error3; \
     } \
     \
-    out->outp = (vma + shdrs[symtab[sym].shndx].addr \
-                 + symtab[sym].value);
+    out->outp = (vma + shdrs[symtab[sym[n]].shndx].addr \
+                 + symtab[sym[n]].value);
 
-        DO_ONE("lib_get_name", lib_get_name);
-        DO_ONE("lib_get_version", lib_get_version);
-        DO_ONE("lib_open", lib_open);
-        DO_ONE("lib_close", lib_close);
+        DO_ONE(0, lib_get_name);
+        DO_ONE(1, lib_get_version);
+        DO_ONE(2, lib_open);
+        DO_ONE(3, lib_close);
 #undef DO_ONE
     }
 
     free(img);
     dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "elf_load final ELF stats: memory image at %p, size %08lx\n", out->data, out->size);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "elf_load: resolved %d symbols, "
+           "loaded in %lu us\n", resolved,
+           (unsigned long)(timer_us_gettime64() - start));
 
     /* Flush the icache for that zone */
     icache_sync_range((uint32_t)out->data, out->size);
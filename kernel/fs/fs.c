@@ -50,6 +50,9 @@ typedef struct fs_hnd {
     int idx;     /* Current index for readdir */
 } fs_hnd_t;
 
+/* Drops poll()/epoll registrations for a file descriptor (in poll.c). */
+extern void __poll_fd_closed(int fd);
+
 /* The global file descriptor table */
 fs_hnd_t *fd_table[FD_SETSIZE] = { NULL };
 
@@ -339,6 +342,9 @@ int fs_close(file_t fd) {
 
     if(!h) return -1;
 
+    /* Nobody can be waiting on it once it's gone */
+    __poll_fd_closed(fd);
+
     /* Deref it and remove it from our table */
     retval = fs_hnd_unref(h);
 
@@ -14,13 +14,21 @@ many operating systems would do, this file system keeps the directory structure
 and file data in allocated chunks of RAM. This also means that the ramdisk can
 get as big as the memory available, there's no arbitrary limit.
 
+File data is kept in a list of extents rather than one block, with each new
+extent about as big as the file already is (up to RAMDISK_MAX_EXTENT, see
+kos/opts.h). Growing a file therefore never copies what has already been
+written, and data doesn't move once it has been written, so a pointer from
+mmap() stays good as the file grows. mmap() needs the file in one piece, so the
+first call on a file in several extents joins them into one block.
+
 A note of warning about thread usage here as well. This FS is protected against
 thread contention at a file handle and data structure level. This means that the
-directory structures and the file handles will never become inconsistent. However,
-it is not protected at the individual file level. Because of this limitation, only
-one file handle may be open to an individual file for writing at any given time.
-If the file is already open for reading, it cannot be written to. Likewise, if
-the file is open for writing, you can't open it for reading or writing.
+directory structures and the file handles will never become inconsistent. Each
+file's data has a lock of its own, so that threads reading or writing different
+files don't hold each other up. However, only one file handle may be open to an
+individual file for writing at any given time. If the file is already open for
+reading, it cannot be written to. Likewise, if the file is open for writing, you
+can't open it for reading or writing.
 
 So for example, if you wanted to cache an MP3 in the ramdisk, you'd copy the data
 to the ramdisk in write mode, then close the file and let the library re-open it
@@ -52,6 +60,13 @@ cache data from disk rather than as a general purpose file system.
 char *strdup(const char *);
 #endif
 
+/* A piece of a file's data */
+typedef struct rd_extent {
+    uint8_t   *data;    /* Allocated block */
+    uint32_t  offset;   /* Where in the file the block starts */
+    uint32_t  size;     /* Size of the block */
+} rd_extent_t;
+
 /* File definition */
 typedef struct rd_file {
     char      *name;    /* File name -- allocated */
@@ -60,17 +75,22 @@ typedef struct rd_file {
     int       openfor;  /* Lock constant */
     int       usage;    /* Usage count (unopened is 0) */
 
-    /* For the following two members:
-      - In files, this is a block of allocated memory containing the
-        actual file data. Each time we need to expand it beyond its
-        current capacity, we realloc() with enough to hold the new
-        data plus 4k (to avoid realloc thrashing). All files start
-        out with a 1K block of space.
-      - In directories, this is just a pointer to an rd_dir struct,
-        which is defined below. datasize has no meaning for a
-        directory. */
-    void      *data;    /* Data block pointer */
-    uint32_t  datasize; /* Size of data block pointer */
+    /* In directories, this is just a pointer to an rd_dir struct, which is
+       defined below. Files don't use it. */
+    void      *data;
+
+    /* In files, the blocks holding the file data, in order. Each time we
+       need to expand the file beyond its current capacity, another extent
+       is added on the end, at least as big as the ones before it put
+       together (up to RAMDISK_MAX_EXTENT). Files start out with none at
+       all. datasize has no meaning for a directory. */
+    rd_extent_t *ext;   /* Extent list -- allocated */
+    int       extcnt;   /* Extents in use */
+    int       extmax;   /* Extents there is room for in ext */
+    uint32_t  datasize; /* Size of all extents together */
+    int       mapped;   /* Number of open fds that have mmap()ed the file */
+
+    mutex_t   lock;     /* Protects the data, size and fd positions */
 
     LIST_ENTRY(rd_file) dirlist;    /* Directory list entry */
 } rd_file_t;
@@ -94,6 +114,8 @@ static rd_dir_t  *rootdir = NULL;
 typedef struct rd_fd {
     rd_file_t   *file;      /* ramdisk file struct */
     uintptr_t   ptr;        /* Current read position in bytes */
+    int         ext;        /* Extent ptr was last found in */
+    bool        mapped;     /* true if mmap() has been called */
     int         omode;      /* Open mode */
     TAILQ_ENTRY(rd_fd)  next;   /* Next handle in the linked list */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
@@ -102,7 +124,8 @@ typedef struct rd_fd {
 
 static TAILQ_HEAD(rd_fd_queue, rd_fd) rd_fd_queue;
 
-/* Mutex for file system structs */
+/* Mutex for file system structs. When both are needed, this one is taken
+   before a file's own lock. */
 static mutex_t rd_mutex;
 
 /* Data used for stat->st_dev's dev_t */
@@ -116,6 +139,172 @@ static inline bool ramdisk_fd_invalid(rd_fd_t *fd) {
     return(!fd || (!fd->file));
 }
 
+/* Free all of a file's data. */
+static void ramdisk_free_data(rd_file_t *f) {
+    int i;
+
+    for(i = 0; i < f->extcnt; i++)
+        free(f->ext[i].data);
+
+    free(f->ext);
+    f->ext = NULL;
+    f->extcnt = f->extmax = 0;
+    f->datasize = 0;
+}
+
+/* Add a block to the end of a file's data. */
+static int ramdisk_add_extent(rd_file_t *f, void *data, uint32_t size) {
+    rd_extent_t *ne;
+
+    if(f->extcnt == f->extmax) {
+        ne = realloc(f->ext, (f->extmax ? f->extmax * 2 : 4) * sizeof(*ne));
+
+        if(ne == NULL)
+            return -1;
+
+        f->ext = ne;
+        f->extmax = f->extmax ? f->extmax * 2 : 4;
+    }
+
+    f->ext[f->extcnt].data = data;
+    f->ext[f->extcnt].offset = f->datasize;
+    f->ext[f->extcnt].size = size;
+    f->extcnt++;
+    f->datasize += size;
+
+    return 0;
+}
+
+/* Make sure a file can hold at least need bytes. Assumes we hold the
+   file's lock. */
+static int ramdisk_grow(rd_file_t *f, uint32_t need) {
+    uint32_t    size;
+    void        *data;
+
+    if(need <= f->datasize)
+        return 0;
+
+    /* Double the capacity, within limits, but always add enough for what
+       is needed in one go. */
+    size = f->datasize < (uint32_t)rd_blksize ? (uint32_t)rd_blksize : f->datasize;
+
+    if(size > RAMDISK_MAX_EXTENT)
+        size = RAMDISK_MAX_EXTENT;
+
+    if(size < need - f->datasize)
+        size = __align_up(need - f->datasize, rd_blksize);
+
+    if(!(data = malloc(size)))
+        return -1;
+
+    if(ramdisk_add_extent(f, data, size) < 0) {
+        free(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Find the extent holding byte pos of a file, which must be within its
+   capacity. hint is the last one used, which is the right one or the one
+   before it for reads and writes that go through in order. */
+static int ramdisk_find_extent(rd_file_t *f, uint32_t pos, int hint) {
+    int lo = 0, hi = f->extcnt - 1, mid;
+
+    if(hint >= 0 && hint < f->extcnt && pos >= f->ext[hint].offset) {
+        if(pos - f->ext[hint].offset < f->ext[hint].size)
+            return hint;
+        else if(hint + 1 < f->extcnt &&
+                pos - f->ext[hint + 1].offset < f->ext[hint + 1].size)
+            return hint + 1;
+    }
+
+    while(lo < hi) {
+        mid = (lo + hi + 1) / 2;
+
+        if(f->ext[mid].offset <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+/* Copy bytes between buf and the file at the fd's position, which must be
+   within the file's capacity, and move the position along. Assumes we hold
+   the file's lock. */
+static void ramdisk_copy(rd_fd_t *fd, void *buf, size_t bytes, bool write) {
+    rd_file_t   *f = fd->file;
+    rd_extent_t *e;
+    uint8_t     *b = buf;
+    uint32_t    o;
+    size_t      n;
+    int         i = fd->ext;
+
+    while(bytes) {
+        i = ramdisk_find_extent(f, fd->ptr, i);
+        e = f->ext + i;
+        o = fd->ptr - e->offset;
+        n = e->size - o;
+
+        if(n > bytes)
+            n = bytes;
+
+        if(write)
+            memcpy(e->data + o, b, n);
+        else
+            memcpy(b, e->data + o, n);
+
+        b += n;
+        fd->ptr += n;
+        bytes -= n;
+    }
+
+    fd->ext = i;
+}
+
+/* Put a file's data in one block, so that it can be handed out. If the file
+   has been mapped already, through any fd (the caller's too), it can only be
+   joined up again once those fds have been closed, as the block they were
+   given would go away. Assumes we hold the file's lock. */
+static void *ramdisk_join(rd_file_t *f) {
+    uint8_t     *data;
+    uint32_t    size;
+    int         i;
+
+    if(f->extcnt == 1)
+        return f->ext[0].data;
+
+    if(f->mapped) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    size = f->size < (uint32_t)rd_blksize ? (uint32_t)rd_blksize : f->size;
+
+    if(!(data = malloc(size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(i = 0; i < f->extcnt && f->ext[i].offset < f->size; i++) {
+        memcpy(data + f->ext[i].offset, f->ext[i].data,
+               f->size - f->ext[i].offset < f->ext[i].size ?
+               f->size - f->ext[i].offset : f->ext[i].size);
+    }
+
+    ramdisk_free_data(f);
+
+    if(ramdisk_add_extent(f, data, size) < 0) {
+        free(data);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return data;
+}
+
 /* Search a directory for the named file; return the struct if
    we find it. Assumes we hold rd_mutex. */
 static rd_file_t *ramdisk_find(rd_dir_t *parent, const char *name, size_t namelen) {
@@ -242,24 +431,27 @@ static rd_file_t *ramdisk_create_file(rd_dir_t *parent, const char *fn, bool dir
     f->isdir = dir;
     f->openfor = OPENFOR_NOTHING;
     f->usage = 0;
+    f->data = NULL;
+    f->ext = NULL;
+    f->extcnt = f->extmax = 0;
+    f->datasize = 0;
+    f->mapped = 0;
 
-    if(!dir) {
-        /* Initial file is one block */
-        f->datasize = rd_blksize;
-        f->data = malloc(f->datasize);
-    }
-    else {
+    /* Files get their data as it is written */
+    if(dir) {
         f->data = malloc(sizeof(rd_dir_t));
-        f->datasize = 0;
-    }
 
-    if(f->data == NULL) {
-        free(f->name);
-        free(f);
-        errno = ENOMEM;
-        return NULL;
+        if(f->data == NULL) {
+            free(f->name);
+            free(f);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        LIST_INIT((rd_dir_t *)f->data);
     }
 
+    mutex_init(&f->lock, MUTEX_TYPE_NORMAL);
     LIST_INSERT_HEAD(pdir, f, dirlist);
 
     return f;
@@ -350,9 +542,7 @@ static void *ramdisk_open(vfs_handler_t *vfs, const char *fn, int mode) {
             fd->ptr = f->size;
         /* If we're opening with O_TRUNC, kill the existing contents */
         else if(mode & O_TRUNC) {
-            free(f->data);
-            f->datasize = rd_blksize;
-            f->data = malloc(f->datasize);
+            ramdisk_free_data(f);
             f->size = 0;
             fd->ptr = 0;
         }
@@ -394,6 +584,12 @@ static int ramdisk_close(void *h) {
     f = fd->file;
     fd->file = NULL;
 
+    if(fd->mapped) {
+        mutex_lock(&f->lock);
+        f->mapped--;
+        mutex_unlock(&f->lock);
+    }
+
     /* Decrease the usage count */
     f->usage--;
     assert(f->usage >= 0);
@@ -414,21 +610,20 @@ static int ramdisk_close(void *h) {
 static ssize_t ramdisk_read(void *h, void *buf, size_t bytes) {
     rd_fd_t     *fd = h;
 
-    mutex_lock_scoped(&rd_mutex);
-
     /* Check that the fd is invalid or a dir */
     if(ramdisk_fd_invalid(fd) || fd->dir) {
         errno = EBADF;
         return (ssize_t)-1;
     }
 
+    mutex_lock_scoped(&fd->file->lock);
+
     /* Is there enough left? */
     if((fd->ptr + bytes) > fd->file->size)
         bytes = fd->file->size - fd->ptr;
 
     /* Copy out the requested amount */
-    memcpy(buf, ((uint8_t *)fd->file->data) + fd->ptr, bytes);
-    fd->ptr += bytes;
+    ramdisk_copy(fd, buf, bytes, false);
 
     return bytes;
 }
@@ -437,8 +632,6 @@ static ssize_t ramdisk_read(void *h, void *buf, size_t bytes) {
 static ssize_t ramdisk_write(void *h, const void *buf, size_t bytes) {
     rd_fd_t     *fd = h;
 
-    mutex_lock_scoped(&rd_mutex);
-
     /* Check that the fd is invalid or a dir or not open for writing */
     if(ramdisk_fd_invalid(fd) || fd->dir ||
         (fd->file->openfor != OPENFOR_WRITE)) {
@@ -446,23 +639,19 @@ static ssize_t ramdisk_write(void *h, const void *buf, size_t bytes) {
         return (ssize_t)-1;
     }
 
+    mutex_lock_scoped(&fd->file->lock);
+
     /* Is there enough left? */
     if((fd->ptr + bytes) > fd->file->datasize) {
-        /* We need to realloc the block */
-        void *np = realloc(fd->file->data, (fd->ptr + bytes) + (rd_blksize * 4));
-
-        if(np == NULL) {
+        /* We need another extent */
+        if(ramdisk_grow(fd->file, fd->ptr + bytes) < 0) {
             errno = ENOSPC;
             return -1;
         }
-
-        fd->file->data = np;
-        fd->file->datasize = (fd->ptr + bytes) + (rd_blksize * 4);
     }
 
-    /* Copy out the requested amount */
-    memcpy(((uint8_t *)fd->file->data) + fd->ptr, buf, bytes);
-    fd->ptr += bytes;
+    /* Copy in the requested amount */
+    ramdisk_copy(fd, (void *)buf, bytes, true);
 
     if(fd->file->size < fd->ptr) {
         fd->file->size = fd->ptr;
@@ -475,14 +664,14 @@ static ssize_t ramdisk_write(void *h, const void *buf, size_t bytes) {
 static off_t ramdisk_seek(void *h, off_t offset, int whence) {
     rd_fd_t     *fd = h;
 
-    mutex_lock_scoped(&rd_mutex);
-
     /* Check that the fd is invalid or a dir */
     if(ramdisk_fd_invalid(fd) || fd->dir) {
         errno = EBADF;
         return -1;
     }
 
+    mutex_lock_scoped(&fd->file->lock);
+
     /* Update current position according to arguments */
     switch(whence) {
         case SEEK_SET:
@@ -528,14 +717,14 @@ static off_t ramdisk_seek(void *h, off_t offset, int whence) {
 static off_t ramdisk_tell(void *h) {
     rd_fd_t     *fd = h;
 
-    mutex_lock_scoped(&rd_mutex);
-
     /* Check that the fd is invalid or a dir */
     if(ramdisk_fd_invalid(fd) || fd->dir) {
         errno = EBADF;
         return -1;
     }
 
+    mutex_lock_scoped(&fd->file->lock);
+
     return fd->ptr;
 }
 
@@ -543,14 +732,14 @@ static off_t ramdisk_tell(void *h) {
 static size_t ramdisk_total(void *h) {
     rd_fd_t     *fd = h;
 
-    mutex_lock_scoped(&rd_mutex);
-
     /* Check that the fd is invalid or a dir */
     if(ramdisk_fd_invalid(fd) || fd->dir) {
         errno = EBADF;
         return -1;
     }
 
+    mutex_lock_scoped(&fd->file->lock);
+
     return fd->file->size;
 }
 
@@ -612,6 +801,8 @@ static int ramdisk_unlink(vfs_handler_t *vfs, const char *fn) {
     /* Free its data */
     free(f->name);
     free(f->data);
+    ramdisk_free_data(f);
+    mutex_destroy(&f->lock);
 
     /* Remove it from the parent list */
     LIST_REMOVE(f, dirlist);
@@ -622,15 +813,27 @@ static int ramdisk_unlink(vfs_handler_t *vfs, const char *fn) {
     return 0;
 }
 
+/* Map a file. The data is used where it is, so the pointer stays good
+   until the file is closed (or truncated), though it only covers what was in
+   the file when it was mapped. */
 static void *ramdisk_mmap(void *h) {
     rd_fd_t     *fd = h;
-
-    mutex_lock_scoped(&rd_mutex);
+    void        *data;
 
     /* Check that the fd is invalid or a dir */
     if(ramdisk_fd_invalid(fd) || fd->dir) return NULL;
 
-    return fd->file->data;
+    mutex_lock_scoped(&fd->file->lock);
+
+    if(!(data = ramdisk_join(fd->file)))
+        return NULL;
+
+    if(!fd->mapped) {
+        fd->mapped = true;
+        fd->file->mapped++;
+    }
+
+    return data;
 }
 
 static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
@@ -661,12 +864,14 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
         return -1;
     }
 
+    mutex_lock_scoped(&f->lock);
+
     memset(st, 0, sizeof(struct stat));
     st->st_dev = rd_dev;
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->isdir) ?
         (S_IFDIR | S_IXUSR | S_IXGRP | S_IXOTH) : S_IFREG;
-    st->st_size = (f->isdir) ? -1 : (int)f->datasize;
+    st->st_size = (f->isdir) ? -1 : (int)f->size;
     st->st_nlink = (f->isdir) ? 2 : 1;
     st->st_blksize = rd_blksize;
     st->st_blocks = __align_up(f->datasize, rd_blksize) / rd_blksize;
@@ -733,13 +938,14 @@ static int ramdisk_fstat(void *h, struct stat *st) {
 
     /* Grab the file itself... */
     f = fd->file;
+    mutex_lock_scoped(&f->lock);
 
     /* Fill in the structure. */
     memset(st, 0, sizeof(struct stat));
     st->st_dev = rd_dev;
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->isdir) ? S_IFDIR : S_IFREG;
-    st->st_size = (f->isdir) ? -1 : (int)f->datasize;
+    st->st_size = (f->isdir) ? -1 : (int)f->size;
     st->st_nlink = (f->isdir) ? 2 : 1;
     st->st_blksize = rd_blksize;
     st->st_blocks = __align_up(f->datasize, rd_blksize) / rd_blksize;
@@ -791,7 +997,8 @@ static vfs_handler_t vh = {
 
 /* Attach a piece of memory to a file. This works somewhat like open for
    writing, but it doesn't actually attach the file to an fd, and it starts
-   out with data instead of being blank. */
+   out with data instead of being blank. The block only becomes ours once
+   this succeeds; on failure, the caller still owns it. */
 int fs_ramdisk_attach(const char *fn, void *obj, size_t size) {
     rd_fd_t     *fd;
     rd_file_t   *f;
@@ -803,11 +1010,19 @@ int fs_ramdisk_attach(const char *fn, void *obj, size_t size) {
     if(fd == NULL)
         return -1;
 
-    /* Ditch the data block we had and replace it with the user one. */
+    /* The user block becomes the file's only extent, as it is. */
     f = fd->file;
-    free(f->data);
-    f->data = obj;
-    f->datasize = size;
+
+    if(!size)
+        free(obj);
+    else if(ramdisk_add_extent(f, obj, size) < 0) {
+        /* obj never made it into the file, so this leaves it alone. */
+        ramdisk_close(fd);
+        ramdisk_unlink(&vh, fn);
+        errno = ENOMEM;
+        return -1;
+    }
+
     f->size = size;
 
     /* Close the file */
@@ -833,13 +1048,25 @@ int fs_ramdisk_detach(const char *fn, void **obj, size_t *size) {
     assert(size != NULL);
 
     f = fd->file;
-    *obj = f->data;
+    mutex_lock(&f->lock);
+
+    /* Hand over the data as one block; a file that was attached and hasn't
+       been grown since is already in one. */
+    if(!(*obj = ramdisk_join(f))) {
+        mutex_unlock(&f->lock);
+        ramdisk_close(fd);
+        return -1;
+    }
+
     *size = f->size;
 
-    /* Ditch the data block we had and replace it with a fake one. */
-    f->data = NULL;
+    /* Forget about the block without freeing it. */
+    free(f->ext);
+    f->ext = NULL;
+    f->extcnt = f->extmax = 0;
     f->datasize = 0;
     f->size = 0;
+    mutex_unlock(&f->lock);
 
     /* Close the file */
     ramdisk_close(fd);
@@ -878,7 +1105,11 @@ void fs_ramdisk_init(void) {
     root->openfor = OPENFOR_NOTHING;
     root->usage = 0;
     root->data = rootdir;
+    root->ext = NULL;
+    root->extcnt = root->extmax = 0;
     root->datasize = 0;
+    root->mapped = 0;
+    mutex_init(&root->lock, MUTEX_TYPE_NORMAL);
 
     LIST_INIT(rootdir);
 
@@ -912,11 +1143,14 @@ void fs_ramdisk_shutdown(void) {
         LIST_REMOVE(f1, dirlist);
         free(f1->name);
         free(f1->data);
+        ramdisk_free_data(f1);
+        mutex_destroy(&f1->lock);
         free(f1);
     }
 
     free(rootdir);
     free(root->name);
+    mutex_destroy(&root->lock);
     free(root);
 
     mutex_destroy(&rd_mutex);
@@ -26,6 +26,7 @@ on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian
 #include <stdint.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
@@ -78,6 +79,19 @@ static uint32_t ntohl_32(const void *data) {
 struct rd_image;
 typedef LIST_HEAD(rdi_list, rd_image) rdi_list_t;
 
+/* A slot in the hashed index of an image. Each file and directory is in here
+   under the directory it's in (as the offset of the first entry of that
+   directory, which is what a lookup has in hand at that point). */
+typedef struct {
+    uint32_t            dir;        /* First entry of the containing dir */
+    uint32_t            entry;      /* Offset of the entry, 0 if free */
+} rd_index_slot_t;
+
+/* State of the index of an image */
+#define RD_INDEX_NONE   0           /* Not built yet */
+#define RD_INDEX_BUILT  1           /* Built, use it */
+#define RD_INDEX_NOPE   2           /* Not worth it or couldn't be built */
+
 /* A single mounted romdisk image; a pointer to one of these will be in our
    VFS struct for each mount. */
 typedef struct rd_image {
@@ -85,8 +99,13 @@ typedef struct rd_image {
 
     bool                own_buffer; /* Do we own the memory? */
     const uint8_t       *image;     /* The actual image */
+    uint32_t            size;       /* Size of the image, from its header */
     uint32_t            files;      /* Offset in the image to the files area */
     vfs_handler_t       *vfsh;      /* Our VFS mount struct */
+
+    volatile int        index_state; /* One of RD_INDEX_* */
+    rd_index_slot_t     *index;     /* Hashed index of all entries */
+    uint32_t            index_mask; /* Number of slots, less one */
 } rd_image_t;
 
 /* Global list of mounted romdisks */
@@ -125,6 +144,167 @@ static inline bool romdisk_fd_invalid(rd_fd_t *fd) {
 /* We use it for both the files list and the images list. */
 static mutex_t fh_mutex;
 
+/********************************************************************************/
+/* Hashed index. Looking a name up by walking the entries of a directory gets
+   slow with a few thousand files, so the first lookup on an image with at
+   least ROMDISK_INDEX_MIN entries goes through the whole thing and puts every
+   file and directory into an open-addressed hash table, keyed on the
+   directory it's in and its name (without regard to case). The image can't
+   change under us, so the index never needs updating. */
+
+static uint32_t rd_index_hash(uint32_t dir, const char *fn, size_t fnlen) {
+    uint32_t h = 2166136261U ^ dir;
+
+    while(fnlen--) {
+        h ^= (uint8_t)tolower((uint8_t)*fn++);
+        h *= 16777619U;
+    }
+
+    return h ^ (h >> 15);
+}
+
+/* The entries of a directory that a lookup can find: files and directories,
+   but not the hard links that "." and ".." are. */
+static inline bool rd_index_kind(uint32_t type) {
+    return (type & 3) == 1 || (type & 3) == 2;
+}
+
+static inline bool rd_entry_matches(const rd_image_t *mnt, uint32_t entry,
+                                    const char *fn, size_t fnlen, bool dir) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(mnt->image + entry);
+    uint32_t type = ntohl_32(&fhdr->next_header) & 3;
+
+    return type == (dir ? 1 : 2) && strlen(fhdr->filename) == fnlen &&
+           !strncasecmp(fhdr->filename, fn, fnlen);
+}
+
+/* Add an entry, unless there's one of the same kind and name in the same
+   directory already: the first one in the directory is the one a walk of it
+   would have found. */
+static void rd_index_add(rd_image_t *mnt, uint32_t dir, uint32_t entry) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(mnt->image + entry);
+    size_t len = strlen(fhdr->filename);
+    bool isdir = (ntohl_32(&fhdr->next_header) & 3) == 1;
+    uint32_t i = rd_index_hash(dir, fhdr->filename, len) & mnt->index_mask;
+
+    while(mnt->index[i].entry) {
+        if(mnt->index[i].dir == dir &&
+           rd_entry_matches(mnt, mnt->index[i].entry, fhdr->filename, len,
+                            isdir))
+            return;
+
+        i = (i + 1) & mnt->index_mask;
+    }
+
+    mnt->index[i].dir = dir;
+    mnt->index[i].entry = entry;
+}
+
+/* Go through every directory in the image, counting the entries to index or
+   (once there's a table for them) adding them. Returns the count, or -1 if
+   the image doesn't make sense. */
+static int rd_index_walk(rd_image_t *mnt, bool add) {
+    uint32_t *dirs = NULL, *tmp;
+    size_t ndirs = 1, maxdirs = 0, d;
+    uint32_t i, ni, type, seen = 0;
+    const romdisk_file_t *fhdr;
+    int count = 0;
+
+    /* Every entry takes at least 32 bytes, so a walk that has seen more than
+       that many has gone around in circles. */
+    const uint32_t max_entries = mnt->size / 32;
+
+    for(d = 0; d < ndirs; d++) {
+        i = d ? dirs[d] : mnt->files;
+
+        while(i) {
+            if(i >= mnt->size || ++seen > max_entries) {
+                free(dirs);
+                return -1;
+            }
+
+            fhdr = (const romdisk_file_t *)(mnt->image + i);
+            ni = ntohl_32(&fhdr->next_header);
+            type = ni & 0x0f;
+
+            if(rd_index_kind(type)) {
+                if(add)
+                    rd_index_add(mnt, d ? dirs[d] : mnt->files, i);
+
+                ++count;
+            }
+
+            /* "." (and sometimes "..") are directories too, but don't
+               need going into again. */
+            if((type & 7) == ROMFH_DIR && strcmp(fhdr->filename, ".") &&
+               strcmp(fhdr->filename, "..")) {
+                if(ndirs >= maxdirs) {
+                    maxdirs = maxdirs ? maxdirs * 2 : 16;
+
+                    if(!(tmp = realloc(dirs, maxdirs * sizeof(uint32_t)))) {
+                        free(dirs);
+                        return -1;
+                    }
+
+                    dirs = tmp;
+                }
+
+                dirs[ndirs++] = ntohl_32(&fhdr->spec_info);
+            }
+
+            i = ni & 0xfffffff0;
+        }
+    }
+
+    free(dirs);
+    return count;
+}
+
+static void rd_index_build(rd_image_t *mnt) {
+    uint32_t slots = 16;
+    int count;
+
+    mutex_lock_scoped(&fh_mutex);
+
+    if(mnt->index_state != RD_INDEX_NONE)
+        return;
+
+    if((count = rd_index_walk(mnt, false)) < ROMDISK_INDEX_MIN) {
+        mnt->index_state = RD_INDEX_NOPE;
+        return;
+    }
+
+    /* Keep the table at most three quarters full */
+    while(slots < (uint32_t)count + (uint32_t)count / 3)
+        slots <<= 1;
+
+    if(!(mnt->index = calloc(slots, sizeof(rd_index_slot_t)))) {
+        dbglog(DBG_WARNING, "fs_romdisk: no memory to index image at %p\n",
+               mnt->image);
+        mnt->index_state = RD_INDEX_NOPE;
+        return;
+    }
+
+    mnt->index_mask = slots - 1;
+    rd_index_walk(mnt, true);
+    mnt->index_state = RD_INDEX_BUILT;
+}
+
+static uint32_t rd_index_find(rd_image_t *mnt, const char *fn, size_t fnlen,
+                              bool dir, uint32_t offset) {
+    uint32_t i = rd_index_hash(offset, fn, fnlen) & mnt->index_mask;
+
+    while(mnt->index[i].entry) {
+        if(mnt->index[i].dir == offset &&
+           rd_entry_matches(mnt, mnt->index[i].entry, fn, fnlen, dir))
+            return mnt->index[i].entry;
+
+        i = (i + 1) & mnt->index_mask;
+    }
+
+    return 0;
+}
+
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
@@ -132,6 +312,12 @@ static uint32_t romdisk_find_object(rd_image_t *mnt, const char *fn, size_t fnle
     uint32_t          i, ni, type;
     const romdisk_file_t    *fhdr;
 
+    if(mnt->index_state == RD_INDEX_NONE)
+        rd_index_build(mnt);
+
+    if(mnt->index_state == RD_INDEX_BUILT)
+        return rd_index_find(mnt, fn, fnlen, dir, offset);
+
     i = offset;
 
     do {
@@ -636,6 +822,8 @@ static void fs_romdisk_list_remove(rd_image_t *n) {
     assert((void *)&n->vfsh->nmmgr == (void *)n->vfsh);
     nmmgr_handler_remove(&n->vfsh->nmmgr);
 
+    free(n->index);
+
     /* If we own the buffer, free it */
     if(n->own_buffer) {
         dbglog(DBG_DEBUG, "   (and also freeing its image buffer)\n");
@@ -724,9 +912,15 @@ int fs_romdisk_mount(const char *mountpoint, const uint8_t *img, bool own_buffer
     }
     mnt->own_buffer = own_buffer;
     mnt->image = img;
+    mnt->size = ntohl_32(&hdr->full_size);
     mnt->files = sizeof(romdisk_hdr_t)
                  + (strlen(hdr->volume_name) / RD_VN_MAX) * RD_VN_MAX;
 
+    /* The index is built on the first lookup */
+    mnt->index_state = RD_INDEX_NONE;
+    mnt->index = NULL;
+    mnt->index_mask = 0;
+
     /* Make a VFS struct */
     vfsh = (vfs_handler_t *)malloc(sizeof(vfs_handler_t));
 
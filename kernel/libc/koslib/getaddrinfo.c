@@ -38,6 +38,8 @@
 
 #include <kos/net.h>
 #include <kos/dbglog.h>
+#include <kos/once.h>
+#include <kos/slab.h>
 
 /* How many attempts to make at contacting the DNS server before giving up. */
 #define DNS_ATTEMPTS    4
@@ -518,20 +520,46 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
 
 /* New stuff below here... */
 
+/* Each result and the address it points at are allocated together, out of a
+   cache made the first time one is needed. */
+typedef struct ai_node {
+    struct addrinfo ai;
+
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;
+} ai_node_t;
+
+static slab_cache_t *ai_slab;
+static kthread_once_t ai_slab_once = KTHREAD_ONCE_INIT;
+
+static void ai_slab_init(void) {
+    ai_slab = slab_cache_create_type("getaddrinfo", ai_node_t, NULL, NULL, 0);
+}
+
+static ai_node_t *ai_alloc(void) {
+    kthread_once(&ai_slab_once, ai_slab_init);
+
+    if(!ai_slab) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return (ai_node_t *)slab_alloc(ai_slab);
+}
+
 static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
                                     struct addrinfo *h, struct addrinfo *tail) {
     struct addrinfo *result;
     struct sockaddr_in *addr;
+    ai_node_t *node;
 
-    /* Allocate all our space first. */
-    if(!(result = (struct addrinfo *)malloc(sizeof(struct addrinfo)))) {
+    if(!(node = ai_alloc()))
         return NULL;
-    }
 
-    if(!(addr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in)))) {
-        free(result);
-        return NULL;
-    }
+    result = &node->ai;
+    addr = &node->addr.in;
 
     /* Fill in the sockaddr_in structure */
     memset(addr, 0, sizeof(struct sockaddr_in));
@@ -561,16 +589,13 @@ static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
                                     struct addrinfo *h, struct addrinfo *tail) {
     struct addrinfo *result;
     struct sockaddr_in6 *addr;
+    ai_node_t *node;
 
-    /* Allocate all our space first. */
-    if(!(result = (struct addrinfo *)malloc(sizeof(struct addrinfo)))) {
+    if(!(node = ai_alloc()))
         return NULL;
-    }
 
-    if(!(addr = (struct sockaddr_in6 *)malloc(sizeof(struct sockaddr_in6)))) {
-        free(result);
-        return NULL;
-    }
+    result = &node->ai;
+    addr = &node->addr.in6;
 
     /* Fill in the sockaddr_in structure */
     memset(addr, 0, sizeof(struct sockaddr_in6));
@@ -603,10 +628,10 @@ void freeaddrinfo(struct addrinfo *ai) {
     while(ai) {
         next = ai->ai_next;
 
-        /* Free up anything that might have been malloced. */
-        free(ai->ai_addr);
+        /* Free up anything that might have been malloced. The address is
+           part of the same node. */
         free(ai->ai_canonname);
-        free(ai);
+        slab_free(ai_slab, ai);
 
         /* Continue to the next entry, if any. */
         ai = next;
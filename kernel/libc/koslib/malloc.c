@@ -25,6 +25,8 @@
 #include <kos/dbglog.h>
 #include <kos/opts.h>
 #include <kos/mutex.h>
+#include <kos/thread.h>
+#include <kos/irq.h>
 
 #undef DEBUG
 
@@ -1592,6 +1594,11 @@ static size_t   mUSABLe(Void_t*);
 static void     mSTATs(void);
 static int      mALLOPt(int, int);
 static struct mallinfo mALLINFo(void);
+
+#ifndef KM_DBG
+static Void_t*  tcache_get(size_t);
+static int      tcache_put(Void_t*);
+#endif
 #else
 static Void_t*  mALLOc();
 static void     fREe();
@@ -1793,6 +1800,9 @@ Void_t* public_mALLOc(size_t bytes) {
 #ifdef KM_DBG
     uint32_t rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     memctl_t * ctl;
+#else
+    if((m = tcache_get(bytes)))
+        return m;
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -1856,6 +1866,11 @@ void public_fREe(Void_t* m) {
     if(m == NULL)
         return;
 
+#ifndef KM_DBG
+    if(tcache_put(m))
+        return;
+#endif
+
     if(MALLOC_PREACTION != 0) {
         return;
     }
@@ -2096,6 +2111,14 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     uint32_t rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     size_t bytes = n * elem_size;
     memctl_t * ctl;
+#else
+    size_t bytes;
+
+    if(!__builtin_mul_overflow(n, elem_size, &bytes) &&
+       (m = tcache_get(bytes))) {
+        memset(m, 0, bytes);
+        return m;
+    }
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -5326,6 +5349,192 @@ int value;
 }
 
 
+/*** Begin KOS Code ***/
+/*
+  -------------------------- thread caches --------------------------
+
+  Small blocks that a thread frees are kept in a cache of its own, with a
+  list for each chunk size, and handed straight back out by its next
+  malloc() or calloc() of that size without taking the lock. As far as the
+  arena is concerned they're still in use (and mallinfo() and malloc_stats()
+  count them that way). A list that runs dry is filled with a batch of
+  blocks at once under a single lock, and one that gets too long gives half
+  of its blocks back the same way. The whole cache goes back to the arena
+  when the thread is destroyed, or when malloc_thread_flush() is called.
+
+  IRQ handlers don't use the caches at all, since they could be in the
+  middle of changing the interrupted thread's one.
+*/
+
+#ifndef KM_DBG
+
+/* Largest chunk size that's cached */
+#define TCACHE_MAX_CHUNK    256
+
+#define TCACHE_CLASSES      (TCACHE_MAX_CHUNK / (int)MALLOC_ALIGNMENT + 1)
+
+/* How many bytes' worth of blocks each list may hold, and the fewest
+   blocks it may hold all the same */
+#define TCACHE_BYTES        512
+#define TCACHE_MIN          2
+
+struct malloc_tcache {
+    Void_t *head[TCACHE_CLASSES];
+    uint8_t count[TCACHE_CLASSES];
+};
+
+static inline int tcache_limit(int c) {
+    int n = TCACHE_BYTES / (c * MALLOC_ALIGNMENT);
+
+    return n < TCACHE_MIN ? TCACHE_MIN : n;
+}
+
+/* Give count blocks from a list back to the arena, with the lock held. */
+static void tcache_release(struct malloc_tcache *tc, int c, int count) {
+    Void_t *m;
+
+    while(count-- && (m = tc->head[c])) {
+        tc->head[c] = *(Void_t **)m;
+        tc->count[c]--;
+        fREe(m);
+    }
+}
+
+/* The current thread's cache, made if need be, or NULL if it can't use
+   one. */
+static struct malloc_tcache *tcache_current(void) {
+    kthread_t *thd = thd_current;
+    struct malloc_tcache *tc;
+
+    if(!thd || irq_inside_int())
+        return NULL;
+
+    if((tc = thd->malloc_cache))
+        return tc;
+
+    if(MALLOC_PREACTION != 0)
+        return NULL;
+
+    if((tc = mALLOc(sizeof(struct malloc_tcache))))
+        memset(tc, 0, sizeof(struct malloc_tcache));
+
+    (void)MALLOC_POSTACTION;
+
+    return thd->malloc_cache = tc;
+}
+
+static Void_t* tcache_get(size_t bytes) {
+    struct malloc_tcache *tc;
+    CHUNK_SIZE_T nb;
+    Void_t *m;
+    int c, i;
+
+    if(bytes > TCACHE_MAX_CHUNK)
+        return NULL;
+
+    nb = request2size(bytes);
+
+    if(nb > TCACHE_MAX_CHUNK || !(tc = tcache_current()))
+        return NULL;
+
+    c = nb / MALLOC_ALIGNMENT;
+
+    if(!tc->head[c]) {
+        if(MALLOC_PREACTION != 0)
+            return NULL;
+
+        /* Fill half of the list, asking for exactly the size the list is
+           for. Some blocks may come back a little bigger than that, which
+           doesn't matter. */
+        for(i = tcache_limit(c) / 2; i > 0; i--) {
+            if(!(m = mALLOc(nb - SIZE_SZ)))
+                break;
+
+            *(Void_t **)m = tc->head[c];
+            tc->head[c] = m;
+            tc->count[c]++;
+        }
+
+        (void)MALLOC_POSTACTION;
+
+        if(!tc->head[c])
+            return NULL;
+    }
+
+    m = tc->head[c];
+    tc->head[c] = *(Void_t **)m;
+    tc->count[c]--;
+
+    return m;
+}
+
+static int tcache_put(Void_t* m) {
+    struct malloc_tcache *tc;
+    mchunkptr p = mem2chunk(m);
+    CHUNK_SIZE_T size = chunksize(p);
+    int c;
+
+    if(size > TCACHE_MAX_CHUNK || chunk_is_mmapped(p) ||
+       !(tc = tcache_current()))
+        return 0;
+
+    /* Blocks go on the list for the size they really are, so everything on
+       a list is at least as big as the list says. */
+    c = size / MALLOC_ALIGNMENT;
+    *(Void_t **)m = tc->head[c];
+    tc->head[c] = m;
+
+    if(++tc->count[c] > tcache_limit(c)) {
+        if(MALLOC_PREACTION == 0) {
+            tcache_release(tc, c, tc->count[c] / 2);
+            (void)MALLOC_POSTACTION;
+        }
+    }
+
+    return 1;
+}
+
+static void tcache_destroy(struct malloc_tcache *tc) {
+    int c;
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    for(c = 0; c < TCACHE_CLASSES; c++)
+        tcache_release(tc, c, tc->count[c]);
+
+    fREe(tc);
+
+    (void)MALLOC_POSTACTION;
+}
+
+#endif  /* !KM_DBG */
+
+void malloc_thread_flush(void) {
+#ifndef KM_DBG
+    kthread_t *thd = thd_current;
+
+    if(thd && thd->malloc_cache && !irq_inside_int()) {
+        tcache_destroy(thd->malloc_cache);
+        thd->malloc_cache = NULL;
+    }
+#endif
+}
+
+/* Called by thd_destroy(), once nothing else will run on the thread. */
+void __malloc_thread_destroy(kthread_t *thd) {
+#ifndef KM_DBG
+    if(thd->malloc_cache) {
+        tcache_destroy(thd->malloc_cache);
+        thd->malloc_cache = NULL;
+    }
+#else
+    (void)thd;
+#endif
+}
+/*** End KOS Code ***/
+
+
 /*
   -------------------- Alternative MORECORE functions --------------------
 */
@@ -7,52 +7,267 @@
 
 #include <poll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
 
 #include <kos/fs.h>
 #include <kos/irq.h>
 #include <kos/mutex.h>
 #include <kos/cond.h>
+#include <arch/timer.h>
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
+/* Interest in events is indexed by file descriptor. Each fd has a list of the
+   registrations (made either through epoll_ctl() or by a thread sitting in
+   poll()) that want to hear about it, so an event only costs as much as the
+   number of things watching that particular fd. Registrations that have seen
+   an event sit on the ready list of the instance they belong to until the
+   event is collected. */
+
+struct poll_ep;
+
+struct poll_item {
+    LIST_ENTRY(poll_item) fd_entry;     /* Registrations for the same fd */
+    LIST_ENTRY(poll_item) ep_entry;     /* Registrations in the same instance */
+    TAILQ_ENTRY(poll_item) rdy_entry;   /* Instance's ready list */
+    struct poll_ep *ep;
+    int fd;                             /* -1 once off the fd's list */
+    uint32_t events;
+    short revents;                      /* Events seen since last collected */
+    int ready;                          /* Is it on the ready list? */
+    int armed;                          /* Cleared by EPOLLONESHOT */
+    epoll_data_t data;
+};
+
+LIST_HEAD(poll_item_list, poll_item);
+TAILQ_HEAD(poll_ready_list, poll_item);
+
+struct poll_ep {
+    struct poll_item_list items;
+    struct poll_ready_list ready;
     condvar_t cv;
+    int temp;                           /* Belongs to a call to poll() */
 };
 
-LIST_HEAD(polllist, poll_int) poll_list;
+/* These are always reported, whether they were asked for or not. */
+#define POLL_ALWAYS (POLLERR | POLLHUP | POLLNVAL)
+
+/* Registrations made by poll() for up to this many fds live on the stack. */
+#define POLL_STACK_ITEMS 16
+
+static struct poll_item_list fd_items[FD_SETSIZE];
 
 static mutex_t mutex = MUTEX_INITIALIZER;
 
+static int epoll_close(void *hnd);
+static short epoll_poll(void *hnd, short events);
+
+static vfs_handler_t epoll_vh = {
+    /* Name handler */
+    {
+        "/epoll",       /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,        /* No cache, privdata */
+
+    NULL,            /* open */
+    epoll_close,     /* close */
+    NULL,            /* read */
+    NULL,            /* write */
+    NULL,            /* seek */
+    NULL,            /* tell */
+    NULL,            /* total */
+    NULL,            /* readdir */
+    NULL,            /* ioctl */
+    NULL,            /* rename */
+    NULL,            /* unlink */
+    NULL,            /* mmap */
+    NULL,            /* complete */
+    NULL,            /* stat */
+    NULL,            /* mkdir */
+    NULL,            /* rmdir */
+    NULL,            /* fcntl */
+    epoll_poll,      /* poll */
+    NULL,            /* link */
+    NULL,            /* symlink */
+    NULL,            /* seek64 */
+    NULL,            /* tell64 */
+    NULL,            /* total64 */
+    NULL,            /* readlink */
+    NULL,            /* rewinddir */
+    NULL             /* fstat */
+};
+
+/* Ask the handler of the fd what state it is in right now. */
+static short poll_query(int fd, short events) {
+    vfs_handler_t *hndl = fs_get_handler(fd);
+    void *hnd = fs_get_handle(fd);
+
+    /* If we didn't get one of these, then assume its a bad fd. */
+    if(!hndl || !hnd)
+        return POLLNVAL;
+
+    /* Assume its a regular file if there's no poll method in the handler. */
+    if(!hndl->poll)
+        return (POLLRDNORM | POLLWRNORM) & events;
+
+    return hndl->poll(hnd, events);
+}
+
+/* Everything below here that touches items or instances must be called with
+   the mutex held. */
+static void poll_item_link(struct poll_ep *ep, struct poll_item *i, int fd,
+                           uint32_t events) {
+    i->ep = ep;
+    i->fd = fd;
+    i->events = events;
+    i->revents = 0;
+    i->ready = 0;
+    i->armed = 1;
+    LIST_INSERT_HEAD(&fd_items[fd], i, fd_entry);
+    LIST_INSERT_HEAD(&ep->items, i, ep_entry);
+}
+
+static void poll_item_unlink(struct poll_item *i) {
+    if(i->fd >= 0) {
+        LIST_REMOVE(i, fd_entry);
+        i->fd = -1;
+    }
+
+    if(i->ready) {
+        TAILQ_REMOVE(&i->ep->ready, i, rdy_entry);
+        i->ready = 0;
+    }
+
+    LIST_REMOVE(i, ep_entry);
+}
+
+static void poll_item_ready(struct poll_item *i, short events) {
+    i->revents |= events;
+
+    if(!i->ready) {
+        TAILQ_INSERT_TAIL(&i->ep->ready, i, rdy_entry);
+        i->ready = 1;
+    }
+
+    cond_signal(&i->ep->cv);
+}
+
+/* Wait for something to show up on the instance's ready list, until the given
+   deadline (0 for no deadline). Returns 0 if something did, -1 on timeout. */
+static int poll_ep_wait(struct poll_ep *ep, uint64_t deadline) {
+    uint64_t now;
+    int tmp = errno, timeout = 0;
+
+    while(TAILQ_EMPTY(&ep->ready)) {
+        if(deadline) {
+            now = timer_ms_gettime64();
+
+            if(now >= deadline)
+                break;
+
+            timeout = (int)(deadline - now);
+        }
+
+        if(cond_wait_timed(&ep->cv, &mutex, timeout) && TAILQ_EMPTY(&ep->ready))
+            break;
+    }
+
+    errno = tmp;
+    return TAILQ_EMPTY(&ep->ready) ? -1 : 0;
+}
+
+/* Pull up to max events off the instance's ready list. */
+static int poll_ep_collect(struct poll_ep *ep, struct epoll_event *out,
+                           int max) {
+    struct poll_ready_list again = TAILQ_HEAD_INITIALIZER(again);
+    struct poll_item *i;
+    short mask, ev;
+    int n = 0;
+
+    while(n < max && (i = TAILQ_FIRST(&ep->ready))) {
+        TAILQ_REMOVE(&ep->ready, i, rdy_entry);
+        i->ready = 0;
+        i->revents = 0;
+
+        if(!i->armed)
+            continue;
+
+        /* Report the current state of the fd rather than whatever caused it to
+           be queued, since that may well have been dealt with already. */
+        mask = (short)i->events | POLL_ALWAYS;
+        if(!(ev = poll_query(i->fd, mask) & mask))
+            continue;
+
+        out[n].events = (uint16_t)ev;
+        out[n].data = i->data;
+        ++n;
+
+        /* Level-triggered fds get looked at again next time around, and only
+           drop off the list once they stop being ready. */
+        if(i->events & EPOLLONESHOT)
+            i->armed = 0;
+        else if(!(i->events & EPOLLET))
+            TAILQ_INSERT_TAIL(&again, i, rdy_entry);
+    }
+
+    while((i = TAILQ_FIRST(&again))) {
+        TAILQ_REMOVE(&again, i, rdy_entry);
+        TAILQ_INSERT_TAIL(&ep->ready, i, rdy_entry);
+        i->ready = 1;
+    }
+
+    return n;
+}
+
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
+    struct poll_item *i;
     short mask;
 
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
     if(mutex_lock_irqsafe(&mutex))
         /* XXXX: Uhh... this is bad... */
         return;
 
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
-                }
-            }
-        }
+    /* Only the registrations for this fd need to be looked at. */
+    LIST_FOREACH(i, &fd_items[fd], fd_entry) {
+        mask = (short)i->events | POLL_ALWAYS;
+
+        if(i->armed && (event & mask))
+            poll_item_ready(i, event & mask);
+    }
 
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
+    mutex_unlock(&mutex);
+}
+
+/* Called by fs_close() before the fd goes away. */
+void __poll_fd_closed(int fd) {
+    struct poll_item *i;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return;
+
+    while((i = LIST_FIRST(&fd_items[fd]))) {
+        if(i->ep->temp) {
+            /* Somebody is sitting in poll() on it, so let them know. Their
+               registration belongs to them, so just take it off the fd. */
+            LIST_REMOVE(i, fd_entry);
+            i->fd = -1;
+            poll_item_ready(i, POLLNVAL);
+        }
+        else {
+            poll_item_unlink(i);
+            free(i);
         }
     }
 
@@ -60,48 +275,25 @@ void __poll_event_trigger(int fd, short event) {
 }
 
 int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
-    int tmp;
+    struct poll_ep ep;
+    struct poll_item stack_items[POLL_STACK_ITEMS], *items = stack_items;
+    int nmatched = 0;
     nfds_t i;
-    vfs_handler_t *hndl;
-    void *hnd;
 
     if(mutex_lock_irqsafe(&mutex))
         return -1;
 
     /* Check if any of the fds already match */
     for(i = 0; i < nfds; ++i) {
-        hndl = fs_get_handler(fds[i].fd);
-        hnd = fs_get_handle(fds[i].fd);
-        fds[i].revents = 0;
-
-        /* If we didn't get one of these, then assume its a bad fd. */
-        if(!hndl || !hnd) {
-            fds[i].revents = POLLNVAL;
-            ++p.nmatched;
-            continue;
-        }
-
-        if(!hndl->poll) {
-            /* Assume its a regular file if there's no poll method in the
-               handler. */
-            if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
-                fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
-            }
-        }
-        else {
-            if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
-            }
-        }
+        if((fds[i].revents = poll_query(fds[i].fd, fds[i].events)))
+            ++nmatched;
     }
 
     /* If the user specified a 0 timeout, or we've already matched something,
        bail out now. */
-    if(p.nmatched || !timeout) {
+    if(nmatched || !timeout) {
         mutex_unlock(&mutex);
-        return p.nmatched;
+        return nmatched;
     }
 
     /* We can't actually wait while we're in an interrupt, so if we got this far
@@ -112,26 +304,238 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
         return -1;
     }
 
-    /* Map to the value used by cond_wait_timed() */
-    if(timeout == -1)
-        timeout = 0;
+    if(nfds > POLL_STACK_ITEMS &&
+       !(items = (struct poll_item *)malloc(sizeof(*items) * nfds))) {
+        mutex_unlock(&mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Register interest in each of the fds for the duration of the call. Every
+       one of them was valid above, or we wouldn't have made it this far. */
+    LIST_INIT(&ep.items);
+    TAILQ_INIT(&ep.ready);
+    cond_init(&ep.cv);
+    ep.temp = 1;
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+    for(i = 0; i < nfds; ++i)
+        poll_item_link(&ep, &items[i], fds[i].fd, (uint16_t)fds[i].events);
 
-    tmp = errno;
-    if(cond_wait_timed(&p.cv, &mutex, timeout)) {
-        errno = tmp;
-        tmp = 0;
-        goto out;
+    poll_ep_wait(&ep, timeout > 0 ? timer_ms_gettime64() + timeout : 0);
+
+    for(i = 0; i < nfds; ++i) {
+        if((fds[i].revents = items[i].revents))
+            ++nmatched;
+
+        poll_item_unlink(&items[i]);
     }
 
-    tmp = p.nmatched;
+    cond_destroy(&ep.cv);
+    mutex_unlock(&mutex);
+
+    if(items != stack_items)
+        free(items);
 
-out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+    return nmatched;
+}
+
+static struct poll_ep *epoll_get(int epfd) {
+    struct poll_ep *ep;
+
+    if(!fs_get_handler(epfd)) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(fs_get_handler(epfd) != &epoll_vh || !(ep = fs_get_handle(epfd))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return ep;
+}
+
+static int epoll_close(void *hnd) {
+    struct poll_ep *ep = (struct poll_ep *)hnd;
+    struct poll_item *i;
+
+    mutex_lock(&mutex);
+
+    while((i = LIST_FIRST(&ep->items))) {
+        poll_item_unlink(i);
+        free(i);
+    }
+
+    mutex_unlock(&mutex);
+
+    cond_destroy(&ep->cv);
+    free(ep);
+    return 0;
+}
+
+/* An epoll instance is readable when it has events waiting to be collected,
+   so they can be nested or mixed with poll(). */
+static short epoll_poll(void *hnd, short events) {
+    struct poll_ep *ep = (struct poll_ep *)hnd;
+
+    return TAILQ_EMPTY(&ep->ready) ? 0 : (events & (POLLIN | POLLRDNORM));
+}
+
+int epoll_create1(int flags) {
+    struct poll_ep *ep;
+    int fd;
+
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ep = (struct poll_ep *)malloc(sizeof(*ep)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    LIST_INIT(&ep->items);
+    TAILQ_INIT(&ep->ready);
+    cond_init(&ep->cv);
+    ep->temp = 0;
+
+    if((fd = fs_open_handle(&epoll_vh, ep)) < 0) {
+        cond_destroy(&ep->cv);
+        free(ep);
+        return -1;
+    }
+
+    return fd;
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    struct poll_ep *ep;
+    struct poll_item *i;
+    short mask, ev;
+
+    if(!(ep = epoll_get(epfd)))
+        return -1;
+
+    if(fd < 0 || fd >= FD_SETSIZE || !fs_get_handler(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(fd == epfd || (op != EPOLL_CTL_DEL && !event)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    LIST_FOREACH(i, &fd_items[fd], fd_entry) {
+        if(i->ep == ep)
+            break;
+    }
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(i) {
+                errno = EEXIST;
+                goto err;
+            }
+
+            if(!(i = (struct poll_item *)malloc(sizeof(*i)))) {
+                errno = ENOMEM;
+                goto err;
+            }
+
+            poll_item_link(ep, i, fd, event->events);
+            break;
+
+        case EPOLL_CTL_MOD:
+            if(!i) {
+                errno = ENOENT;
+                goto err;
+            }
+
+            i->events = event->events;
+            i->revents = 0;
+            i->armed = 1;
+            break;
+
+        case EPOLL_CTL_DEL:
+            if(!i) {
+                errno = ENOENT;
+                goto err;
+            }
+
+            poll_item_unlink(i);
+            free(i);
+            mutex_unlock(&mutex);
+            return 0;
+
+        default:
+            errno = EINVAL;
+            goto err;
+    }
+
+    i->data = event->data;
+
+    /* Events only get triggered on changes, so if the fd is ready already, it
+       has to go on the ready list now. */
+    mask = (short)i->events | POLL_ALWAYS;
+    if((ev = poll_query(fd, mask) & mask))
+        poll_item_ready(i, ev);
+
+    mutex_unlock(&mutex);
+    return 0;
+
+err:
+    mutex_unlock(&mutex);
+    return -1;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    struct poll_ep *ep;
+    uint64_t deadline = 0;
+    int n;
+
+    if(!(ep = epoll_get(epfd)))
+        return -1;
+
+    if(!events || maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    /* Things on the ready list may turn out not to be ready any more by the
+       time we get to them, so keep going until something is or time runs
+       out. */
+    while(!(n = poll_ep_collect(ep, events, maxevents)) && timeout) {
+        if(irq_inside_int()) {
+            mutex_unlock(&mutex);
+            errno = EPERM;
+            return -1;
+        }
+
+        if(poll_ep_wait(ep, deadline) < 0)
+            break;
+    }
 
     mutex_unlock(&mutex);
-    return tmp;
+    return n;
 }
@@ -0,0 +1,471 @@
+/* KallistiOS ##version##
+
+   mm/slab.c
+
+*/
+
+/* Pools of fixed-size objects. Each slab is one block from memalign(),
+   aligned to the next power of two up from its size, so the slab an object
+   is in can be found by masking off the low bits of its address. A slab
+   starts with this header, followed by a stack of the indices of its free
+   objects, followed by the objects themselves; keeping the free list out of
+   the objects is what lets them keep their constructed state while they're
+   free.
+
+   That would waste a lot on big objects, which only fit a few to a slab:
+   an 8KiB one would get a slab aligned to 16KiB to itself. So objects too
+   big to fit SLAB_MIN_OBJS of them in SLAB_MAX_BYTES go in slabs that are
+   only aligned as the objects need, and each one has a pointer back to its
+   slab just in front of it instead.
+
+   Slabs are kept on three lists, by whether they're full, partly used or
+   empty. Objects come out of partly used slabs first, so that the rest can
+   empty out and be given back. */
+
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/slab.h>
+#include <kos/mutex.h>
+#include <kos/irq.h>
+#include <kos/udiv.h>
+#include <kos/intmath.h>
+
+/* Slabs are made big enough to hold at least SLAB_MIN_OBJS objects, as long
+   as that doesn't take them past SLAB_MAX_BYTES. Objects bigger than that
+   get as many to a slab as fit in SLAB_MAX_BYTES, or one each. */
+#define SLAB_MIN_BYTES      1024
+#define SLAB_MAX_BYTES      8192
+#define SLAB_MIN_OBJS       8
+#define SLAB_MAX_OBJS       255
+
+/* How much a cache holds on to in empty slabs (always at least one) */
+#define SLAB_KEEP_BYTES     16384
+
+#define SLAB_NAME_LEN       24
+
+struct slab {
+    LIST_ENTRY(slab) list;
+    slab_cache_t *cache;
+    uint8_t nfree;
+    uint8_t stack[];
+};
+
+LIST_HEAD(slab_list, slab);
+
+struct slab_cache {
+    LIST_ENTRY(slab_cache) list;
+    char name[SLAB_NAME_LEN];
+
+    size_t size;                /* Object size, padded to the alignment,
+                                   with the back pointer for big ones */
+    size_t offset;              /* Where the first object is in a slab */
+    size_t slab_size;           /* Bytes in a slab */
+    size_t slab_align;          /* Alignment slabs are got with */
+    uintptr_t mask;             /* slab_align - 1, or 0 for big objects */
+    unsigned int per_slab;
+    udiv_t div;                 /* For dividing by size */
+
+    slab_ctor_t ctor, dtor;
+    uint32_t flags;
+    mutex_t lock;
+
+    struct slab_list partial, full, empty;
+    size_t nempty;
+
+    size_t slabs, in_use, peak;
+    uint64_t allocs, frees, failures, grows, shrinks;
+};
+
+/* Every cache, for slab_print_stats() */
+static LIST_HEAD(, slab_cache) caches = LIST_HEAD_INITIALIZER(caches);
+static mutex_t caches_lock = MUTEX_INITIALIZER;
+
+static inline irq_mask_t cache_lock(slab_cache_t *cache) {
+    if(cache->flags & SLAB_IRQSAFE)
+        return irq_disable();
+
+    mutex_lock(&cache->lock);
+    return 0;
+}
+
+static inline void cache_unlock(slab_cache_t *cache, irq_mask_t irqs) {
+    if(cache->flags & SLAB_IRQSAFE)
+        irq_restore(irqs);
+    else
+        mutex_unlock(&cache->lock);
+}
+
+static inline int too_many_empty(slab_cache_t *cache) {
+    return cache->nempty > 1 &&
+           cache->nempty * cache->slab_size > SLAB_KEEP_BYTES;
+}
+
+static inline void *slab_obj(slab_cache_t *cache, struct slab *s,
+                             unsigned int i) {
+    return (uint8_t *)s + cache->offset + i * cache->size;
+}
+
+static inline struct slab *obj_slab(slab_cache_t *cache, void *obj) {
+    if(cache->mask)
+        return (struct slab *)((uintptr_t)obj & ~cache->mask);
+    else
+        return ((struct slab **)obj)[-1];
+}
+
+/* Put a slab on the list it belongs on now, after taking it off the one it
+   was on if need be. */
+static void slab_place(slab_cache_t *cache, struct slab *s, int was_on) {
+    if(was_on)
+        LIST_REMOVE(s, list);
+
+    if(!s->nfree) {
+        LIST_INSERT_HEAD(&cache->full, s, list);
+    }
+    else if(s->nfree == cache->per_slab) {
+        LIST_INSERT_HEAD(&cache->empty, s, list);
+        cache->nempty++;
+    }
+    else {
+        LIST_INSERT_HEAD(&cache->partial, s, list);
+    }
+}
+
+/* Make a new slab, without the cache locked. */
+static struct slab *slab_grow(slab_cache_t *cache) {
+    struct slab *s;
+    unsigned int i;
+
+    if(irq_inside_int() && !malloc_irq_safe())
+        return NULL;
+
+    if(!(s = memalign(cache->slab_align, cache->slab_size)))
+        return NULL;
+
+    s->cache = cache;
+    s->nfree = cache->per_slab;
+
+    /* Hand them out from the start of the slab. */
+    for(i = 0; i < cache->per_slab; i++) {
+        s->stack[i] = cache->per_slab - 1 - i;
+
+        if(!cache->mask)
+            ((struct slab **)slab_obj(cache, s, i))[-1] = s;
+
+        if(cache->ctor)
+            cache->ctor(slab_obj(cache, s, i));
+    }
+
+    return s;
+}
+
+/* Give an empty slab back, without the cache locked. */
+static void slab_release(slab_cache_t *cache, struct slab *s) {
+    unsigned int i;
+
+    if(cache->dtor) {
+        for(i = 0; i < cache->per_slab; i++)
+            cache->dtor(slab_obj(cache, s, i));
+    }
+
+    free(s);
+}
+
+/* How many objects of the cache's size fit in a slab of the given size, and
+   where the first one starts. */
+static size_t slab_fit(slab_cache_t *cache, size_t bytes, size_t align,
+                       size_t *offset) {
+    size_t per = (bytes - sizeof(struct slab)) / (cache->size + 1);
+
+    if(per > SLAB_MAX_OBJS)
+        per = SLAB_MAX_OBJS;
+
+    for(; per; per--) {
+        *offset = __align_up(sizeof(struct slab) + per, align);
+
+        if(*offset + per * cache->size <= bytes)
+            break;
+    }
+
+    return per;
+}
+
+/* Work out how many objects go in a slab, and where. */
+static void slab_layout(slab_cache_t *cache, size_t align) {
+    size_t bytes, per, back, offset = 0;
+
+    for(bytes = SLAB_MIN_BYTES; bytes <= SLAB_MAX_BYTES; bytes *= 2) {
+        if((per = slab_fit(cache, bytes, align, &offset)) >= SLAB_MIN_OBJS) {
+            cache->per_slab = per;
+            cache->offset = offset;
+            cache->slab_size = offset + per * cache->size;
+            cache->slab_align = (size_t)1 <<
+                (32 - __builtin_clz(cache->slab_size - 1));
+            cache->mask = cache->slab_align - 1;
+            return;
+        }
+    }
+
+    /* Big objects, with a back pointer in front of each one. The size
+       includes it, and the first one's goes where the first object would
+       have. Objects are kept aligned for the pointers. */
+    if(align < _Alignof(struct slab *)) {
+        align = _Alignof(struct slab *);
+        cache->size = __align_up(cache->size, align);
+    }
+
+    back = __align_up(sizeof(struct slab *), align);
+    cache->size += back;
+
+    if(!(per = slab_fit(cache, SLAB_MAX_BYTES, align, &offset))) {
+        per = 1;
+        offset = __align_up(sizeof(struct slab) + 1, align);
+    }
+
+    cache->per_slab = per;
+    cache->offset = offset + back;
+    cache->slab_size = offset + per * cache->size;
+    cache->slab_align = align;
+    cache->mask = 0;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, slab_ctor_t dtor,
+                                uint32_t flags) {
+    slab_cache_t *cache;
+
+    if(!align)
+        align = _Alignof(max_align_t);
+
+    if(!size || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(cache = calloc(1, sizeof(slab_cache_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    strncpy(cache->name, name ? name : "?", SLAB_NAME_LEN - 1);
+    cache->size = __align_up(size, align);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->flags = flags;
+    slab_layout(cache, align);
+    cache->div = udiv_set_divider(cache->size);
+
+    mutex_init(&cache->lock, MUTEX_TYPE_NORMAL);
+    LIST_INIT(&cache->partial);
+    LIST_INIT(&cache->full);
+    LIST_INIT(&cache->empty);
+
+    mutex_lock(&caches_lock);
+    LIST_INSERT_HEAD(&caches, cache, list);
+    mutex_unlock(&caches_lock);
+
+    return cache;
+}
+
+int slab_cache_destroy(slab_cache_t *cache) {
+    struct slab *s;
+
+    mutex_lock(&caches_lock);
+
+    if(cache->in_use) {
+        mutex_unlock(&caches_lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    LIST_REMOVE(cache, list);
+    mutex_unlock(&caches_lock);
+
+    while((s = LIST_FIRST(&cache->empty))) {
+        LIST_REMOVE(s, list);
+        slab_release(cache, s);
+    }
+
+    mutex_destroy(&cache->lock);
+    free(cache);
+
+    return 0;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    struct slab *s;
+    irq_mask_t irqs;
+    void *obj;
+
+    irqs = cache_lock(cache);
+
+    if(!(s = LIST_FIRST(&cache->partial))) {
+        if((s = LIST_FIRST(&cache->empty))) {
+            cache->nempty--;
+        }
+        else {
+            /* Get a new slab with the cache unlocked, since malloc() may
+               have to wait. */
+            cache_unlock(cache, irqs);
+            s = slab_grow(cache);
+            irqs = cache_lock(cache);
+
+            if(!s) {
+                cache->failures++;
+                cache_unlock(cache, irqs);
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            LIST_INSERT_HEAD(&cache->partial, s, list);
+            cache->slabs++;
+            cache->grows++;
+        }
+    }
+
+    obj = slab_obj(cache, s, s->stack[--s->nfree]);
+
+    /* It came off the partial or empty list, and may belong on another
+       now. */
+    if(s->nfree + 1 == (int)cache->per_slab || !s->nfree)
+        slab_place(cache, s, 1);
+
+    if(++cache->in_use > cache->peak)
+        cache->peak = cache->in_use;
+
+    cache->allocs++;
+    cache_unlock(cache, irqs);
+
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+    struct slab_list release;
+    struct slab *s;
+    irq_mask_t irqs;
+    unsigned int i;
+
+    if(!obj)
+        return;
+
+    s = obj_slab(cache, obj);
+    assert(s->cache == cache);
+    i = udiv_divide((uint8_t *)obj - (uint8_t *)s - cache->offset, cache->div);
+
+    irqs = cache_lock(cache);
+    assert(s->nfree < cache->per_slab);
+
+    s->stack[s->nfree++] = i;
+
+    /* It was full, or it's empty now. */
+    if(s->nfree == 1 || s->nfree == cache->per_slab)
+        slab_place(cache, s, 1);
+
+    cache->in_use--;
+    cache->frees++;
+
+    /* free() can fail inside an IRQ, so leave any extra empty slabs for
+       later there. */
+    LIST_INIT(&release);
+
+    while(too_many_empty(cache) && !irq_inside_int()) {
+        s = LIST_FIRST(&cache->empty);
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&release, s, list);
+        cache->nempty--;
+        cache->slabs--;
+        cache->shrinks++;
+    }
+
+    cache_unlock(cache, irqs);
+
+    while((s = LIST_FIRST(&release))) {
+        LIST_REMOVE(s, list);
+        slab_release(cache, s);
+    }
+}
+
+size_t slab_cache_shrink(slab_cache_t *cache) {
+    struct slab_list empty;
+    struct slab *s;
+    irq_mask_t irqs;
+    size_t n;
+
+    irqs = cache_lock(cache);
+
+    LIST_INIT(&empty);
+
+    while((s = LIST_FIRST(&cache->empty))) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&empty, s, list);
+    }
+
+    n = cache->nempty;
+    cache->slabs -= n;
+    cache->shrinks += n;
+    cache->nempty = 0;
+
+    cache_unlock(cache, irqs);
+
+    while((s = LIST_FIRST(&empty))) {
+        LIST_REMOVE(s, list);
+        slab_release(cache, s);
+    }
+
+    return n * cache->slab_size;
+}
+
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats) {
+    irq_mask_t irqs;
+
+    irqs = cache_lock(cache);
+
+    stats->name = cache->name;
+    stats->obj_size = cache->size;
+    stats->slab_size = cache->slab_size;
+    stats->objs_per_slab = cache->per_slab;
+    stats->slabs = cache->slabs;
+    stats->in_use = cache->in_use;
+    stats->peak = cache->peak;
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+    stats->failures = cache->failures;
+    stats->grows = cache->grows;
+    stats->shrinks = cache->shrinks;
+
+    cache_unlock(cache, irqs);
+}
+
+int slab_print_stats(int (*pf)(const char *fmt, ...)) {
+    slab_cache_t *cache;
+    slab_stats_t st;
+    size_t total = 0;
+
+    pf("Slab caches:\n");
+    pf("name                     size  per   in use     peak   slabs"
+       "      KiB       allocs  failed\n");
+
+    mutex_lock(&caches_lock);
+
+    LIST_FOREACH(cache, &caches, list) {
+        slab_cache_get_stats(cache, &st);
+        total += st.slabs * st.slab_size;
+
+        pf("%-23s %5u %4u %8u %8u %7u %8u %12llu %7llu\n", st.name,
+           (unsigned int)st.obj_size, (unsigned int)st.objs_per_slab,
+           (unsigned int)st.in_use, (unsigned int)st.peak,
+           (unsigned int)st.slabs,
+           (unsigned int)((st.slabs * st.slab_size + 1023) / 1024),
+           (unsigned long long)st.allocs, (unsigned long long)st.failures);
+    }
+
+    mutex_unlock(&caches_lock);
+
+    pf("%u KiB in slabs\n", (unsigned int)((total + 1023) / 1024));
+
+    return 0;
+}
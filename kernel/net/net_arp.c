@@ -14,6 +14,7 @@
 
 #include <kos/dbglog.h>
 #include <kos/net.h>
+#include <kos/slab.h>
 #include <kos/thread.h>
 #include <kos/timer.h>
 
@@ -73,6 +74,10 @@ LIST_HEAD(netarp_list, netarp);
 /* ARP cache */
 struct netarp_list net_arp_cache = LIST_HEAD_INITIALIZER(0);
 
+/* Where the entries come from. They're made and thrown away from inside
+   the network IRQ. */
+static slab_cache_t *net_arp_slab;
+
 /**************************************************************************/
 /* Cache management */
 
@@ -95,7 +100,7 @@ static int net_arp_gc(netif_t *nif) {
                     free(a1->data);
                 }
 
-                free(a1);
+                slab_free(net_arp_slab, a1);
                 a1 = a2;
                 continue;
             }
@@ -142,9 +147,7 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
     }
 
     /* It's not there, add an entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-
-    if(cur == NULL)
+    if(!net_arp_slab || !(cur = (netarp_t *)slab_alloc(net_arp_slab)))
         return -1;
 
     memcpy(cur->mac, mac, 6);
@@ -167,7 +170,18 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
    will have arrived. */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
                    const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
+    struct iovec iov = { (void *)data, data_size };
+
+    return net_arp_lookupv(nif, ip_in, mac_out, pkt, &iov,
+                           data && data_size ? 1 : 0);
+}
+
+/* Same as above, but the packet's data may be split into multiple pieces. */
+int net_arp_lookupv(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
+                    const ip_hdr_t *pkt, const struct iovec *iov, int iovcnt) {
     netarp_t *cur;
+    size_t data_size = 0, off = 0;
+    int i;
 
     /* Garbage collect expired entries */
     net_arp_gc(nif);
@@ -191,17 +205,18 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
     }
 
     /* It's not there... Add an incomplete ARP entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-
-    if(cur == NULL)
+    if(!net_arp_slab || !(cur = (netarp_t *)slab_alloc(net_arp_slab)))
         return -3;
 
     memset(cur, 0, sizeof(netarp_t));
     memcpy(cur->ip, ip_in, 4);
     cur->timestamp = timer_ms_gettime64();
 
+    for(i = 0; i < iovcnt; ++i)
+        data_size += iov[i].iov_len;
+
     /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
+    if(pkt && data_size) {
         cur->data = (uint8_t *)malloc(data_size);
 
         if(cur->data) {
@@ -213,7 +228,12 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
             }
             else {
                 memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
+
+                for(i = 0; i < iovcnt; ++i) {
+                    memcpy(cur->data + off, iov[i].iov_base, iov[i].iov_len);
+                    off += iov[i].iov_len;
+                }
+
                 cur->data_size = data_size;
             }
         }
@@ -368,7 +388,11 @@ int net_arp_init(void) {
     /* Initialize the ARP cache */
     LIST_INIT(&net_arp_cache);
 
-    return 0;
+    if(!net_arp_slab)
+        net_arp_slab = slab_cache_create_type("net_arp", netarp_t, NULL, NULL,
+                                              SLAB_IRQSAFE);
+
+    return net_arp_slab ? 0 : -1;
 }
 
 /* Shutdown */
@@ -386,9 +410,14 @@ void net_arp_shutdown(void) {
             free(a1->data);
         }
 
-        free(a1);
+        slab_free(net_arp_slab, a1);
         a1 = a2;
     }
 
     LIST_INIT(&net_arp_cache);
+
+    if(net_arp_slab) {
+        slab_cache_destroy(net_arp_slab);
+        net_arp_slab = NULL;
+    }
 }
@@ -5,59 +5,222 @@
 
 */
 
+#include <stdint.h>
+#include <stddef.h>
 #include <kos/net.h>
+#include <kos/opts.h>
 
-/* Calculate a CRC-32 checksum over a given block of data. Somewhat inspired by
-   the CRC32 function in Figure 14-6 of http://www.hackersdelight.org/crc.pdf */
-uint32_t __pure net_crc32le(const uint8_t *data, int size) {
-    int i;
-    uint32_t rv = 0xFFFFFFFF;
+/* All of the CRCs in here are table-driven, with NET_CRC_SLICES tables each.
+   The first table of each set is the usual one-byte-at-a-time table, and table
+   n gives the effect of a byte followed by n zero bytes, which lets us fold
+   four or eight bytes into the CRC at once ("slicing-by-4/8"). With
+   NET_CRC_SLICES set to 0 there are no tables at all and everything is done a
+   bit at a time instead.
 
-    for(i = 0; i < size; ++i) {
-        rv ^= data[i];
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-    }
+   The "big-endian" CRC-32 shifts the other way, but since it feeds the bits of
+   each byte in least significant bit first, its register is always the exact
+   bit reversal of the little-endian one. So it is computed with the same tables
+   and reversed at the end. */
 
-    return ~rv;
-}
+#if NET_CRC_SLICES != 0 && NET_CRC_SLICES != 1 && NET_CRC_SLICES != 4 && \
+    NET_CRC_SLICES != 8
+#error NET_CRC_SLICES must be 0, 1, 4 or 8
+#endif
 
-/* This one isn't quite as nice as the one above for little-endian... */
-uint32_t __pure net_crc32be(const uint8_t *data, int size) {
+#define CRC32_POLY      0xEDB88320      /* Reflected 0x04C11DB7 */
+#define CRC16_POLY      0x1021
+
+#if NET_CRC_SLICES > 0
+
+static uint32_t crc32_tab[NET_CRC_SLICES][256];
+static uint16_t crc16_tab[NET_CRC_SLICES][256];
+static volatile int tabs_ready;
+
+/* The tables always come out the same, so if two threads both get here at
+   once, nothing bad comes of it. */
+static void crc_init_tables(void) {
+    uint32_t c;
+    uint16_t d;
     int i, j;
-    uint32_t rv = 0xFFFFFFFF, b, c;
 
-    for(i = 0; i < size; ++i) {
-        b = data[i];
+    for(i = 0; i < 256; ++i) {
+        c = i;
+        d = i << 8;
 
         for(j = 0; j < 8; ++j) {
-            c = ((rv & 0x80000000) ? 1 : 0) ^(b & 1);
-            b >>= 1;
+            c = (c >> 1) ^ (CRC32_POLY & (-(c & 1)));
+            d = (d << 1) ^ ((d & 0x8000) ? CRC16_POLY : 0);
+        }
+
+        crc32_tab[0][i] = c;
+        crc16_tab[0][i] = d;
+    }
 
-            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
-            else    rv <<= 1;
+    for(j = 1; j < NET_CRC_SLICES; ++j) {
+        for(i = 0; i < 256; ++i) {
+            c = crc32_tab[j - 1][i];
+            crc32_tab[j][i] = (c >> 8) ^ crc32_tab[0][c & 0xFF];
+
+            d = crc16_tab[j - 1][i];
+            crc16_tab[j][i] = (d << 8) ^ crc16_tab[0][d >> 8];
         }
     }
 
-    return rv;
+    tabs_ready = 1;
 }
 
-/* Based on code found at: http://www.ccsinfo.com/forum/viewtopic.php?t=24977 */
-uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
-    uint16_t rv = start, tmp;
+#define CRC_TABLES() do { if(!tabs_ready) crc_init_tables(); } while(0)
+
+#endif /* NET_CRC_SLICES > 0 */
+
+#if NET_CRC_SLICES >= 4
+/* Only ever called on aligned pointers. */
+static inline uint32_t crc_load32le(const uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return *(const uint32_t *)p;
+#else
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+#endif
+}
+#endif
+
+uint32_t net_crc32le_init(void) {
+    return 0xFFFFFFFF;
+}
+
+uint32_t net_crc32le_update(uint32_t crc, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+#if NET_CRC_SLICES == 0
+    int i;
+#elif NET_CRC_SLICES == 4
+    uint32_t one;
+#elif NET_CRC_SLICES == 8
+    uint32_t one, two;
+#endif
+
+#if NET_CRC_SLICES == 0
+    /* Somewhat inspired by the CRC32 function in Figure 14-6 of
+       http://www.hackersdelight.org/crc.pdf */
+    while(size--) {
+        crc ^= *p++;
+
+        for(i = 0; i < 8; ++i)
+            crc = (CRC32_POLY & (-(crc & 1))) ^ (crc >> 1);
+    }
+#else
+    CRC_TABLES();
+
+#if NET_CRC_SLICES >= 4
+    /* Get to a word boundary, so the rest can be loaded a word at a time. */
+    while(size && ((uintptr_t)p & 3)) {
+        crc = (crc >> 8) ^ crc32_tab[0][(crc ^ *p++) & 0xFF];
+        --size;
+    }
+
+#if NET_CRC_SLICES == 8
+    while(size >= 8) {
+        one = crc ^ crc_load32le(p);
+        two = crc_load32le(p + 4);
+        crc = crc32_tab[7][one & 0xFF] ^ crc32_tab[6][(one >> 8) & 0xFF] ^
+              crc32_tab[5][(one >> 16) & 0xFF] ^ crc32_tab[4][one >> 24] ^
+              crc32_tab[3][two & 0xFF] ^ crc32_tab[2][(two >> 8) & 0xFF] ^
+              crc32_tab[1][(two >> 16) & 0xFF] ^ crc32_tab[0][two >> 24];
+        p += 8;
+        size -= 8;
+    }
+#endif
 
+    while(size >= 4) {
+        one = crc ^ crc_load32le(p);
+        crc = crc32_tab[3][one & 0xFF] ^ crc32_tab[2][(one >> 8) & 0xFF] ^
+              crc32_tab[1][(one >> 16) & 0xFF] ^ crc32_tab[0][one >> 24];
+        p += 4;
+        size -= 4;
+    }
+#endif /* NET_CRC_SLICES >= 4 */
+
+    while(size--)
+        crc = (crc >> 8) ^ crc32_tab[0][(crc ^ *p++) & 0xFF];
+#endif /* NET_CRC_SLICES == 0 */
+
+    return crc;
+}
+
+uint32_t net_crc32le_final(uint32_t crc) {
+    return ~crc;
+}
+
+uint32_t net_crc32be_init(void) {
+    return 0xFFFFFFFF;
+}
+
+uint32_t net_crc32be_update(uint32_t crc, const void *data, size_t size) {
+    /* The running value is kept bit-reversed, see above. */
+    return net_crc32le_update(crc, data, size);
+}
+
+uint32_t net_crc32be_final(uint32_t crc) {
+    crc = ((crc >> 1) & 0x55555555) | ((crc & 0x55555555) << 1);
+    crc = ((crc >> 2) & 0x33333333) | ((crc & 0x33333333) << 2);
+    crc = ((crc >> 4) & 0x0F0F0F0F) | ((crc & 0x0F0F0F0F) << 4);
+    crc = ((crc >> 8) & 0x00FF00FF) | ((crc & 0x00FF00FF) << 8);
+    return (crc >> 16) | (crc << 16);
+}
+
+uint16_t net_crc16ccitt_update(uint16_t crc, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+#if NET_CRC_SLICES == 0
+    uint16_t tmp;
+
+    /* Based on code found at:
+       http://www.ccsinfo.com/forum/viewtopic.php?t=24977 */
     while(size--) {
-        tmp = (rv >> 8) ^ *data++;
+        tmp = (crc >> 8) ^ *p++;
         tmp ^= tmp >> 4;
 
-        rv = (rv << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
+        crc = (crc << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
     }
+#else
+    CRC_TABLES();
 
-    return rv;
+#if NET_CRC_SLICES == 8
+    while(size >= 8) {
+        crc ^= (p[0] << 8) | p[1];
+        crc = crc16_tab[7][crc >> 8] ^ crc16_tab[6][crc & 0xFF] ^
+              crc16_tab[5][p[2]] ^ crc16_tab[4][p[3]] ^ crc16_tab[3][p[4]] ^
+              crc16_tab[2][p[5]] ^ crc16_tab[1][p[6]] ^ crc16_tab[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+#endif
+
+#if NET_CRC_SLICES >= 4
+    while(size >= 4) {
+        crc ^= (p[0] << 8) | p[1];
+        crc = crc16_tab[3][crc >> 8] ^ crc16_tab[2][crc & 0xFF] ^
+              crc16_tab[1][p[2]] ^ crc16_tab[0][p[3]];
+        p += 4;
+        size -= 4;
+    }
+#endif
+
+    while(size--)
+        crc = (crc << 8) ^ crc16_tab[0][(crc >> 8) ^ *p++];
+#endif /* NET_CRC_SLICES == 0 */
+
+    return crc;
+}
+
+uint32_t __pure net_crc32le(const uint8_t *data, int size) {
+    return net_crc32le_final(net_crc32le_update(net_crc32le_init(), data,
+                                                size > 0 ? size : 0));
+}
+
+uint32_t __pure net_crc32be(const uint8_t *data, int size) {
+    return net_crc32be_final(net_crc32be_update(net_crc32be_init(), data,
+                                                size > 0 ? size : 0));
+}
+
+uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
+    return net_crc16ccitt_update(start, data, size > 0 ? size : 0);
 }
@@ -28,31 +28,193 @@
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
-/* Perform an IP-style checksum on a block of data */
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
-    typedef uint16_t __attribute__((may_alias)) alias_u16_t;
-    uint32_t acc_sum = sum;
+typedef uint16_t __attribute__((may_alias)) alias_u16_t;
+typedef uint32_t __attribute__((may_alias)) alias_u32_t;
+
+/* Used to split a 32-bit word into the two halfwords that make it up in
+   memory, regardless of endianness. */
+typedef union {
+    uint32_t w;
+    uint16_t h[2];
+    uint8_t b[4];
+} cksum_word_t;
+
+/* Fold a 64-bit accumulator down to a 16-bit one's complement sum. Summing
+   32-bit words is fine, since 0xFFFF divides 0xFFFFFFFF, the carries just
+   have to be folded back in at the end. */
+static inline uint16_t cksum_fold(uint64_t acc) {
+    uint32_t sum;
+
+    acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+    sum = (uint32_t)(acc >> 32) + (uint32_t)acc;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return (uint16_t)sum;
+}
+
+/* Add a lone byte to the sum in the lane it occupies in memory. */
+static inline uint64_t cksum_byte(uint64_t acc, const uint8_t *p) {
+    cksum_word_t u = { 0 };
+
+    u.b[(uintptr_t)p & 1] = *p;
+    return acc + u.h[0];
+}
+
+/* Sum up the data, 32 bits at a time, leaving the carries in the upper half of
+   the accumulator to be dealt with at the end. Every byte is summed in the
+   lane that it occupies in memory, so a block can be split up at any point
+   as long as each piece is summed at its own address. */
+static uint64_t cksum_sum(const uint8_t *data, size_t bytes, uint64_t acc) {
+    const alias_u32_t *w;
+
+    if(!bytes)
+        return acc;
 
-    /* Make sure we don't do any unaligned memory accesses */
     if((uintptr_t)data & 1) {
-        acc_sum += *data;
+        acc = cksum_byte(acc, data);
         bytes--;
         data++;
     }
 
-    /* Compute checksum two bytes at a time */
-    for(; bytes > 1; bytes -= 2, data += 2)
-        acc_sum += *(const alias_u16_t *)data;
+    if(bytes >= 2 && ((uintptr_t)data & 2)) {
+        acc += *(const alias_u16_t *)data;
+        bytes -= 2;
+        data += 2;
+    }
+
+    for(w = (const alias_u32_t *)data; bytes >= 16; bytes -= 16, w += 4) {
+        acc += w[0];
+        acc += w[1];
+        acc += w[2];
+        acc += w[3];
+    }
+
+    for(; bytes >= 4; bytes -= 4)
+        acc += *w++;
+
+    data = (const uint8_t *)w;
+
+    if(bytes >= 2) {
+        acc += *(const alias_u16_t *)data;
+        bytes -= 2;
+        data += 2;
+    }
 
-    /* Handle the last byte, if we have an odd byte count */
     if(bytes)
-        acc_sum += *data;
+        acc = cksum_byte(acc, data);
+
+    return acc;
+}
+
+/* Sum up a piece of a packet that will end up at offset pos in it, wherever
+   it happens to be in memory right now. */
+uint16_t __pure net_ipv4_checksum_part(const uint8_t *data, size_t bytes,
+                                       size_t pos) {
+    uint16_t sum = cksum_fold(cksum_sum(data, bytes, 0));
+
+    /* If the alignment differs, every byte was summed in the wrong lane. */
+    if(((uintptr_t)data ^ pos) & 1)
+        sum = (uint16_t)((sum << 8) | (sum >> 8));
+
+    return sum;
+}
+
+/* Perform an IP-style checksum on a block of data */
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
+    return (uint16_t)~cksum_fold((uint64_t)sum +
+                                 net_ipv4_checksum_part(data, bytes, 0));
+}
+
+/* Copy a block of data while summing it up, so that it only needs to pass
+   through the cache once. The bytes are summed in the lanes they land in at
+   dst, which is what we want when dst is inside a packet that starts at an
+   even address. */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t sum) {
+    const alias_u32_t *s;
+    alias_u16_t *d16;
+    alias_u32_t *d32;
+    cksum_word_t u0, u1, u2, u3;
+    uint64_t acc = sum;
+
+    /* The word loop needs both pointers to be at least halfword aligned. */
+    if(((uintptr_t)dst | (uintptr_t)src) & 1) {
+        memcpy(dst, src, bytes);
+        return cksum_fold(cksum_sum(dst, bytes, acc));
+    }
+
+    if(bytes >= 2 && ((uintptr_t)src & 2)) {
+        acc += *(alias_u16_t *)dst = *(const alias_u16_t *)src;
+        bytes -= 2;
+        src += 2;
+        dst += 2;
+    }
+
+    s = (const alias_u32_t *)src;
+
+    if(!((uintptr_t)dst & 2)) {
+        for(d32 = (alias_u32_t *)dst; bytes >= 16; bytes -= 16, s += 4, d32 += 4) {
+            u0.w = s[0];
+            u1.w = s[1];
+            u2.w = s[2];
+            u3.w = s[3];
+            d32[0] = u0.w;
+            d32[1] = u1.w;
+            d32[2] = u2.w;
+            d32[3] = u3.w;
+            acc += u0.w;
+            acc += u1.w;
+            acc += u2.w;
+            acc += u3.w;
+        }
+
+        for(; bytes >= 4; bytes -= 4)
+            acc += *d32++ = *s++;
+
+        d16 = (alias_u16_t *)d32;
+    }
+    else {
+        /* The destination is off by a halfword (which is what happens with
+           the payload behind the 14 byte ethernet header), so load whole words
+           and store them in halves. */
+        for(d16 = (alias_u16_t *)dst; bytes >= 8; bytes -= 8, s += 2, d16 += 4) {
+            u0.w = s[0];
+            u1.w = s[1];
+            d16[0] = u0.h[0];
+            d16[1] = u0.h[1];
+            d16[2] = u1.h[0];
+            d16[3] = u1.h[1];
+            acc += u0.w;
+            acc += u1.w;
+        }
 
-    /* Take care of any carry bits */
-    while(acc_sum >> 16)
-        acc_sum = (acc_sum >> 16) + (acc_sum & 0xFFFF);
+        if(bytes >= 4) {
+            u0.w = *s++;
+            d16[0] = u0.h[0];
+            d16[1] = u0.h[1];
+            acc += u0.w;
+            d16 += 2;
+            bytes -= 4;
+        }
+    }
 
-    return (uint16_t)~acc_sum;
+    src = (const uint8_t *)s;
+    dst = (uint8_t *)d16;
+
+    if(bytes >= 2) {
+        acc += *(alias_u16_t *)dst = *(const alias_u16_t *)src;
+        bytes -= 2;
+        src += 2;
+        dst += 2;
+    }
+
+    if(bytes) {
+        *dst = *src;
+        acc = cksum_byte(acc, dst);
+    }
+
+    return cksum_fold(acc);
 }
 
 /* Determine if a given IP is in the current network */
@@ -203,12 +365,21 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
 
 int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
                           int ttl, int tos, int proto, uint32_t src, uint32_t dst) {
+    return net_ipv4_send_sg(net, frame, size, NULL, 0, id, ttl, tos, proto, src,
+                            dst);
+}
+
+int net_ipv4_send_sg(netif_t *net, uint8_t *frame, size_t size,
+                     const struct iovec *iov, int iovcnt, int id, int ttl,
+                     int tos, int proto, uint32_t src, uint32_t dst) {
     eth_hdr_t *ehdr = (eth_hdr_t *)frame;
     ip_hdr_t *hdr = (ip_hdr_t *)(frame + sizeof(eth_hdr_t));
     uint8_t *data = frame + NET_IPV4_FRAME_HDR_SIZE;
+    struct iovec vec[iovcnt + 1];
+    size_t total = size;
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
-    int err;
+    int err, i;
 
     if(!net) {
         net = net_default_dev;
@@ -219,6 +390,9 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
         }
     }
 
+    for(i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+
     /* If the ID is -1, generate a random ID value that can be used in case the
        packet gets fragmented. */
     if(id == -1)
@@ -231,7 +405,7 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
     /* Build the IPv4 header in place, directly in front of the segment. */
     hdr->version_ihl = 0x45;
     hdr->tos = tos;
-    hdr->length = htons(size + sizeof(ip_hdr_t));
+    hdr->length = htons(total + sizeof(ip_hdr_t));
     hdr->packet_id = id;
     hdr->flags_frag_offs = 0;
     hdr->ttl = ttl;
@@ -245,7 +419,20 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
 
     /* Only handle a single unfragmented frame on an ethernet link. Loopback,
        header-less links (e.g. PPP), and anything that would need fragmentation
-       needs to go through the copy-based path */
+       needs to go through the copy-based path, as does a device that can't
+       gather the pieces of the frame itself. The caller's frame has room for
+       the whole packet in those cases. */
+    if(iovcnt && (!net->if_tx_sg || (net->flags & NETIF_NOETH) ||
+                  dest_ip[0] == 0x7F ||
+                  (total + sizeof(ip_hdr_t)) > (size_t)net->mtu)) {
+        for(i = 0; i < iovcnt; ++i) {
+            memcpy(data + size, iov[i].iov_base, iov[i].iov_len);
+            size += iov[i].iov_len;
+        }
+
+        iovcnt = 0;
+    }
+
     if((net->flags & NETIF_NOETH) || dest_ip[0] == 0x7F ||
        (size + sizeof(ip_hdr_t)) > (size_t)net->mtu)
         return net_ipv4_frag_send(net, hdr, data, size);
@@ -262,7 +449,13 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
         /* Get our destination's MAC address. If we do not have the MAC address
            cached, return a distinguished error to the upper-level protocol so
            that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+        vec[0].iov_base = data;
+        vec[0].iov_len = size;
+
+        for(i = 0; i < iovcnt; ++i)
+            vec[i + 1] = iov[i];
+
+        err = net_arp_lookupv(net, dest_ip, dest_mac, hdr, vec, iovcnt + 1);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -284,8 +477,19 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
 
     ++ipv4_stats.pkt_sent;
 
-    /* Send it away */
-    net->if_tx(net, frame, NET_IPV4_FRAME_HDR_SIZE + size, NETIF_BLOCK);
+    /* Send it away, letting the device pick up the payload wherever it is. */
+    if(iovcnt) {
+        vec[0].iov_base = frame;
+        vec[0].iov_len = NET_IPV4_FRAME_HDR_SIZE + size;
+
+        for(i = 0; i < iovcnt; ++i)
+            vec[i + 1] = iov[i];
+
+        net->if_tx_sg(net, vec, iovcnt + 1, NETIF_BLOCK);
+    }
+    else {
+        net->if_tx(net, frame, NET_IPV4_FRAME_HDR_SIZE + size, NETIF_BLOCK);
+    }
 
     return 0;
 }
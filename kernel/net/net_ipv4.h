@@ -9,6 +9,7 @@
 #define __LOCAL_NET_IPV4_H
 
 #include <kos/net.h>
+#include <sys/uio.h>
 
 /* These structs are from AndrewK's dcload-ip. */
 typedef struct {
@@ -30,12 +31,29 @@ typedef struct {
 #define NET_IPV4_FRAME_HDR_SIZE (sizeof(eth_hdr_t) + sizeof(ip_hdr_t))
 
 uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
+
+/* Partial (uncomplemented) sums, for building a checksum up piece by piece.
+   The result of these can be passed as the start value of the functions
+   above. */
+uint16_t __pure net_ipv4_checksum_part(const uint8_t *data, size_t bytes,
+                                       size_t pos);
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
+
+static inline uint16_t net_ipv4_checksum_add(uint16_t a, uint16_t b) {
+    uint32_t sum = (uint32_t)a + b;
+    return (uint16_t)((sum & 0xFFFF) + (sum >> 16));
+}
+
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int tos, int proto, uint32_t src, uint32_t dst);
 int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
                           int ttl, int tos,int proto, uint32_t src, uint32_t dst);
+int net_ipv4_send_sg(netif_t *net, uint8_t *frame, size_t size,
+                     const struct iovec *iov, int iovcnt, int id, int ttl,
+                     int tos, int proto, uint32_t src, uint32_t dst);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
@@ -43,6 +61,10 @@ int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
 uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
                                 uint16_t len);
 
+/* In net_arp.c */
+int net_arp_lookupv(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
+                    const ip_hdr_t *pkt, const struct iovec *iov, int iovcnt);
+
 /* In net_ipv4_frag.c */
 int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                        size_t size);
@@ -274,6 +274,7 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8_t *data,
     f = (struct ip_frag *)malloc(sizeof(struct ip_frag));
 
     if(!f) {
+        mutex_unlock(&frag_mutex);
         errno = ENOMEM;
         return -1;
     }
@@ -318,7 +319,7 @@ void net_ipv4_frag_shutdown(void) {
         while(c) {
             n = TAILQ_NEXT(c, listhnd);
             free(c->data);
-            free(c->bitfield);
+            free(c);
             c = n;
         }
     }
@@ -84,12 +84,18 @@
    list of sockets.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   The base protocol is RFC 793. On top of that, the retransmission timer is
+   computed as described in RFC 6298 (with Karn's algorithm when timestamps are
+   not in use), and congestion control is the usual slow start/congestion
+   avoidance of RFC 5681 with NewReno fast retransmit/fast recovery (RFC 6582).
+   The window scale and timestamp options of RFC 7323 are negotiated if the
+   other side offers them, as is the selective acknowledgement option of RFC
+   2018. Incoming out-of-order segments are reported back in SACK blocks, and
+   the SACK blocks we receive are used to pick which holes to retransmit during
+   fast recovery. PAWS is not implemented, nor is urgent data in any meaningful
+   way. That all said, everything in here works just fine over IPv4 or IPv6,
+   and can be used just fine to communicate with "normal" TCP/IP
+   implementations.
 */
 
 typedef struct tcp_hdr {
@@ -113,12 +119,17 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    int8_t wscale;      /* -1 if the window scale option wasn't sent */
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+    uint32_t ts_val;
 };
 
 /* Send/receive variables... */
 struct sndrec {
     uint32_t una;
     uint32_t nxt;
+    uint32_t max;       /* Highest sequence number sent so far */
     uint32_t wnd;
     uint32_t up;
     uint32_t wl1;
@@ -142,6 +153,15 @@ struct tcp_ooo_seg {
     uint16_t len;
 };
 
+/* Selectively acknowledged ranges reported by the other side, kept sorted and
+   non-overlapping. Anything past the end of this table is just forgotten. */
+#define TCP_SACK_MAX 8
+
+struct tcp_sack_blk {
+    uint32_t start;
+    uint32_t end;
+};
+
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
     struct sockaddr_in6 local_addr;
@@ -178,7 +198,6 @@ struct tcp_sock {
             uint32_t rcvbuf_tail;
             uint8_t *sndbuf;
             uint32_t sndbuf_cur_sz;
-            uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
             uint64_t timer;
@@ -186,7 +205,39 @@ struct tcp_sock {
             condvar_t recv_cv;
             struct tcp_ooo_seg ooo[TCP_OOO_MAX];
             int ooo_count;
+            uint32_t ooo_last;      /* seq of the last out-of-order segment */
             uint8_t ack_pending;    /* segments since last ACK */
+
+            /* Retransmission timer (RFC 6298). srtt is scaled by 8 and rttvar
+               by 4, all values are in milliseconds. */
+            int32_t srtt;
+            int32_t rttvar;
+            uint32_t rto;
+            uint8_t rtt_valid;
+            uint8_t rtt_active;     /* Timing a segment (Karn's algorithm) */
+            uint8_t backoff;        /* Consecutive retransmission timeouts */
+            uint32_t rtt_seq;
+            uint64_t rtt_time;
+
+            /* Congestion control (RFC 5681 and RFC 6582) */
+            uint32_t cwnd;
+            uint32_t ssthresh;
+            uint32_t bytes_acked;
+            uint32_t recover;
+            uint32_t rexmit_nxt;    /* Next hole to look at in recovery */
+            uint8_t dupacks;
+            uint8_t in_recovery;
+
+            /* Negotiated options (RFC 7323 and RFC 2018) */
+            uint8_t ws_ok;
+            uint8_t snd_wscale;
+            uint8_t rcv_wscale;
+            uint8_t ts_ok;
+            uint8_t sack_ok;
+            uint32_t ts_recent;
+            uint32_t last_ack_sent;
+            struct tcp_sack_blk sack[TCP_SACK_MAX];
+            int sack_count;
         } data;
     };
 };
@@ -196,11 +247,18 @@ LIST_HEAD(tcp_sock_list, tcp_sock);
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 
-/* Default starting window size for connections. Must fit in uint16_t (max
-   65535 without RFC 1323 window scaling). Larger = more in-flight data =
-   better throughput on links with any latency or reordering. */
+/* Default starting window size for connections. Larger = more in-flight data =
+   better throughput on links with any latency or reordering. Anything over
+   65535 relies on the other side supporting window scaling, so the default
+   stays there and SO_RCVBUF can be used to go up to TCP_MAX_WINDOW. */
 #define TCP_DEFAULT_WINDOW  65535
 
+/* Largest receive buffer that can be requested with SO_RCVBUF. */
+#define TCP_MAX_WINDOW      (1024 * 1024)
+
+/* Largest window shift allowed by RFC 7323. */
+#define TCP_MAX_WSCALE      14
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
@@ -208,8 +266,18 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Retransmission timeout bounds (in milliseconds). The initial value is the one
+   from RFC 6298, the minimum is lower than the RFC's suggested one second, as
+   is common practice these days. */
+#define TCP_INITIAL_RTO     1000
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define TCP_DUPACK_THRESH   3
+
+/* Initial slow start threshold, effectively infinite. */
+#define TCP_INITIAL_SSTHRESH    0x7FFFFFFF
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
@@ -251,6 +319,18 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TS              8
+
+/* Space taken by the timestamp option (with its leading NOPs) on every segment
+   once it has been negotiated. */
+#define TCP_TS_OPT_LEN          12
+
+/* Maximum number of SACK blocks we'll put on an outgoing segment (three fit
+   alongside the timestamp option) or take from an incoming one. */
+#define TCP_SACK_BLKS           4
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -259,6 +339,19 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
+
+/* Options parsed out of an incoming segment */
+struct tcp_opts {
+    int mss;                /* -1 if not present */
+    int wscale;             /* -1 if not present */
+    int sack_ok;
+    int ts_ok;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    int sack_count;
+    struct tcp_sack_blk sack[TCP_SACK_BLKS];
+};
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -269,7 +362,9 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
 static void tcp_send_data(struct tcp_sock *sock, int resend);
-static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_send_fin_ack(struct tcp_sock *sock, int resend);
+static uint8_t tcp_wscale(uint32_t wnd);
+static void tcp_init_timers(struct tcp_sock *sock);
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -423,8 +518,7 @@ retry:
         case TCP_STATE_SYN_RECEIVED:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_send_fin_ack(sock, 0);
             sock->state = TCP_STATE_FIN_WAIT_1;
             goto ret_no_remove;
 
@@ -435,8 +529,7 @@ retry:
                 goto ret_no_remove;
             }
 
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_send_fin_ack(sock, 0);
             sock->state = TCP_STATE_CLOSING;
             goto ret_no_remove;
 
@@ -721,19 +814,36 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
        by the wording of the RFC... */
     sock2->data.snd.iss = (uint32_t)(timer_us_gettime64() >> 2);
     sock2->data.snd.nxt = sock2->data.snd.iss + 1;
+    sock2->data.snd.max = sock2->data.snd.nxt;
     sock2->data.snd.una = sock2->data.snd.iss;
     sock2->data.snd.wnd = lsock.wnd;
-    sock2->data.snd.wl1 = sock2->data.snd.iss;
+    sock2->data.snd.wl1 = lsock.isn;
+    sock2->data.snd.wl2 = sock2->data.snd.iss;
     sock2->data.snd.mss = lsock.mss;
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
+    /* Take whatever options the other side offered us. */
+    if(lsock.wscale >= 0) {
+        sock2->data.ws_ok = 1;
+        sock2->data.snd_wscale = lsock.wscale;
+        sock2->data.rcv_wscale = tcp_wscale(sock2->rcvbuf_sz);
+    }
+
+    sock2->data.sack_ok = lsock.sack_ok;
+    sock2->data.ts_ok = lsock.ts_ok;
+    sock2->data.ts_recent = lsock.ts_val;
+    tcp_init_timers(sock2);
+
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
     sock2->data.timer = timer_ms_gettime64();
+    sock2->data.rtt_active = 1;
+    sock2->data.rtt_seq = sock2->data.snd.iss;
+    sock2->data.rtt_time = sock2->data.timer;
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
     mutex_unlock(&sock2->mutex);
@@ -1076,6 +1186,9 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd.max = sock->data.snd.nxt;
+    sock->data.rcv_wscale = tcp_wscale(sock->rcvbuf_sz);
+    tcp_init_timers(sock);
     sock->state = TCP_STATE_SYN_SENT;
 
     /* Send a <SYN> packet */
@@ -1085,6 +1198,11 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    sock->data.timer = timer_ms_gettime64();
+    sock->data.rtt_active = 1;
+    sock->data.rtt_seq = sock->data.snd.iss;
+    sock->data.rtt_time = sock->data.timer;
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1477,8 +1595,7 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
 
     /* Reset the pointers if there's nothing in the buffer */
     if(sock->data.sndbuf_cur_sz == 0)
-        sock->data.sndbuf_head = sock->data.sndbuf_acked =
-                                     sock->data.sndbuf_tail = 0;
+        sock->data.sndbuf_acked = sock->data.sndbuf_tail = 0;
 
     /* Figure out how much we can copy in */
     bsz = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
@@ -1669,11 +1786,13 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_WINDOW. Anything over 65535 is only usable if
+                       the other side does window scaling. */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
 
                     new_ptr = realloc(sock->data.rcvbuf, tmp);
                     if(!new_ptr)
@@ -1689,8 +1808,8 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
 
                     tmp = *(uint32_t *)option_value;
                     /* Local staging send buffer size for outbound data
-                       (unsent + unacked). Not a wire value, so unlike SO_RCVBUF
-                       it isn't bound by the 16-bit window field. */
+                       (unsent + unacked). Not a wire value, so it isn't
+                       bound by the window the other side advertises. */
                     if(tmp < 2048)
                         tmp = 2048;
                     else if(tmp > 1024 * 1024)
@@ -2138,193 +2257,771 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
                   dst, src);
 }
 
-static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Options are not necessarily aligned, so pull them apart a byte at a time. */
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Timestamp clock for RFC 7323. One tick per millisecond. */
+static inline uint32_t tcp_ts_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
+
+/* Figure out the smallest window shift that lets us advertise the whole of a
+   receive buffer of the given size. */
+static uint8_t tcp_wscale(uint32_t wnd) {
+    uint8_t shift = 0;
+
+    while(shift < TCP_MAX_WSCALE && (wnd >> shift) > 65535)
+        ++shift;
+
+    return shift;
+}
+
+static void tcp_init_timers(struct tcp_sock *sock) {
+    sock->data.rto = TCP_INITIAL_RTO;
+    sock->data.ssthresh = TCP_INITIAL_SSTHRESH;
+    sock->data.recover = sock->data.snd.iss;
+}
+
+/* The amount of data that fits on a segment, less the options that go on every
+   one of them (RFC 6691). */
+static inline uint32_t tcp_seg_mss(const struct tcp_sock *sock) {
+    return sock->data.snd.mss - (sock->data.ts_ok ? TCP_TS_OPT_LEN : 0);
+}
+
+/* Set up the congestion window once the connection is established. The initial
+   window is the one from RFC 6928, unless we had to retransmit the SYN, in
+   which case RFC 5681 says to start from one segment. */
+static void tcp_init_cwnd(struct tcp_sock *sock) {
+    uint32_t mss = tcp_seg_mss(sock);
+
+    if(sock->data.backoff)
+        sock->data.cwnd = mss;
+    else
+        sock->data.cwnd = MIN(10 * mss, MAX(2 * mss, 14600));
+
+    sock->data.backoff = 0;
+}
+
+/* Parse the options on an incoming segment. Returns -1 if they are malformed,
+   in which case whatever was parsed before the bad option is still filled in
+   to the opts structure. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *opts) {
+    const uint8_t *o = tcp->options;
+    int j = 0, i, len;
+    int end_of_opts = TCP_GET_OFFSET(flags) - 20;
+
+    memset(opts, 0, sizeof(struct tcp_opts));
+    opts->mss = -1;
+    opts->wscale = -1;
+
+    while(j < end_of_opts) {
+        switch(o[j]) {
+            case TCP_OPT_EOL:
+                j = end_of_opts;
+                continue;
+
+            case TCP_OPT_NOP:
+                ++j;
+                continue;
+        }
+
+        if(j + 1 >= end_of_opts)
+            return -1;
+
+        len = o[j + 1];
+
+        if(len < 2 || j + len > end_of_opts)
+            return -1;
+
+        switch(o[j]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                opts->mss = (o[j + 2] << 8) | o[j + 3];
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                opts->wscale = MIN(o[j + 2], TCP_MAX_WSCALE);
+                break;
+
+            case TCP_OPT_SACK_PERM:
+                if(len != 2)
+                    return -1;
+
+                opts->sack_ok = 1;
+                break;
+
+            case TCP_OPT_TS:
+                if(len != 10)
+                    return -1;
+
+                opts->ts_ok = 1;
+                opts->ts_val = tcp_get32(o + j + 2);
+                opts->ts_ecr = tcp_get32(o + j + 6);
+                break;
+
+            case TCP_OPT_SACK:
+                if((len - 2) & 7)
+                    return -1;
+
+                for(i = 0; i < (len - 2) >> 3 && i < TCP_SACK_BLKS; ++i) {
+                    opts->sack[i].start = tcp_get32(o + j + 2 + (i << 3));
+                    opts->sack[i].end = tcp_get32(o + j + 6 + (i << 3));
+                }
+
+                opts->sack_count = i;
+                break;
+
+            default:
+                /* Skip unknown options */
+                break;
+        }
+
+        j += len;
+    }
+
+    return 0;
+}
+
+/* Build the SACK blocks to send from the out-of-order segment table. The block
+   holding the most recently received segment goes first, as RFC 2018 asks, and
+   the rest follow in sequence order. Returns the number of blocks. */
+static int tcp_sack_build(struct tcp_sock *sock, struct tcp_sack_blk *blks,
+                          int max) {
+    struct tcp_sack_blk tmp[TCP_OOO_MAX], b;
+    int i, j, n = 0, m = 0;
+
+    for(i = 0; i < sock->data.ooo_count; ++i) {
+        b.start = sock->data.ooo[i].seq;
+        b.end = b.start + sock->data.ooo[i].len;
+
+        if(SEQ_LE(b.end, sock->data.rcv.nxt))
+            continue;
+
+        for(j = n; j > 0 && SEQ_GT(tmp[j - 1].start, b.start); --j)
+            tmp[j] = tmp[j - 1];
+
+        tmp[j] = b;
+        ++n;
+    }
+
+    /* Merge anything that is adjacent or overlapping. */
+    for(i = 0; i < n; ++i) {
+        if(m && SEQ_LE(tmp[i].start, tmp[m - 1].end)) {
+            if(SEQ_GT(tmp[i].end, tmp[m - 1].end))
+                tmp[m - 1].end = tmp[i].end;
+        }
+        else {
+            tmp[m++] = tmp[i];
+        }
+    }
+
+    for(i = 0; i < m; ++i) {
+        if(SEQ_GE(sock->data.ooo_last, tmp[i].start) &&
+           SEQ_LT(sock->data.ooo_last, tmp[i].end)) {
+            b = tmp[i];
+
+            for(j = i; j > 0; --j)
+                tmp[j] = tmp[j - 1];
+
+            tmp[0] = b;
+            break;
+        }
+    }
+
+    if(m > max)
+        m = max;
+
+    memcpy(blks, tmp, m * sizeof(struct tcp_sack_blk));
+    return m;
+}
+
+/* Merge the SACK blocks from an incoming ACK into our scoreboard. Blocks that
+   don't make any sense (or are just reporting duplicates) are ignored. */
+static void tcp_sack_update(struct tcp_sock *sock,
+                            const struct tcp_opts *opts) {
+    struct tcp_sack_blk tmp[TCP_SACK_MAX + TCP_SACK_BLKS], b;
+    int i, j, n, m = 0;
+
+    n = sock->data.sack_count;
+    memcpy(tmp, sock->data.sack, n * sizeof(struct tcp_sack_blk));
+
+    for(i = 0; i < opts->sack_count; ++i) {
+        b = opts->sack[i];
+
+        if(!SEQ_LT(b.start, b.end) || SEQ_LE(b.end, sock->data.snd.una) ||
+           SEQ_GT(b.end, sock->data.snd.max))
+            continue;
+
+        if(SEQ_LT(b.start, sock->data.snd.una))
+            b.start = sock->data.snd.una;
+
+        for(j = n; j > 0 && SEQ_GT(tmp[j - 1].start, b.start); --j)
+            tmp[j] = tmp[j - 1];
+
+        tmp[j] = b;
+        ++n;
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(m && SEQ_LE(tmp[i].start, tmp[m - 1].end)) {
+            if(SEQ_GT(tmp[i].end, tmp[m - 1].end))
+                tmp[m - 1].end = tmp[i].end;
+        }
+        else {
+            tmp[m++] = tmp[i];
+        }
+    }
+
+    /* If we run out of room, forget about the blocks furthest to the right.
+       The holes closest to snd.una are the ones that matter. */
+    if(m > TCP_SACK_MAX)
+        m = TCP_SACK_MAX;
+
+    memcpy(sock->data.sack, tmp, m * sizeof(struct tcp_sack_blk));
+    sock->data.sack_count = m;
+}
+
+/* Drop anything in the scoreboard that has been cumulatively acknowledged. */
+static void tcp_sack_trim(struct tcp_sock *sock) {
+    int i, j = 0;
+
+    for(i = 0; i < sock->data.sack_count; ++i) {
+        if(SEQ_LE(sock->data.sack[i].end, sock->data.snd.una))
+            continue;
+
+        sock->data.sack[j] = sock->data.sack[i];
+
+        if(SEQ_LT(sock->data.sack[j].start, sock->data.snd.una))
+            sock->data.sack[j].start = sock->data.snd.una;
+
+        ++j;
+    }
+
+    sock->data.sack_count = j;
+}
+
+/* Fill in the header of an outgoing segment, along with the timestamp and SACK
+   options, if we're using them. Returns the length of the header. */
+static int tcp_fill_hdr(struct tcp_sock *sock, tcp_hdr_t *hdr, uint32_t seq,
+                        uint16_t flags) {
+    struct tcp_sack_blk blks[TCP_SACK_BLKS];
+    uint8_t *opt = hdr->options;
+    uint32_t wnd;
+    int i, n, len;
 
-    /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.iss);
+    hdr->seq = htonl(seq);
     hdr->ack = htonl(sock->data.rcv.nxt);
+    wnd = sock->data.rcv.wnd >> sock->data.rcv_wscale;
+    hdr->wnd = htons(MIN(wnd, 65535));
+    hdr->checksum = 0;
+    hdr->urg = 0;
 
-    if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+    if(sock->data.ts_ok) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_NOP;
+        opt[2] = TCP_OPT_TS;
+        opt[3] = 10;
+        tcp_put32(opt + 4, tcp_ts_now());
+        tcp_put32(opt + 8, sock->data.ts_recent);
+        opt += TCP_TS_OPT_LEN;
+    }
+
+    if(sock->data.sack_ok && sock->data.ooo_count && (flags & TCP_FLAG_ACK)) {
+        n = tcp_sack_build(sock, blks, sock->data.ts_ok ? TCP_SACK_BLKS - 1 :
+                           TCP_SACK_BLKS);
+
+        if(n) {
+            opt[0] = TCP_OPT_NOP;
+            opt[1] = TCP_OPT_NOP;
+            opt[2] = TCP_OPT_SACK;
+            opt[3] = 2 + (n << 3);
+            opt += 4;
+
+            for(i = 0; i < n; ++i, opt += 8) {
+                tcp_put32(opt, blks[i].start);
+                tcp_put32(opt + 4, blks[i].end);
+            }
+        }
     }
-    else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+
+    if(flags & TCP_FLAG_ACK) {
+        sock->data.last_ack_sent = sock->data.rcv.nxt;
+        sock->data.ack_pending = 0;
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->checksum = 0;
-    hdr->urg = 0;
+    len = opt - (uint8_t *)hdr;
+    hdr->off_flags = htons(flags | TCP_OFFSET(len >> 2));
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    return len;
+}
+
+/* Send a segment without any data on it. */
+static void tcp_send_ctl(struct tcp_sock *sock, uint32_t seq, uint16_t flags) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 40];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    int len;
+    uint16_t cs;
+
+    len = tcp_fill_hdr(sock, hdr, seq, flags);
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  &sock->remote_addr.sin6_addr, len,
+                                  IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
-                         sock->hop_limit, sock->tos, IPPROTO_TCP,
-                         &sock->local_addr.sin6_addr,
-                         &sock->remote_addr.sin6_addr);
+    net_ipv6_send(sock->data.net, rawpkt, len, sock->hop_limit, sock->tos,
+                  IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                  &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+static int tcp_send_syn(struct tcp_sock *sock, int ack) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 20];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint8_t *opt = hdr->options;
+    int sack, ts, ws, len;
     uint16_t cs;
 
-    /* Fill in the base packet */
+    /* A <SYN> offers everything we support, a <SYN,ACK> only has the options
+       that the other side offered us. */
+    sack = !ack || sock->data.sack_ok;
+    ts = !ack || sock->data.ts_ok;
+    ws = !ack || sock->data.ws_ok;
+
+    /* Fill in the base packet. The window in a <SYN> is never scaled. */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->seq = htonl(sock->data.snd.iss);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd, 65535));
     hdr->checksum = 0;
     hdr->urg = 0;
 
+    opt[0] = TCP_OPT_MSS;
+    opt[1] = 4;
+    opt[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opt[3] = TCP_DEFAULT_MSS & 0xFF;
+    opt += 4;
+
+    if(ts) {
+        if(sack) {
+            opt[0] = TCP_OPT_SACK_PERM;
+            opt[1] = 2;
+        }
+        else {
+            opt[0] = TCP_OPT_NOP;
+            opt[1] = TCP_OPT_NOP;
+        }
+
+        opt[2] = TCP_OPT_TS;
+        opt[3] = 10;
+        tcp_put32(opt + 4, tcp_ts_now());
+        tcp_put32(opt + 8, ack ? sock->data.ts_recent : 0);
+        opt += TCP_TS_OPT_LEN;
+    }
+    else if(sack) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_NOP;
+        opt[2] = TCP_OPT_SACK_PERM;
+        opt[3] = 2;
+        opt += 4;
+    }
+
+    if(ws) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_WSCALE;
+        opt[2] = 3;
+        opt[3] = sock->data.rcv_wscale;
+        opt += 4;
+    }
+
+    len = opt - rawpkt;
+
+    if(ack) {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(len >> 2));
+        sock->data.last_ack_sent = sock->data.rcv.nxt;
+    }
+    else {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(len >> 2));
+    }
+
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+                                  len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
-                  sock->tos, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    return net_ipv6_send(sock->data.net, rawpkt, len,
+                         sock->hop_limit, sock->tos, IPPROTO_TCP,
+                         &sock->local_addr.sin6_addr,
+                         &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
-
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+/* Send our <FIN>. If resend is set, this is a retransmission of one that has
+   already gone out, otherwise it takes up the next sequence number. */
+static void tcp_send_fin_ack(struct tcp_sock *sock, int resend) {
+    if(resend) {
+        tcp_send_ctl(sock, sock->data.snd.max - 1, TCP_FLAG_FIN | TCP_FLAG_ACK);
+        return;
+    }
 
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+    tcp_send_ctl(sock, sock->data.snd.nxt, TCP_FLAG_FIN | TCP_FLAG_ACK);
+    sock->data.snd.max = ++sock->data.snd.nxt;
+    sock->data.timer = timer_ms_gettime64();
+}
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, sock->tos, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+static void tcp_send_ack(struct tcp_sock *sock) {
+    tcp_send_ctl(sock, sock->data.snd.nxt, TCP_FLAG_ACK);
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz;
+/* Send up to len bytes from the send buffer, starting at sequence number seq.
+   The caller is responsible for making sure the data is actually in the
+   buffer. Returns the number of bytes sent, which may be less than len if the
+   options on the segment took up some of the room. */
+static uint32_t tcp_send_seg(struct tcp_sock *sock, uint32_t seq,
+                             uint32_t len) {
     alignas(32) uint8_t frame[NET_IPV4_FRAME_HDR_SIZE + 1500];
     uint8_t *seg = frame + NET_IPV4_FRAME_HDR_SIZE;
     tcp_hdr_t *hdr = (tcp_hdr_t *)seg;
+    netif_t *net = sock->data.net ? sock->data.net : net_default_dev;
+    struct iovec iov[2];
+    uint32_t off, first, room;
+    int hlen, v4, cnt = 0;
     uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
-    int v4;
-    uint32_t v4src = 0, v4dst = 0;
+    uint8_t *buf;
+
+    hlen = tcp_fill_hdr(sock, hdr, seq, TCP_FLAG_ACK);
+    room = sock->data.snd.mss - (hlen - sizeof(tcp_hdr_t));
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
+    if(len > room)
+        len = room;
+
+    /* The data might wrap around the end of the send buffer. */
+    buf = seg + hlen;
+    off = (sock->data.sndbuf_acked + (seq - sock->data.snd.una)) %
+          sock->sndbuf_sz;
+    first = MIN(len, sock->sndbuf_sz - off);
+
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr, hlen + len,
+                                  IPPROTO_TCP);
+    v4 = IN6_IS_ADDR_V4MAPPED(&sock->local_addr.sin6_addr) &&
+         IN6_IS_ADDR_V4MAPPED(&sock->remote_addr.sin6_addr);
+
+    if(v4 && net && net->if_tx_sg) {
+        /* The device can pick the data up straight out of the send buffer, so
+           all that needs doing here is summing it up. */
+        if(first) {
+            iov[cnt].iov_base = sock->data.sndbuf + off;
+            iov[cnt++].iov_len = first;
+            cs = net_ipv4_checksum_add(cs,
+                net_ipv4_checksum_part(sock->data.sndbuf + off, first, hlen));
+        }
+
+        if(len > first) {
+            iov[cnt].iov_base = sock->data.sndbuf;
+            iov[cnt++].iov_len = len - first;
+            cs = net_ipv4_checksum_add(cs,
+                net_ipv4_checksum_part(sock->data.sndbuf, len - first,
+                                       hlen + first));
+        }
     }
     else {
-        seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
+        /* Copy in the data, summing it up on the way. */
+        cs = net_ipv4_checksum_copy(buf, sock->data.sndbuf + off, first, cs);
+
+        if(len > first)
+            cs = net_ipv4_checksum_copy(buf + first, sock->data.sndbuf,
+                                        len - first, cs);
     }
 
-    if(!wnd)
-        wnd = 1;
+    hdr->checksum = net_ipv4_checksum(seg, hlen, cs);
 
     /* Use the zero-extra-copy IPv4 path when both ends are V4-mapped. */
-    v4 = IN6_IS_ADDR_V4MAPPED(&sock->local_addr.sin6_addr) &&
-         IN6_IS_ADDR_V4MAPPED(&sock->remote_addr.sin6_addr);
+    if(v4)
+        net_ipv4_send_sg(net, frame, cnt ? (uint32_t)hlen : hlen + len, iov,
+                         cnt, -1, sock->hop_limit, sock->tos, IPPROTO_TCP,
+                         sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3],
+                         sock->remote_addr.sin6_addr.__s6_addr.__s6_addr32[3]);
+    else
+        net_ipv6_send(sock->data.net, seg, hlen + len, sock->hop_limit,
+                      sock->tos, IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                      &sock->remote_addr.sin6_addr);
+
+    return len;
+}
+
+/* Send as much new data as the send and congestion windows allow. If resend is
+   set, the retransmission timer has gone off, so start over from the first
+   unacknowledged byte (and send a one byte probe if the window is closed). */
+static void tcp_send_data(struct tcp_sock *sock, int resend) {
+    uint32_t una = sock->data.snd.una, seq, end, limit, len, cwnd;
+    int idle;
+
+    /* Data only starts flowing once the connection has been established. */
+    if(sock->state != TCP_STATE_ESTABLISHED &&
+       sock->state != TCP_STATE_CLOSE_WAIT)
+        return;
+
+    if(resend)
+        sock->data.snd.nxt = una;
+
+    seq = sock->data.snd.nxt;
+    idle = (seq == una);
+    end = una + sock->data.sndbuf_cur_sz;
+    cwnd = sock->data.cwnd;
+
+    /* Limited transmit (RFC 3042): let one new segment out for each of the
+       first two duplicate ACKs so that a small window can still generate
+       enough of them for a fast retransmit. */
+    if(!sock->data.in_recovery && sock->data.dupacks < TCP_DUPACK_THRESH)
+        cwnd += sock->data.dupacks * tcp_seg_mss(sock);
 
-    if(v4) {
-        v4src = sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3];
-        v4dst = sock->remote_addr.sin6_addr.__s6_addr.__s6_addr32[3];
+    limit = una + MIN(sock->data.snd.wnd, cwnd);
+
+    if(resend && SEQ_GE(seq, limit))
+        limit = seq + 1;
+
+    while(SEQ_LT(seq, end) && SEQ_LT(seq, limit)) {
+        len = MIN(limit - seq, end - seq);
+        len = MIN(len, tcp_seg_mss(sock));
+
+        /* Time this segment if we're not already timing one and it is not a
+           retransmission (Karn's algorithm). */
+        if(!sock->data.rtt_active && SEQ_GE(seq, sock->data.snd.max)) {
+            sock->data.rtt_active = 1;
+            sock->data.rtt_seq = seq;
+            sock->data.rtt_time = timer_ms_gettime64();
+        }
+
+        seq += tcp_send_seg(sock, seq, len);
     }
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+    if(seq == sock->data.snd.nxt)
+        return;
+
+    /* Start the retransmission timer if nothing was outstanding before. */
+    if(idle)
+        sock->data.timer = timer_ms_gettime64();
 
-    /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = seg + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    sock->data.snd.nxt = seq;
+
+    if(SEQ_GT(seq, sock->data.snd.max))
+        sock->data.snd.max = seq;
+}
 
-        if(snd > sock->data.snd.mss)
-            snd = sock->data.snd.mss;
+/* Retransmit the next hole in the sequence space, looking from rexmit_nxt
+   onwards. The first unacknowledged segment always counts as a hole, anything
+   after it only does if the other side has SACKed something past it. Returns
+   non-zero if anything was sent. */
+static int tcp_rexmit_hole(struct tcp_sock *sock) {
+    uint32_t una = sock->data.snd.una, seq, end, len;
+    int i;
+
+    seq = SEQ_LT(sock->data.rexmit_nxt, una) ? una : sock->data.rexmit_nxt;
+    end = una + sock->data.sndbuf_cur_sz;
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+    if(SEQ_GT(end, sock->data.snd.max))
+        end = sock->data.snd.max;
 
-        /* Copy in the data(unavoidable copy) */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+    for(i = 0; i < sock->data.sack_count; ++i) {
+        if(SEQ_LE(sock->data.sack[i].end, seq))
+            continue;
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
+        if(SEQ_LE(sock->data.sack[i].start, seq)) {
+            seq = sock->data.sack[i].end;
+            continue;
+        }
+
+        if(SEQ_LT(sock->data.sack[i].start, end))
+            end = sock->data.sack[i].start;
+
+        break;
+    }
+
+    if((i == sock->data.sack_count && seq != una) || !SEQ_LT(seq, end))
+        return 0;
+
+    len = MIN(end - seq, tcp_seg_mss(sock));
+
+    /* Karn's algorithm: don't trust any timing across a retransmission. */
+    sock->data.rtt_active = 0;
+    len = tcp_send_seg(sock, seq, len);
+    sock->data.rexmit_nxt = seq + len;
+
+    return 1;
+}
+
+/* Feed a round-trip time measurement into the retransmission timer, as
+   described in section 2 of RFC 6298. The clock granularity is the period of
+   the timer job. */
+static void tcp_rtt_update(struct tcp_sock *sock, int32_t rtt) {
+    int32_t delta;
+    uint32_t rto;
+
+    if(rtt < 0)
+        return;
+
+    if(!sock->data.rtt_valid) {
+        sock->data.srtt = rtt << 3;
+        sock->data.rttvar = rtt << 1;
+        sock->data.rtt_valid = 1;
+    }
+    else {
+        delta = rtt - (sock->data.srtt >> 3);
+        sock->data.srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        sock->data.rttvar += delta - (sock->data.rttvar >> 2);
+    }
+
+    rto = (sock->data.srtt >> 3) + MAX(TCP_POLL_PERIOD_MS, sock->data.rttvar);
+    sock->data.rto = MIN(MAX(rto, TCP_MIN_RTO), TCP_MAX_RTO);
+}
+
+/* Back off the retransmission timer after it has gone off. */
+static void tcp_rto_backoff(struct tcp_sock *sock) {
+    sock->data.rtt_active = 0;
+    sock->data.rto = MIN(sock->data.rto << 1, TCP_MAX_RTO);
+
+    if(sock->data.backoff < 255)
+        ++sock->data.backoff;
+}
+
+/* The retransmission timer went off with data outstanding. Unless we were just
+   probing a zero window, the network has dropped something, so go back to
+   slow start (RFC 5681 section 3.1). Anything the other side SACKed may be
+   reneged on, so forget all of it (RFC 2018 section 8). */
+static void tcp_rto(struct tcp_sock *sock) {
+    uint32_t mss = tcp_seg_mss(sock);
+
+    if(sock->data.snd.wnd) {
+        if(!sock->data.backoff)
+            sock->data.ssthresh = MAX((sock->data.snd.max - sock->data.snd.una)
+                                      / 2, 2 * mss);
+
+        sock->data.cwnd = mss;
+        sock->data.bytes_acked = 0;
+        sock->data.dupacks = 0;
+        sock->data.in_recovery = 0;
+        sock->data.recover = sock->data.snd.max;
+        sock->data.sack_count = 0;
+    }
+
+    tcp_rto_backoff(sock);
+}
+
+/* Open up the congestion window for newly acknowledged data, or deal with a
+   partial/full acknowledgement during fast recovery (RFC 6582). */
+static void tcp_cc_ack(struct tcp_sock *sock, uint32_t acked) {
+    uint32_t mss = tcp_seg_mss(sock), flight;
+
+    if(sock->data.in_recovery) {
+        if(SEQ_GE(sock->data.snd.una, sock->data.recover)) {
+            /* Full acknowledgement, so we're done with fast recovery. */
+            flight = sock->data.snd.max - sock->data.snd.una;
+            sock->data.cwnd = MIN(sock->data.ssthresh, MAX(flight, mss) + mss);
+            sock->data.in_recovery = 0;
+            sock->data.dupacks = 0;
         }
         else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+            /* Partial acknowledgement: the next hole has been lost too.
+               Retransmit it and deflate the window by the amount acked. */
+            tcp_rexmit_hole(sock);
+            sock->data.cwnd = sock->data.cwnd > acked ?
+                sock->data.cwnd - acked : 0;
+
+            if(acked >= mss || sock->data.cwnd < mss)
+                sock->data.cwnd += mss;
         }
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
-        seq += snd;
-        unacked += snd;
+        return;
+    }
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(seg, sz, cs);
+    sock->data.dupacks = 0;
 
-        if(v4)
-            net_ipv4_send_inplace(sock->data.net, frame, sz, -1,
-                                  sock->hop_limit, sock->tos, IPPROTO_TCP, v4src, v4dst);
-        else
-            net_ipv6_send(sock->data.net, seg, sz, sock->hop_limit, sock->tos, IPPROTO_TCP,
-                          &sock->local_addr.sin6_addr,
-                          &sock->remote_addr.sin6_addr);
+    /* Slow start grows by the number of bytes acked, congestion avoidance by
+       one segment per window's worth of bytes acked (RFC 3465). */
+    if(sock->data.cwnd < sock->data.ssthresh) {
+        sock->data.cwnd = MIN(sock->data.cwnd + acked, sock->data.ssthresh);
     }
+    else {
+        sock->data.bytes_acked += acked;
 
-    sock->data.timer = timer_ms_gettime64();
-    sock->data.sndbuf_head = head;
-    sock->data.snd.nxt = seq;
+        if(sock->data.bytes_acked >= sock->data.cwnd) {
+            sock->data.bytes_acked -= sock->data.cwnd;
+            sock->data.cwnd += mss;
+        }
+    }
+
+    /* There's no point in letting the window grow past what we can buffer. */
+    if(sock->data.cwnd > MAX(sock->sndbuf_sz, 2 * mss))
+        sock->data.cwnd = MAX(sock->sndbuf_sz, 2 * mss);
+}
+
+/* Handle a duplicate ACK: fast retransmit on the third one, and fast recovery
+   after that (RFC 5681 section 3.2 and RFC 6582). Returns non-zero if a segment
+   was retransmitted. */
+static int tcp_cc_dupack(struct tcp_sock *sock) {
+    uint32_t mss = tcp_seg_mss(sock), flight, sacked = 0;
+    int i;
+
+    if(sock->data.in_recovery) {
+        /* Each duplicate ACK means a segment has left the network. Use that to
+           fill the next hole if there is one, otherwise let the inflated
+           window send new data. */
+        if(tcp_rexmit_hole(sock))
+            return 1;
+
+        sock->data.cwnd += mss;
+        return 0;
+    }
+
+    if(sock->data.dupacks < 255)
+        ++sock->data.dupacks;
+
+    /* With SACK, the scoreboard can prove a loss before the third duplicate
+       ACK shows up (e.g., if some of the ACKs were lost), see RFC 6675. */
+    for(i = 0; i < sock->data.sack_count; ++i)
+        sacked += sock->data.sack[i].end - sock->data.sack[i].start;
+
+    /* Don't go into recovery again for losses in data that was sent before the
+       last retransmission timeout. */
+    if((sock->data.dupacks < TCP_DUPACK_THRESH &&
+        sacked <= (TCP_DUPACK_THRESH - 1) * mss) ||
+       SEQ_LT(sock->data.snd.una, sock->data.recover))
+        return 0;
+
+    flight = sock->data.snd.max - sock->data.snd.una;
+    sock->data.ssthresh = MAX(flight / 2, 2 * mss);
+    sock->data.recover = sock->data.snd.max;
+    sock->data.in_recovery = 1;
+    sock->data.rexmit_nxt = sock->data.snd.una;
+    tcp_rexmit_hole(sock);
+    sock->data.cwnd = sock->data.ssthresh + 3 * mss;
+
+    return 1;
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2386,9 +3083,10 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
+    int j;
     uint16_t mss = 576;
+    struct tcp_opts opts;
+    struct lsock *ls;
 
     (void)size;
 
@@ -2400,53 +3098,31 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     if(flags & TCP_FLAG_ACK)
         return -1;
 
-    /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
-
-            default:
-
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
+    /* Parse options now, in case we need to update the max segment size or
+       enable any of the extensions. */
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return -1;
 
-                j += tcp->options[j + 1];
-        }
-    }
+    if(opts.mss >= 0)
+        mss = opts.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
         mss = 1460;
+    else if(mss < 64)
+        mss = 64;
 
     /* If the SYN bit is set, we should check the security/compartment. We just
        silently ignore them for now. We also ignore the precedence... Thus, the
        next thing is to make sure that we don't already have this connection in
        the queue... */
     for(j = s->listen.head; j < s->listen.tail; ++j) {
-        if(ADDR_EQUAL(s->listen.queue[j].remote_addr.sin6_addr, *srca) &&
-                ADDR_EQUAL(s->listen.queue[j].local_addr.sin6_addr, *dsta) &&
-                s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
-            s->listen.queue[j].isn = ntohl(tcp->seq);
-            s->listen.queue[j].mss = mss;
-            return 0;
-        }
+        ls = s->listen.queue + j;
+
+        if(ADDR_EQUAL(ls->remote_addr.sin6_addr, *srca) &&
+                ADDR_EQUAL(ls->local_addr.sin6_addr, *dsta) &&
+                ls->remote_addr.sin6_port == tcp->src_port)
+            goto fill_opts;
     }
 
     /* Next, see if we have space for this one in the queue... */
@@ -2455,14 +3131,12 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* The rest of the processing is put off until the program does an accept().
        Save the connection in the list of incoming sockets. */
-    s->listen.queue[s->listen.tail].net = src;
-    s->listen.queue[s->listen.tail].remote_addr.sin6_addr = *srca;
-    s->listen.queue[s->listen.tail].remote_addr.sin6_port = tcp->src_port;
-    s->listen.queue[s->listen.tail].local_addr.sin6_addr = *dsta;
-    s->listen.queue[s->listen.tail].local_addr.sin6_port = tcp->dst_port;
-    s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
-    s->listen.queue[s->listen.tail].mss = mss;
-    s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    ls = s->listen.queue + s->listen.tail;
+    ls->net = src;
+    ls->remote_addr.sin6_addr = *srca;
+    ls->remote_addr.sin6_port = tcp->src_port;
+    ls->local_addr.sin6_addr = *dsta;
+    ls->local_addr.sin6_port = tcp->dst_port;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2473,6 +3147,15 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->poll_pending |= POLLRDNORM;
     cond_signal(&s->listen.cv);
 
+fill_opts:
+    ls->isn = ntohl(tcp->seq);
+    ls->mss = mss;
+    ls->wnd = ntohs(tcp->wnd);
+    ls->wscale = opts.wscale;
+    ls->sack_ok = opts.sack_ok;
+    ls->ts_ok = opts.ts_ok;
+    ls->ts_val = opts.ts_val;
+
     /* We're done, return success. */
     return 0;
 }
@@ -2484,7 +3167,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    int mss = 536;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2520,40 +3204,31 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
-
-                case TCP_OPT_MSS:
-
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
+        if(tcp_parse_opts(tcp, flags, &opts))
+            return -1;
 
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        if(opts.mss >= 0)
+            mss = opts.mss;
 
-                default:
+        s->data.snd.mss = mss > 1460 ? 1460 : (mss < 64 ? 64 : mss);
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        /* The window in a <SYN> is never scaled. */
+        s->data.snd.wnd = ntohs(tcp->wnd);
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
 
-                    j += tcp->options[j + 1];
-            }
+        /* Window scaling is only in effect if both sides sent the option. */
+        if(opts.wscale >= 0) {
+            s->data.ws_ok = 1;
+            s->data.snd_wscale = opts.wscale;
+        }
+        else {
+            s->data.rcv_wscale = 0;
         }
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
-        s->data.snd.wnd = htons(tcp->wnd);
+        s->data.sack_ok = opts.sack_ok;
+        s->data.ts_ok = opts.ts_ok;
+        s->data.ts_recent = opts.ts_val;
 
         if(gotack) {
             s->data.snd.una = ack;
@@ -2561,6 +3236,13 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the ack covers our iss, then we've established the connection.
                Update the state and ack it. */
             if(SEQ_GT(ack, s->data.snd.iss)) {
+                if(s->data.rtt_active) {
+                    tcp_rtt_update(s, (int32_t)(timer_ms_gettime64() -
+                                                s->data.rtt_time));
+                    s->data.rtt_active = 0;
+                }
+
+                tcp_init_cwnd(s);
                 s->state = TCP_STATE_ESTABLISHED;
                 tcp_send_ack(s);
                 s->poll_pending |= (POLLWRNORM | POLLWRBAND);
@@ -2586,10 +3268,9 @@ static int tcp_ooo_add(struct tcp_sock *s, uint32_t seq, size_t sz,
     if(s->data.ooo_count >= TCP_OOO_MAX)
         return -1;
 
-    /* Reject duplicates — if this segment overlaps with an existing
-       OOO entry, skip it. Without this check, retransmitted OOO
-       segments decrement rcv.wnd repeatedly, eventually leaking
-       the window to zero and deadlocking the connection. */
+    /* Reject duplicates — if this segment starts inside an existing
+       OOO entry, skip it. There's no sense in burning a table entry
+       on data we already have. */
     for(int i = 0; i < s->data.ooo_count; i++) {
         uint32_t ooo_end = s->data.ooo[i].seq + s->data.ooo[i].len;
         if(SEQ_GE(seq, s->data.ooo[i].seq) && SEQ_LT(seq, ooo_end))
@@ -2634,10 +3315,11 @@ static uint32_t tcp_ooo_consume(struct tcp_sock *s) {
                 break;
             }
 
-            /* Contiguous — consume */
-            if(s->data.ooo[i].seq == s->data.rcv.nxt) {
-                total += s->data.ooo[i].len;
-                s->data.rcv.nxt += s->data.ooo[i].len;
+            /* Contiguous (or overlapping what we already have) — consume
+               whatever is past rcv.nxt */
+            if(SEQ_LE(s->data.ooo[i].seq, s->data.rcv.nxt)) {
+                total += seg_end - s->data.rcv.nxt;
+                s->data.rcv.nxt = seg_end;
                 s->data.ooo[i] = s->data.ooo[--s->data.ooo_count];
                 changed = 1;
                 break;
@@ -2653,11 +3335,13 @@ static uint32_t tcp_ooo_consume(struct tcp_sock *s) {
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
-    size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    uint32_t seq, ack, up, wnd, acked, data;
+    size_t sz, seglen;
+    int bad_pkt = 0, tmp, acksyn = 0, newack = 0, sent = 0;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
+    struct tcp_opts opts;
+    uint64_t now;
 
     (void)src;
 
@@ -2666,9 +3350,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     ack = ntohl(tcp->ack);
 
     /* Check the validity of the incoming segment's sequence number */
-    sz = size - TCP_GET_OFFSET(flags);
+    sz = seglen = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
 
+    /* If the options are malformed, just go with whatever could be parsed. */
+    tcp_parse_opts(tcp, flags, &opts);
+
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
             bad_pkt = 1;
@@ -2680,11 +3367,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 bad_pkt = 1;
         }
         else {
-            /* Accept data segments anywhere in [rcv.nxt, rcv.nxt+wnd).
+            /* Accept data segments that overlap [rcv.nxt, rcv.nxt+wnd) at all.
                In-order segments (seq == rcv.nxt) go straight to the app.
-               Out-of-order segments are buffered for reassembly. */
-            if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
-                    SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
+               Out-of-order segments are buffered for reassembly. Anything
+               we already have is trimmed off the front below. */
+            if(!(SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd) &&
+                    SEQ_GT(seq + sz, s->data.rcv.nxt)))
                 bad_pkt = 1;
         }
     }
@@ -2701,6 +3389,20 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Remember the timestamp to echo back (RFC 7323 section 4.3). */
+    if(s->data.ts_ok && opts.ts_ok &&
+            SEQ_GE(opts.ts_val, s->data.ts_recent) &&
+            SEQ_LE(seq, s->data.last_ack_sent))
+        s->data.ts_recent = opts.ts_val;
+
+    /* Trim off any data we've already received. */
+    if(sz && SEQ_LT(seq, s->data.rcv.nxt)) {
+        tmp = s->data.rcv.nxt - seq;
+        buf += tmp;
+        sz -= tmp;
+        seq = s->data.rcv.nxt;
+    }
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2740,8 +3442,9 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* The state changes how we handle the rest... */
     if(s->state == TCP_STATE_SYN_RECEIVED) {
-        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
+        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
             s->state = TCP_STATE_ESTABLISHED;
+            tcp_init_cwnd(s);
             acksyn = 1;
         }
         else {
@@ -2750,10 +3453,24 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* This ACKs something we haven't sent, so try to correct the other side
+       and return */
+    if(SEQ_GT(ack, s->data.snd.max)) {
+        tcp_send_ack(s);
+        return 0;
+    }
+
+    wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd_wscale;
+    now = timer_ms_gettime64();
+
     /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
+    if(SEQ_LT(s->data.snd.una, ack)) {
+        /* Don't count our SYN or FIN as data in the buffer. */
+        acked = ack - s->data.snd.una - acksyn;
+        data = MIN(acked, s->data.sndbuf_cur_sz);
+
+        s->data.sndbuf_acked += data;
+        s->data.sndbuf_cur_sz -= data;
         s->data.snd.una = ack;
         s->poll_pending |= (POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
@@ -2761,18 +3478,52 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
+        /* After a retransmission timeout, the other side may well have had
+           more than we've resent so far. */
+        if(SEQ_LT(s->data.snd.nxt, ack))
+            s->data.snd.nxt = ack;
+
+        tcp_sack_trim(s);
+
+        /* Take a round-trip time sample, from the timestamp if we have one,
+           otherwise from the segment we've been timing. */
+        if(s->data.ts_ok && opts.ts_ok && opts.ts_ecr)
+            tcp_rtt_update(s, (int32_t)((uint32_t)now - opts.ts_ecr));
+        else if(s->data.rtt_active && SEQ_GT(ack, s->data.rtt_seq))
+            tcp_rtt_update(s, (int32_t)(now - s->data.rtt_time));
+
+        if(SEQ_GT(ack, s->data.rtt_seq))
+            s->data.rtt_active = 0;
+
+        /* Restart the retransmission timer for whatever is still
+           outstanding. */
+        s->data.backoff = 0;
+        s->data.timer = now;
+        newack = 1;
+
+        tcp_cc_ack(s, acked);
     }
-    else if(SEQ_GT(ack, s->data.snd.nxt)) {
-        /* This ACKs something we haven't sent, so try to correct the other side
-           and return */
-        tcp_send_ack(s);
-        return 0;
+
+    if(s->data.sack_ok && opts.sack_count)
+        tcp_sack_update(s, &opts);
+
+    /* A duplicate ACK is one that doesn't move anything forward while we have
+       data outstanding (RFC 5681 section 2). */
+    if(!newack && ack == s->data.snd.una && !seglen &&
+            !(flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) &&
+            wnd == s->data.snd.wnd && s->data.snd.una != s->data.snd.max &&
+            (s->state == TCP_STATE_ESTABLISHED ||
+             s->state == TCP_STATE_CLOSE_WAIT))
+        sent = tcp_cc_dupack(s);
+
+    /* Update the send window, even if nothing new was acked, otherwise we'd
+       never notice a window opening back up. */
+    if(SEQ_GE(ack, s->data.snd.una) &&
+            (SEQ_LT(s->data.snd.wl1, seq) ||
+             (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
     }
 
     /* We need to do a bit more processing in certain states... */
@@ -2827,10 +3578,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     if(s->state == TCP_STATE_ESTABLISHED || s->state == TCP_STATE_FIN_WAIT_1 ||
             s->state == TCP_STATE_FIN_WAIT_2) {
-        /* Next, check the data size versus our window. If its more than the
-           window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
+        /* Next, check the data size versus our window. If it goes past the
+           right edge of the window, truncate the data and copy out what we
+           can. */
+        if(SEQ_GT(seq + sz, s->data.rcv.nxt + s->data.rcv.wnd)) {
+            sz = s->data.rcv.nxt + s->data.rcv.wnd - seq;
             bad_pkt = 1;
         }
 
@@ -2860,10 +3612,10 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                     extra = tcp_ooo_consume(s);
                     if(extra) {
                         /* Data already in buffer from when OOO arrived.
-                           Advance tail and cur_sz. rcv.wnd was already
-                           decremented when the OOO segment was buffered,
-                           and rcv.nxt was advanced by tcp_ooo_consume. */
+                           Advance tail, cur_sz and the window. rcv.nxt was
+                           advanced by tcp_ooo_consume. */
                         s->data.rcvbuf_cur_sz += extra;
+                        s->data.rcv.wnd -= extra;
                         s->data.rcvbuf_tail =
                             (s->data.rcvbuf_tail + extra) % s->rcvbuf_sz;
                     }
@@ -2886,20 +3638,18 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 }
             }
             else if(SEQ_GT(seq, s->data.rcv.nxt)) {
-                /* --- Out-of-order segment: buffer for reassembly --- */
-                if(tcp_ooo_add(s, seq, sz, buf) == 0) {
-                    /* Only shrink window if data was actually buffered.
-                       If table was full, data was dropped — don't account
-                       for phantom bytes or the app gets garbage later. */
-                    s->data.rcv.wnd -= sz;
-                }
-
-                /* Send dup ACK (with current rcv.nxt) so the sender
-                   can do fast retransmit after 3 dup ACKs. */
+                /* --- Out-of-order segment: buffer for reassembly ---
+                   The data lands in the free part of the buffer inside the
+                   window, so the window itself doesn't shrink until it is
+                   actually consumed. If the table is full, it is simply
+                   dropped. */
+                s->data.ooo_last = seq;
+                tcp_ooo_add(s, seq, sz, buf);
+
+                /* Send dup ACK (with current rcv.nxt and SACK blocks) so the
+                   sender can do fast retransmit after 3 dup ACKs. */
                 tcp_send_ack(s);
             }
-            /* else: seq < rcv.nxt — duplicate/retransmit, ignore data.
-               The ACK sent for bad_pkt (if any) covers this. */
         }
     }
     else if(sz) {
@@ -2909,8 +3659,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     }
 
     /* Finally, check the FIN bit. We don't try to ack it if the packet had too
-       much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+       much data, or if it arrived out of order. */
+    if(!bad_pkt && (flags & TCP_FLAG_FIN) && seq + sz == s->data.rcv.nxt) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2943,6 +3693,13 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* The ACK may have opened up either window, so send anything more that we
+       can, unless we've just used this ACK to retransmit something. */
+    if(!sent && (s->state == TCP_STATE_ESTABLISHED ||
+                 s->state == TCP_STATE_CLOSE_WAIT) &&
+            s->data.sndbuf_cur_sz > s->data.snd.nxt - s->data.snd.una)
+        tcp_send_data(s, 0);
+
     /* And... We're done, finally. */
     return 0;
 }
@@ -3076,8 +3833,9 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
                 /* If our last <SYN> was sent more than one  retransmission
                    timeout period ago and we are still in the SYN-SENT state,
                    send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
+                if(i->data.timer + i->data.rto <= timer) {
                     tcp_send_syn(i, 0);
+                    tcp_rto_backoff(i);
                     i->data.timer = timer;
                 }
 
@@ -3088,8 +3846,9 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
                 /* If our last <SYN,ACK> was sent more than one  retransmission
                    timeout period ago and we are still in the SYN-RECEIVED
                    state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
+                if(i->data.timer + i->data.rto <= timer) {
                     tcp_send_syn(i, 1);
+                    tcp_rto_backoff(i);
                     i->data.timer = timer;
                 }
 
@@ -3116,8 +3875,10 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
                 }
 
                 if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
+                        i->data.timer + i->data.rto <= timer) {
+                    tcp_rto(i);
                     tcp_send_data(i, 1);
+                    i->data.timer = timer;
                 }
                 else if(!i->data.sndbuf_cur_sz &&
                         (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
@@ -3128,8 +3889,21 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
                         i->state = TCP_STATE_CLOSING;
                     }
 
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
+                    tcp_send_fin_ack(i, 0);
+                }
+
+                break;
+
+            case TCP_STATE_FIN_WAIT_1:
+            case TCP_STATE_CLOSING:
+            case TCP_STATE_LAST_ACK:
+
+                /* Resend our <FIN> if it hasn't been acknowledged. */
+                if(i->data.snd.una != i->data.snd.max &&
+                        i->data.timer + i->data.rto <= timer) {
+                    tcp_send_fin_ack(i, 1);
+                    tcp_rto_backoff(i);
+                    i->data.timer = timer;
                 }
 
                 break;
@@ -5,6 +5,7 @@
 
 */
 
+#include <stdalign.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -1415,10 +1416,14 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
                             const struct sockaddr_in6 *dst, const uint8_t *data,
                             size_t size, uint32_t flags, int hops, int tos,
                             uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
+    alignas(32) uint8_t frame[NET_IPV4_FRAME_HDR_SIZE + sizeof(udp_hdr_t) +
+                              size];
+    uint8_t *buf = frame + NET_IPV4_FRAME_HDR_SIZE;
     udp_hdr_t *hdr = (udp_hdr_t *)buf;
+    struct iovec iov = { (void *)data, size };
+    size_t cover;
     uint16_t cs;
-    int err;
+    int err, v4, sg;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
@@ -1459,39 +1464,61 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
+    v4 = IN6_IS_ADDR_V4MAPPED(&srcaddr) && IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr);
+
+    /* If the device can gather the pieces itself, the data doesn't need to be
+       copied at all. */
+    sg = v4 && net->if_tx_sg && size;
     size += sizeof(udp_hdr_t);
 
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
     hdr->checksum = 0;
 
-    /* Is this UDP or UDP-Lite? */
+    /* Is this UDP or UDP-Lite? Figure out how much of the datagram the
+       checksum covers. */
     if(proto == IPPROTO_UDP) {
         hdr->length = htons(size);
-
-        if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
-            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
-                                          proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
-        }
+        cover = (iflags & UDPSOCK_NO_CHECKSUM) ? 0 : size;
     }
     else {
-        if(cscov <= size) {
+        if(cscov && cscov <= size) {
             hdr->length = htons(cscov);
+            cover = cscov < sizeof(udp_hdr_t) ? sizeof(udp_hdr_t) : cscov;
         }
         else {
             hdr->length = 0;
-            cscov = size;
+            cover = size;
         }
+    }
 
-        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
+    cs = cover ? net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
+                                          proto) : 0;
+    cover = cover ? cover - sizeof(udp_hdr_t) : 0;
+
+    if(sg) {
+        cs = net_ipv4_checksum_add(cs,
+            net_ipv4_checksum_part(data, cover, sizeof(udp_hdr_t)));
+    }
+    else {
+        /* Copy the data in, summing up the covered part on the way. */
+        cs = net_ipv4_checksum_copy(buf + sizeof(udp_hdr_t), data, cover, cs);
+        memcpy(buf + sizeof(udp_hdr_t) + cover, data + cover,
+               size - sizeof(udp_hdr_t) - cover);
     }
 
+    if(proto != IPPROTO_UDP || !(iflags & UDPSOCK_NO_CHECKSUM))
+        hdr->checksum = net_ipv4_checksum(buf, sizeof(udp_hdr_t), cs);
+
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, tos, proto, &srcaddr,
-                        &dst->sin6_addr);
+    if(v4)
+        err = net_ipv4_send_sg(net, frame, sg ? sizeof(udp_hdr_t) : size,
+                               &iov, sg, -1, hops, tos, proto,
+                               srcaddr.__s6_addr.__s6_addr32[3],
+                               dst->sin6_addr.__s6_addr.__s6_addr32[3]);
+    else
+        err = net_ipv6_send(net, buf, size, hops, tos, proto, &srcaddr,
+                            &dst->sin6_addr);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -32,40 +32,94 @@
 static TAILQ_HEAD(slpquehead, kthread) slpque[TABLESIZE];
 #define LOOKUP(x)   (((uintptr_t)(x) >> 8) & (TABLESIZE - 1))
 
-/* Timed event queue. Anything that isn't ready to run yet, but will be
+/* Timed event wheel. Anything that isn't ready to run yet, but will be
    ready to run at a later time will be placed here. Note that this doesn't
    deal with pre-emptive timeslice context switching, only things that are
    specifically blocked for a timed event (thd_sleep, genwait_wait, etc).
-   This queue is sorted by remaining time (smallest at the front). */
-static struct ktqueue timer_queue;
 
-/* Internal function to insert a thread on the timer queue. Maintains
-   sorting order by wait time. */
+   This is a hierarchical timing wheel with a resolution of one millisecond:
+   the first level has one slot per millisecond for the next 256ms, and each
+   of the following levels has 64 slots, each one covering a whole turn of
+   the level below it. Whenever a level wraps around, the next slot of the
+   level above is cascaded down. Timeouts that are too far away for the last
+   level go on an (unsorted) overflow list. Each time the last level wraps
+   around, the whole list goes through tw_cascade(), which re-inserts its
+   entries with tq_insert(), so those that have come within range move into
+   the wheel. This gives O(1) insertion and removal, and expiry that is O(1)
+   per millisecond elapsed. */
+#define TW_L0_BITS  8
+#define TW_LN_BITS  6
+#define TW_LEVELS   3
+#define TW_L0_SIZE  (1 << TW_L0_BITS)
+#define TW_LN_SIZE  (1 << TW_LN_BITS)
+#define TW_L0_MASK  (TW_L0_SIZE - 1)
+#define TW_LN_MASK  (TW_LN_SIZE - 1)
+#define TW_SHIFT(lvl)   (TW_L0_BITS + (lvl) * TW_LN_BITS)
+
+LIST_HEAD(tw_slot, kthread);
+static struct tw_slot tw_l0[TW_L0_SIZE];
+static struct tw_slot tw_ln[TW_LEVELS][TW_LN_SIZE];
+static struct tw_slot tw_overflow;
+
+/* The next millisecond to be processed by the wheel */
+static uint64_t tw_time;
+
+/* Number of threads on the wheel */
+static size_t tw_count;
+
+/* Internal function to insert a thread on the timer wheel, in the slot
+   matching its timeout. */
 static void __nonnull_all tq_insert(kthread_t *thd) {
-    kthread_t *t;
+    uint64_t expires = thd->wait_timeout;
+    uint64_t delta;
+    struct tw_slot *slot = &tw_overflow;
+    unsigned int lvl;
 
-    /* Search for its place; note that new threads will be placed at
-       the end of a group with the same timeout. */
-    TAILQ_FOREACH_REVERSE(t, &timer_queue, slpquehead, timerq) {
-        if(thd->wait_timeout >= t->wait_timeout) {
-            TAILQ_INSERT_AFTER(&timer_queue, t, thd, timerq);
-            return;
+    /* Anything that has expired already goes in the next slot. */
+    if(expires < tw_time)
+        expires = tw_time;
+
+    delta = expires - tw_time;
+
+    if(delta < TW_L0_SIZE) {
+        slot = &tw_l0[expires & TW_L0_MASK];
+    }
+    else {
+        for(lvl = 0; lvl < TW_LEVELS; lvl++) {
+            if(delta < (1ULL << TW_SHIFT(lvl + 1))) {
+                slot = &tw_ln[lvl][(expires >> TW_SHIFT(lvl)) & TW_LN_MASK];
+                break;
+            }
         }
     }
 
-    /* Couldn't find anything scheduled earlier, put this at the start. */
-    TAILQ_INSERT_HEAD(&timer_queue, thd, timerq);
+    LIST_INSERT_HEAD(slot, thd, timerq);
+    tw_count++;
 }
 
-/* Internal function to remove a thread from the timer queue. */
+/* Internal function to remove a thread from the timer wheel. */
 static void __nonnull_all tq_remove(kthread_t *thd) {
-    TAILQ_REMOVE(&timer_queue, thd, timerq);
+    LIST_REMOVE(thd, timerq);
+    tw_count--;
 }
 
-/* Returns the top thread on the timer queue (next event). If nothing is
-   queued, we'll return NULL. */
-static kthread_t *tq_next(void) {
-    return TAILQ_FIRST(&timer_queue);
+/* Re-insert all the threads of a slot, now that the wheel got closer to
+   their timeout. */
+static void tw_cascade(struct tw_slot *slot) {
+    struct tw_slot tmp = LIST_HEAD_INITIALIZER(tmp);
+    kthread_t *t;
+
+    /* Detach the whole slot first, as threads may land right back in it. */
+    while((t = LIST_FIRST(slot))) {
+        LIST_REMOVE(t, timerq);
+        LIST_INSERT_HEAD(&tmp, t, timerq);
+    }
+
+    while((t = LIST_FIRST(&tmp))) {
+        LIST_REMOVE(t, timerq);
+        tw_count--;
+        tq_insert(t);
+    }
 }
 
 int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
@@ -186,33 +240,89 @@ int genwait_wake_thd(const void *obj, kthread_t *thd, int err) {
 }
 
 void genwait_check_timeouts(uint64_t tm) {
-    kthread_t   *t;
+    struct tw_slot *slot;
+    kthread_t *t;
+    unsigned int lvl;
 
-    while((t = tq_next())) {
-        /* If the next timeout is beyond our current time, then
-           forget about it. */
-        if(t->wait_timeout > tm)
+    while(tw_time <= tm) {
+        /* Nothing left to wait for, so just catch up with the time. */
+        if(!tw_count) {
+            tw_time = tm + 1;
             return;
+        }
+
+        /* If the first level wrapped around, pull down the next slot of each
+           level above it that also wrapped around. */
+        if(!(tw_time & TW_L0_MASK)) {
+            for(lvl = 0; lvl < TW_LEVELS; lvl++) {
+                tw_cascade(&tw_ln[lvl][(tw_time >> TW_SHIFT(lvl)) & TW_LN_MASK]);
+
+                if((tw_time >> TW_SHIFT(lvl)) & TW_LN_MASK)
+                    break;
+            }
+
+            if(lvl == TW_LEVELS)
+                tw_cascade(&tw_overflow);
+        }
+
+        /* Re-activate everything in this slot with an error code */
+        slot = &tw_l0[tw_time & TW_L0_MASK];
+
+        while((t = LIST_FIRST(slot)))
+            genwait_unqueue(t, EAGAIN);
 
-        /* Re-activate it with an error code */
-        genwait_unqueue(t, EAGAIN);
+        tw_time++;
     }
 }
 
+/* Not used by the scheduler itself, so this just looks at every thread on
+   the wheel rather than keeping track of the earliest timeout. */
 uint64_t genwait_next_timeout(void) {
-    kthread_t *t = tq_next();
+    uint64_t next = 0;
+    kthread_t *t;
+    unsigned int i, lvl;
 
-    if(t == NULL)
-        return 0;
-    else
-        return t->wait_timeout;
+    irq_disable_scoped();
+
+    for(i = 0; i < TW_L0_SIZE; i++) {
+        LIST_FOREACH(t, &tw_l0[i], timerq) {
+            if(!next || t->wait_timeout < next)
+                next = t->wait_timeout;
+        }
+    }
+
+    for(lvl = 0; lvl < TW_LEVELS; lvl++) {
+        for(i = 0; i < TW_LN_SIZE; i++) {
+            LIST_FOREACH(t, &tw_ln[lvl][i], timerq) {
+                if(!next || t->wait_timeout < next)
+                    next = t->wait_timeout;
+            }
+        }
+    }
+
+    LIST_FOREACH(t, &tw_overflow, timerq) {
+        if(!next || t->wait_timeout < next)
+            next = t->wait_timeout;
+    }
+
+    return next;
 }
 
 int genwait_init(void) {
     for(size_t i = 0; i < TABLESIZE; i++)
         TAILQ_INIT(&slpque[i]);
 
-    TAILQ_INIT(&timer_queue);
+    for(size_t i = 0; i < TW_L0_SIZE; i++)
+        LIST_INIT(&tw_l0[i]);
+
+    for(size_t lvl = 0; lvl < TW_LEVELS; lvl++) {
+        for(size_t i = 0; i < TW_LN_SIZE; i++)
+            LIST_INIT(&tw_ln[lvl][i]);
+    }
+
+    LIST_INIT(&tw_overflow);
+    tw_time = timer_ms_gettime64();
+    tw_count = 0;
     return 0;
 }
 
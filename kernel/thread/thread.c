@@ -67,14 +67,34 @@ static unsigned int thd_ageing_ms_log2;
 /* Thread list. This includes all threads except dead ones. */
 static struct ktlist thd_list;
 
-/* Run queue. This is more like on a standard time sharing system than the
-   previous versions. The top element of this priority queue should be the
-   thread that is ready to run next. When a thread is scheduled, it will be
-   removed from this queue. When it's de-scheduled, it will be re-inserted
-   by its priority value at the end of its priority group. Note that right
-   now this condition is being broken because sleeping threads are on the
-   same queue. We deal with those in thd_switch below. */
-static struct ktqueue run_queue;
+/* Run queue. This is split into buckets of priorities, each of which is a
+   queue of runnable threads, and a bitmap of the non-empty buckets. Each
+   priority below THD_RUNQ_EXACT has a bucket of its own; above that, each
+   bucket covers a power-of-two range of priorities and is kept sorted by
+   priority. The last bucket holds the threads above PRIO_MAX (i.e. the idle
+   thread). Within a priority group, threads are queued in FIFO order, which
+   implements round robin scheduling. The thread that is ready to run next is
+   therefore always the first one of the lowest set bucket. */
+#define THD_RUNQ_BUCKETS    32
+#define THD_RUNQ_EXACT      16
+
+/* Special bucket value for threads on the polling queue */
+#define THD_RUNQ_POLL       0xff
+
+static struct ktqueue run_queue[THD_RUNQ_BUCKETS];
+static uint32_t run_queue_mask;
+
+/* Polling threads. These are not runnable until their poll callback says
+   so, so they are kept away from the run queue and checked on each pass. */
+static struct ktqueue poll_queue;
+
+/* Ageing queue. All the threads of the run queue, in the order they were
+   queued (or last aged). Only its head has to be looked at to know whether
+   some thread has been waiting long enough to be promoted. */
+static struct ktqueue age_queue;
+
+/* Time of the last scheduler pass, used to timestamp run queue insertions */
+static uint32_t thd_runq_time;
 
 /* The currently executing thread. This thread should not be on any queues. */
 kthread_t *thd_current = NULL;
@@ -94,7 +114,7 @@ static kthread_t *thd_idle_thd = NULL;
 /*****************************************************************************/
 /* Debug */
 
-static const char *thd_state_to_str(kthread_t *thd) {
+static const char *thd_state_to_str(const kthread_t *thd) {
     switch(thd->state) {
         case STATE_ZOMBIE:
             return "zombie";
@@ -171,26 +191,36 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
     return 0;
 }
 
+static void thd_pslist_queue_one(int (*pf)(const char *fmt, ...),
+                                 const kthread_t *cur) {
+    pf("%08lx\t", CONTEXT_PC(cur->context));
+    pf("%d\t", cur->tid);
+
+    if(cur->prio == PRIO_MAX)
+        pf("MAX\t");
+    else
+        pf("%d\t", cur->prio);
+
+    pf("%08lx\t", cur->flags);
+    pf("%ld\t\t", (uint32_t)cur->wait_timeout);
+    pf("%10s", thd_state_to_str(cur));
+    pf("%s\n", cur->label);
+}
+
 int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
     kthread_t *cur;
 
     pf("Queued threads:\n");
     pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
-    TAILQ_FOREACH(cur, &run_queue, thdq) {
-        pf("%08lx\t", CONTEXT_PC(cur->context));
-        pf("%d\t", cur->tid);
 
-        if(cur->prio == PRIO_MAX)
-            pf("MAX\t");
-        else
-            pf("%d\t", cur->prio);
-
-        pf("%08lx\t", cur->flags);
-        pf("%ld\t\t", (uint32_t)cur->wait_timeout);
-        pf("%10s", thd_state_to_str(cur));
-        pf("%s\n", cur->label);
+    for(unsigned int i = 0; i < THD_RUNQ_BUCKETS; i++) {
+        TAILQ_FOREACH(cur, &run_queue[i], thdq)
+            thd_pslist_queue_one(pf, cur);
     }
 
+    TAILQ_FOREACH(cur, &poll_queue, thdq)
+        thd_pslist_queue_one(pf, cur);
+
     return 0;
 }
 
@@ -222,16 +252,7 @@ kthread_t *thd_by_tid(tid_t tid) {
 
 
 static bool thd_has_polls(void) {
-    kthread_t *thd;
-
-    irq_disable_scoped();
-
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(thd->state == STATE_POLLING)
-            return true;
-    }
-
-    return false;
+    return !TAILQ_EMPTY(&poll_queue);
 }
 
 /*****************************************************************************/
@@ -333,49 +354,88 @@ void thd_exit(void *rv) {
 /*****************************************************************************/
 /* Thread creation and deletion */
 
+/* Priority of a queued thread, taking ageing into account */
+static inline prio_t thd_runq_prio(const kthread_t *thd) {
+    return thd->prio >> thd->age;
+}
+
+/* Run queue bucket for a given priority */
+static inline unsigned int thd_runq_bucket(prio_t prio) {
+    if(prio < THD_RUNQ_EXACT)
+        return prio < 0 ? 0 : prio;
+
+    if(prio > PRIO_MAX)
+        return THD_RUNQ_BUCKETS - 1;
+
+    return THD_RUNQ_EXACT - log2_rdown(THD_RUNQ_EXACT) + log2_rdown(prio);
+}
+
 /* Enqueue a process in the runnable queue; adds it right after the
    process group of the same priority (front_of_line==0) or
    right before the process group of the same priority (front_of_line!=0).
-   See thd_schedule for why this is helpful. */
+   See thd_schedule for why this is helpful. Polling threads go to the
+   polling queue instead. */
 void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
+    struct ktqueue *q;
     kthread_t *i;
+    prio_t prio;
+    unsigned int bucket;
     int done;
 
     if(t->flags & THD_QUEUED)
         return;
 
+    t->flags |= THD_QUEUED;
+
+    if(__predict_false(t->state == STATE_POLLING)) {
+        t->runq = THD_RUNQ_POLL;
+        TAILQ_INSERT_TAIL(&poll_queue, t, thdq);
+        return;
+    }
+
+    prio = thd_runq_prio(t);
+    bucket = thd_runq_bucket(prio);
+    q = &run_queue[bucket];
     done = 0;
 
     if(!front_of_line) {
-        /* Look for a thread of lower priority and insert
-           before it. If there is nothing on the run queue, we'll
-           fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio > t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
+        /* Look backwards for a thread of the same or higher priority and
+           insert after it. In a bucket of a single priority, this is the
+           last thread. */
+        TAILQ_FOREACH_REVERSE(i, q, ktqueue, thdq) {
+            if(thd_runq_prio(i) <= prio) {
+                TAILQ_INSERT_AFTER(q, i, t, thdq);
                 done = 1;
                 break;
             }
         }
+
+        /* Didn't find one, put it at the start */
+        if(!done)
+            TAILQ_INSERT_HEAD(q, t, thdq);
     }
     else {
         /* Look for a thread of the same or lower priority and
-           insert before it. If there is nothing on the run queue,
-           we'll fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio >= t->prio) {
+           insert before it. In a bucket of a single priority, this is the
+           first thread. */
+        TAILQ_FOREACH(i, q, thdq) {
+            if(thd_runq_prio(i) >= prio) {
                 TAILQ_INSERT_BEFORE(i, t, thdq);
                 done = 1;
                 break;
             }
         }
+
+        /* Didn't find one, put it at the end */
+        if(!done)
+            TAILQ_INSERT_TAIL(q, t, thdq);
     }
 
-    /* Didn't find one, put it at the end */
-    if(!done)
-        TAILQ_INSERT_TAIL(&run_queue, t, thdq);
+    t->runq = bucket;
+    run_queue_mask |= 1u << bucket;
 
-    t->flags |= THD_QUEUED;
+    t->age_time = thd_runq_time;
+    TAILQ_INSERT_TAIL(&age_queue, t, ageq);
 }
 
 /* Removes a thread from the runnable queue, if it's there. */
@@ -383,7 +443,18 @@ int thd_remove_from_runnable(kthread_t *thd) {
     if(!(thd->flags & THD_QUEUED)) return 0;
 
     thd->flags &= ~THD_QUEUED;
-    TAILQ_REMOVE(&run_queue, thd, thdq);
+
+    if(__predict_false(thd->runq == THD_RUNQ_POLL)) {
+        TAILQ_REMOVE(&poll_queue, thd, thdq);
+        return 0;
+    }
+
+    TAILQ_REMOVE(&run_queue[thd->runq], thd, thdq);
+    TAILQ_REMOVE(&age_queue, thd, ageq);
+
+    if(TAILQ_EMPTY(&run_queue[thd->runq]))
+        run_queue_mask &= ~(1u << thd->runq);
+
     return 0;
 }
 
@@ -561,6 +632,9 @@ int thd_destroy(kthread_t *thd) {
         i = i2;
     }
 
+    /* Give back the blocks malloc() was keeping for it. */
+    __malloc_thread_destroy(thd);
+
     /* Free its stack (if we're managing it). */
     if(thd->flags & THD_OWNS_STACK)
         free(thd->stack);
@@ -589,9 +663,18 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
     if((prio < 0) || (prio > PRIO_MAX))
         return -2;
 
+    irq_disable_scoped();
+
     /* Set the new priority */
     thd->prio = prio;
     thd->real_prio = prio;
+
+    /* Move it to its new place in the run queue, if it's in there. */
+    if(thd->flags & THD_QUEUED) {
+        thd_remove_from_runnable(thd);
+        thd_add_to_runnable(thd, false);
+    }
+
     return 0;
 }
 
@@ -622,6 +705,7 @@ static void thd_update_cpu_time(kthread_t *thd, uint64_t now) {
 /* Helper function that sets a thread being scheduled */
 static inline void thd_schedule_inner(kthread_t *thd, uint64_t now) {
     thd_remove_from_runnable(thd);
+    thd->age = 0;
 
     thd_update_cpu_time(thd, now);
 
@@ -641,13 +725,63 @@ static inline void thd_schedule_inner(kthread_t *thd, uint64_t now) {
     irq_set_context(&thd_current->context);
 }
 
-static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
-    prio_t prio = thd->prio;
+/* Ageing: promote the threads that have been waiting in the run queue for
+   longer than the ageing interval by doubling their priority (i.e. halving
+   their priority value), and move them to their new bucket. As the ageing
+   queue is sorted by time, this only ever touches the threads that actually
+   get promoted. Threads that can't be promoted any further keep their place
+   in their bucket, and are only sent back to the end of the ageing queue. */
+static void thd_runq_age(uint32_t now) {
+    const uint32_t interval = 1u << thd_ageing_ms_log2;
+    kthread_t *thd;
+
+    while((thd = TAILQ_FIRST(&age_queue)) != NULL) {
+        if(now - thd->age_time < interval)
+            break;
+
+        if(__predict_false(thd->prio >= PRIO_MAX) || thd_runq_prio(thd) <= 0) {
+            TAILQ_REMOVE(&age_queue, thd, ageq);
+            thd->age_time = now;
+            TAILQ_INSERT_TAIL(&age_queue, thd, ageq);
+            continue;
+        }
+
+        thd_remove_from_runnable(thd);
+        thd->age++;
+        thd_add_to_runnable(thd, false);
+    }
+}
+
+/* Call the callbacks of the polling threads, and move those which are done
+   (or timed out) over to the run queue. */
+static void thd_runq_poll(uint64_t now) {
+    kthread_t *thd, *tmp;
+    int ret;
+
+    TAILQ_FOREACH_SAFE(thd, &poll_queue, thdq, tmp) {
+        if(thd->wait_timeout && thd->wait_timeout < now) {
+            ret = 0;
+        }
+        else {
+            ret = thd->poll_cb(thd->wait_obj);
+
+            if(!ret)
+                continue;
+        }
+
+        thd_remove_from_runnable(thd);
+        thd->state = STATE_READY;
+        CONTEXT_RET(thd->context) = ret;
+        thd_add_to_runnable(thd, false);
+    }
+}
 
-    if(__predict_true(prio < PRIO_MAX))
-       prio >>= (now - (uint32_t)thd->cpu_time.scheduled) >> thd_ageing_ms_log2;
+/* Returns the thread at the front of the run queue, if any */
+static inline kthread_t *thd_runq_first(void) {
+    if(__predict_false(!run_queue_mask))
+        return NULL;
 
-    return prio;
+    return TAILQ_FIRST(&run_queue[__builtin_ctz(run_queue_mask)]);
 }
 
 /* Thread scheduler; this function will find a new thread to run when a
@@ -667,12 +801,11 @@ static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
    don't want a full context switch inside the same priority group.
 */
 void thd_schedule(bool front_of_line) {
-    kthread_t *thd, *next_thd = NULL;
-    prio_t prio, max_prio = INT_MAX;
+    kthread_t *next_thd;
     uint64_t now;
-    int ret;
 
     now = timer_ms_gettime64();
+    thd_runq_time = (uint32_t)now;
 
     /* If there's only two thread left, it's the idle task and the reaper task:
        exit the OS */
@@ -691,37 +824,17 @@ void thd_schedule(bool front_of_line) {
     /* Look for timed out waits */
     genwait_check_timeouts(now);
 
-    /* Search downwards through the run queue for a runnable thread; if
-       we don't find a normal runnable thread, the idle process will
-       always be there at the bottom. */
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(__predict_false(thd->state == STATE_POLLING)) {
-            /* Is it polling? Call the polling function. */
+    /* Wake up the polling threads that are done */
+    if(thd_has_polls())
+        thd_runq_poll(now);
 
-            if(thd->wait_timeout && thd->wait_timeout < now) {
-                thd->state = STATE_READY;
-                CONTEXT_RET(thd->context) = 0;
-            }
-            else {
-                ret = thd->poll_cb(thd->wait_obj);
+    /* Promote the threads that have been waiting for too long */
+    thd_runq_age(thd_runq_time);
 
-                if(ret) {
-                    thd->state = STATE_READY;
-                    CONTEXT_RET(thd->context) = ret;
-                }
-            }
-        }
-
-        /* Is it runnable? If not, keep going */
-        if(thd->state != STATE_READY)
-            continue;
-
-        prio = thd_calc_prio(thd, now);
-        if(prio < max_prio) {
-            next_thd = thd;
-            max_prio = prio;
-        }
-    }
+    /* Take the first thread of the highest priority bucket; if we don't find
+       a normal runnable thread, the idle process will always be there at the
+       bottom. */
+    next_thd = thd_runq_first();
 
     /* If we didn't already re-enqueue the thread and we are supposed to do so,
        do it now. */
@@ -1099,7 +1212,12 @@ int thd_init(void) {
     LIST_INIT(&thd_list);
 
     /* Initialize the run queue */
-    TAILQ_INIT(&run_queue);
+    for(unsigned int i = 0; i < THD_RUNQ_BUCKETS; i++)
+        TAILQ_INIT(&run_queue[i]);
+
+    run_queue_mask = 0;
+    TAILQ_INIT(&poll_queue);
+    TAILQ_INIT(&age_queue);
 
     /* Start off with no "current" thread */
     thd_current = NULL;
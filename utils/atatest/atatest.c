@@ -0,0 +1,380 @@
+/* KallistiOS ##version##
+
+   atatest.c
+
+   Test and time the G1 ATA request queue against a model of a disk. The real
+   g1ata_queue.c is built into this program, and fed by a few clients that
+   each keep some requests outstanding, the way threads reading and writing
+   through the block device would, making new ones from their callbacks as
+   the old ones finish. Each transfer the queue hands out is done on the
+   model disk, which charges for the command, for moving the head to where
+   the transfer starts, and for the data.
+
+   Every request has to be called back exactly once, with the data that it
+   would have seen if the requests had been done one at a time in the order
+   they were made, and every transfer has to be made up of requests that go
+   on from each other on the disk and in memory. The same workloads are also
+   run through a plain first come, first served queue, one request to a
+   transfer, to compare.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../../kernel/arch/dreamcast/hardware/g1ata_queue.c"
+
+/* The model of the disk, with its timing in microseconds. */
+#define DISK_SECTORS    65536
+#define MEM_SIZE        (4 * 1024 * 1024)
+#define QUEUE_DEPTH     32
+#define MAX_COUNT       256
+
+static uint8_t *disk;
+static uint8_t *shadow;         /* The disk as the requests made so far see it */
+static uint8_t *mem;            /* "Physical" memory, for the DMA addresses */
+
+static double cmd_us = 60.0;
+static double seek_us = 1500.0; /* To move at all, and wait for the sector */
+static double stroke_us = 9000.0; /* Extra, to move all the way across */
+static double bytes_per_us = 12.0;
+
+static struct {
+    uint64_t head;
+    double now;
+    unsigned long transfers, seeks, sectors;
+} drive;
+
+/* Requests, and what they should see. */
+typedef struct io {
+    struct client *c;
+    int write;
+    uint64_t sector;
+    size_t count;
+    int slot;
+    uint8_t *expect;
+    int calls;
+} io_t;
+
+typedef struct client {
+    int kind;
+    uint64_t base, span;        /* The part of the disk it uses */
+    size_t count;               /* Sectors in each request, or most if mixed */
+    int depth;                  /* Requests it keeps outstanding */
+    int limit;                  /* Requests it makes in all */
+
+    uint64_t next;
+    uint8_t *buf;               /* Its part of memory, in depth * 2 slots */
+    bool *busy;
+    int nslots;
+    int issued, outstanding;
+} client_t;
+
+enum {
+    SEQ,                        /* Reads, one after another */
+    RANDOM,                     /* Reads, anywhere in its part */
+    MIXED                       /* Reads and writes of any size, in a small
+                                   part, so they overlap a lot */
+};
+
+static int failures;
+static int use_fifo;
+static ata_queue_t queue;
+static ata_req_t reqs[QUEUE_DEPTH];
+static struct ata_req_list fifo;
+static unsigned long requests, callbacks;
+
+static void fail(const char *what) {
+    if(++failures <= 10)
+        printf("  FAIL: %s\n", what);
+}
+
+static void client_fill(client_t *c);
+
+static void io_done(int err, void *data) {
+    io_t *io = (io_t *)data;
+    client_t *c = io->c;
+
+    ++callbacks;
+
+    if(err)
+        fail("request failed");
+
+    if(++io->calls != 1)
+        fail("callback called more than once");
+
+    if(!io->write &&
+       memcmp(c->buf + io->slot * c->count * 512, io->expect,
+              io->count * 512))
+        fail("read the wrong data");
+
+    c->busy[io->slot] = false;
+    --c->outstanding;
+    free(io->expect);
+    free(io);
+
+    /* Just as a callback might from the DMA IRQ. */
+    client_fill(c);
+}
+
+static void add(ata_req_t *r) {
+    if(use_fifo) {
+        TAILQ_INSERT_TAIL(&fifo, r, link);
+        ++queue.requests;
+    }
+    else {
+        ata_queue_add(&queue, r);
+    }
+}
+
+static ata_req_t *start(size_t *count) {
+    ata_req_t *r;
+
+    if(!use_fifo)
+        return ata_queue_start(&queue, count);
+
+    if(!(r = TAILQ_FIRST(&fifo)))
+        return NULL;
+
+    TAILQ_REMOVE(&fifo, r, link);
+    r->next = NULL;
+    queue.active = r;
+    ++queue.transfers;
+    *count = r->count;
+    return r;
+}
+
+static void client_fill(client_t *c) {
+    ata_req_t *r;
+    io_t *io;
+    int slot;
+    uint8_t *buf;
+    size_t i;
+
+    while(c->outstanding < c->depth && c->issued < c->limit) {
+        slot = c->issued % c->nslots;
+
+        if(c->busy[slot] || !(r = ata_queue_alloc(&queue)))
+            return;
+
+        io = calloc(1, sizeof(io_t));
+        io->c = c;
+        io->slot = slot;
+        io->count = c->count;
+
+        switch(c->kind) {
+            case SEQ:
+                io->sector = c->base + c->next;
+                c->next = (c->next + c->count) % c->span;
+                break;
+
+            case RANDOM:
+                io->sector = c->base +
+                    (rand() % (c->span / c->count)) * c->count;
+                break;
+
+            case MIXED:
+                io->count = 1 + rand() % c->count;
+                io->sector = c->base + rand() % (c->span - io->count + 1);
+                io->write = !(rand() % 3);
+                break;
+        }
+
+        buf = c->buf + slot * c->count * 512;
+
+        if(io->write) {
+            for(i = 0; i < io->count * 512; ++i)
+                buf[i] = (uint8_t)rand();
+
+            memcpy(shadow + io->sector * 512, buf, io->count * 512);
+        }
+        else {
+            memset(buf, 0xEE, io->count * 512);
+            io->expect = malloc(io->count * 512);
+            memcpy(io->expect, shadow + io->sector * 512, io->count * 512);
+        }
+
+        r->sector = io->sector;
+        r->count = io->count;
+        r->addr = (uintptr_t)(buf - mem);
+        r->write = io->write;
+        r->cb = &io_done;
+        r->data = io;
+
+        c->busy[slot] = true;
+        ++c->issued;
+        ++c->outstanding;
+        ++requests;
+        add(r);
+    }
+}
+
+/* Do a transfer on the disk, checking that it hangs together. */
+static void transfer(ata_req_t *r, size_t count) {
+    ata_req_t *i;
+    uint64_t dist;
+    size_t total = 0;
+
+    dist = r->sector > drive.head ? r->sector - drive.head :
+           drive.head - r->sector;
+    drive.now += cmd_us;
+
+    if(dist) {
+        drive.now += seek_us + stroke_us * dist / DISK_SECTORS;
+        ++drive.seeks;
+    }
+
+    drive.now += count * 512 / bytes_per_us;
+    drive.head = r->sector + count;
+    ++drive.transfers;
+    drive.sectors += count;
+
+    if(count > MAX_COUNT)
+        fail("transfer too long");
+
+    for(i = r; i; i = i->next) {
+        if(i->next && (i->sector + i->count != i->next->sector ||
+                       i->addr + i->count * 512 != i->next->addr ||
+                       i->write != i->next->write))
+            fail("merged requests that don't go on from each other");
+
+        if(i->write)
+            memcpy(disk + i->sector * 512, mem + i->addr, i->count * 512);
+        else
+            memcpy(mem + i->addr, disk + i->sector * 512, i->count * 512);
+
+        total += i->count;
+    }
+
+    if(total != count)
+        fail("transfer count doesn't add up");
+}
+
+static void finish(int err) {
+    ata_req_t *r, *next;
+    kos_blockdev_cb_t cb;
+    void *data;
+
+    for(r = ata_queue_finish(&queue); r; r = next) {
+        next = r->next;
+        cb = r->cb;
+        data = r->data;
+        ata_queue_release(&queue, r);
+        cb(err, data);
+    }
+}
+
+typedef struct workload {
+    const char *name;
+    int nclients;
+    int kind;
+    size_t count;
+    int depth;
+    uint64_t span;
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "seq 1x8",    1, SEQ,    8,  16, 8192 },
+    { "seq 4x8",    4, SEQ,    8,  8,  4096 },
+    { "random 8x1", 8, RANDOM, 1,  4,  8192 },
+    { "random 4x16", 4, RANDOM, 16, 4, 16384 },
+    { "mixed 4x8",  4, MIXED,  8,  4,  256 },
+    { NULL }
+};
+
+static void run(const workload_t *w, int fifo_mode, int total) {
+    client_t clients[8];
+    uint8_t *m = mem;
+    ata_req_t *r;
+    size_t count;
+    int i, before = failures;
+
+    memset(&drive, 0, sizeof(drive));
+    memcpy(shadow, disk, DISK_SECTORS * 512);
+    requests = callbacks = 0;
+    use_fifo = fifo_mode;
+    TAILQ_INIT(&fifo);
+    ata_queue_init(&queue, reqs, QUEUE_DEPTH, MAX_COUNT);
+    srand(1234);
+
+    for(i = 0; i < w->nclients; ++i) {
+        client_t *c = &clients[i];
+
+        memset(c, 0, sizeof(*c));
+        c->kind = w->kind;
+        c->count = w->count;
+        c->depth = w->depth;
+        c->limit = total / w->nclients;
+        c->span = w->span;
+        c->base = w->kind == MIXED ? 1000 :
+                  (uint64_t)i * (DISK_SECTORS / w->nclients);
+        c->nslots = c->depth * 2;
+        c->busy = calloc(c->nslots, sizeof(bool));
+        c->buf = m;
+        m += c->nslots * c->count * 512;
+    }
+
+    for(;;) {
+        for(i = 0; i < w->nclients; ++i)
+            client_fill(&clients[i]);
+
+        if(!(r = start(&count)))
+            break;
+
+        transfer(r, count);
+        finish(0);
+    }
+
+    for(i = 0; i < w->nclients; ++i) {
+        if(clients[i].outstanding || clients[i].issued != clients[i].limit)
+            fail("requests left over");
+
+        free(clients[i].busy);
+    }
+
+    if(callbacks != requests)
+        fail("not every request was called back");
+
+    if(memcmp(disk, shadow, DISK_SECTORS * 512))
+        fail("the disk doesn't have the data it should");
+
+    printf("  %-12s %-8s %8.1f KiB/s %6lu transfers %6lu seeks  %s\n",
+           w->name, fifo_mode ? "fifo" : "elevator",
+           drive.sectors * 512.0 / drive.now * 1000000.0 / 1024.0,
+           drive.transfers, drive.seeks,
+           failures == before ? "ok" : "FAILED");
+}
+
+int main(int argc, char *argv[]) {
+    int total = 4000, i;
+    const workload_t *w;
+
+    if(argc > 1)
+        total = atoi(argv[1]);
+
+    disk = malloc(DISK_SECTORS * 512);
+    shadow = malloc(DISK_SECTORS * 512);
+    mem = malloc(MEM_SIZE);
+
+    for(i = 0; i < DISK_SECTORS * 512; ++i)
+        disk[i] = (uint8_t)(i * 7 + (i >> 9));
+
+    for(w = workloads; w->name; ++w) {
+        run(w, 1, total);
+        run(w, 0, total);
+    }
+
+    free(disk);
+    free(shadow);
+    free(mem);
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
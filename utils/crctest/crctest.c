@@ -0,0 +1,166 @@
+/* KallistiOS ##version##
+
+   crctest.c
+
+   Test the CRC functions from kernel/net/net_crc.c. The real source file is
+   built into this program, so this checks the exact code the kernel uses, on
+   a PC. It is compared against known check values and against a simple
+   bit-at-a-time version of each CRC on random data of every length and
+   alignment, both all at once and in pieces through the incremental
+   interface.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Keep the KOS headers out of it, we only need what net_crc.c defines. */
+#define __KOS_NET_H
+#define __KOS_OPTS_H
+#define __pure __attribute__((pure))
+
+#include "../../kernel/net/net_crc.c"
+
+static uint32_t ref_crc32le(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF;
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        rv ^= data[i];
+
+        for(j = 0; j < 8; ++j)
+            rv = (rv >> 1) ^ ((rv & 1) ? 0xEDB88320 : 0);
+    }
+
+    return ~rv;
+}
+
+/* This is how net_crc32be() used to be written. */
+static uint32_t ref_crc32be(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF, b, c;
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        b = data[i];
+
+        for(j = 0; j < 8; ++j) {
+            c = ((rv & 0x80000000) ? 1 : 0) ^ (b & 1);
+            b >>= 1;
+
+            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
+            else    rv <<= 1;
+        }
+    }
+
+    return rv;
+}
+
+static uint16_t ref_crc16ccitt(const uint8_t *data, int size, uint16_t rv) {
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        rv ^= data[i] << 8;
+
+        for(j = 0; j < 8; ++j)
+            rv = (rv << 1) ^ ((rv & 0x8000) ? 0x1021 : 0);
+    }
+
+    return rv;
+}
+
+static int failures;
+
+#define CHECK(what, got, want) do { \
+        if((got) != (want)) { \
+            printf("FAIL: %s: got %08lx, want %08lx\n", what, \
+                   (unsigned long)(got), (unsigned long)(want)); \
+            ++failures; \
+        } \
+    } while(0)
+
+#define BUF_SIZE    4096
+
+int main(int argc, char *argv[]) {
+    static const uint8_t check[] = "123456789";
+    uint8_t *buf = malloc(BUF_SIZE + 8);
+    uint32_t crc;
+    uint16_t crc16;
+    int off, len, split;
+    clock_t start;
+    double secs;
+
+    (void)argc;
+    (void)argv;
+
+    if(!buf)
+        return 1;
+
+    /* Standard check values */
+    CHECK("crc32le check", net_crc32le(check, 9), 0xCBF43926);
+    CHECK("crc32be check", net_crc32be(check, 9), ref_crc32be(check, 9));
+    CHECK("crc16 (XMODEM) check", net_crc16ccitt(check, 9, 0), 0x31C3);
+    CHECK("crc16 (CCITT-FALSE) check", net_crc16ccitt(check, 9, 0xFFFF),
+          0x29B1);
+    CHECK("crc32le empty", net_crc32le(check, 0), 0);
+    CHECK("crc32le negative size", net_crc32le(check, -1), 0);
+
+    srand(1234);
+
+    for(len = 0; len < BUF_SIZE + 8; ++len)
+        buf[len] = rand();
+
+    for(off = 0; off < 8; ++off) {
+        for(len = 0; len <= 300; ++len) {
+            CHECK("crc32le", net_crc32le(buf + off, len),
+                  ref_crc32le(buf + off, len));
+            CHECK("crc32be", net_crc32be(buf + off, len),
+                  ref_crc32be(buf + off, len));
+            CHECK("crc16ccitt", net_crc16ccitt(buf + off, len, 0x1D0F),
+                  ref_crc16ccitt(buf + off, len, 0x1D0F));
+        }
+
+        len = BUF_SIZE - off;
+        CHECK("crc32le long", net_crc32le(buf + off, len),
+              ref_crc32le(buf + off, len));
+        CHECK("crc16ccitt long", net_crc16ccitt(buf + off, len, 0),
+              ref_crc16ccitt(buf + off, len, 0));
+    }
+
+    /* Incremental, split at every point of a buffer */
+    for(split = 0; split <= 100; ++split) {
+        crc = net_crc32le_init();
+        crc = net_crc32le_update(crc, buf + 1, split);
+        crc = net_crc32le_update(crc, buf + 1 + split, 100 - split);
+        CHECK("crc32le incremental", net_crc32le_final(crc),
+              ref_crc32le(buf + 1, 100));
+
+        crc = net_crc32be_init();
+        crc = net_crc32be_update(crc, buf + 1, split);
+        crc = net_crc32be_update(crc, buf + 1 + split, 100 - split);
+        CHECK("crc32be incremental", net_crc32be_final(crc),
+              ref_crc32be(buf + 1, 100));
+
+        crc16 = net_crc16ccitt_update(0xFFFF, buf + 1, split);
+        crc16 = net_crc16ccitt_update(crc16, buf + 1 + split, 100 - split);
+        CHECK("crc16ccitt incremental", crc16,
+              ref_crc16ccitt(buf + 1, 100, 0xFFFF));
+    }
+
+    /* Rough speed, just for comparing the table settings */
+    start = clock();
+
+    for(len = 0; len < 4096; ++len)
+        crc = net_crc32le_update(crc, buf, BUF_SIZE);
+
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("NET_CRC_SLICES=%d: %s, crc32le %.1f MiB/s (%08lx)\n",
+           NET_CRC_SLICES, failures ? "FAILED" : "passed",
+           secs > 0 ? 16.0 / secs : 0.0, (unsigned long)crc);
+
+    free(buf);
+    return failures ? 1 : 0;
+}
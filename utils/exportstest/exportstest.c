@@ -0,0 +1,333 @@
+/* KallistiOS ##version##
+
+   exportstest.c
+
+   Test and time looking up exported symbols. The real exports.c and nmmgr.c
+   are built into this program, and the symbol tables are made by
+   genexports.sh, the same as the kernel's are, from the names in the
+   kernel's export lists (see the Makefile), with pthreads mutexes standing
+   in for KOS ones.
+
+   Every symbol in every table is looked up, by name and by table, and has
+   to come back as the right entry, and a lot of names that aren't in any of
+   them have to come back as not found. A library's table is added over the
+   top of the kernel's to check that its symbols are found first, and that
+   the cache forgets the kernel's ones when it comes and goes.
+
+   Then the symbols a few libraries need are looked up, the way elf_load()
+   looks them up when they're loaded, one after another: with the plain
+   search that export_lookup() used to do, with the hash tables alone, and
+   with the hash tables and the cache. The time taken for each library is
+   shown.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#ifndef __weak_symbol
+#define __weak_symbol __attribute__((weak))
+#endif
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_THREAD_H
+#define __KOS_MUTEX_H
+
+/* Mutexes */
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define mutex_lock(m)               pthread_mutex_lock(m)
+#define mutex_lock_irqsafe(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)             pthread_mutex_unlock(m)
+
+#include "../../kernel/exports/nmmgr.c"
+#include "../../kernel/exports/exports.c"
+
+extern export_sym_t lib_symtab[];
+extern const export_hash_t lib_symtab_hash;
+
+static symtab_handler_t st_lib = {
+    {
+        "sym/library/test",
+        0,
+        0x00010000,
+        0,
+        NMMGR_TYPE_SYMTAB,
+        NMMGR_LIST_INIT
+    },
+    lib_symtab,
+    &lib_symtab_hash
+};
+
+static int failures;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *name) {
+    if(++failures <= 10)
+        printf("FAIL: %s: %s\n", what, name);
+}
+
+/* What export_lookup() used to do */
+static export_sym_t *old_lookup(const char *name) {
+    nmmgr_handler_t *nmmgr;
+    symtab_handler_t *sth;
+    int i;
+
+    SLIST_FOREACH(nmmgr, nmmgr_get_list(), list_ent) {
+        if(nmmgr->type != NMMGR_TYPE_SYMTAB)
+            continue;
+
+        sth = (symtab_handler_t *)nmmgr;
+
+        for(i = 0; sth->table[i].name; i++) {
+            if(!strcmp(name, sth->table[i].name))
+                return sth->table + i;
+        }
+    }
+
+    return NULL;
+}
+
+static int count(const export_sym_t *table) {
+    int i;
+
+    for(i = 0; table[i].name; i++)
+        ;
+
+    return i;
+}
+
+/********************************************************************************/
+/* Finding what's there, and not what isn't */
+
+static void check_table(const char *path, export_sym_t *table,
+                        const export_hash_t *hash) {
+    int i, n = count(table);
+
+    if((int)hash->count != n)
+        fail("hash table has the wrong count", path);
+
+    for(i = 0; i < n; i++) {
+        if(export_lookup_path(table[i].name, path) != table + i)
+            fail("not found in its table", table[i].name);
+
+        if(export_lookup(table[i].name) != old_lookup(table[i].name))
+            fail("found in the wrong table", table[i].name);
+    }
+
+    printf("%-20s %5d symbols, %5u buckets\n", path, n,
+           (unsigned)hash->nbuckets);
+}
+
+static void check_missing(void) {
+    char name[128];
+    const char *base;
+    int i, n = count(kernel_symtab), passed = 0;
+
+    for(i = 0; i < 20000; i++) {
+        base = kernel_symtab[rand() % n].name;
+
+        switch(i % 4) {
+            case 0:
+                snprintf(name, sizeof(name), "%s_", base);
+                break;
+            case 1:
+                snprintf(name, sizeof(name), "%.*s", (int)strlen(base) - 1,
+                         base);
+                break;
+            case 2:
+                snprintf(name, sizeof(name), "y%s", base + 1);
+                break;
+            case 3:
+                snprintf(name, sizeof(name), "%s_%d", base, 7 + rand() % 100);
+                break;
+        }
+
+        if(old_lookup(name))
+            continue;
+
+        if(export_lookup(name))
+            fail("found a name that isn't there", name);
+
+        if(export_lookup_path(name, "sym/kernel/kernel"))
+            fail("found a name that isn't in the table", name);
+
+        /* How often the Bloom filter lets one through */
+        {
+            uint32_t h = export_hash_name(name);
+            const export_hash_t *eh = &kernel_symtab_hash;
+            uint32_t word = eh->bloom[(h / 32) & (eh->bloom_words - 1)];
+
+            passed += (word >> (h % 32)) &
+                      (word >> ((h >> eh->bloom_shift) % 32)) & 1;
+        }
+    }
+
+    printf("Bloom filter passes %.1f%% of names that aren't there\n",
+           passed * 100.0 / 20000);
+}
+
+/* The library's symbols have to be found before the kernel's, and not once
+   it's gone. A table without a hash table has to work too. */
+static void check_library(void) {
+    export_sym_t *sym, *libsym = NULL;
+    int i;
+
+    for(i = 0; lib_symtab[i].name; i++) {
+        if(export_lookup_path(lib_symtab[i].name, "sym/kernel/kernel")) {
+            libsym = lib_symtab + i;
+            break;
+        }
+    }
+
+    if(!libsym) {
+        fail("library has no names from the kernel", "sym/library/test");
+        return;
+    }
+
+    sym = export_lookup(libsym->name);
+
+    if(sym == libsym || sym != old_lookup(libsym->name))
+        fail("library found before it was added", libsym->name);
+
+    nmmgr_handler_add(&st_lib.nmmgr);
+
+    if(export_lookup(libsym->name) != libsym)
+        fail("library's symbol not found first", libsym->name);
+
+    check_table("sym/library/test", lib_symtab, &lib_symtab_hash);
+
+    nmmgr_handler_remove(&st_lib.nmmgr);
+
+    if(export_lookup(libsym->name) != sym)
+        fail("library's symbol still found once it's gone", libsym->name);
+
+    st_lib.hash = NULL;
+    nmmgr_handler_add(&st_lib.nmmgr);
+
+    for(i = 0; lib_symtab[i].name; i++) {
+        if(export_lookup(lib_symtab[i].name) != lib_symtab + i)
+            fail("not found without a hash table", lib_symtab[i].name);
+    }
+
+    nmmgr_handler_remove(&st_lib.nmmgr);
+    st_lib.hash = &lib_symtab_hash;
+}
+
+/********************************************************************************/
+/* Timing */
+
+#define LIBRARIES       8
+#define UNDEFINED       600
+
+static const char *undefined[LIBRARIES][UNDEFINED];
+
+/* Each library needs some of the symbols that most of them need, and some
+   of its own, out of all of the tables. */
+static void make_libraries(void) {
+    static export_sym_t *tables[] = {
+        kernel_symtab, arch_symtab, lib_symtab
+    };
+    int common = count(kernel_symtab) / 8;
+    int i, j, t;
+
+    for(i = 0; i < LIBRARIES; i++) {
+        for(j = 0; j < UNDEFINED; j++) {
+            if(j % 3) {
+                undefined[i][j] = kernel_symtab[rand() % common].name;
+            }
+            else {
+                t = rand() % 3;
+                undefined[i][j] =
+                    tables[t][rand() % count(tables[t])].name;
+            }
+        }
+    }
+}
+
+/* Load the libraries one after another, a few times over, starting with an
+   empty cache each time, or with the cache emptied for each library. */
+static void time_libraries(const char *how, int mode) {
+    volatile uintptr_t sink = 0;
+    double t, times[LIBRARIES] = { 0 }, total = 0;
+    int i, j, r;
+
+    printf("%-28s", how);
+
+    for(r = 0; r < 20; r++) {
+        ++__nmmgr_symtab_gen;
+
+        for(i = 0; i < LIBRARIES; i++) {
+            if(mode == 1)
+                ++__nmmgr_symtab_gen;
+
+            t = now();
+
+            for(j = 0; j < UNDEFINED; j++) {
+                if(mode)
+                    sink += (uintptr_t)export_lookup(undefined[i][j]);
+                else
+                    sink += (uintptr_t)old_lookup(undefined[i][j]);
+            }
+
+            times[i] += now() - t;
+        }
+    }
+
+    for(i = 0; i < LIBRARIES; i++) {
+        printf(" %6.0f", times[i] / 20 * 1e6);
+        total += times[i] / 20;
+    }
+
+    printf("  (%.0f us in all)\n", total * 1e6);
+    (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    nmmgr_init();
+    export_init();
+    srand(1234);
+
+    check_table("sym/kernel/kernel", kernel_symtab, &kernel_symtab_hash);
+    check_table("sym/kernel/arch", arch_symtab, &arch_symtab_hash);
+    check_table("sym/kernel/subarch", subarch_symtab, &subarch_symtab_hash);
+    check_missing();
+    check_library();
+
+    nmmgr_handler_add(&st_lib.nmmgr);
+    make_libraries();
+
+    printf("Resolving %d symbols for each of %d libraries, in us:\n",
+           UNDEFINED, LIBRARIES);
+    time_libraries("Searching every table", 0);
+    time_libraries("Hash tables", 1);
+    time_libraries("Hash tables and the cache", 2);
+
+    nmmgr_handler_remove(&st_lib.nmmgr);
+    nmmgr_shutdown();
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -34,12 +34,100 @@ for i in $includes; do
 	echo "#include <$i>" >> $outpfile
 done
 
-# Now write out the sym table
+# Now write out the sym table, sorted by hash bucket, and the hash table to
+# go with it (see export_hash_t in kos/exports.h). The hashing is all done
+# with plain arithmetic, since not every awk has bitwise operators.
 echo '#pragma GCC diagnostic ignored "-Wdeprecated-declarations"' >> $outpfile
-echo "export_sym_t ${outpsym}[] = {" >> $outpfile
-for i in $names; do
-	echo "	{ \"$i\", (unsigned long)(&$i) }," >> $outpfile
-done
+echo "$names" | awk -v sym="$outpsym" '
+function pow2(n,  p) {
+	p = 1
+	while(p < n)
+		p *= 2
+	return p
+}
+
+function hash(s,  h, i) {
+	h = 5381
+	for(i = 1; i <= length(s); i++)
+		h = (h * 33 + ord[substr(s, i, 1)]) % 4294967296
+	return h
+}
+
+function setbit(w, b) {
+	if(int(bloom[w] / pow[b]) % 2 == 0)
+		bloom[w] += pow[b]
+}
+
+function words(name, a, n,  i) {
+	printf("static const uint32_t %s_%s[] = {", sym, name)
+	for(i = 0; i < n; i++)
+		printf("%s%.0fu", !i ? "\n\t" : i % 6 ? ", " : ",\n\t", a[i])
+	printf("\n};\n\n")
+}
+
+BEGIN {
+	n = 0
+	for(i = 1; i < 128; i++)
+		ord[sprintf("%c", i)] = i
+	for(i = 0; i < 32; i++)
+		pow[i] = 2 ^ i
+}
+
+{
+	for(i = 1; i <= NF; i++) {
+		name[n] = $i
+		h[n] = hash($i)
+		n++
+	}
+}
+
+END {
+	nbuckets = pow2(n / 2)
+	nwords = pow2(n / 4)
+	shift = 6
+
+	for(i = 0; i < nwords; i++)
+		bloom[i] = 0
+
+	for(i = 0; i < n; i++) {
+		setbit(int(h[i] / 32) % nwords, h[i] % 32)
+		setbit(int(h[i] / 32) % nwords, int(h[i] / pow[shift]) % 32)
+	}
+
+	# Sort by bucket, keeping the names in order within each one.
+	for(i = 0; i < n; i++) {
+		bk[i] = h[i] % nbuckets
+		cnt[bk[i]]++
+	}
+
+	k = 0
+	for(b = 0; b < nbuckets; b++) {
+		if(cnt[b]) {
+			bucket[b] = pos[b] = k
+			k += cnt[b]
+			end[k - 1] = 1
+		}
+		else {
+			bucket[b] = n
+		}
+	}
+
+	for(i = 0; i < n; i++)
+		order[pos[bk[i]]++] = i
+
+	printf("export_sym_t %s[] = {\n", sym)
+	for(k = 0; k < n; k++) {
+		i = order[k]
+		printf("\t{ \"%s\", (unsigned long)(&%s) },\n", name[i], name[i])
+		chain[k] = h[i] - h[i] % 2 + end[k]
+	}
+	printf("\t{ 0, 0 }\n};\n\n")
+
+	words("bloom", bloom, nwords)
+	words("buckets", bucket, nbuckets)
+	words("chain", chain, n ? n : 1)
 
-echo "	{ 0, 0 }" >> $outpfile
-echo "};" >> $outpfile
+	printf("const export_hash_t %s_hash = {\n", sym)
+	printf("\t%d, %d, %d, %d,\n", n, nbuckets, nwords, shift)
+	printf("\t%s_bloom, %s_buckets, %s_chain\n};\n", sym, sym, sym)
+}' >> $outpfile
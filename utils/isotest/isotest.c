@@ -3,759 +3,633 @@
    isotest.c
    (c)2000 Megan Potter
 
-   Test ISO filesystem reader. This is a functional duplicate of fs_iso9660, but
-   designed to run on a PC for testing.
+   Test ISO filesystem reader. The real fs_iso9660.c is built into this
+   program, with the CD drive replaced by an .iso image, so that it can be
+   tested on a PC.
+
+   Every file and directory on the image is found with readdir, and then
+   looked up by path in a number of ways: with the path lookup cache empty,
+   with it warmed up, after a reset, and after preloading it with the whole
+   tree. Each lookup is checked against a search straight through the
+   directories on the image, which doesn't use the cache at all, and the
+   number of sectors read is shown for each pass.
+
+   After that, the biggest files are read a bit at a time from each in turn,
+   with and without read-ahead hints, checking the data against the image
+   and showing how often the drive had to seek or restart a stream. The drive
+   streams from the image too, with transfers that don't block being left
+   under way for a little while, like the real thing.
 
 */
 
-/*
-Various notes
-
-In Linux, accessing the /dev device on a single-session CD puts the
-"bootstrap" zone at offset 0x8000, and the begin of the CD data itself at
-0x8800.
-
-*/
-
-/****************************** LINUX SPECIFIC CODE ***********************************/
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/queue.h>
+
+/* The host's sys/queue.h may not have this one */
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = TAILQ_FIRST((head)); \
+        (var) && ((tvar) = TAILQ_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
 
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef signed char int8;
-typedef signed short int16;
-typedef signed long int32;
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_THREAD_H
+#define __KOS_MUTEX_H
+#define __DC_CDROM_H
+#define __DC_VBLANK_H
 
-/* Low-level sector read (for Linux to emulate hardware/cd.c) */
-static int cdrom_read_sectors(void *buffer, uint32 sector, uint32 cnt) {
-    FILE *f;
+#include <kos/fs.h>
+#include <kos/dbglog.h>
 
-    /* Subtract out DC's LBA offset */
-    sector -= 150;
+int dbglog_level = DBG_WARNING;
 
-    f = fopen("/dev/scd0", "r");
+#define __is_aligned(p, a)  (((uintptr_t)(p) & ((a) - 1)) == 0)
+#define IOCTL_FS_ROOTBUS_DMA_READY  0x4000
 
-    if(!f) return -1;
+/* Mutexes; everything happens on one thread here */
+typedef int mutex_t;
+#define MUTEX_TYPE_NORMAL           0
+#define mutex_init(m, t)            ((void)(m), (void)(t))
+#define mutex_destroy(m)            ((void)(m))
+#define mutex_lock(m)               ((void)(m))
+#define mutex_unlock(m)             ((void)(m))
+#define mutex_lock_scoped(m)        ((void)(m))
 
-    fseek(f, sector * 2048, SEEK_SET);
-    if(fread(buffer, cnt * 2048, 1, f) != 1) {
-        fclose(f);
-        return 1;
-    }
+typedef int (*thd_cb_t)(void *);
 
-    fclose(f);
-    return 0;
-}
+static int thd_poll(thd_cb_t cb, void *data, unsigned long timeout_ms) {
+    (void)timeout_ms;
 
-/* Linux emulation of various other KOS CD prims */
-typedef int CDROM_TOC;
+    while(!cb(data))
+        ;
 
-static int cdrom_reinit() {
     return 0;
 }
 
-static int cdrom_read_toc(CDROM_TOC *toc, int session) {
-    return 0;
-}
+/* The "drive" */
+#define ERR_OK              0
+#define ERR_NO_DISC         1
+#define ERR_DISC_CHG        2
+#define ERR_SYS             3
+#define CD_STATUS_NO_DISC   7
+#define CD_STATUS_OPEN      6
+
+typedef int cd_toc_t;
+
+static FILE *image;
+static unsigned long sectors_read;
+static int failures;
+
+/* The stream being read, in bytes from the start of the image. A transfer
+   that doesn't block is left "under way" for a couple of checks on its
+   progress, so that the driver has to cope with that. */
+static bool streaming;
+static long stream_pos, stream_left;
+static int dma_pending;
+
+static int check_idle(const char *what) {
+    if(dma_pending) {
+        printf("FAIL: %s while a transfer is under way\n", what);
+        failures++;
+        return -1;
+    }
 
-static uint32 cdrom_locate_data_track(CDROM_TOC *toc) {
-    return 150;
+    return 0;
 }
 
-/* KOS VFS prims */
-#define O_RDONLY 0
-#define O_MODE_MASK 0xfff
-#define O_DIR 0x1000
-#define MAX_FN_LEN 256
-typedef struct {
-    int     size;
-    char    name[MAX_FN_LEN];
-    uint32  time;
-    uint32  attr;
-} dirent_t;
+static int read_image(void *buffer, long pos, size_t size) {
+    sectors_read += size / 2048;
 
-typedef void *vfs_handler[];
-
-static int fs_handler_add(char *fn, void *p) {
-    return 0;
-}
+    if(fseek(image, pos, SEEK_SET) || fread(buffer, 1, size, image) != size) {
+        printf("FAIL: couldn't read %zu bytes at %ld\n", size, pos);
+        failures++;
+        return -1;
+    }
 
-static int fs_handler_remove(void *p) {
     return 0;
 }
 
-/* Thread prims */
-typedef int thd_mutex_t;
-
-static void thd_mutex_reset(int *p) { }
-static void thd_mutex_lock(int *p) { }
-static void thd_mutex_unlock(int *p) { }
-
-/* iso9660 defines */
-#define MAX_ISO_FILES 8
+static int cdrom_read_sectors_ex(void *buffer, uint32_t sector, size_t cnt,
+                                 bool dma) {
+    (void)dma;
 
-/****************************** END LINUX SPECIFIC CODE ***********************************/
-
-/* Cut here to insert into KallistiOS fs_iso9660.c */
-
-
-/* #include <kallisti/stdtypes.h> */
-#include <stdlib.h>
-#include <string.h>
+    if(check_idle("sector read") < 0)
+        return ERR_SYS;
 
-/********************************************************************************/
-/* Low-level ISO utils */
+    /* Take out the Dreamcast's LBA offset */
+    if(read_image(buffer, (long)(sector - 150) * 2048, cnt * 2048) < 0)
+        return ERR_NO_DISC;
 
-/* ISO Directory entry */
-typedef struct {
-    uint8   length;         /* 711 */
-    uint8   ext_attr_length;    /* 711 */
-    uint8   extent[8];      /* 733 */
-    uint8   size[8];        /* 733 */
-    uint8   date[7];        /* 7x711 */
-    uint8   flags;
-    uint8   file_unit_size;     /* 711 */
-    uint8   interleave;     /* 711 */
-    uint8   vol_sequence[4];    /* 723 */
-    uint8   name_len;       /* 711 */
-    char    name[1];
-} iso_dirent_t;
-
-#if 0
-/* Util function to reverse the byte order of a uint32 */
-static uint32 ntohl_32(void *data) {
-    uint8 *d = (uint8*)data;
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
+    return ERR_OK;
 }
-#endif
 
-/* This seems kinda silly, but it's important since it allows us
-   to do unaligned accesses on a buffer */
-static uint32 htohl_32(void *data) {
-    uint8 *d = (uint8*)data;
-    return (d[0] << 0) | (d[1] << 8) | (d[2] << 16) | (d[3] << 24);
+static int cdrom_reinit(void) {
+    return 0;
 }
 
-#if 0
-/* Read red-book section 7.1.1 number (8 bit) */
-static uint8 iso_711(uint8 *from) {
-    return (*from & 0xff);
+static int cdrom_read_toc(cd_toc_t *toc, bool high_density) {
+    (void)toc;
+    (void)high_density;
+    return 0;
 }
-#endif
 
-/* Read red-book section 7.3.3 number (32 bit LE / 32 bit BE) */
-static uint32 iso_733(uint8 *from) {
-    return htohl_32(from);
+static uint32_t cdrom_locate_data_track(cd_toc_t *toc) {
+    (void)toc;
+    return 150;
 }
 
-
-/********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    int32   sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
-} cache_block_t;
-
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 8
-static cache_block_t *cache[NUM_CACHE_BLOCKS];
-
-/* Cache modification mutex */
-static thd_mutex_t cache_mutex;
-
-/* Clears all cache blocks */
-static void bclear() {
-    int i;
-
-    thd_mutex_lock(&cache_mutex);
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = -1;
-
-    thd_mutex_unlock(&cache_mutex);
+static int cdrom_get_status(int *status, int *disc_type) {
+    (void)status;
+    (void)disc_type;
+    return -1;
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad(int block) {
-    int     i;
-    cache_block_t   *tmp;
+static int cdrom_stream_start(int sector, int cnt, bool dma) {
+    (void)dma;
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+    if(check_idle("stream start") < 0)
+        return ERR_SYS;
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    streaming = true;
+    stream_pos = (long)(sector - 150) * 2048;
+    stream_left = (long)cnt * 2048;
+    return ERR_OK;
+}
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+static int cdrom_stream_stop(bool abort_dma) {
+    (void)abort_dma;
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    check_idle("stream stop");
+    streaming = false;
+    return ERR_OK;
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static int bread(int32 sector) {
-    int i, rv = -1;
+static int cdrom_stream_request(void *buffer, size_t size, bool block) {
+    if(check_idle("stream request") < 0)
+        return ERR_SYS;
 
-    thd_mutex_lock(&cache_mutex);
-
-    /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad(i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
+    if(!streaming || (long)size > stream_left || ((uintptr_t)buffer & 31) ||
+       (size & 31)) {
+        printf("FAIL: bad stream request of %zu bytes\n", size);
+        failures++;
+        return ERR_SYS;
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == -1) break;
-    }
+    if(read_image(buffer, stream_pos, size) < 0)
+        return ERR_SYS;
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
-    }
+    stream_pos += size;
+    stream_left -= size;
 
-    /* Load the requested block */
-    if(cdrom_read_sectors(cache[i]->data, sector + 150, 1) < 0) {
-        rv = -1;
-        goto bread_exit;
-    }
+    if(!block)
+        dma_pending = 2;
 
-    cache[i]->sector = sector;
-
-    /* Move it to the most-recently-used position */
-    bgrad(i);
-    rv = NUM_CACHE_BLOCKS - 1;
-
-    /* Return the new cache block index */
-bread_exit:
-    thd_mutex_unlock(&cache_mutex);
-    return rv;
+    return ERR_OK;
 }
 
+static int cdrom_stream_progress(size_t *size) {
+    if(dma_pending) {
+        --dma_pending;
 
-/********************************************************************************/
-/* Higher-level ISO9660 primitives */
-
-/* Root FS session location (in sectors) */
-static int32 session_base = 0;
-
-/* Root directory extent and size in bytes */
-static int32 root_extent = 0, root_size = 0;
-
-/* Root dirent */
-static iso_dirent_t root_dirent;
-
-
-/* Per-disc initialization; this is done every time it's discovered that
-   a new CD has been inserted. */
-static int init_percd() {
-    int     i;
-    CDROM_TOC   toc;
-
-    /* Start off with no cached blocks */
-    bclear();
-
-    /* Locate the root session */
-    if((i = cdrom_reinit()) != 0)
-        return i;
-
-    if((i = cdrom_read_toc(&toc, 0)) != 0)
-        return i;
+        if(size)
+            *size = 0;
 
-    if(!(session_base = cdrom_locate_data_track(&toc)))
-        return -1;
-
-    /* Grab and check the volume descriptor */
-    i = bread(session_base + 16 - 150);
-
-    if(i < 0) return i;
-
-    if(memcmp((char*)cache[i]->data, "\01CD001", 6)) {
-        printf("fs_iso9660: disc is not iso9660\r\n");
-        return -1;
+        return 1;
     }
 
-    /* Locate the root directory */
-    memcpy(&root_dirent, cache[i]->data + 156, sizeof(iso_dirent_t));
-    root_extent = iso_733(root_dirent.extent);
-    root_size = iso_733(root_dirent.size);
+    if(size)
+        *size = stream_left;
 
     return 0;
 }
 
-/* Compare an ISO9660 filename against a normal filename. This takes into
-   account the version code on the end and is not case sensitive. */
-static int fncompare(const char *isofn, int isosize, const char *normalfn) {
-    int i;
-
-    for(i = 0; i < isosize; i++) {
-        if(isofn[i] == ';') return 0;
+typedef void (*vblank_handler_t)(uint32_t evt, void *data);
 
-        if(tolower(isofn[i]) != tolower(normalfn[i]))
-            return -1;
-    }
+static int vblank_handler_add(vblank_handler_t hnd, void *data) {
+    (void)hnd;
+    (void)data;
+    return 1;
+}
 
+static int vblank_handler_remove(int handle) {
+    (void)handle;
     return 0;
 }
 
-/* Locate an ISO9660 object in the given directory; this can be a directory or
-   a file, it works fine for either one. Pass in:
-
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
-
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object(const char *fn, int dir,
-                                 int32 dir_extent, int32 dir_size) {
-    int32         i;
-    iso_dirent_t * de;
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
 
-    while(dir_size > 0) {
-        int c = bread(dir_extent);
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
 
-        if(c < 0) return NULL;
+#include "../../kernel/arch/dreamcast/fs/fs_iso9660.c"
 
-        for(i = 0; i < 2048 && i < dir_size;) {
-            /* Locate the current dirent */
-            de = (iso_dirent_t *)(cache[c]->data + i);
+/* What's on the image, as found by readdir */
+typedef struct {
+    char *path;
+    bool dir;
+    int size;
+} entry_t;
+
+static entry_t *entries;
+static size_t entry_cnt, entry_max;
+static unsigned long lookup_reads;
+
+static void add_entry(const char *path, bool dir, int size) {
+    if(entry_cnt == entry_max) {
+        entry_max = entry_max ? entry_max * 2 : 64;
+        entries = realloc(entries, entry_max * sizeof(entry_t));
+    }
 
-            if(!de->length) break;
+    entries[entry_cnt].path = strdup(path);
+    entries[entry_cnt].dir = dir;
+    entries[entry_cnt].size = size;
+    entry_cnt++;
+}
 
-            /* Check the filename against the requested one */
-            if(!fncompare(de->name, de->name_len, fn)) {
-                if(!((dir << 1) ^ de->flags))
-                    return de;
-            }
+static void scan_dir(const char *path) {
+    const dirent_t *de;
+    char sub[PATH_MAX];
+    void *h;
 
-            i += de->length;
-        }
+    if(!(h = iso_open(NULL, path, O_RDONLY | O_DIR))) {
+        printf("FAIL: couldn't open directory %s\n", path);
+        failures++;
+        return;
+    }
 
-        dir_extent++;
-        dir_size -= 2048;
+    while((de = iso_readdir(h))) {
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->name);
+        add_entry(sub, de->attr == O_DIR, de->size);
     }
 
-    return NULL;
+    iso_close(h);
 }
 
-/* Locate an ISO9660 object anywhere on the disc, starting at the root,
-   and expecting a fully qualified path name. This is analogous to find_object
-   but it searches with the path in mind.
-
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+/* Look a path up the way fs_iso9660 used to, a component at a time without
+   any cache. */
+static int ref_lookup(const char *fn, bool dir, uint32_t *extent,
+                      uint32_t *size) {
+    uint32_t ext = root_extent, sz = root_size;
+    iso_dirent_t *de;
+    const char *cur;
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
-    char        *cur;
-
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory */
     while((cur = strchr(fn, '/'))) {
         if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
+            if(!(de = find_object(fn, 1, ext, sz)))
+                return -1;
 
-            if(start == NULL) return NULL;
+            ext = iso_733(de->extent);
+            sz = iso_733(de->size);
         }
 
         fn = cur + 1;
     }
 
-    /* Locate the file in the resulting directory */
     if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
-        return start;
+        if(!(de = find_object(fn, dir, ext, sz)))
+            return -1;
+
+        ext = iso_733(de->extent);
+        sz = iso_733(de->size);
     }
-    else {
-        if(!dir)
-            return NULL;
-        else
-            return start;
+    else if(!dir) {
+        return -1;
     }
-}
-
-/********************************************************************************/
-/* File primitives */
-
-/* File handles.. I could probably do this with a linked list, but I'm just
-   too lazy right now. =) */
-static struct {
-    int32      first_extent;   /* First sector */
-    int     dir;        /* >0 if a directory */
-    int32      ptr;        /* Current read position in bytes */
-    int32      size;       /* Length of file in bytes */
-    dirent_t    dirent;     /* A static dirent to pass back to clients */
-} fh[MAX_ISO_FILES];
-
-/* Mutex for file handles */
-static thd_mutex_t fh_mutex;
-
-/* Open a file or directory */
-static int32 iso_open(const char *fn, int mode) {
-    int32      fd;
-    iso_dirent_t    *de;
-
-    /* Make sure they don't want to open things as writeable */
-    if((mode & O_MODE_MASK) != O_RDONLY)
-        return 0;
-
-    /* Find a free file handle */
-    thd_mutex_lock(&fh_mutex);
-
-    for(fd = 0; fd < MAX_ISO_FILES; fd++)
-        if(fh[fd].first_extent == 0) {
-            fh[fd].first_extent = -1;
-            break;
-        }
 
-    thd_mutex_unlock(&fh_mutex);
-
-    if(fd >= MAX_ISO_FILES)
-        return 0;
-
-    /* For now we always do this, but it should eventually be set
-       up to detect the CD tray having been opened. */
-    if(init_percd() < 0)
-        return 0;
-
-    /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
+    *extent = ext;
+    *size = sz;
+    return 0;
+}
 
-    if(!de) return 0;
+static void check_path(const char *path, bool dir) {
+    uint32_t ext1 = 0, size1 = 0, ext2 = 0, size2 = 0;
+    unsigned long before = sectors_read;
+    int rv1, rv2;
 
-    /* Fill in the file handle and return the fd */
-    fh[fd].first_extent = iso_733(de->extent);
-    fh[fd].dir = (mode & O_DIR) ? 1 : 0;
-    fh[fd].ptr = 0;
-    fh[fd].size = iso_733(de->size);
+    rv1 = iso_lookup(path, strlen(path), dir, &ext1, &size1);
+    lookup_reads += sectors_read - before;
+    rv2 = ref_lookup(path, dir, &ext2, &size2);
 
-    return fd;
+    if(rv1 != rv2 || (!rv1 && (ext1 != ext2 || size1 != size2))) {
+        printf("FAIL: %s (%s): got %d %u/%u, expected %d %u/%u\n", path,
+               dir ? "dir" : "file", rv1, ext1, size1, rv2, ext2, size2);
+        failures++;
+    }
 }
 
-/* Close a file or directory */
-static void iso_close(uint32 fd) {
-    /* Check that the fd is valid */
-    if(fd < MAX_ISO_FILES) {
-        /* No need to lock the mutex: this is an atomic op */
-        fh[fd].first_extent = 0;
+static void swap_case(char *s) {
+    for(; *s; s++) {
+        if(isupper((unsigned char)*s))
+            *s = tolower((unsigned char)*s);
+        else
+            *s = toupper((unsigned char)*s);
     }
 }
 
-/* Read from a file */
-static ssize_t iso_read(uint32 fd, char *buf, size_t bytes) {
-    int rv = 0, c;
-    size_t toread, thissect;
-
-    /* Check that the fd is valid */
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
-        return -1;
-
-    /* Read zero or more sectors into the buffer from the current pos */
-    while(bytes > 0) {
-        /* Figure out how much we still need to read */
-        toread = (bytes > (size_t)(fh[fd].size - fh[fd].ptr)) ?
-                 (size_t)(fh[fd].size - fh[fd].ptr) : bytes;
+/* Look everything up as both a file and a directory, plus a few variations
+   on each path and some paths that shouldn't exist. */
+static void check_all(const char *what) {
+    char buf[PATH_MAX + 16];
+    struct stat st;
+    size_t i;
 
-        if(toread == 0) break;
+    lookup_reads = 0;
 
-        /* How much more can we read in the current sector? */
-        thissect = 2048 - (fh[fd].ptr % 2048);
-        toread = (toread > thissect) ? thissect : toread;
+    for(i = 0; i < entry_cnt; i++) {
+        const char *p = entries[i].path;
 
-        /* Do the read */
-        c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
+        check_path(p, false);
+        check_path(p, true);
 
-        if(c < 0) return -1;
+        if(iso_stat(NULL, p, &st, 0) < 0 ||
+           (entries[i].dir != S_ISDIR(st.st_mode)) ||
+           (!entries[i].dir && st.st_size != entries[i].size)) {
+            printf("FAIL: stat %s\n", p);
+            failures++;
+        }
 
-        memcpy(buf, cache[c]->data + (fh[fd].ptr % 2048), toread);
+        strcpy(buf, p);
+        swap_case(buf);
+        check_path(buf, entries[i].dir);
 
-        /* Adjust pointers */
-        buf += toread;
-        fh[fd].ptr += toread;
-        bytes -= toread;
-        rv += toread;
-    }
+        snprintf(buf, sizeof(buf), "/%s/", p);
+        check_path(buf, true);
+        check_path(buf, false);
 
-    return rv;
-}
-
-/* Seek elsewhere in a file */
-static off_t iso_seek(uint32 fd, off_t offset, int whence) {
-    /* Check that the fd is valid */
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
-        return -1;
+        snprintf(buf, sizeof(buf), "%s_missing", p);
+        check_path(buf, false);
 
-    /* Update current position according to arguments */
-    switch(whence) {
-        case SEEK_SET:
-            fh[fd].ptr = offset;
-        case SEEK_CUR:
-            fh[fd].ptr += offset;
-        case SEEK_END:
-            fh[fd].ptr = fh[fd].size + offset;
-        default:
-            return -1;
+        snprintf(buf, sizeof(buf), "%s/missing", p);
+        check_path(buf, false);
+        check_path(buf, true);
     }
 
-    /* Check bounds */
-    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
+    check_path("/", true);
+    check_path("/", false);
+    check_path("", true);
 
-    return fh[fd].ptr;
+    printf("%-20s %8lu sectors read by lookups\n", what, lookup_reads);
 }
 
-/* Tell where in the file we are */
-static off_t iso_tell(uint32 fd) {
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
-        return -1;
+static void check_reads(void) {
+    char buf[4096];
+    size_t i;
+    void *h;
+    ssize_t n;
+    size_t total;
+
+    for(i = 0; i < entry_cnt; i++) {
+        if(entries[i].dir)
+            continue;
+
+        if(!(h = iso_open(NULL, entries[i].path, O_RDONLY))) {
+            printf("FAIL: open %s: %s\n", entries[i].path, strerror(errno));
+            failures++;
+            continue;
+        }
 
-    return fh[fd].ptr;
-}
+        total = 0;
 
-/* Tell how big the file is */
-static size_t iso_total(uint32 fd) {
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
-        return -1;
+        while((n = iso_read(h, buf, sizeof(buf))) > 0)
+            total += n;
 
-    return fh[fd].size;
-}
+        if(n < 0 || total != (size_t)entries[i].size ||
+           iso_total(h) != (size_t)entries[i].size) {
+            printf("FAIL: read %s\n", entries[i].path);
+            failures++;
+        }
 
-/* Helper function for readdir: post-processes an ISO filename to make
-   it a bit prettier. */
-static void fn_postprocess(char *fn) {
-    while(*fn && *fn != ';') {
-        *fn = tolower(*fn);
-        fn++;
+        iso_close(h);
     }
-
-    *fn = 0;
 }
 
-/* Read a directory entry */
-static dirent_t *iso_readdir(uint32 fd) {
-    int     c;
-    iso_dirent_t    *de;
-
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || !fh[fd].dir)
-        return NULL;
-
-    /* Scan forwards until we find the next valid entry, an
-       end-of-entry mark, or run out of dir size. */
-    while(fh[fd].ptr < fh[fd].size) {
-        /* Get the current dirent block */
-        c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
+/* Read a file in pieces of the given size, checking what comes back against
+   the image. */
+static int read_piece(void *h, long base, size_t *pos, size_t piece,
+                      const char *path) {
+    static uint8_t __attribute__((aligned(32))) buf[65536], ref[65536];
+    ssize_t n;
 
-        if(c < 0) return NULL;
-
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
-
-        if(de->length) break;
-
-        /* Skip to the next sector */
-        fh[fd].ptr += 2048 - (fh[fd].ptr % 2048);
+    if((n = iso_read(h, buf, piece)) < 0) {
+        printf("FAIL: read %s: %s\n", path, strerror(errno));
+        failures++;
+        return -1;
     }
 
-    if(fh[fd].ptr >= fh[fd].size) return NULL;
-
-    /* If we're at the first, skip the two blank entries */
-    if(!de->name[0]) {
-        fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
-        fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
-
-        if(!de->length) return NULL;
+    if(n && (fseek(image, base + *pos, SEEK_SET) ||
+             fread(ref, 1, n, image) != (size_t)n || memcmp(buf, ref, n))) {
+        printf("FAIL: wrong data from %s at %zu\n", path, *pos);
+        failures++;
+        return -1;
     }
 
-    /* Fill out the VFS dirent */
-    strncpy(fh[fd].dirent.name, de->name, de->name_len);
-    fh[fd].dirent.name[de->name_len] = 0;
-    fn_postprocess(fh[fd].dirent.name);
-
-    if(de->flags & 2)
-        fh[fd].dirent.size = -1;
-    else
-        fh[fd].dirent.size = iso_733(de->size);
+    *pos += n;
+    return n;
+}
 
-    fh[fd].ptr += de->length;
+static void print_stats(const char *what) {
+    iso_stats_t st;
 
-    return &fh[fd].dirent;
+    iso_get_stats(&st);
+    printf("%-20s %8lu sectors, %u seeks, %u streams (%u restarts), "
+           "%u read-ahead fills, %llu bytes read ahead\n", what, sectors_read,
+           (unsigned)st.seeks, (unsigned)st.stream_starts,
+           (unsigned)st.stream_restarts, (unsigned)st.ra_fills,
+           (unsigned long long)st.ra_bytes);
 }
 
-/* Put everything together */
-static vfs_handler vh = {
-    0, 0,       /* In-kernel, no caching */
-    iso_open,
-    iso_close,
-    iso_read,
-    NULL,
-    iso_seek,
-    iso_tell,
-    iso_total,
-    iso_readdir,
-    NULL,
-    NULL
-};
-
-/* Initialize the file system */
-static int fs_iso9660_init() {
-    int i;
-
-    /* Reset fd's */
-    memset(fh, 0, sizeof(fh));
-
-    /* Mark the first as active so we can have an error FD of zero */
-    fh[0].first_extent = -1;
-
-    /* Init thread mutexes */
-    thd_mutex_reset(&cache_mutex);
-    thd_mutex_reset(&fh_mutex);
-
-    /* Allocate cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        cache[i] = malloc(sizeof(cache_block_t));
-        cache[i]->sector = -1;
+/* Read the biggest files on the image a bit at a time from each in turn, the
+   way a game might play music while loading a level, with or without a
+   read-ahead hint on all but the last of them. */
+static void check_interleaved(bool hint, int nfiles) {
+    static const size_t pieces[] = { 2048, 1000, 4096, 32, 8192, 777 };
+    entry_t *files[4] = { NULL };
+    void *h[4] = { NULL };
+    size_t pos[4] = { 0 };
+    long base[4];
+    uint32_t ext, size;
+    iso_fadvise_t adv = { 0, 0, ISO_FADV_SEQUENTIAL };
+    bool more = true;
+    size_t i, k;
+    int j;
+
+    for(i = 0; i < entry_cnt; i++) {
+        if(entries[i].dir)
+            continue;
+
+        for(j = 0; j < nfiles; j++) {
+            if(!files[j] || entries[i].size > files[j]->size) {
+                memmove(&files[j + 1], &files[j],
+                        (nfiles - j - 1) * sizeof(files[0]));
+                files[j] = &entries[i];
+                break;
+            }
+        }
     }
 
-    /* Register with VFS */
-    return fs_handler_add("/cd", &vh);
-}
+    iso_reset();
+    iso_reset_stats();
+    sectors_read = 0;
+
+    for(j = 0; j < nfiles; j++) {
+        if(!files[j] || !(h[j] = iso_open(NULL, files[j]->path, O_RDONLY)) ||
+           iso_lookup(files[j]->path, strlen(files[j]->path), false, &ext,
+                      &size) < 0) {
+            printf("FAIL: open %s\n", files[j] ? files[j]->path : "?");
+            failures++;
+            return;
+        }
 
-/* De-init the file system */
-static int fs_iso9660_shutdown() {
-    int i;
+        base[j] = (long)ext * 2048;
 
-    /* Dealloc cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        free(cache[i]);
+        if(hint && j < nfiles - 1 && iso_advise(h[j], &adv) < 0) {
+            printf("FAIL: hint %s: %s\n", files[j]->path, strerror(errno));
+            failures++;
+        }
+    }
 
-    return fs_handler_remove(&vh);
-}
+    for(k = 0; more; k++) {
+        more = false;
 
+        for(j = 0; j < nfiles; j++) {
+            if(read_piece(h[j], base[j], &pos[j],
+                          pieces[(k + j) % (sizeof(pieces) / sizeof(pieces[0]))],
+                          files[j]->path) > 0)
+                more = true;
+        }
+    }
 
+    for(j = 0; j < nfiles; j++) {
+        if(pos[j] != (size_t)files[j]->size) {
+            printf("FAIL: read %zu of %d bytes of %s\n", pos[j],
+                   files[j]->size, files[j]->path);
+            failures++;
+        }
 
-/* Cut here to insert into KallistiOS fs_iso9660.c */
+        iso_close(h[j]);
+    }
 
-/********************************************************************************/
+    print_stats(hint ? "Read-ahead:" : "No read-ahead:");
+}
 
-#if 0
-static void read_dir(uint32 extent, uint32 size) {
-    int     i;
-    iso_dirent_t    *de;
-    char        fn[32];
+/* Jump around a hinted file, and use the other hints on it. */
+static void check_seeking(void) {
+    iso_fadvise_t adv = { 0, 0, ISO_FADV_SEQUENTIAL };
+    uint32_t ext, size;
+    size_t pos;
+    entry_t *e = NULL;
+    void *h;
+    size_t i;
+    int k;
+
+    for(i = 0; i < entry_cnt; i++) {
+        if(!entries[i].dir && (!e || entries[i].size > e->size))
+            e = &entries[i];
+    }
 
-    while(size > 0) {
-        int c = bread(extent);
+    if(!e || !(h = iso_open(NULL, e->path, O_RDONLY)))
+        return;
 
-        if(c < 0) return;
+    iso_lookup(e->path, strlen(e->path), false, &ext, &size);
+    iso_advise(h, &adv);
 
-        for(i = 0; i < 2048 && i < size;) {
-            de = (iso_dirent_t*)(cache[c]->data + i);
+    for(k = 0; k < 64; k++) {
+        pos = (size_t)rand() % (size + 1);
 
-            if(!de->length) break;
+        if(k == 20) {
+            adv.advice = ISO_FADV_WILLNEED;
+            adv.offset = pos;
+            iso_advise(h, &adv);
+        }
+        else if(k == 30) {
+            adv.advice = ISO_FADV_DONTNEED;
+            iso_advise(h, &adv);
+        }
+        else if(k == 40) {
+            adv.advice = ISO_FADV_RANDOM;
+            iso_advise(h, &adv);
+        }
+        else if(k == 50) {
+            adv.advice = ISO_FADV_SEQUENTIAL;
+            iso_advise(h, &adv);
+        }
 
-            strncpy(fn, de->name, de->name_len);
-            fn[de->name_len] = 0;
+        iso_seek(h, pos, SEEK_SET);
+        read_piece(h, (long)ext * 2048, &pos, 1 + rand() % 5000, e->path);
+        read_piece(h, (long)ext * 2048, &pos, 1 + rand() % 5000, e->path);
+    }
 
-            if(de->flags & 2)
-                printf("%s\t\t<DIR>\n", fn);
-            else
-                printf("%s\t\t%d\n", fn, iso_733(de->size));
+    iso_close(h);
+}
 
-            i += de->length;
-        }
+int main(int argc, char **argv) {
+    size_t i;
+    int n;
 
-        extent++;
-        size -= 2048;
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s image.iso\n", argv[0]);
+        return 1;
     }
-}
-#endif
 
+    if(!(image = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
 
-int main() {
     fs_iso9660_init();
 
-    /*
-    {
-    uint32  fd, size, t;
-    char    buf[667];
+    /* Walk the tree (the list grows as directories are found) */
+    scan_dir("");
 
-    printf("Opening file /escape.txt\n");
-    fd = iso_open("/escape.txt", O_RDONLY);
-    if (fd == 0) {
-        printf("Couldn't open file\n");
-        return 1;
+    for(i = 0; i < entry_cnt; i++) {
+        if(entries[i].dir)
+            scan_dir(entries[i].path);
     }
-    size = iso_total(fd);
-    printf("fd is %d, size is %08lx\n", fd, size);
-
-    while (size > 0) {
-        int r;
-        r = iso_read(fd, buf, 666);
-        if (r < 0) {
-            printf("Read error\n");
-            return 1;
-        }
-        buf[r] = 0;
-        printf("%s", buf);
-        if (strstr(buf, "Let the party")) {
-            t = 0;
-        }
-        size -= r;
-    }
-    printf("\nFile read is done\n");
-    iso_close(fd); */
 
-    {
-        uint32      fd;
-        dirent_t    *de;
+    printf("%zu files and directories, cache size %d\n", entry_cnt,
+           ISO9660_DCACHE_SIZE);
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
+    iso_reset();
+    percd_done = init_percd() == 0;
+    check_all("Empty cache:");
+    check_all("Warm cache:");
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return 1;
-        }
+    iso_reset();
+    percd_done = init_percd() == 0;
+    check_all("After reset:");
 
-        printf("Scanning dir:\n");
+    iso_reset();
+    n = iso_dcache_preload();
+    printf("Preloaded %d entries\n", n);
+    check_all("Preloaded cache:");
 
-        while((de = iso_readdir(fd))) {
-            printf("%s\t%d\n", de->name, de->size);
+    check_reads();
+    check_seeking();
+    check_interleaved(false, 3);
+    check_interleaved(true, 3);
 
-            if(!strcmp(de->name, "R_WAR.ZIP")) {
-                /* what's this test for? */
-            }
-        }
+    fs_iso9660_shutdown();
+    fclose(image);
 
-        iso_close(fd);
+    if(failures) {
+        printf("%d failures\n", failures);
+        return 1;
     }
 
-    fs_iso9660_shutdown();
-
+    printf("All tests passed\n");
     return 0;
 }
@@ -0,0 +1,459 @@
+/* KallistiOS ##version##
+
+   malloctest.c
+
+   Test and time malloc() from a few threads at once. The real malloc.c is
+   built into this program, with its functions given a dl prefix so that they
+   don't get mixed up with the PC's own, its memory coming out of one big
+   block the way sbrk() hands it out on a Dreamcast, and pthreads standing in
+   for KOS threads and mutexes.
+
+   Each thread allocates and frees small objects of the sorts of sizes that
+   network packets, job structures and strings come in, along with the odd
+   bigger one, and hands some of them on to the next thread to free. Every
+   object is filled in when it's allocated and has to still hold what was put
+   in it when it's freed. Once the threads have gone, everything they took has
+   to be back in the arena.
+
+   The same work is done with the threads' caches turned off (by leaving
+   thd_current NULL, which is how malloc() sees IRQ handlers and the early
+   days of the kernel) and on, first with the threads free to run on every CPU
+   the PC has, then all on one CPU, which is closer to how threads share a
+   Dreamcast. How many allocations and frees were done each second, how often
+   the arena's lock was taken, and how long it was held and waited for are
+   shown.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef __used
+#define __used __attribute__((used))
+#endif
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_THREAD_H
+#define __KOS_MUTEX_H
+#define __KOS_IRQ_H
+#define __ARCH_ARCH_H
+
+#include <machine/malloc.h>
+#include <kos/dbglog.h>
+
+#define PAGESIZE                    4096
+#define irq_inside_int()            0
+
+/* Threads: just enough of one for malloc() to keep its cache in */
+typedef struct kthread {
+    struct malloc_tcache *malloc_cache;
+} kthread_t;
+
+static __thread kthread_t *cur_thread;
+#define thd_current                 cur_thread
+
+/* The arena's mutex, which keeps count of how long it's held and waited for.
+   The counts are only changed with it held. */
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define mutex_is_locked(m)          ((void)(m), 0)
+
+static struct {
+    uint64_t locks, contended;
+    uint64_t wait_ns, hold_ns;
+    uint64_t since;
+} lock_stats;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int mutex_lock_irqsafe(mutex_t *m) {
+    uint64_t t = now_ns();
+    int contended = 0;
+
+    if(pthread_mutex_trylock(m)) {
+        contended = 1;
+        pthread_mutex_lock(m);
+    }
+
+    lock_stats.since = now_ns();
+    lock_stats.wait_ns += lock_stats.since - t;
+    lock_stats.contended += contended;
+    lock_stats.locks++;
+    return 0;
+}
+
+static int mutex_unlock(mutex_t *m) {
+    lock_stats.hold_ns += now_ns() - lock_stats.since;
+    return pthread_mutex_unlock(m);
+}
+
+/* Memory for the arena, handed out like sbrk() does */
+#define ARENA_SIZE                  (256 * 1024 * 1024)
+
+static char *arena;
+static size_t arena_used;
+
+static void *arena_sbrk(ptrdiff_t incr) {
+    void *rv = arena + arena_used;
+
+    if(incr < 0 || arena_used + incr > ARENA_SIZE)
+        return (void *)-1;
+
+    arena_used += incr;
+    return rv;
+}
+
+int dbglog_level = DBG_WARNING;
+
+#define USE_DL_PREFIX
+#define MORECORE                    arena_sbrk
+
+#include "../../kernel/libc/koslib/malloc.c"
+
+static int failures;
+static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    return now_ns() / 1e9;
+}
+
+static void fail(const char *what) {
+    pthread_mutex_lock(&fail_lock);
+
+    if(++failures <= 10)
+        printf("FAIL: %s\n", what);
+
+    pthread_mutex_unlock(&fail_lock);
+}
+
+/********************************************************************************/
+/* Objects */
+
+typedef struct obj {
+    uint32_t size;
+    uint32_t seed;
+    uint32_t data[];
+} obj_t;
+
+#define WORDS(o)        (((o)->size - sizeof(obj_t)) / sizeof(uint32_t))
+
+/* Mostly strings and job structures, then packets, then a few bigger blocks
+   that the caches never see. */
+static size_t pick_size(unsigned int *seed) {
+    int r = rand_r(seed) % 100;
+
+    if(r < 55)
+        return 8 + rand_r(seed) % 56;
+    else if(r < 90)
+        return 64 + rand_r(seed) % 160;
+    else if(r < 98)
+        return 224 + rand_r(seed) % 1300;
+    else
+        return 2048 + rand_r(seed) % 6000;
+}
+
+static obj_t *obj_new(unsigned int *seed, int n) {
+    size_t size = pick_size(seed), i;
+    int zero = !(n % 16);
+    obj_t *o;
+
+    if(zero)
+        o = dlcalloc(1, size);
+    else
+        o = dlmalloc(size);
+
+    if(!o) {
+        fail("out of memory");
+        return NULL;
+    }
+
+    /* This takes the lock too, so don't do it too often. */
+    if(!(n % 64) && dlmalloc_usable_size(o) < size)
+        fail("block smaller than asked for");
+
+    if(zero) {
+        for(i = 0; i < size; i++) {
+            if(((unsigned char *)o)[i]) {
+                fail("calloc() block not cleared");
+                break;
+            }
+        }
+    }
+
+    o->size = size;
+    o->seed = rand_r(seed);
+
+    for(i = 0; i < WORDS(o); i++)
+        o->data[i] = o->seed + i;
+
+    return o;
+}
+
+static void obj_free(obj_t *o) {
+    size_t i;
+
+    for(i = 0; i < WORDS(o); i++) {
+        if(o->data[i] != o->seed + i) {
+            fail("object changed while it was allocated");
+            break;
+        }
+    }
+
+    /* Dirty it, so a calloc() that gets it back has to clear it. */
+    memset(o, 0xA5, o->size);
+    dlfree(o);
+}
+
+/********************************************************************************/
+/* Threads */
+
+#define MAX_THREADS     8
+#define LIVE            256
+#define MAILBOX         64
+
+typedef struct worker {
+    pthread_t thread;
+    int id, nthreads, cache, one_cpu;
+    long ops;
+
+    /* Objects handed over from the thread before this one, to free */
+    pthread_mutex_t lock;
+    obj_t *mailbox[MAILBOX];
+    int mail;
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg, *next;
+    kthread_t thd = { NULL };
+    obj_t *live[LIVE] = { NULL }, *o;
+    unsigned int seed = 1234 + w->id;
+    long i;
+    int j;
+
+    if(w->one_cpu) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(0, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    if(w->cache)
+        cur_thread = &thd;
+
+    next = &workers[(w->id + 1) % w->nthreads];
+
+    for(i = 0; i < w->ops; i++) {
+        j = rand_r(&seed) % LIVE;
+
+        if((o = live[j])) {
+            live[j] = NULL;
+
+            /* Pass one in eight on to be freed by the next thread. */
+            if(w->nthreads > 1 && !(rand_r(&seed) % 8)) {
+                pthread_mutex_lock(&next->lock);
+
+                if(next->mail < MAILBOX) {
+                    next->mailbox[next->mail++] = o;
+                    o = NULL;
+                }
+
+                pthread_mutex_unlock(&next->lock);
+            }
+
+            if(o)
+                obj_free(o);
+        }
+        else {
+            live[j] = obj_new(&seed, i);
+        }
+
+        if(!(i % 32)) {
+            pthread_mutex_lock(&w->lock);
+
+            while(w->mail)
+                obj_free(w->mailbox[--w->mail]);
+
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+
+    for(j = 0; j < LIVE; j++) {
+        if(live[j])
+            obj_free(live[j]);
+    }
+
+    /* What thd_destroy() does */
+    __malloc_thread_destroy(&thd);
+    cur_thread = NULL;
+
+    if(thd.malloc_cache)
+        fail("thread's cache left behind");
+
+    return NULL;
+}
+
+static void run(int nthreads, int cache, int one_cpu, long ops) {
+    struct mallinfo before, after;
+    double t;
+    int i;
+
+    before = dlmallinfo();
+    memset(&lock_stats, 0, sizeof(lock_stats));
+
+    for(i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].nthreads = nthreads;
+        workers[i].cache = cache;
+        workers[i].one_cpu = one_cpu;
+        workers[i].ops = ops / nthreads;
+        workers[i].mail = 0;
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    t = now();
+
+    for(i = 0; i < nthreads; i++)
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+
+    for(i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    t = now() - t;
+
+    /* Anything left in a mailbox after its thread finished */
+    for(i = 0; i < nthreads; i++) {
+        while(workers[i].mail)
+            obj_free(workers[i].mailbox[--workers[i].mail]);
+
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+
+    after = dlmallinfo();
+
+    if(after.uordblks != before.uordblks)
+        fail("memory not given back to the arena");
+
+    printf("  %d thread%s  %-9s %6.2f M/s  %6.1f locks/1000  %5.1f%% held  "
+           "%7.0f ns waited/lock\n", nthreads, nthreads > 1 ? "s" : " ",
+           cache ? "cached" : "uncached", ops / t / 1e6,
+           lock_stats.locks * 1000.0 / ops,
+           lock_stats.hold_ns / 1e9 / t * 100.0,
+           lock_stats.locks ? (double)lock_stats.wait_ns / lock_stats.locks
+           : 0.0);
+}
+
+/********************************************************************************/
+/* The cache itself */
+
+static void check_cache(void) {
+    kthread_t thd = { NULL };
+    struct mallinfo before;
+    void *a, *b, *big;
+    unsigned char *c;
+    uint64_t locks;
+    int i;
+
+    before = dlmallinfo();
+    cur_thread = &thd;
+
+    /* A block freed and asked for again comes straight back from the cache
+       without the lock. */
+    a = dlmalloc(40);
+    dlfree(a);
+    locks = lock_stats.locks;
+    b = dlmalloc(40);
+
+    if(a != b)
+        fail("freed block not handed back out");
+
+    if(lock_stats.locks != locks)
+        fail("lock taken for a cached block");
+
+    memset(b, 0xA5, 40);
+    dlfree(b);
+    c = dlcalloc(5, 8);
+
+    for(i = 0; i < 40; i++) {
+        if(c[i]) {
+            fail("calloc() block from the cache not cleared");
+            break;
+        }
+    }
+
+    dlfree(c);
+
+    /* Big blocks go straight back to the arena. */
+    big = dlmalloc(4096);
+    dlfree(big);
+
+    if(dlmallinfo().uordblks == before.uordblks)
+        fail("nothing cached");
+
+    /* A flush gives everything back. */
+    malloc_thread_flush();
+
+    if(thd.malloc_cache || dlmallinfo().uordblks != before.uordblks)
+        fail("malloc_thread_flush() didn't give everything back");
+
+    /* With no thread (as in an IRQ), blocks go straight to the arena. */
+    cur_thread = NULL;
+    a = dlmalloc(40);
+    dlfree(a);
+
+    if(dlmallinfo().uordblks != before.uordblks)
+        fail("block cached with no thread");
+}
+
+int main(int argc, char *argv[]) {
+    static const int threads[] = { 1, 2, 4 };
+    long ops = 2000000;
+    unsigned int i;
+    int one_cpu;
+
+    if(argc > 1)
+        ops = atol(argv[1]);
+
+    arena = malloc(ARENA_SIZE);
+
+    /* Get the arena going before anything is measured against it. */
+    dlfree(dlmalloc(1));
+
+    check_cache();
+
+    for(one_cpu = 0; one_cpu < 2; one_cpu++) {
+        printf("%s:\n", one_cpu ? "All threads on one CPU" : "Every CPU");
+
+        for(i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+            run(threads[i], 0, one_cpu, ops);
+            run(threads[i], 1, one_cpu, ops);
+        }
+    }
+
+    free(arena);
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
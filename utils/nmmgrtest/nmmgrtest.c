@@ -0,0 +1,377 @@
+/* KallistiOS ##version##
+
+   nmmgrtest.c
+
+   Test and time the name manager's path lookups. The real nmmgr.c is built
+   into this program, along with fs.c, fs_utils.c and fs_null.c, so that
+   files can be opened and stat'd through the VFS on a PC, with pthreads
+   mutexes standing in for KOS ones.
+
+   A set of handlers like the ones a running program has is added, and then
+   a lot of paths are looked up, checking each against a plain scan of the
+   list of handlers matching whole path components, which is what the lookup
+   is supposed to do. Aliases, handlers added over the top of another one at
+   the same path and taken away again, and handlers added with a trailing
+   slash are all checked too. The time taken to look paths up, both with the
+   plain scan the name manager used to do and with nmmgr_lookup(), and to
+   open, close and stat files on /dev/null is shown.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/* The host's sys/queue.h may not have these */
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = TAILQ_FIRST((head)); \
+        (var) && ((tvar) = TAILQ_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#ifndef __weak_symbol
+#define __weak_symbol __attribute__((weak))
+#endif
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_THREAD_H
+#define __KOS_MUTEX_H
+
+#include <kos/fs.h>
+#include <kos/dbglog.h>
+
+/* Mutexes */
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_TYPE_NORMAL           0
+#define mutex_init(m, t)            ((void)(t), pthread_mutex_init((m), NULL))
+#define mutex_destroy(m)            pthread_mutex_destroy(m)
+#define mutex_lock(m)               pthread_mutex_lock(m)
+#define mutex_lock_irqsafe(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)             pthread_mutex_unlock(m)
+
+static inline void scoped_unlock(mutex_t **m) {
+    if(*m)
+        pthread_mutex_unlock(*m);
+}
+
+#define scoped_lock_(m, l) \
+    mutex_t *scoped_##l __attribute__((cleanup(scoped_unlock))) = \
+        pthread_mutex_lock(m) ? NULL : (m)
+#define scoped_lock(m, l)           scoped_lock_(m, l)
+#define mutex_lock_scoped(m)        scoped_lock((m), __LINE__)
+
+/* Threads, for the working directory */
+#define thd_get_current()           NULL
+#define thd_get_pwd(t)              ((void)(t), "/")
+#define thd_set_pwd(t, p)           ((void)(t), (void)(p))
+
+int dbglog_level = DBG_WARNING;
+
+void export_init(void) {
+}
+
+void __poll_fd_closed(int fd) {
+    (void)fd;
+}
+
+#include "../../kernel/exports/nmmgr.c"
+#include "../../kernel/fs/fs.c"
+#include "../../kernel/fs/fs_utils.c"
+#include "../../kernel/fs/fs_null.c"
+
+static int failures;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *path) {
+    if(++failures <= 10)
+        printf("FAIL: %s: %s\n", what, path);
+}
+
+/********************************************************************************/
+/* Handlers */
+
+static const char *mounts[] = {
+    "/rd", "/cd", "/pc", "/sd", "/ide", "/vmu", "/dev", "/dev/random",
+    "/pty", "/sock", "/ram", "/epoll", "/sd2", "/sd/music",
+    "sym/kernel", "sym/kernel/arch", "sym/kernel/subarch"
+};
+
+#define MOUNTS          (sizeof(mounts) / sizeof(mounts[0]))
+
+static vfs_handler_t handlers[MOUNTS];
+static alias_handler_t urandom;
+
+static void add_handlers(void) {
+    size_t i;
+
+    for(i = 0; i < MOUNTS; i++) {
+        strcpy(handlers[i].nmmgr.pathname, mounts[i]);
+        handlers[i].nmmgr.type = i < 14 ? NMMGR_TYPE_VFS : NMMGR_TYPE_SYMTAB;
+
+        if(nmmgr_handler_add(&handlers[i].nmmgr))
+            fail("couldn't add a handler", mounts[i]);
+    }
+
+    strcpy(urandom.nmmgr.pathname, "/dev/urandom");
+    urandom.nmmgr.flags = NMMGR_FLAGS_ALIAS;
+    urandom.nmmgr.type = NMMGR_TYPE_VFS;
+    urandom.alias = &handlers[7].nmmgr;
+    nmmgr_handler_add(&urandom.nmmgr);
+
+    fs_null_init();
+}
+
+/* What the lookup should give: the newest handler whose path name is the
+   same as the start of the path, up to a slash or the end of it. This is
+   also close to what the name manager used to do for every lookup, which
+   didn't look for the slash. */
+static nmmgr_handler_t *scan(const char *fn, bool whole) {
+    nmmgr_handler_t *cur = NULL, *tmp;
+    size_t cur_len = 0, tmp_len;
+
+    SLIST_FOREACH(tmp, &nmmgr_handlers, list_ent) {
+        tmp_len = strlen(tmp->pathname);
+
+        if(!strncasecmp(tmp->pathname, fn, tmp_len) &&
+           (!whole || fn[tmp_len] == '/' || !fn[tmp_len] ||
+            tmp->pathname[tmp_len - 1] == '/')) {
+            if(cur_len < tmp_len) {
+                cur_len = tmp_len;
+                cur = tmp;
+            }
+        }
+    }
+
+    if(cur && (cur->flags & NMMGR_FLAGS_ALIAS))
+        return ((alias_handler_t *)cur)->alias;
+
+    return cur;
+}
+
+/********************************************************************************/
+/* Paths */
+
+#define PATHS           4096
+
+static char paths[PATHS][64];
+
+static const char *parts[] = {
+    "x", "dev", "DEV", "null", "random", "urandom", "cd", "CD", "cdx",
+    "sd", "Sd", "music", "sd2", "kernel", "arch", "subarch", "sym", "a.txt",
+    "vmu", "a1", "epoll", "ram", "sock"
+};
+
+#define PARTS           (sizeof(parts) / sizeof(parts[0]))
+
+static void make_paths(void) {
+    int i, j, depth;
+    char *p;
+
+    srand(1234);
+
+    for(i = 0; i < PATHS; i++) {
+        p = paths[i];
+        depth = 1 + rand() % 4;
+
+        /* Mostly absolute paths, with the odd symbol table name */
+        if(rand() % 8)
+            *p++ = '/';
+        else
+            p += sprintf(p, "sym/");
+
+        for(j = 0; j < depth; j++) {
+            if(j)
+                *p++ = '/';
+
+            p += sprintf(p, "%s", parts[rand() % PARTS]);
+        }
+
+        *p = '\0';
+    }
+}
+
+static void check_paths(const char *when) {
+    int i;
+
+    for(i = 0; i < PATHS; i++) {
+        if(nmmgr_lookup(paths[i]) != scan(paths[i], true))
+            fail(when, paths[i]);
+    }
+}
+
+/********************************************************************************/
+/* Handlers coming and going */
+
+static void check_changes(void) {
+    vfs_handler_t over, slash;
+
+    if(nmmgr_lookup("/cd") != &handlers[1].nmmgr ||
+       nmmgr_lookup("/CD/data/a.bin") != &handlers[1].nmmgr)
+        fail("case isn't ignored", "/cd");
+
+    if(nmmgr_lookup("/cdx/a") || nmmgr_lookup("/") || nmmgr_lookup("") ||
+       nmmgr_lookup("/sym/kernel"))
+        fail("found a handler that doesn't match", "/cdx/a");
+
+    if(nmmgr_lookup("/dev/urandom/x") != &handlers[7].nmmgr)
+        fail("alias not followed", "/dev/urandom");
+
+    /* A handler added at a path that already has one takes over from it
+       until it's removed. */
+    memset(&over, 0, sizeof(over));
+    strcpy(over.nmmgr.pathname, "/cd");
+    over.nmmgr.type = NMMGR_TYPE_VFS;
+    nmmgr_handler_add(&over.nmmgr);
+
+    if(nmmgr_lookup("/cd/a") != &over.nmmgr)
+        fail("newer handler not used", "/cd");
+
+    check_paths("lookup with two handlers at a path");
+
+    nmmgr_handler_remove(&over.nmmgr);
+
+    if(nmmgr_lookup("/cd/a") != &handlers[1].nmmgr)
+        fail("older handler not used again", "/cd");
+
+    /* The other way around: take away the older one first. */
+    nmmgr_handler_add(&over.nmmgr);
+    nmmgr_handler_remove(&handlers[1].nmmgr);
+
+    if(nmmgr_lookup("/cd/a") != &over.nmmgr)
+        fail("newer handler lost", "/cd");
+
+    nmmgr_handler_remove(&over.nmmgr);
+
+    if(nmmgr_lookup("/cd/a"))
+        fail("removed handler still found", "/cd");
+
+    check_paths("lookup after removing a handler");
+
+    nmmgr_handler_add(&handlers[1].nmmgr);
+
+    if(nmmgr_handler_remove(&over.nmmgr) != -1)
+        fail("removed a handler that wasn't there", "/cd");
+
+    /* A name with a trailing slash can't be used for the path without it,
+       since fs.c cuts the name off the front of the path. */
+    memset(&slash, 0, sizeof(slash));
+    strcpy(slash.nmmgr.pathname, "/mnt/");
+    slash.nmmgr.type = NMMGR_TYPE_VFS;
+    nmmgr_handler_add(&slash.nmmgr);
+
+    if(nmmgr_lookup("/mnt/a") != &slash.nmmgr || nmmgr_lookup("/mnt"))
+        fail("trailing slash", "/mnt/");
+
+    nmmgr_handler_remove(&slash.nmmgr);
+    check_paths("lookup after everything");
+}
+
+/********************************************************************************/
+/* Timing */
+
+#define ROUNDS          200
+
+static void time_lookups(void) {
+    volatile uintptr_t sink = 0;
+    double t;
+    int r, i;
+
+    t = now();
+
+    for(r = 0; r < ROUNDS; r++)
+        for(i = 0; i < PATHS; i++)
+            sink += (uintptr_t)scan(paths[i], false);
+
+    t = now() - t;
+    printf("Lookup, scanning the list: %.1f ns\n", t / ROUNDS / PATHS * 1e9);
+
+    t = now();
+
+    for(r = 0; r < ROUNDS; r++)
+        for(i = 0; i < PATHS; i++)
+            sink += (uintptr_t)nmmgr_lookup(paths[i]);
+
+    t = now() - t;
+    printf("Lookup, through the trie:  %.1f ns\n", t / ROUNDS / PATHS * 1e9);
+    (void)sink;
+}
+
+#define OPENS           200000
+
+static void time_vfs(void) {
+    struct stat st;
+    file_t fd;
+    double t;
+    int i;
+
+    t = now();
+
+    for(i = 0; i < OPENS; i++) {
+        if((fd = fs_open("/dev/null", O_RDWR)) < 0) {
+            fail("couldn't open", "/dev/null");
+            return;
+        }
+
+        fs_close(fd);
+    }
+
+    t = now() - t;
+    printf("fs_open() and fs_close() on /dev/null: %.0f per second\n",
+           OPENS / t);
+
+    t = now();
+
+    for(i = 0; i < OPENS; i++) {
+        if(fs_stat("/dev/null", &st, 0) || !S_ISCHR(st.st_mode)) {
+            fail("couldn't stat", "/dev/null");
+            return;
+        }
+    }
+
+    t = now() - t;
+    printf("fs_stat() on /dev/null: %.0f per second\n", OPENS / t);
+
+    if(fs_open("/dev/nullx", O_RDONLY) >= 0)
+        fail("opened a file that isn't there", "/dev/nullx");
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    nmmgr_init();
+    add_handlers();
+    make_paths();
+
+    check_paths("lookup");
+    check_changes();
+    time_lookups();
+    time_vfs();
+
+    fs_null_shutdown();
+    nmmgr_shutdown();
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
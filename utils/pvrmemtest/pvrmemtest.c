@@ -0,0 +1,644 @@
+/* KallistiOS ##version##
+
+   pvrmemtest.c
+
+   Test and measure the PVR memory allocator. The real pvr_mem_core.c is
+   built into this program, along with the slab allocator it gets its block
+   descriptors from, and hands out pieces of a buffer standing in for VRAM.
+
+   Allocation traces are replayed against it: one made up here, of a game
+   streaming textures of all the usual sizes in and out over a series of
+   levels, or ones recorded on a Dreamcast by building KOS with PVR_KM_DBG
+   and PVR_KM_DBG_VERBOSE and saving what pvr_mem_malloc(), pvr_mem_free(),
+   the handle functions and pvr_mem_compact() print. After every operation
+   the block list, free lists and hash table have to agree with each other
+   and cover the whole pool, and every block has to still hold what was
+   written to it when it's freed, and after every compaction.
+
+   Each trace is replayed as it is, without and with the pool being
+   compacted whenever an allocation fails, then with every block allocated
+   with pvr_mem_malloc(), and then with every block allocated through a
+   handle and the pool compacted whenever an allocation fails for want of a
+   big enough piece of free memory (which then has to make room for it).
+   How many allocations failed (and how many of those only failed because
+   the free memory was in pieces), how fragmented the free memory got, the
+   peak usage, how much was moved and the time taken are printed for each.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_MUTEX_H
+#define __KOS_IRQ_H
+
+#ifndef __nonnull_all
+#define __nonnull_all               __attribute__((nonnull))
+#endif
+
+#ifndef __predict_false
+#define __predict_false(x)          __builtin_expect(!!(x), 0)
+#endif
+
+#ifndef __align_up
+#define __align_up(x, a)            (((x) + ((a) - 1)) & ~((a) - 1))
+#endif
+
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_TYPE_NORMAL           0
+#define mutex_init(m, t)            ((void)(t), pthread_mutex_init((m), NULL))
+#define mutex_destroy(m)            pthread_mutex_destroy(m)
+#define mutex_lock(m)               pthread_mutex_lock(m)
+#define mutex_unlock(m)             pthread_mutex_unlock(m)
+
+typedef int irq_mask_t;
+#define irq_disable()               (0)
+#define irq_restore(s)              ((void)(s))
+#define irq_inside_int()            (0)
+#define malloc_irq_safe()           (0)
+
+#include "../../kernel/mm/slab.c"
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_mem_core.c"
+
+/* The pool: 6 MiB of a retail unit's 8, after the frame and TA buffers. */
+#define POOL_BASE       0xa4200000
+#define POOL_SIZE       (6 * 1024 * 1024)
+
+static uint8_t vram[POOL_SIZE];
+
+static int failures;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *name) {
+    if(++failures <= 10)
+        printf("FAIL: %s: %s\n", what, name);
+}
+
+static uint32_t *vram_at(uint32_t addr) {
+    return (uint32_t *)(vram + (addr - POOL_BASE));
+}
+
+static void vram_move(uint32_t dst, uint32_t src, size_t size) {
+    if(dst >= src)
+        fail("block moved up", "compact");
+
+    memmove(vram_at(dst), vram_at(src), size);
+}
+
+/********************************************************************************/
+/* Traces */
+
+enum { OP_ALLOC, OP_FREE, OP_COMPACT };
+
+typedef struct trace_op {
+    uint8_t op;
+    uint8_t movable;
+    uint64_t id;
+    size_t size;
+} trace_op_t;
+
+typedef struct trace {
+    trace_op_t *ops;
+    size_t count, max;
+} trace_t;
+
+static void trace_add(trace_t *t, int op, int movable, uint64_t id,
+                      size_t size) {
+    if(t->count == t->max) {
+        t->max = t->max ? t->max * 2 : 1024;
+
+        if(!(t->ops = realloc(t->ops, t->max * sizeof(trace_op_t)))) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    t->ops[t->count++] = (trace_op_t) { op, movable, id, size };
+}
+
+/* Read the lines pvr_mem.c prints with PVR_KM_DBG_VERBOSE from a log,
+   skipping everything else in it. */
+static int trace_read(trace_t *t, const char *fn) {
+    char line[256], *p;
+    unsigned long long id;
+    size_t size;
+    FILE *fp;
+
+    if(!(fp = fopen(fn, "r"))) {
+        perror(fn);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        if(strstr(line, "pvr_mem_compact: moved")) {
+            trace_add(t, OP_COMPACT, 0, 0, 0);
+            continue;
+        }
+
+        if(!(p = strstr(line, "Thread ")))
+            continue;
+
+        if(sscanf(p, "Thread %*d/%*x allocated %zu movable bytes at %*x, "
+                  "handle %llx", &size, &id) == 2)
+            trace_add(t, OP_ALLOC, 1, id, size);
+        else if(sscanf(p, "Thread %*d/%*x allocated %zu bytes at %llx",
+                       &size, &id) == 2)
+            trace_add(t, OP_ALLOC, 0, id, size);
+        else if(sscanf(p, "Thread %*d/%*x freeing handle %llx", &id) == 1 ||
+                sscanf(p, "Thread %*d/%*x freeing block @ %llx", &id) == 1)
+            trace_add(t, OP_FREE, 0, id, 0);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/* Write a trace out the way pvr_mem.c would have printed it. */
+static int trace_write(const trace_t *t, const char *fn) {
+    const trace_op_t *op;
+    FILE *fp;
+    size_t i;
+
+    if(!(fp = fopen(fn, "w"))) {
+        perror(fn);
+        return -1;
+    }
+
+    for(i = 0; i < t->count; i++) {
+        op = &t->ops[i];
+
+        if(op->op == OP_COMPACT)
+            fprintf(fp, "pvr_mem_compact: moved 0 bytes\n");
+        else if(op->op == OP_ALLOC && op->movable)
+            fprintf(fp, "Thread 1/8c010000 allocated %zu movable bytes at "
+                    "00000000, handle 0x%llx\n", op->size,
+                    (unsigned long long)op->id);
+        else if(op->op == OP_ALLOC)
+            fprintf(fp, "Thread 1/8c010000 allocated %zu bytes at %08llx\n",
+                    op->size, (unsigned long long)op->id);
+        else
+            fprintf(fp, "Thread 1/8c010000 freeing %s %llx\n",
+                    op->movable ? "handle" : "block @",
+                    (unsigned long long)op->id);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/* Sizes of textures: 16-bit ones from 8x8 to 512x512, more of them small
+   than big, some compressed and some mipmapped. */
+static size_t texture_size(void) {
+    int lw = rand() % 7, lh;
+    size_t size;
+
+    if(rand() % 2)
+        lw = lw < rand() % 7 ? lw : rand() % 7;
+
+    lh = lw + rand() % 3 - 1;
+    lh = lh < 0 ? 0 : lh > 6 ? 6 : lh;
+
+    size = (size_t)(8 << lw) * (8 << lh) * 2;
+
+    switch(rand() % 10) {
+        case 0:
+        case 1:
+        case 2:
+            return 2048 + size / 8;         /* VQ, codebook and indices */
+
+        case 3:
+        case 4:
+            return size + size / 3 + 6;     /* Mipmapped */
+
+        default:
+            return size;
+    }
+}
+
+#define LEVELS          40
+#define LEVEL_OPS       5000
+#define MAX_STREAM      4096
+
+/* A game going through levels. Each one has a few big buffers allocated
+   with pvr_mem_malloc() for as long as it lasts (render targets and such),
+   and streams textures in and out around them through handles, keeping the
+   pool somewhere between 50% and 80% full. A font and some menu graphics
+   stay for the whole time. */
+static void trace_make(trace_t *t) {
+    static struct {
+        uint64_t id;
+        size_t size;
+    } stream[MAX_STREAM];
+    uint64_t next_id = 1, level_ids[4];
+    size_t live = 0, live_bytes = 0, target, size;
+    int level, i, j, n;
+
+    trace_add(t, OP_ALLOC, 0, next_id++, 128 * 1024);
+    trace_add(t, OP_ALLOC, 0, next_id++, 256 * 1024);
+    live_bytes = 384 * 1024;
+
+    for(level = 0; level < LEVELS; level++) {
+        n = 1 + rand() % 4;
+
+        for(i = 0; i < n; i++) {
+            size = (64 << (rand() % 3)) * 1024;
+            level_ids[i] = next_id;
+            trace_add(t, OP_ALLOC, 0, next_id++, size);
+        }
+
+        target = POOL_SIZE / 100 * (50 + rand() % 31);
+
+        for(i = 0; i < LEVEL_OPS; i++) {
+            if(live < MAX_STREAM && live_bytes < target && rand() % 4) {
+                size = texture_size();
+                stream[live].id = next_id;
+                stream[live].size = size;
+                live++;
+                live_bytes += size;
+                trace_add(t, OP_ALLOC, 1, next_id++, size);
+            }
+            else if(live) {
+                j = rand() % live;
+                trace_add(t, OP_FREE, 1, stream[j].id, 0);
+                live_bytes -= stream[j].size;
+                stream[j] = stream[--live];
+            }
+        }
+
+        for(i = 0; i < n; i++)
+            trace_add(t, OP_FREE, 0, level_ids[i], 0);
+    }
+
+    while(live--)
+        trace_add(t, OP_FREE, 1, stream[live].id, 0);
+
+    trace_add(t, OP_FREE, 0, 1, 0);
+    trace_add(t, OP_FREE, 0, 2, 0);
+}
+
+/********************************************************************************/
+/* Checks */
+
+/* Everything the allocator keeps has to agree: the blocks cover the pool
+   with no gaps and no two free blocks next to each other, every free block
+   is on the right list, the map of lists is right, every block from
+   pvr_mem_malloc() can be found in the hash table, and the counts add up. */
+static int check_pool(const char *name) {
+    pvr_mem_block_t *b, *prev = NULL;
+    uint32_t addr = POOL_BASE;
+    size_t used = 0, movable = 0, nblocks = 0, nfree = 0, pinned = 0, n;
+    int c;
+
+    TAILQ_FOREACH(b, &blocks, addr_list) {
+        if(b->addr != addr || !b->size || b->size % PVR_MEM_CORE_UNIT) {
+            fail("blocks don't cover the pool", name);
+            return -1;
+        }
+
+        if(b->flags & PVR_MEM_BLOCK_FREE) {
+            if(prev && (prev->flags & PVR_MEM_BLOCK_FREE)) {
+                fail("free blocks not merged", name);
+                return -1;
+            }
+
+            nfree++;
+        }
+        else {
+            used += b->size;
+            nblocks++;
+
+            if(b->flags & PVR_MEM_BLOCK_MOVABLE) {
+                movable += b->size;
+            }
+            else {
+                pinned++;
+
+                if(pvr_mem_core_find(b->addr) != b) {
+                    fail("block not in the hash table", name);
+                    return -1;
+                }
+            }
+        }
+
+        addr += b->size;
+        prev = b;
+    }
+
+    if(addr != POOL_BASE + POOL_SIZE) {
+        fail("blocks don't reach the end of the pool", name);
+        return -1;
+    }
+
+    for(c = 0, n = 0; c < PVR_MEM_CORE_CLASSES; c++) {
+        LIST_FOREACH(b, &free_lists[c], free_list) {
+            if(!(b->flags & PVR_MEM_BLOCK_FREE) || size_class(b->size) != c) {
+                fail("block on the wrong free list", name);
+                return -1;
+            }
+
+            n++;
+        }
+
+        if(!(free_map & (1u << c)) != LIST_EMPTY(&free_lists[c])) {
+            fail("free list map is wrong", name);
+            return -1;
+        }
+    }
+
+    if(n != nfree || free_count != nfree || hash_count != pinned ||
+       counts.used != used || counts.movable != movable ||
+       counts.blocks != nblocks) {
+        fail("counts don't add up", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+/* Replaying */
+
+#define MAX_LIVE        65536
+#define LIVE_BUCKETS    4096
+
+typedef struct live {
+    uint64_t id;
+    pvr_mem_block_t *blk;
+    size_t size;
+    uint32_t seed;
+    int next;
+} live_t;
+
+static live_t lives[MAX_LIVE];
+static int live_hash[LIVE_BUCKETS], live_free;
+
+static void live_reset(void) {
+    int i;
+
+    for(i = 0; i < LIVE_BUCKETS; i++)
+        live_hash[i] = -1;
+
+    for(i = 0; i < MAX_LIVE; i++)
+        lives[i].next = i + 1 < MAX_LIVE ? i + 1 : -1;
+
+    live_free = 0;
+}
+
+static int *live_find(uint64_t id) {
+    int *p = &live_hash[(id ^ (id >> 12)) & (LIVE_BUCKETS - 1)];
+
+    while(*p >= 0 && lives[*p].id != id)
+        p = &lives[*p].next;
+
+    return p;
+}
+
+/* A word every 256 bytes of each block, and the last one, is written when
+   it's allocated, and checked when it's freed or has been moved. */
+static void stamp(const live_t *l) {
+    uint32_t *p = vram_at(l->blk->addr);
+    size_t i, words = l->size / 4;
+
+    for(i = 0; i < words; i += 64)
+        p[i] = l->seed ^ i;
+
+    if(words)
+        p[words - 1] = ~l->seed;
+}
+
+static int stamped(const live_t *l) {
+    uint32_t *p = vram_at(l->blk->addr);
+    size_t i, words = l->size / 4;
+
+    for(i = 0; i < words; i += 64) {
+        if(p[i] != (l->seed ^ i))
+            return 0;
+    }
+
+    return !words || p[words - 1] == ~l->seed;
+}
+
+static int check_all(const char *name) {
+    int i;
+
+    for(i = 0; i < MAX_LIVE; i++) {
+        if(lives[i].blk && !stamped(&lives[i])) {
+            fail("block lost what was in it", name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#define AS_TRACED       0
+#define ALL_PINNED      1
+#define ALL_MOVABLE     2
+
+static void replay(const char *name, const trace_t *t, int mode,
+                   int compact, bool checking) {
+    const trace_op_t *op;
+    pvr_mem_info_t info;
+    pvr_mem_block_t *blk;
+    size_t i, fails = 0, frag_fails = 0, samples = 0;
+    unsigned long frag_sum = 0;
+    unsigned int frag_max = 0;
+    int movable, *lp, li;
+    uint32_t seed = 1;
+    double start;
+
+    if(pvr_mem_core_init(POOL_BASE, POOL_SIZE) < 0) {
+        fail("couldn't set up the pool", name);
+        return;
+    }
+
+    live_reset();
+    start = now();
+
+    for(i = 0; i < t->count; i++) {
+        op = &t->ops[i];
+
+        if(op->op == OP_ALLOC) {
+            movable = mode == AS_TRACED ? op->movable : mode == ALL_MOVABLE;
+            blk = pvr_mem_core_alloc(op->size, movable);
+
+            if(!blk && compact && op->size <= POOL_SIZE - counts.used) {
+                pvr_mem_core_compact(vram_move);
+
+                if(checking && check_all(name))
+                    return;
+
+                blk = pvr_mem_core_alloc(op->size, movable);
+            }
+
+            if(!blk) {
+                fails++;
+
+                if(op->size <= POOL_SIZE - counts.used) {
+                    frag_fails++;
+
+                    if(compact && mode == ALL_MOVABLE)
+                        fail("no room even after compacting", name);
+                }
+
+                continue;
+            }
+
+            if(checking && (blk->addr % PVR_MEM_CORE_UNIT ||
+                            blk->size < op->size)) {
+                fail("bad block", name);
+                return;
+            }
+
+            lp = live_find(op->id);
+
+            if(*lp >= 0 || live_free < 0) {
+                fail("trace allocated an id twice, or too many at once",
+                     name);
+                return;
+            }
+
+            li = live_free;
+            live_free = lives[li].next;
+            lives[li] = (live_t) { op->id, blk, op->size, seed++, -1 };
+            *lp = li;
+
+            if(checking)
+                stamp(&lives[li]);
+        }
+        else if(op->op == OP_FREE) {
+            /* Frees of blocks that couldn't be allocated are skipped. */
+            lp = live_find(op->id);
+
+            if((li = *lp) < 0)
+                continue;
+
+            if(checking && !stamped(&lives[li])) {
+                fail("block lost what was in it", name);
+                return;
+            }
+
+            pvr_mem_core_free(lives[li].blk);
+            lives[li].blk = NULL;
+            *lp = lives[li].next;
+            lives[li].next = live_free;
+            live_free = li;
+        }
+        else {
+            pvr_mem_core_compact(vram_move);
+
+            if(checking && check_all(name))
+                return;
+        }
+
+        if(checking) {
+            if(check_pool(name))
+                return;
+
+            pvr_mem_core_get_info(&info);
+            frag_sum += info.fragmentation;
+            samples++;
+
+            if(info.fragmentation > frag_max)
+                frag_max = info.fragmentation;
+        }
+    }
+
+    start = now() - start;
+    pvr_mem_core_get_info(&info);
+
+    if(!checking) {
+        printf("    %.0f ns an operation\n", start / t->count * 1e9);
+        return;
+    }
+
+    if(info.used || info.free_blocks != 1 || info.largest_free != POOL_SIZE)
+        fail("pool not back in one piece at the end", name);
+
+    printf("%s:\n", name);
+    printf("    %llu allocations, %zu failed, %zu of them from "
+           "fragmentation\n", (unsigned long long)info.allocs, fails,
+           frag_fails);
+    printf("    peak %zu KiB of %d, fragmentation %lu%% on average, "
+           "%u%% at most\n", info.peak / 1024, POOL_SIZE / 1024,
+           samples ? frag_sum / samples : 0, frag_max);
+    printf("    %llu compactions, %llu KiB moved\n",
+           (unsigned long long)info.compactions,
+           (unsigned long long)info.moved / 1024);
+}
+
+static void run(const char *name, const trace_t *t) {
+    char what[256];
+
+    snprintf(what, sizeof(what), "%s, as traced", name);
+    replay(what, t, AS_TRACED, 0, true);
+    replay(what, t, AS_TRACED, 0, false);
+
+    snprintf(what, sizeof(what), "%s, as traced, compacting", name);
+    replay(what, t, AS_TRACED, 1, true);
+    replay(what, t, AS_TRACED, 1, false);
+
+    snprintf(what, sizeof(what), "%s, all pvr_mem_malloc()", name);
+    replay(what, t, ALL_PINNED, 0, true);
+    replay(what, t, ALL_PINNED, 0, false);
+
+    snprintf(what, sizeof(what), "%s, all handles, compacting", name);
+    replay(what, t, ALL_MOVABLE, 1, true);
+    replay(what, t, ALL_MOVABLE, 1, false);
+}
+
+int main(int argc, char *argv[]) {
+    trace_t t = { 0 };
+    const char *out = NULL;
+    int i = 1;
+
+    if(argc > 2 && !strcmp(argv[1], "-w")) {
+        out = argv[2];
+        i = 3;
+    }
+
+    srand(1234);
+
+    if(i == argc) {
+        trace_make(&t);
+
+        if(out)
+            return trace_write(&t, out) ? 1 : 0;
+
+        run("streaming", &t);
+    }
+
+    for(; i < argc; i++) {
+        t.count = 0;
+
+        if(trace_read(&t, argv[i]))
+            return 1;
+
+        run(argv[i], &t);
+    }
+
+    pvr_mem_core_shutdown();
+    free(t.ops);
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -24,6 +24,12 @@
  */
 
 #include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ELBG_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #include "libavutil/avassert.h"
 #include "libavutil/common.h"
@@ -32,6 +38,23 @@
 
 #define DELTA_ERR_MAX 0.1  ///< Precision of the ELBG algorithm (as percentage error)
 
+/**
+ * Points whose coordinates all lie in [0, PACKED_MAX] are also kept packed
+ * into int16_t vectors padded to a multiple of PACKED_ALIGN elements, which
+ * lets the distances be computed with 16-bit multiply-adds without changing
+ * any of the results. Very short vectors are quicker to handle as they are.
+ */
+#define PACKED_MAX     2047
+#define PACKED_MIN_DIM 8
+#define PACKED_MAX_DIM 256
+#define PACKED_ALIGN   16
+
+/**
+ * Below this many (point, codebook entry) element comparisons a step is not
+ * split between threads, as starting them would cost more than it saves.
+ */
+#define MIN_THREAD_WORK (1 << 18)
+
 /**
  * In the ELBG jargon, a cell is the set of points that are closest to a
  * codebook entry. Not to be confused with a RoQ Video cell. */
@@ -69,6 +92,21 @@ typedef struct ELBGContext {
     unsigned scratchbuf_allocated;
     unsigned cell_buffer_allocated;
     unsigned temp_points_allocated;
+
+    /* Parallel assignment step */
+    int threads;
+    int packed;              ///< Whether the packed vectors below are in use
+    int packed_dim;          ///< dim rounded up to PACKED_ALIGN
+    int16_t *packed_points;
+    int16_t *packed_codebook;
+    int *min_dist;           ///< Distance from each point to the closest entry
+    int *min_idx;            ///< First codebook entry at that distance
+    int *closest;            ///< Closest other entry to each codebook entry
+    unsigned packed_points_allocated;
+    unsigned packed_codebook_allocated;
+    unsigned min_dist_allocated;
+    unsigned min_idx_allocated;
+    unsigned closest_allocated;
 } ELBGContext;
 
 static inline int distance_limited(int *a, int *b, int dim, int limit)
@@ -89,6 +127,188 @@ static inline int distance_limited(int *a, int *b, int dim, int limit)
     return dist > limit ? limit : dist;
 }
 
+static int packed_distance_c(const int16_t *a, const int16_t *b, int dim)
+{
+    int i, dist = 0;
+    for (i = 0; i < dim; i++)
+        dist += (a[i] - b[i]) * (a[i] - b[i]);
+    return dist;
+}
+
+#ifdef ELBG_X86_SIMD
+__attribute__((target("sse2")))
+static int packed_distance_sse2(const int16_t *a, const int16_t *b, int dim)
+{
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < dim; i += 8) {
+        __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)),
+                                  _mm_loadu_si128((const __m128i *)(b + i)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(d, d));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+static int packed_distance_avx2(const int16_t *a, const int16_t *b, int dim)
+{
+    __m256i sum = _mm256_setzero_si256();
+    __m128i half;
+    for (int i = 0; i < dim; i += 16) {
+        __m256i d = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                     _mm256_loadu_si256((const __m256i *)(b + i)));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+    }
+    half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                         _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
+
+static int (*packed_distance)(const int16_t *a, const int16_t *b, int dim);
+
+static void select_packed_distance(void)
+{
+    if (packed_distance)
+        return;
+#ifdef ELBG_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        packed_distance = packed_distance_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        packed_distance = packed_distance_sse2;
+    else
+#endif
+        packed_distance = packed_distance_c;
+}
+
+static void pack_vectors(int16_t *dst, const int *src, int count, int dim,
+                         int packed_dim)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < dim; j++)
+            dst[j] = src[j];
+        for (int j = dim; j < packed_dim; j++)
+            dst[j] = 0;
+        dst += packed_dim;
+        src += dim;
+    }
+}
+
+/**
+ * Distance between point i and codebook entry k, exactly as distance_limited()
+ * without a limit would compute it.
+ */
+static inline int point_distance(ELBGContext *elbg, int i, int k)
+{
+    if (elbg->packed)
+        return packed_distance(elbg->packed_points   + i * elbg->packed_dim,
+                               elbg->packed_codebook + k * elbg->packed_dim,
+                               elbg->packed_dim);
+    return distance_limited(elbg->points   + i * elbg->dim,
+                            elbg->codebook + k * elbg->dim, elbg->dim, INT_MAX);
+}
+
+static inline int codebook_distance(ELBGContext *elbg, int i, int k)
+{
+    if (elbg->packed)
+        return packed_distance(elbg->packed_codebook + i * elbg->packed_dim,
+                               elbg->packed_codebook + k * elbg->packed_dim,
+                               elbg->packed_dim);
+    return distance_limited(elbg->codebook + i * elbg->dim,
+                            elbg->codebook + k * elbg->dim, elbg->dim, INT_MAX);
+}
+
+typedef struct elbg_job {
+    ELBGContext *elbg;
+    void (*func)(ELBGContext *elbg, int start, int end);
+    int start, end;
+} elbg_job;
+
+static void *run_job(void *arg)
+{
+    elbg_job *job = arg;
+    job->func(job->elbg, job->start, job->end);
+    return NULL;
+}
+
+/**
+ * Run func over [0, count), split into contiguous ranges between the
+ * threads. The ranges are independent, so the result doesn't depend on how
+ * many threads there are (or whether any of them could be started at all).
+ */
+static void run_parallel(ELBGContext *elbg, int count, int64_t work,
+                         void (*func)(ELBGContext *elbg, int start, int end))
+{
+    int n = FFMIN(elbg->threads, count);
+    elbg_job jobs[ELBG_MAX_THREADS];
+    pthread_t tids[ELBG_MAX_THREADS];
+    int started[ELBG_MAX_THREADS];
+
+    if (n <= 1 || work < MIN_THREAD_WORK) {
+        func(elbg, 0, count);
+        return;
+    }
+
+    for (int t = 0; t < n; t++) {
+        jobs[t].elbg  = elbg;
+        jobs[t].func  = func;
+        jobs[t].start = (int64_t)count * t / n;
+        jobs[t].end   = (int64_t)count * (t + 1) / n;
+    }
+
+    for (int t = 1; t < n; t++)
+        started[t] = !pthread_create(&tids[t], NULL, run_job, &jobs[t]);
+
+    run_job(&jobs[0]);
+
+    for (int t = 1; t < n; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+        else
+            run_job(&jobs[t]);
+    }
+}
+
+/**
+ * Find the closest codebook entry to each point in [start, end). Ties go to
+ * the lowest index; do_elbg() sorts out the rest.
+ */
+static void find_nearest(ELBGContext *elbg, int start, int end)
+{
+    for (int i = start; i < end; i++) {
+        int best_dist = INT_MAX, best_idx = 0;
+        for (int k = 0; k < elbg->num_cb; k++) {
+            int dist = point_distance(elbg, i, k);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_idx = k;
+            }
+        }
+        elbg->min_dist[i] = best_dist;
+        elbg->min_idx[i]  = best_idx;
+    }
+}
+
+static void find_closest_codebooks(ELBGContext *elbg, int start, int end)
+{
+    for (int index = start; index < end; index++) {
+        int pick = 0;
+        for (int i = 0, diff_min = INT_MAX; i < elbg->num_cb; i++)
+            if (i != index) {
+                int diff = codebook_distance(elbg, i, index);
+                if (diff < diff_min) {
+                    pick = i;
+                    diff_min = diff;
+                }
+            }
+        elbg->closest[index] = pick;
+    }
+}
+
 static inline void vect_division(int *res, int *vect, int div, int dim)
 {
     int i;
@@ -113,21 +333,6 @@ static int eval_error_cell(ELBGContext *elbg, int *centroid, cell *cells)
     return error;
 }
 
-static int get_closest_codebook(ELBGContext *elbg, int index)
-{
-    int pick = 0;
-    for (int i = 0, diff_min = INT_MAX; i < elbg->num_cb; i++)
-        if (i != index) {
-            int diff;
-            diff = distance_limited(elbg->codebook + i*elbg->dim, elbg->codebook + index*elbg->dim, elbg->dim, diff_min);
-            if (diff < diff_min) {
-                pick = i;
-                diff_min = diff;
-            }
-        }
-    return pick;
-}
-
 static int get_high_utility_cell(ELBGContext *elbg)
 {
     int i=0;
@@ -351,13 +556,19 @@ static void do_shiftings(ELBGContext *elbg)
 
     evaluate_utility_inc(elbg);
 
+    /* The codebook doesn't change until all of the shifts are done, so the
+       closest entry to each one can be worked out up front, in parallel. */
+    run_parallel(elbg, elbg->num_cb,
+                 (int64_t)elbg->num_cb * elbg->num_cb * elbg->dim,
+                 find_closest_codebooks);
+
     for (idx[0]=0; idx[0] < elbg->num_cb; idx[0]++)
         if (elbg->num_cb * (int64_t)elbg->utility[idx[0]] < elbg->error) {
             if (elbg->utility_inc[elbg->num_cb - 1] == 0)
                 return;
 
             idx[1] = get_high_utility_cell(elbg);
-            idx[2] = get_closest_codebook(elbg, idx[0]);
+            idx[2] = elbg->closest[idx[0]];
 
             if (idx[1] != idx[0] && idx[1] != idx[2])
                 try_shift_candidate(elbg, idx);
@@ -375,6 +586,10 @@ static void do_elbg(ELBGContext *av_restrict elbg, int *points, int numpoints,
     elbg->error = INT_MAX;
     elbg->points = points;
 
+    if (elbg->packed)
+        pack_vectors(elbg->packed_points, points, numpoints, elbg->dim,
+                     elbg->packed_dim);
+
     do {
         cell *free_cells = elbg->cell_buffer;
         last_error = elbg->error;
@@ -384,21 +599,24 @@ static void do_elbg(ELBGContext *av_restrict elbg, int *points, int numpoints,
 
         elbg->error = 0;
 
-        /* This loop evaluate the actual Voronoi partition. It is the most
-           costly part of the algorithm. */
+        if (elbg->packed)
+            pack_vectors(elbg->packed_codebook, elbg->codebook, elbg->num_cb,
+                         elbg->dim, elbg->packed_dim);
+
+        /* This evaluates the actual Voronoi partition. It is the most costly
+           part of the algorithm, so the search is done in parallel. */
+        run_parallel(elbg, numpoints,
+                     (int64_t)numpoints * elbg->num_cb * elbg->dim,
+                     find_nearest);
+
         for (i=0; i < numpoints; i++) {
-            int best_dist = distance_limited(elbg->points   + i * elbg->dim,
-                                             elbg->codebook + best_idx * elbg->dim,
-                                             elbg->dim, INT_MAX);
-            for (int k = 0; k < elbg->num_cb; k++) {
-                int dist = distance_limited(elbg->points   + i * elbg->dim,
-                                            elbg->codebook + k * elbg->dim,
-                                            elbg->dim, best_dist);
-                if (dist < best_dist) {
-                    best_dist = dist;
-                    best_idx = k;
-                }
-            }
+            /* A point that is as close to the entry picked for the previous
+               point as it is to anything else stays with that entry, which is
+               what a sequential search starting from there would do. */
+            int best_dist = elbg->min_dist[i];
+            if (elbg->min_idx[i] != best_idx &&
+                point_distance(elbg, i, best_idx) != best_dist)
+                best_idx = elbg->min_idx[i];
             elbg->nearest_cb[i] = best_idx;
             elbg->error = (elbg->error >= INT_MAX - best_dist) ? INT_MAX : elbg->error + best_dist;
             elbg->utility[elbg->nearest_cb[i]] = (elbg->utility[elbg->nearest_cb[i]] >= INT_MAX - best_dist) ?
@@ -477,6 +695,15 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     elbg->codebook   = codebook;
     elbg->num_cb     = num_cb;
     elbg->dim        = dim;
+    elbg->packed     = dim >= PACKED_MIN_DIM && dim <= PACKED_MAX_DIM;
+    elbg->packed_dim = FFALIGN(dim, PACKED_ALIGN);
+
+    for (int64_t i = 0; i < (int64_t)numpoints * dim && elbg->packed; i++)
+        if (points[i] < 0 || points[i] > PACKED_MAX)
+            elbg->packed = 0;
+
+    if (elbg->packed)
+        select_packed_distance();
 
 #define ALLOCATE_IF_NECESSARY(field, new_elements, multiplicator)            \
     if (elbg->field ## _allocated < new_elements) {                          \
@@ -499,6 +726,13 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     ALLOCATE_IF_NECESSARY(size_part,   num_cb,    1)
     ALLOCATE_IF_NECESSARY(cell_buffer, numpoints, 1)
     ALLOCATE_IF_NECESSARY(scratchbuf,  dim,       5)
+    ALLOCATE_IF_NECESSARY(min_dist,    numpoints, 1)
+    ALLOCATE_IF_NECESSARY(min_idx,     numpoints, 1)
+    ALLOCATE_IF_NECESSARY(closest,     num_cb,    1)
+    if (elbg->packed) {
+        ALLOCATE_IF_NECESSARY(packed_points,   numpoints, elbg->packed_dim)
+        ALLOCATE_IF_NECESSARY(packed_codebook, num_cb,    elbg->packed_dim)
+    }
     if (numpoints > 24LL * elbg->num_cb) {
         /* The first step in the recursion in init_elbg() needs a buffer with
         * (numpoints / 8) * dim elements; the next step needs numpoints / 8 / 8
@@ -515,6 +749,18 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     return 0;
 }
 
+int avpriv_elbg_set_threads(ELBGContext **elbgp, int threads)
+{
+    ELBGContext *const elbg = *elbgp ? *elbgp : av_mallocz(sizeof(*elbg));
+
+    if (!elbg)
+        return AVERROR(ENOMEM);
+    *elbgp = elbg;
+
+    elbg->threads = av_clip(threads, 1, ELBG_MAX_THREADS);
+    return 0;
+}
+
 av_cold void avpriv_elbg_free(ELBGContext **elbgp)
 {
     ELBGContext *elbg = *elbgp;
@@ -528,6 +774,11 @@ av_cold void avpriv_elbg_free(ELBGContext **elbgp)
     av_freep(&elbg->utility_inc);
     av_freep(&elbg->scratchbuf);
     av_freep(&elbg->temp_points);
+    av_freep(&elbg->packed_points);
+    av_freep(&elbg->packed_codebook);
+    av_freep(&elbg->min_dist);
+    av_freep(&elbg->min_idx);
+    av_freep(&elbg->closest);
 
     av_freep(elbgp);
 }
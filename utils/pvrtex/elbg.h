@@ -28,6 +28,11 @@
 
 struct ELBGContext;
 
+/**
+ * Upper limit for avpriv_elbg_set_threads().
+ */
+#define ELBG_MAX_THREADS 64
+
 /**
  * Implementation of the Enhanced LBG Algorithm
  * Based on the paper "Neural Networks 14:1219-1237" that can be found in
@@ -51,6 +56,17 @@ int avpriv_elbg_do(struct ELBGContext **ctx, int *points, int dim,
                    int numpoints, int *codebook, int num_cb, int num_steps,
                    int *closest_cb, AVLFG *rand_state, uintptr_t flags);
 
+/**
+ * Set the number of threads avpriv_elbg_do() may use. The codebook that
+ * comes out is the same for any number of threads.
+ *
+ * @param ctx  A pointer to a pointer to an already allocated ELBGContext
+ *             or a pointer to NULL, as for avpriv_elbg_do().
+ * @param threads Number of threads, clipped to [1, ELBG_MAX_THREADS].
+ * @return < 0 in case of error, 0 otherwise
+ */
+int avpriv_elbg_set_threads(struct ELBGContext **ctx, int threads);
+
 /**
  * Free an ELBGContext and reset the pointer to it.
  */
@@ -1,4 +1,4 @@
-#define PVRTEX_VERSION	"2.00"
+#define PVRTEX_VERSION	"2.01"
 
 #include <stdio.h>
 #include <stddef.h>
@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <unistd.h>
 
 #include "stb_image_write.h"
 #include "pvr_texture_encoder.h"
@@ -14,6 +15,7 @@
 #include "mycommon.h"
 #include "file_pvr.h"
 #include "file_tex.h"
+#include "vqcompress.h"
 
 extern int LoadPalette(const char *fname, PvrTexEncoder *pte);
 
@@ -169,11 +171,22 @@ int GetOptMap(const OptionMap *map, size_t mapsize, const char *name, int defaul
 	return default_value;
 }
 
-int main(int argc, char **argv) {
-	program_name = (char*)basename(argv[0]);
+#define MAX_FNAMES	11
+#define MAX_BATCH_ARGS	64
 
+//Everything needed to produce one texture
+typedef struct {
 	PvrTexEncoder pte;
-	pteInit(&pte);
+	const char *fnames[MAX_FNAMES];
+	unsigned fname_cnt;
+	const char *outname;
+	const char *prevname;
+	const char *palfile;
+	const char *batchname;
+} Job;
+
+static void ParseOptions(Job *job, int argc, char **argv) {
+	PvrTexEncoder *pte = &job->pte;
 
 	struct optparse_long longopts[] = {
 		{"help", 'h', OPTPARSE_NONE},
@@ -203,16 +216,11 @@ int main(int argc, char **argv) {
 		{"normal-style", 1, OPTPARSE_REQUIRED},
 		{"flip-v", 2, OPTPARSE_NONE},
 		{"flip-y", 2, OPTPARSE_NONE},
+		{"threads", 3, OPTPARSE_REQUIRED},
+		{"batch", 4, OPTPARSE_REQUIRED},
 		{0}
 	};
 
-	#define MAX_FNAMES	11
-	const char *fnames[MAX_FNAMES];
-	unsigned fname_cnt = 0;
-	const char *outname = "";
-	const char *prevname = "";
-	const char *palfile = NULL;
-
 	//Parse command line parameters
 	struct optparse options;
 	int option;
@@ -221,58 +229,56 @@ int main(int argc, char **argv) {
 		switch(option) {
 		case 'h':
 			printf("%.*s", options_txt_size, options_txt_data);
-			return 0;
-			break;
+			exit(0);
 		case 'E':
 			printf("%.*s", examples_txt_size, examples_txt_data);
-			return 0;
-			break;
+			exit(0);
 		case 'i':
-			ErrorExitOn(fname_cnt >= MAX_FNAMES, "Too many input files have been specified\n");
-			fnames[fname_cnt++] = options.optarg;
+			ErrorExitOn(job->fname_cnt >= MAX_FNAMES, "Too many input files have been specified\n");
+			job->fnames[job->fname_cnt++] = options.optarg;
 			break;
 		case 'o':
-			outname = options.optarg;
+			job->outname = options.optarg;
 			break;
 		case 'f':
-			pte.pixel_format = GetOptMap(supported_pixel_formats, ARR_SIZE(supported_pixel_formats), options.optarg, -1, "invalid pixel format\n");
+			pte->pixel_format = GetOptMap(supported_pixel_formats, ARR_SIZE(supported_pixel_formats), options.optarg, -1, "invalid pixel format\n");
 			break;
 		case 'g':
-			if (sscanf(options.optarg, "%f", &pte.rgb_gamma) != 1)
+			if (sscanf(options.optarg, "%f", &pte->rgb_gamma) != 1)
 				ErrorExit("invalid gamma\n");
 			break;
 		case 'G':
-			if (sscanf(options.optarg, "%f", &pte.alpha_gamma) != 1)
+			if (sscanf(options.optarg, "%f", &pte->alpha_gamma) != 1)
 				ErrorExit("invalid alpha gamma\n");
 			break;
 		case 'r':
 			OPTARG_FIX_UP;
-			pte.resize = PTE_FIX_NEAREST;
+			pte->resize = PTE_FIX_NEAREST;
 			if (options.optarg) {
-				pte.resize = GetOptMap(resize_options, ARR_SIZE(resize_options), options.optarg, PTE_FIX_UP, "invalid resize value\n");
+				pte->resize = GetOptMap(resize_options, ARR_SIZE(resize_options), options.optarg, PTE_FIX_UP, "invalid resize value\n");
 			}
 			break;
 		case 'R':
 			OPTARG_FIX_UP;
-			pte.mipresize = PTE_FIX_MIP_NARROW_X2;
+			pte->mipresize = PTE_FIX_MIP_NARROW_X2;
 			if (options.optarg) {
-				pte.mipresize = GetOptMap(mip_resize_options, ARR_SIZE(mip_resize_options), options.optarg, PTE_FIX_MIP_NARROW_X2, "invalid mip resize value\n");
+				pte->mipresize = GetOptMap(mip_resize_options, ARR_SIZE(mip_resize_options), options.optarg, PTE_FIX_MIP_NARROW_X2, "invalid mip resize value\n");
 			}
 			break;
 		case 'p':
-			prevname = options.optarg;
+			job->prevname = options.optarg;
 			break;
 		case 'S':
-			pte.mip_shift_correction = false;
+			pte->mip_shift_correction = false;
 			break;
 		case 's':
-			pte.stride = true;
+			pte->stride = true;
 			break;
 		case 'e':
-			pte.edge_method = GetOptMap(edge_options, ARR_SIZE(edge_options), options.optarg, -0, "invalid edge handling method\n");
+			pte->edge_method = GetOptMap(edge_options, ARR_SIZE(edge_options), options.optarg, -0, "invalid edge handling method\n");
 			break;
 		case 'H':
-			if (sscanf(options.optarg, "%u", &pte.high_weight_mips) != 1) {
+			if (sscanf(options.optarg, "%u", &pte->high_weight_mips) != 1) {
 				ErrorExit("invalid high weight parameter, must be an integer between 1 and the number of mipmap levels\n");
 			}
 			break;
@@ -288,15 +294,15 @@ int main(int argc, char **argv) {
 			//Fallthrough
 		case 'V':
 			printf("pvrtex - Dreamcast Texture Encoder - Version "PVRTEX_VERSION"\n");
-			return 0;
+			exit(0);
 		case 'b':
 			pteLog(LOG_WARNING, "Option --bilinear does nothing\n");
 			break;
 		case 'd': {
 			OPTARG_FIX_UP;
-			pte.dither = 1.0f;
+			pte->dither = 1.0f;
 			if (options.optarg) {
-				if ((sscanf(options.optarg, "%f", &pte.dither) != 1) || (pte.dither < 0) || (pte.dither > 1))  {
+				if ((sscanf(options.optarg, "%f", &pte->dither) != 1) || (pte->dither < 0) || (pte->dither > 1))  {
 					ErrorExit("invalid dither amount parameter, should be in the range [0, 1]\n");
 				}
 			}
@@ -306,20 +312,20 @@ int main(int argc, char **argv) {
 			unsigned cbsize = 256;
 			if (options.optarg) {
 				if (!strcasecmp(options.optarg, "small") || !strcasecmp(options.optarg, "sm")) {
-					pte.auto_small_vq = true;
+					pte->auto_small_vq = true;
 				} else if ((sscanf(options.optarg, "%u", &cbsize) != 1) || (cbsize <= 0) || (cbsize > 256))  {
 					ErrorExit("invalid compression parameter (%s)\n", options.optarg);
 				}
 			}
-			pteSetCompressed(&pte, cbsize);
+			pteSetCompressed(pte, cbsize);
 			} break;
 		case 'm':
 			OPTARG_FIX_UP;
 
-			pte.want_mips = PTE_MIP_QUALITY;
+			pte->want_mips = PTE_MIP_QUALITY;
 			if (options.optarg) {
 				if (!strcasecmp(options.optarg, "fast"))
-					pte.want_mips = PTE_MIP_FAST;
+					pte->want_mips = PTE_MIP_FAST;
 				else if (!strcasecmp(options.optarg, "quality"))
 					;	//default
 				else
@@ -328,31 +334,47 @@ int main(int argc, char **argv) {
 			break;
 		case 'M':
 			OPTARG_FIX_UP;
-			pte.perfect_mips = 3;
+			pte->perfect_mips = 3;
 			if (options.optarg) {
-				if (sscanf(options.optarg, "%u", &pte.perfect_mips) != 1)  {
+				if (sscanf(options.optarg, "%u", &pte->perfect_mips) != 1)  {
 					ErrorExit("bad perfect mip value\n");
 				}
 			}
 			break;
 		case 'C':
-			if ((sscanf(options.optarg, "%u", &pte.palette_size) != 1) || (pte.palette_size <= 1) || (pte.palette_size > 256))  {
+			if ((sscanf(options.optarg, "%u", &pte->palette_size) != 1) || (pte->palette_size <= 1) || (pte->palette_size > 256))  {
 					ErrorExit("invalid max palette size parameter (should be [1, 16] for 4bpp, or [1, 256] for 8bpp)\n");
 				}
 			break;
 		case 'P':
-			palfile = options.optarg;
+			job->palfile = options.optarg;
 			break;
 		case 1:
-			pte.normal_style = GetOptMap(normal_style_options, ARR_SIZE(normal_style_options), options.optarg, -0, "invalid normal style method\n");
+			pte->normal_style = GetOptMap(normal_style_options, ARR_SIZE(normal_style_options), options.optarg, -0, "invalid normal style method\n");
 			break;
 		case 2:
-			pte.flip_v = true;
+			pte->flip_v = true;
+			break;
+		case 3:
+			if ((sscanf(options.optarg, "%u", &pte->threads) != 1) || (pte->threads > VQC_MAX_THREADS))
+				ErrorExit("invalid thread count (should be [0, %u], 0 for one per CPU)\n", VQC_MAX_THREADS);
+			if (pte->threads == 0)
+				pte->threads = CLAMP(1, sysconf(_SC_NPROCESSORS_ONLN), VQC_MAX_THREADS);
+			break;
+		case 4:
+			job->batchname = options.optarg;
 			break;
 		default:
 			ErrorExit("%s\n", options.errmsg);
 		}
 	}
+}
+
+static void RunJob(Job *job) {
+	PvrTexEncoder *pte = &job->pte;
+	const char *outname = job->outname;
+	const char *prevname = job->prevname;
+	const char *palfile = job->palfile;
 
 	bool have_output = strlen(outname) > 0;
 	bool have_preview = strlen(prevname) > 0;
@@ -375,42 +397,42 @@ int main(int argc, char **argv) {
 	}
 
 	ErrorExitOn(!have_output && !have_preview, "No output or preview file name specified, nothing to do\n");
-	ErrorExitOn(fname_cnt == 0, "No input files specified\n");
+	ErrorExitOn(job->fname_cnt == 0, "No input files specified\n");
 
 	pteLog(LOG_PROGRESS, "Reading input...\n");
-	pteLoadFromFiles(&pte, fnames, fname_cnt);
+	pteLoadFromFiles(pte, job->fnames, job->fname_cnt);
 
 	//Check and fix up image size
-	pteSetSize(&pte);
+	pteSetSize(pte);
 
-	if (pte.pixel_format == PTE_AUTO || pte.pixel_format == PTE_AUTO_YUV)
-		pteAutoSelectPixelFormat(&pte);
+	if (pte->pixel_format == PTE_AUTO || pte->pixel_format == PTE_AUTO_YUV)
+		pteAutoSelectPixelFormat(pte);
 
 	//Fix some stuff up for .PVR files
 	if (output_file_type == EXT_PVR) {
-		if (pteIsCompressed(&pte)) {
+		if (pteIsCompressed(pte)) {
 			//.PVR seems to require square textures if compressed
-			pteMakeSquare(&pte);
+			pteMakeSquare(pte);
 
-			if (pte.auto_small_vq == true) {
+			if (pte->auto_small_vq == true) {
 				//For other sizes, we make a full size codebook texture, but don't use all the entries
-				pte.codebook_size = fPvrSmallVQCodebookSize(pte.w, pte.want_mips);
-				if (pte.w != pte.h) {
+				pte->codebook_size = fPvrSmallVQCodebookSize(pte->w, pte->want_mips);
+				if (pte->w != pte->h) {
 					pteLog(LOG_WARNING, ".PVR file does not support small VQ with non-square textures, using full size codebook\n");
-					pte.auto_small_vq = false;
-				} else if (pte.codebook_size < 256) {
-					pteLog(LOG_INFO, "Making small codebook .PVR VQ is CB size of %u\n", pte.codebook_size);
+					pte->auto_small_vq = false;
+				} else if (pte->codebook_size < 256) {
+					pteLog(LOG_INFO, "Making small codebook .PVR VQ is CB size of %u\n", pte->codebook_size);
 
 				} else {
 					pteLog(LOG_WARNING, ".PVR file does not support small VQ with current size/mipmap combination, using full size codebook\n");
-					pte.auto_small_vq = false;
+					pte->auto_small_vq = false;
 				}
 			}
 		}
 	}
 
 	if (output_file_type == EXT_DT) {
-		if (pte.auto_small_vq) {
+		if (pte->auto_small_vq) {
 			//8x8 no mips has 10 entries, 128x128 with mips has 192 entires
 			//Pick something in between
 			float small_uncomp = CalcTextureSize(8, 8, PT_ARGB1555, 0, 0, 0);
@@ -418,8 +440,8 @@ int main(int argc, char **argv) {
 			unsigned small_cbsize = 10;
 			unsigned large_cbsize = 192;
 
-			unsigned idxsize = CalcTextureSize(pte.w, pte.h, PT_ARGB1555, pteHasMips(&pte), 1, 0);
-			float uncompsize = CalcTextureSize(pte.w, pte.h, PT_ARGB1555, pteHasMips(&pte), 0, 0);
+			unsigned idxsize = CalcTextureSize(pte->w, pte->h, PT_ARGB1555, pteHasMips(pte), 1, 0);
+			float uncompsize = CalcTextureSize(pte->w, pte->h, PT_ARGB1555, pteHasMips(pte), 0, 0);
 
 			float ratio = (uncompsize - small_uncomp) / (large_uncomp - small_uncomp);
 			unsigned cbsize = lerp(ratio, small_cbsize, large_cbsize);
@@ -431,19 +453,19 @@ int main(int argc, char **argv) {
 			unsigned extraroom = roundupsize - size;
 			pteLog(LOG_DEBUG, "Idx %u, CBsize %u, Extra %u\n", idxsize, cbsize, extraroom);
 
-			pte.codebook_size = CLAMP(8, cbsize + extraroom/8, 256);
+			pte->codebook_size = CLAMP(8, cbsize + extraroom/8, 256);
 		}
 
 		//.DT supports codebook offsets for true reduced codebooks
-		pte.pvr_idx_offset = PVR_FULL_CODEBOOK - pte.codebook_size;
+		pte->pvr_idx_offset = PVR_FULL_CODEBOOK - pte->codebook_size;
 	}
 
 	//If no edge method is specified, use clamp if no using mipmaps, or wrap if we are
-	if (pte.edge_method == 0) {
-		if (pte.want_mips)
-			pte.edge_method = STBIR_EDGE_WRAP;
+	if (pte->edge_method == 0) {
+		if (pte->want_mips)
+			pte->edge_method = STBIR_EDGE_WRAP;
 		else
-			pte.edge_method = STBIR_EDGE_CLAMP;
+			pte->edge_method = STBIR_EDGE_CLAMP;
 	}
 
 	//Load external palette if one exists
@@ -451,27 +473,27 @@ int main(int argc, char **argv) {
 		const char *pal_ext = strrchr(palfile, '.');
 		if (pal_ext)
 			already_have_pal_file = strcasecmp(pal_ext, ".pal") == 0;
-		LoadPalette(palfile, &pte);
+		LoadPalette(palfile, pte);
 	}
 
-	pteEncodeTexture(&pte);
+	pteEncodeTexture(pte);
 
 	//Make preview
 	if (have_preview) {
 		const char *prevextension = strrchr(prevname, '.');
 		if (prevextension != NULL) {
 			pteLog(LOG_PROGRESS, "Writing preview to \"%s\"...\n", prevname);
-			pteGeneratePreviews(&pte);
+			pteGeneratePreviews(pte);
 
 			//Write preview image to file
 			if (strcasecmp(prevextension, ".png") == 0)
-				stbi_write_png(prevname, pte.final_preview_w, pte.h, 4, pte.final_preview, 0);
+				stbi_write_png(prevname, pte->final_preview_w, pte->h, 4, pte->final_preview, 0);
 			else if (strcasecmp(prevextension, ".jpg") == 0 || strcasecmp(prevextension, ".jpeg") == 0)
-				stbi_write_jpg(prevname, pte.final_preview_w, pte.h, 4, pte.final_preview, 95);
+				stbi_write_jpg(prevname, pte->final_preview_w, pte->h, 4, pte->final_preview, 95);
 			else if (strcasecmp(prevextension, ".bmp") == 0)
-				stbi_write_bmp(prevname, pte.final_preview_w, pte.h, 4, pte.final_preview);
+				stbi_write_bmp(prevname, pte->final_preview_w, pte->h, 4, pte->final_preview);
 			else if (strcasecmp(prevextension, ".tga") == 0)
-				stbi_write_tga(prevname, pte.final_preview_w, pte.h, 4, pte.final_preview);
+				stbi_write_tga(prevname, pte->final_preview_w, pte->h, 4, pte->final_preview);
 			else
 				pteLog(LOG_WARNING, "Skipping preview creation because of unknown file type (%s). Supported types are PNG, JPG, BMP, and TGA.\n", prevextension);
 		} else {
@@ -482,23 +504,23 @@ int main(int argc, char **argv) {
 	//Write resulting texture
 	if (have_output) {
 		if (only_want_pal) {
-			fTexWritePalette(&pte, outname);
+			fTexWritePalette(pte, outname);
 		} else if (output_file_type == EXT_PVR) {
 			pteLog(LOG_COMPLETION, "Writing .PVR to \"%s\"...\n", outname);
-			fPvrWrite(&pte, outname);
+			fPvrWrite(pte, outname);
 		} else if (output_file_type == EXT_TEX) {
 			pteLog(LOG_COMPLETION, "Writing texconv .TEX to \"%s\"...\n", outname);
-			fTexWrite(&pte, outname);
+			fTexWrite(pte, outname);
 
-			if (!already_have_pal_file && pteIsPalettized(&pte))
-				fTexWritePaletteAppendPal(&pte, outname);
+			if (!already_have_pal_file && pteIsPalettized(pte))
+				fTexWritePaletteAppendPal(pte, outname);
 		} else if (output_file_type == EXT_DT) {
 			pteLog(LOG_COMPLETION, "Writing .DT to \"%s\"...\n", outname);
 			void fDtWrite(const PvrTexEncoder *pte, const char *outfname);
-			fDtWrite(&pte, outname);
+			fDtWrite(pte, outname);
 
-			if (!already_have_pal_file && pteIsPalettized(&pte))
-				fTexWritePaletteAppendPal(&pte, outname);
+			if (!already_have_pal_file && pteIsPalettized(pte))
+				fTexWritePaletteAppendPal(pte, outname);
 		} else {
 			ErrorExit("Unsupported output file type for \"%s\"\n", outname);
 		}
@@ -506,7 +528,97 @@ int main(int argc, char **argv) {
 		pteLog(LOG_COMPLETION, "No output file specified\n");
 	}
 
-	pteFree(&pte);
+	pteFree(pte);
+}
+
+//Split a line from a batch file into arguments, in place. Arguments are separated by
+//whitespace, and can be quoted with ' or ". A # at the start of an argument starts a comment.
+static int SplitArgs(char *line, char **args, int max_args, unsigned lineno) {
+	int cnt = 0;
+	char *src = line, *dst = line;
+
+	for(;;) {
+		while (isspace((unsigned char)*src))
+			src++;
+		if (*src == '\0' || *src == '#')
+			break;
+
+		ErrorExitOn(cnt >= max_args, "Too many arguments on line %u of batch file\n", lineno);
+		args[cnt++] = dst;
+
+		char quote = 0;
+		while (*src && (quote || !isspace((unsigned char)*src))) {
+			if (quote && *src == quote) {
+				quote = 0;
+				src++;
+			} else if (!quote && (*src == '"' || *src == '\'')) {
+				quote = *src++;
+			} else {
+				*dst++ = *src++;
+			}
+		}
+		ErrorExitOn(quote, "Unterminated quote on line %u of batch file\n", lineno);
+
+		if (*src)
+			src++;
+		*dst++ = '\0';
+	}
+	return cnt;
+}
+
+//Convert one texture for each line of a batch file. Each line has the same options
+//as the command line, and options given along with --batch apply to every line.
+static void RunBatch(const Job *defaults, const char *fname) {
+	FILE *f = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	ErrorExitOn(f == NULL, "Could not open batch file \"%s\"\n", fname);
+
+	char line[4096];
+	unsigned lineno = 0, converted = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		ErrorExitOn(strchr(line, '\n') == NULL && !feof(f), "Line %u of batch file is too long\n", lineno);
+
+		char *args[MAX_BATCH_ARGS + 2];
+		int argc = SplitArgs(line, args + 1, MAX_BATCH_ARGS, lineno);
+		if (argc == 0)
+			continue;
+		args[0] = (char*)program_name;
+		args[argc + 1] = NULL;
+
+		Job job = *defaults;
+		job.batchname = NULL;
+		int saved_log_level = log_level;
+
+		ParseOptions(&job, argc + 1, args);
+		ErrorExitOn(job.batchname != NULL, "--batch can't be used inside a batch file (line %u)\n", lineno);
+
+		pteLog(LOG_PROGRESS, "Batch line %u...\n", lineno);
+		RunJob(&job);
+
+		log_level = saved_log_level;
+		converted++;
+	}
+
+	if (f != stdin)
+		fclose(f);
+	pteLog(LOG_COMPLETION, "Converted %u textures from batch file\n", converted);
+}
+
+int main(int argc, char **argv) {
+	program_name = (char*)basename(argv[0]);
+
+	Job job = {
+		.outname = "",
+		.prevname = "",
+	};
+	pteInit(&job.pte);
+
+	ParseOptions(&job, argc, argv);
+
+	if (job.batchname)
+		RunBatch(&job, job.batchname);
+	else
+		RunJob(&job);
 
 	return 0;
 }
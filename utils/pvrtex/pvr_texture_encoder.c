@@ -370,6 +370,7 @@ void pteGeneratePalette(PvrTexEncoder *pte) {
 	VQCompressor vqc;
 	vqcInit(&vqc, VQC_UINT8, 4, 1, pte->palette_size);
 	vqcSetRGBAGamma(&vqc, pte->rgb_gamma, pte->alpha_gamma);
+	vqcSetThreads(&vqc, pte->threads);
 
 	//Add mipmaps to compressor input
 	FOR_EACH_MIP(pte, i) {
@@ -486,6 +487,7 @@ void pteCompress(PvrTexEncoder *pte) {
 	VQCompressor vqc;
 	vqcInit(&vqc, VQC_UINT8, 4, vectorarea, cbsize);
 	vqcSetRGBAGamma(&vqc, pte->rgb_gamma, pte->alpha_gamma);
+	vqcSetThreads(&vqc, pte->threads);
 
 	//Add uncompressed data
 	const unsigned perfect_mip_pixels = perfect_mip_idx * vectorarea;
@@ -107,6 +107,10 @@ typedef struct PvrTexEncoder {
 	//the top left.
 	bool flip_v;
 
+	//Number of threads to use for VQ codebook and palette generation. 0 or 1 for
+	//none. The output does not depend on this.
+	unsigned threads;
+
 	//Unprocessed source images specified by user
 	unsigned src_img_cnt;
 	pteImage src_imgs[PVR_MAX_MIPMAPS];
@@ -9,7 +9,7 @@ _pvrtex_completions()
 	_init_completion || return
 	
 	case $prev in
-		--help|--version|--no-mip-shift|--max-color|--perfect-mip|--high-weight|--dither|--stride|--bilinear|--nearest|\
+		--help|--version|--no-mip-shift|--max-color|--perfect-mip|--high-weight|--dither|--stride|--bilinear|--nearest|--threads|\
 		-!(-*)[hvCSMHdsbn])
 			return
 			;;
@@ -25,6 +25,10 @@ _pvrtex_completions()
 			_filedir "@(dt|tex|pvr)"
 			return
 			;;
+		--batch)
+			_filedir
+			return
+			;;
 		-p|--preview)
 			_filedir "@(png|jpg|bmp|tga)"
 			return
@@ -56,7 +60,7 @@ _pvrtex_completions()
 		*)
 			
 			#This is the suggestion if not suggesting for one of the above. It suggests supported options.
-			COMPREPLY=($(compgen -W "--in --out --preview --format --compress --mipmap --perfect-mip --max-color --no-mip-shift --high-weight --high-weight --dither --stride --resize --mip-resize --edge --bilinear --nearest --normal-style --flip-v" -- "$cur"))
+			COMPREPLY=($(compgen -W "--in --out --preview --format --compress --mipmap --perfect-mip --max-color --no-mip-shift --high-weight --high-weight --dither --stride --resize --mip-resize --edge --bilinear --nearest --normal-style --flip-v --threads --batch" -- "$cur"))
 			return
 			;;
 		
@@ -110,6 +110,11 @@ void vqcSetARGBGamma(VQCompressor *c, float rgb, float alpha) {
 	}
 }
 
+void vqcSetThreads(VQCompressor *c, unsigned threads) {
+	assert(c);
+	c->threads = threads;
+}
+
 vqcResults vqcCompress(VQCompressor *c, int quality) {
 	assert(c);
 	assert(c->cb_size);
@@ -129,7 +134,12 @@ vqcResults vqcCompress(VQCompressor *c, int quality) {
 	struct ELBGContext *elbgcxt = 0;
 	struct AVLFG randcxt;
 	av_lfg_init(&randcxt, 1);
-	int errval = avpriv_elbg_do(&elbgcxt, c->data, c->dimensions, c->point_cnt, int_codebook, c->cb_size, quality, result.indices, &randcxt, 0);
+	int errval = 0;
+	//Results are the same for any number of threads
+	if (c->threads > 1)
+		errval = avpriv_elbg_set_threads(&elbgcxt, c->threads);
+	assert(errval == 0);
+	errval = avpriv_elbg_do(&elbgcxt, c->data, c->dimensions, c->point_cnt, int_codebook, c->cb_size, quality, result.indices, &randcxt, 0);
 	assert(errval == 0);
 	avpriv_elbg_free(&elbgcxt);
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #define VQC_MAX_CHANNELS	4
+#define VQC_MAX_THREADS	64	//Same as ELBG_MAX_THREADS
 
 typedef enum {
 	VQC_UINT8,
@@ -18,6 +19,8 @@ typedef struct {
 	//channels can have different gammas (alpha could be 1.0, while RGB could be 2.2)
 	float gamma[VQC_MAX_CHANNELS];
 
+	unsigned threads;	//number of threads to train the codebook with, 0 or 1 for none
+
 	size_t data_space;
 	int *data;	//data to compress
 } VQCompressor;
@@ -33,6 +36,7 @@ void vqcAddPoints(VQCompressor *c, const void *src, size_t pixel_cnt);
 void vqcSetChannelGamma(VQCompressor *c, unsigned channel, float val);
 void vqcSetRGBAGamma(VQCompressor *c, float rgb, float alpha);
 void vqcSetARGBGamma(VQCompressor *c, float rgb, float alpha);
+void vqcSetThreads(VQCompressor *c, unsigned threads);
 vqcResults vqcCompress(VQCompressor *c, int quality);
 
 
@@ -0,0 +1,427 @@
+/* KallistiOS ##version##
+
+   ramdisktest.c
+
+   Test and time the ramdisk filesystem. The real fs_ramdisk.c is built into
+   this program so that it can be tested on a PC, with its mutexes made from
+   pthreads ones so that several threads can use it at once.
+
+   A big file is written a bit at a time and read back in pieces from all
+   over the place, checking the data each time. Then the things extents are
+   supposed to guarantee are checked: a pointer from mmap() has to stay put
+   and keep its data as the file grows, and a block attached to the ramdisk
+   has to come back out of it as the same block. Last of all, some files are
+   read by several threads at once, both each thread with a file of its own
+   and all of them reading the same file. The time taken for each part is
+   shown.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/* The host's sys/queue.h may not have these */
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = TAILQ_FIRST((head)); \
+        (var) && ((tvar) = TAILQ_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = LIST_FIRST((head)); \
+        (var) && ((tvar) = LIST_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_THREAD_H
+#define __KOS_MUTEX_H
+
+#include <kos/fs.h>
+#include <kos/dbglog.h>
+
+int dbglog_level = DBG_WARNING;
+
+#define __align_up(x, a)    (((x) + (a) - 1) & ~((a) - 1))
+#define assert_msg(e, m)    assert(e)
+
+/* Mutexes */
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_TYPE_NORMAL           0
+#define mutex_init(m, t)            ((void)(t), pthread_mutex_init((m), NULL))
+#define mutex_destroy(m)            pthread_mutex_destroy(m)
+#define mutex_lock(m)               pthread_mutex_lock(m)
+#define mutex_unlock(m)             pthread_mutex_unlock(m)
+
+static inline void scoped_unlock(mutex_t **m) {
+    if(*m)
+        pthread_mutex_unlock(*m);
+}
+
+#define scoped_lock_(m, l) \
+    mutex_t *scoped_##l __attribute__((cleanup(scoped_unlock))) = \
+        pthread_mutex_lock(m) ? NULL : (m)
+#define scoped_lock(m, l)           scoped_lock_(m, l)
+#define mutex_lock_scoped(m)        scoped_lock((m), __LINE__)
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+#include "../../kernel/fs/fs_ramdisk.c"
+
+static int failures;
+
+#define BIG_SIZE        (8 * 1024 * 1024)
+#define READERS         4
+#define READER_SIZE     (2 * 1024 * 1024)
+#define READER_PASSES   8
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what) {
+    printf("FAIL: %s\n", what);
+    failures++;
+}
+
+/* What each file should hold: the bytes in ref starting at pos % PERIOD,
+   with PERIOD picked so that a piece of a file that turns up in the wrong
+   place won't match. */
+#define PERIOD          65521
+#define MAX_IO          65536
+
+static uint8_t ref[8][PERIOD + MAX_IO];
+
+static void make_ref(void) {
+    uint32_t i, s;
+
+    for(s = 0; s < 8; s++)
+        for(i = 0; i < sizeof(ref[s]); i++)
+            ref[s][i] = (uint8_t)(((i % PERIOD) * 2654435761u) >> 24) ^
+                        (uint8_t)(s * 37);
+}
+
+static inline const uint8_t *expect(uint32_t seed, uint32_t pos) {
+    return ref[seed & 7] + pos % PERIOD;
+}
+
+static bool matches(const uint8_t *buf, uint32_t seed, uint32_t pos,
+                    size_t len) {
+    return !memcmp(buf, expect(seed, pos), len);
+}
+
+/* Write a file of size bytes, in writes of step bytes (or of sizes between 1
+   and 8k if step is 0). */
+static int write_file(const char *fn, uint32_t seed, uint32_t size,
+                      uint32_t step) {
+    uint32_t pos = 0, n;
+    void *fd;
+
+    if(!(fd = ramdisk_open(&vh, fn, O_WRONLY | O_TRUNC))) {
+        fail("couldn't create a file");
+        return -1;
+    }
+
+    while(pos < size) {
+        n = step ? step : 1 + (uint32_t)rand() % 8192;
+
+        if(n > size - pos)
+            n = size - pos;
+
+        if(ramdisk_write(fd, expect(seed, pos), n) != (ssize_t)n) {
+            fail("short write");
+            break;
+        }
+
+        pos += n;
+    }
+
+    ramdisk_close(fd);
+    return 0;
+}
+
+/********************************************************************************/
+/* A big file */
+
+static void check_big(void) {
+    static uint8_t buf[MAX_IO];
+    struct stat st;
+    uint32_t pos, n;
+    double t;
+    void *fd;
+    int i;
+
+    t = now();
+    write_file("big", 1, BIG_SIZE, 4096);
+    t = now() - t;
+    printf("Streaming write, 4k at a time: %.1f MB/s\n", BIG_SIZE / t / 1e6);
+
+    t = now();
+    write_file("big", 2, BIG_SIZE, 256);
+    t = now() - t;
+    printf("Streaming write, 256 bytes at a time: %.1f MB/s\n",
+           BIG_SIZE / t / 1e6);
+
+    write_file("big", 3, BIG_SIZE, 0);
+
+    if(ramdisk_stat(&vh, "big", &st, 0) || st.st_size != BIG_SIZE)
+        fail("stat gave the wrong size");
+
+    if(!(fd = ramdisk_open(&vh, "big", O_RDONLY))) {
+        fail("couldn't open the big file");
+        return;
+    }
+
+    /* Straight through, in odd sized pieces */
+    pos = 0;
+
+    while((n = ramdisk_read(fd, buf, 1 + (uint32_t)rand() % MAX_IO)) > 0) {
+        if(!matches(buf, 3, pos, n)) {
+            fail("wrong data reading through the big file");
+            break;
+        }
+
+        pos += n;
+    }
+
+    if(pos != BIG_SIZE)
+        fail("didn't read the whole of the big file");
+
+    /* All over the place */
+    t = now();
+
+    for(i = 0; i < 20000; i++) {
+        pos = (uint32_t)rand() % BIG_SIZE;
+        n = 1 + (uint32_t)rand() % 4096;
+
+        if(ramdisk_seek(fd, pos, SEEK_SET) != (off_t)pos) {
+            fail("seek went wrong");
+            break;
+        }
+
+        n = ramdisk_read(fd, buf, n);
+
+        if(!matches(buf, 3, pos, n)) {
+            fail("wrong data reading the big file at random");
+            break;
+        }
+    }
+
+    t = now() - t;
+    printf("Random reads of up to 4k: %.0f ns each\n", t / i * 1e9);
+
+    ramdisk_close(fd);
+    ramdisk_unlink(&vh, "big");
+}
+
+/********************************************************************************/
+/* mmap() and attaching */
+
+static void check_mmap(void) {
+    const size_t len = 100000;
+    uint8_t *p, *q;
+    void *fd, *obj;
+    size_t size;
+
+    /* Map a file that is being written, then keep writing */
+    fd = ramdisk_open(&vh, "map", O_WRONLY | O_TRUNC);
+
+    ramdisk_write(fd, expect(4, 0), MAX_IO);
+    ramdisk_write(fd, expect(4, MAX_IO), len - MAX_IO);
+    p = ramdisk_mmap(fd);
+
+    if(!p || !matches(p, 4, 0, len))
+        fail("mmap didn't give the file data");
+
+    for(size = len; size < 2000000; size += 1000)
+        ramdisk_write(fd, expect(4, size), 1000);
+
+    /* It's in more than one piece now, and can't be joined up while the
+       first mapping is still in use */
+    if(ramdisk_mmap(fd) || errno != EBUSY)
+        fail("mapping the grown file again didn't fail with EBUSY");
+
+    if(!p || !matches(p, 4, 0, len))
+        fail("mapped data changed as the file grew");
+
+    ramdisk_close(fd);
+
+    /* Once closed, the next mapping puts the whole file in one piece */
+    fd = ramdisk_open(&vh, "map", O_RDONLY);
+    q = ramdisk_mmap(fd);
+
+    for(size = 0; q && size < 2000000; size += MAX_IO) {
+        if(!matches(q + size, 4, size, size + MAX_IO <= 2000000 ?
+                    MAX_IO : 2000000 - size)) {
+            fail("mapping a grown file gave the wrong data");
+            break;
+        }
+    }
+
+    if(!q)
+        fail("couldn't map a grown file");
+
+    ramdisk_close(fd);
+    ramdisk_unlink(&vh, "map");
+
+    /* Attached blocks are used as they are */
+    p = malloc(MAX_IO);
+    memcpy(p, expect(5, 0), MAX_IO);
+
+    if(fs_ramdisk_attach("attached", p, MAX_IO))
+        fail("couldn't attach a block");
+
+    fd = ramdisk_open(&vh, "attached", O_RDONLY);
+
+    if(ramdisk_mmap(fd) != p)
+        fail("mapping an attached file didn't give the block");
+
+    ramdisk_close(fd);
+
+    if(fs_ramdisk_detach("attached", &obj, &size) || obj != p ||
+       size != MAX_IO)
+        fail("detaching didn't give the block back");
+
+    free(obj);
+
+    /* A file that has been written is given back in one piece */
+    write_file("detached", 6, 60000, 1000);
+
+    if(fs_ramdisk_detach("detached", &obj, &size) || size != 60000 ||
+       !matches(obj, 6, 0, size))
+        fail("detaching a written file gave the wrong data");
+
+    free(obj);
+}
+
+/********************************************************************************/
+/* Several readers at once */
+
+typedef struct {
+    char name[16];
+    uint32_t seed;
+    int errors;
+} reader_t;
+
+static void *reader(void *arg) {
+    reader_t *r = arg;
+    uint8_t buf[16384];
+    uint32_t pos;
+    ssize_t n;
+    void *fd;
+    int i;
+
+    if(!(fd = ramdisk_open(&vh, r->name, O_RDONLY))) {
+        r->errors++;
+        return NULL;
+    }
+
+    for(i = 0; i < READER_PASSES; i++) {
+        ramdisk_seek(fd, 0, SEEK_SET);
+        pos = 0;
+
+        while((n = ramdisk_read(fd, buf, sizeof(buf))) > 0) {
+            if(!matches(buf, r->seed, pos, n))
+                r->errors++;
+
+            pos += n;
+        }
+    }
+
+    ramdisk_close(fd);
+    return NULL;
+}
+
+static double run_readers(int count, bool shared) {
+    pthread_t thd[READERS];
+    reader_t r[READERS];
+    double t;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        snprintf(r[i].name, sizeof(r[i].name), "r%d", shared ? 0 : i);
+        r[i].seed = 10 + (shared ? 0 : i);
+        r[i].errors = 0;
+    }
+
+    t = now();
+
+    for(i = 0; i < count; i++)
+        pthread_create(thd + i, NULL, reader, r + i);
+
+    for(i = 0; i < count; i++) {
+        pthread_join(thd[i], NULL);
+
+        if(r[i].errors)
+            fail("a reader got the wrong data");
+    }
+
+    t = now() - t;
+    return (double)count * READER_SIZE * READER_PASSES / t / 1e6;
+}
+
+static void check_readers(void) {
+    char fn[16];
+    int i;
+
+    for(i = 0; i < READERS; i++) {
+        snprintf(fn, sizeof(fn), "r%d", i);
+        write_file(fn, 10 + i, READER_SIZE, 0);
+    }
+
+    printf("One reader: %.0f MB/s\n", run_readers(1, false));
+    printf("%d readers, a file each: %.0f MB/s\n", READERS,
+           run_readers(READERS, false));
+    printf("%d readers, all on one file: %.0f MB/s\n", READERS,
+           run_readers(READERS, true));
+
+    for(i = 0; i < READERS; i++) {
+        snprintf(fn, sizeof(fn), "r%d", i);
+        ramdisk_unlink(&vh, fn);
+    }
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    srand(1);
+    make_ref();
+    fs_ramdisk_init();
+
+    check_big();
+    check_mmap();
+    check_readers();
+
+    fs_ramdisk_shutdown();
+
+    if(failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+
+    printf("All OK\n");
+    return 0;
+}
@@ -0,0 +1,661 @@
+/* KallistiOS ##version##
+
+   sdtest.c
+
+   Test and time the SD card driver against a model of a card. The real sd.c
+   is built into this program, with the SCIF and SCI SPI functions it calls
+   replaced by a card that works out what to send back a byte at a time, the
+   way a real one does in SPI mode: it takes commands, answers them after a
+   byte or two, sends data blocks after an access delay, takes data blocks
+   with their tokens and CRCs, and holds the data line low while it is busy
+   programming them.
+
+   Time is counted in bytes clocked across the bus, at the clock rate given,
+   and the driver's timer reads that clock too, so the card's delays cost the
+   same number of bytes of polling they would on hardware. For each of a few
+   workloads the data is checked and the throughput, the bytes clocked per
+   block and the commands sent are shown. The same workloads are then run
+   again with the card corrupting a block every now and then, which the
+   driver has to notice by its CRC and retry.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __DC_SCIF_H
+#define __DC_SCI_H
+#define __KOS_NET_H
+#define __KOS_OPTS_H
+#define __KOS_TIMER_H
+#define __KOS_THREAD_H
+#define __KOS_DBGLOG_H
+#define __pure __attribute__((pure))
+
+#define NET_CRC_SLICES  8
+#include "../../kernel/net/net_crc.c"
+
+#define DBG_DEBUG   7
+#define dbglog(lvl, ...)    ((void)(lvl))
+
+/* The model of the card. */
+#define CARD_BLOCKS     16384
+#define OUT_MAX         1024
+
+enum {
+    ST_CMD,                     /* Waiting for a command */
+    ST_READ,                    /* Sending blocks for CMD17/CMD18 */
+    ST_WRITE                    /* Taking blocks for CMD24/CMD25 */
+};
+
+static struct card {
+    uint8_t *data;
+    bool sdsc;                  /* Byte addressed (SDSC) rather than SDHC */
+    bool selected;
+    bool idle;
+    bool app_cmd;
+    bool crc_on;
+    int acmd41_left;
+    int state;
+    bool multi;
+    uint32_t block;             /* Next block to send or take */
+
+    uint8_t cmd[6];
+    int cmd_len;
+
+    uint8_t out[OUT_MAX];       /* Bytes waiting to be sent */
+    int out_head, out_len;
+
+    uint8_t in[514];            /* Data block being taken */
+    int in_len;
+    bool in_block;
+
+    uint64_t ready_ns;          /* When the next read block is ready */
+    uint64_t busy_ns;           /* When programming is done */
+
+    int corrupt_every;          /* Corrupt every nth block, if non-zero */
+    unsigned long blocks_moved, corrupted;
+    unsigned long cmds[64];
+} card;
+
+/* Clock, and the card's timing, in nanoseconds. */
+static uint64_t bus_ns;
+static uint64_t byte_ns = 800;  /* 10MHz */
+static uint64_t access_ns = 100000;
+static uint64_t next_access_ns = 20000;
+static uint64_t program_ns = 250000;
+static unsigned long bus_bytes;
+
+static void card_out(uint8_t b) {
+    if(card.out_len < OUT_MAX)
+        card.out[(card.out_head + card.out_len++) % OUT_MAX] = b;
+}
+
+static void card_r1(uint8_t r1) {
+    /* One byte of Ncr before the response */
+    card_out(0xFF);
+    card_out(r1);
+}
+
+static uint16_t crc16(const uint8_t *buf, size_t len) {
+    return net_crc16ccitt(buf, len, 0);
+}
+
+static uint8_t crc7(const uint8_t *buf, int len) {
+    uint8_t crc = 0, fb;
+    int i, j;
+
+    /* Bit at a time, to check the driver's table against. */
+    for(i = 0; i < len; ++i) {
+        for(j = 7; j >= 0; --j) {
+            fb = ((buf[i] >> j) ^ (crc >> 6)) & 1;
+            crc = (crc << 1) & 0x7F;
+
+            if(fb)
+                crc ^= 0x09;
+        }
+    }
+
+    return crc << 1;
+}
+
+static void card_data_block(const uint8_t *buf, size_t len) {
+    uint16_t crc = crc16(buf, len);
+    size_t i;
+
+    card_out(0xFE);
+
+    for(i = 0; i < len; ++i)
+        card_out(buf[i]);
+
+    card_out((uint8_t)(crc >> 8));
+    card_out((uint8_t)crc);
+}
+
+static void card_send_block(void) {
+    uint8_t buf[512];
+
+    if(card.block >= CARD_BLOCKS) {
+        /* Out of range error token */
+        card_out(0x08);
+        card.state = ST_CMD;
+        return;
+    }
+
+    memcpy(buf, card.data + card.block * 512, 512);
+
+    if(card.corrupt_every && !(++card.blocks_moved % card.corrupt_every)) {
+        buf[rand() & 511] ^= 0x10;
+        ++card.corrupted;
+
+        /* Send it with the CRC of the real data */
+        card_out(0xFE);
+        for(int i = 0; i < 512; ++i)
+            card_out(buf[i]);
+        card_out((uint8_t)(crc16(card.data + card.block * 512, 512) >> 8));
+        card_out((uint8_t)crc16(card.data + card.block * 512, 512));
+    }
+    else {
+        card_data_block(buf, 512);
+    }
+
+    ++card.block;
+
+    if(card.multi)
+        card.ready_ns = bus_ns + next_access_ns;
+    else
+        card.state = ST_CMD;
+}
+
+static uint32_t card_addr(uint32_t arg) {
+    return card.sdsc ? arg >> 9 : arg;
+}
+
+static void card_command(void) {
+    uint8_t cmd = card.cmd[0] & 0x3F;
+    uint32_t arg = (card.cmd[1] << 24) | (card.cmd[2] << 16) |
+        (card.cmd[3] << 8) | card.cmd[4];
+    bool app = card.app_cmd;
+    uint8_t idle = card.idle ? 0x01 : 0x00;
+    uint8_t csd[16];
+
+    card.app_cmd = false;
+    ++card.cmds[cmd];
+
+    /* CMD0 and CMD8 always have their CRCs checked. */
+    if((card.crc_on || cmd == 0 || cmd == 8) &&
+       crc7(card.cmd, 5) != (card.cmd[5] & 0xFE)) {
+        card_r1(idle | 0x08);
+        return;
+    }
+
+    if(cmd == 12) {
+        /* A stuff byte, then the response, then busy for a moment */
+        card.state = ST_CMD;
+        card.out_len = 0;
+        card_out(0xA5);
+        card_out(0x00);
+        card.busy_ns = bus_ns + 4 * byte_ns;
+        return;
+    }
+
+    if(cmd == 0) {
+        card.state = ST_CMD;
+        card.idle = true;
+        card.crc_on = false;
+        card.acmd41_left = 3;
+        card_r1(0x01);
+        return;
+    }
+
+    if(card.state != ST_CMD) {
+        card_r1(idle | 0x04);
+        return;
+    }
+
+    switch(cmd) {
+        case 8:
+            card_r1(idle);
+            card_out(0x00);
+            card_out(0x00);
+            card_out(arg >> 8);
+            card_out(arg);
+            break;
+
+        case 55:
+            card.app_cmd = true;
+            card_r1(idle);
+            break;
+
+        case 41:
+            if(!app) {
+                card_r1(idle | 0x04);
+                break;
+            }
+
+            if(card.acmd41_left-- <= 0)
+                card.idle = false;
+
+            card_r1(card.idle ? 0x01 : 0x00);
+            break;
+
+        case 58:
+            card_r1(idle);
+            card_out(card.sdsc ? 0x80 : 0xC0);
+            card_out(0xFF);
+            card_out(0x80);
+            card_out(0x00);
+            break;
+
+        case 59:
+            card.crc_on = arg & 1;
+            card_r1(idle);
+            break;
+
+        case 16:
+        case 23:
+            card_r1(idle);
+            break;
+
+        case 9:
+            /* CSD version 2.0, C_SIZE = blocks / 1024 - 1 */
+            memset(csd, 0, sizeof(csd));
+            csd[0] = 0x40;
+            csd[8] = (uint8_t)((CARD_BLOCKS / 1024 - 1) >> 8);
+            csd[9] = (uint8_t)(CARD_BLOCKS / 1024 - 1);
+            card_r1(0x00);
+            card_out(0xFF);
+            card_data_block(csd, 16);
+            break;
+
+        case 17:
+        case 18:
+            if(card_addr(arg) >= CARD_BLOCKS) {
+                card_r1(0x40);
+                break;
+            }
+
+            card.block = card_addr(arg);
+            card.multi = cmd == 18;
+            card.state = ST_READ;
+            card_r1(0x00);
+            card.ready_ns = bus_ns + access_ns;
+            break;
+
+        case 24:
+        case 25:
+            if(card_addr(arg) >= CARD_BLOCKS) {
+                card_r1(0x40);
+                break;
+            }
+
+            card.block = card_addr(arg);
+            card.multi = cmd == 25;
+            card.state = ST_WRITE;
+            card.in_block = false;
+            card_r1(0x00);
+            break;
+
+        default:
+            card_r1(idle | 0x04);
+            break;
+    }
+}
+
+static void card_take(uint8_t b) {
+    uint16_t crc;
+
+    if(!card.in_block) {
+        if(b == 0xFE || b == 0xFC) {
+            card.in_block = true;
+            card.in_len = 0;
+        }
+        else if(b == 0xFD && card.multi) {
+            card.state = ST_CMD;
+            card.busy_ns = bus_ns + 2 * byte_ns;
+        }
+
+        return;
+    }
+
+    card.in[card.in_len++] = b;
+
+    if(card.in_len < 514)
+        return;
+
+    card.in_block = false;
+
+    if(card.corrupt_every && !(++card.blocks_moved % card.corrupt_every)) {
+        card.in[rand() & 511] ^= 0x01;
+        ++card.corrupted;
+    }
+
+    crc = (card.in[512] << 8) | card.in[513];
+
+    if(card.crc_on && crc != crc16(card.in, 512)) {
+        card_out(0x0B);
+        card.state = ST_CMD;
+        return;
+    }
+
+    memcpy(card.data + card.block++ * 512, card.in, 512);
+    card_out(0x05);
+    card.busy_ns = bus_ns + program_ns;
+
+    if(!card.multi)
+        card.state = ST_CMD;
+}
+
+static uint8_t card_xfer(uint8_t in) {
+    uint8_t rv = 0xFF;
+
+    ++bus_bytes;
+    bus_ns += byte_ns;
+
+    if(!card.selected)
+        return 0xFF;
+
+    /* Work out what to send first, since the card can't answer a byte it
+       hasn't had yet. */
+    if(card.out_len) {
+        rv = card.out[card.out_head];
+        card.out_head = (card.out_head + 1) % OUT_MAX;
+        --card.out_len;
+    }
+    else if(bus_ns < card.busy_ns) {
+        rv = 0x00;
+    }
+    else if(card.state == ST_READ && bus_ns >= card.ready_ns) {
+        card_send_block();
+        rv = card.out[card.out_head];
+        card.out_head = (card.out_head + 1) % OUT_MAX;
+        --card.out_len;
+    }
+
+    if(card.state == ST_WRITE && card.cmd_len == 0) {
+        card_take(in);
+    }
+    else if(card.cmd_len || (in & 0xC0) == 0x40) {
+        card.cmd[card.cmd_len++] = in;
+
+        if(card.cmd_len == 6) {
+            card.cmd_len = 0;
+            card_command();
+        }
+    }
+
+    return rv;
+}
+
+static void card_select(bool sel) {
+    if(!sel) {
+        card.cmd_len = 0;
+        card.out_len = 0;
+    }
+
+    card.selected = sel;
+}
+
+/* What sd.c wants from the SCIF and SCI drivers, all going to the card. */
+static uint8_t scif_spi_rw_byte(uint8_t b) {
+    return card_xfer(b);
+}
+
+static uint8_t scif_spi_slow_rw_byte(uint8_t b) {
+    return card_xfer(b);
+}
+
+static uint8_t scif_spi_read_byte(void) {
+    return card_xfer(0xFF);
+}
+
+static void scif_spi_write_byte(uint8_t b) {
+    card_xfer(b);
+}
+
+static void scif_spi_read_data(uint8_t *buf, size_t len) {
+    while(len--)
+        *buf++ = card_xfer(0xFF);
+}
+
+static void scif_spi_write_data(const uint8_t *buf, size_t len) {
+    while(len--)
+        card_xfer(*buf++);
+}
+
+static int scif_spi_init(void) {
+    return 0;
+}
+
+static int scif_spi_shutdown(void) {
+    return 0;
+}
+
+static void scif_spi_set_cs(int v) {
+    card_select(!v);
+}
+
+typedef int sci_result_t;
+typedef void (*dma_callback_t)(void *data);
+
+#define SCI_SPI_BAUD_INIT   312500
+#define SCI_SPI_BAUD_MAX    12500000
+#define SCI_MODE_SPI        1
+#define SCI_CLK_INT         0
+
+static sci_result_t sci_init(uint32_t baud, int mode, int clk, size_t bufsz) {
+    (void)baud;
+    (void)mode;
+    (void)clk;
+    (void)bufsz;
+    return 0;
+}
+
+static void sci_shutdown(void) {
+}
+
+static void sci_spi_set_cs(bool enabled) {
+    card_select(enabled);
+}
+
+static sci_result_t sci_spi_rw_byte(uint8_t b, uint8_t *rx) {
+    *rx = card_xfer(b);
+    return 0;
+}
+
+static sci_result_t sci_spi_read_byte(uint8_t *rx) {
+    *rx = card_xfer(0xFF);
+    return 0;
+}
+
+static sci_result_t sci_spi_write_byte(uint8_t b) {
+    card_xfer(b);
+    return 0;
+}
+
+static sci_result_t sci_spi_read_data(uint8_t *buf, size_t len) {
+    scif_spi_read_data(buf, len);
+    return 0;
+}
+
+static sci_result_t sci_spi_write_data(const uint8_t *buf, size_t len) {
+    scif_spi_write_data(buf, len);
+    return 0;
+}
+
+static sci_result_t sci_spi_dma_read_data(uint8_t *buf, size_t len,
+                                          dma_callback_t cb, void *d) {
+    scif_spi_read_data(buf, len);
+    if(cb)
+        cb(d);
+    return 0;
+}
+
+static sci_result_t sci_spi_dma_write_data(const uint8_t *buf, size_t len,
+                                           dma_callback_t cb, void *d) {
+    scif_spi_write_data(buf, len);
+    if(cb)
+        cb(d);
+    return 0;
+}
+
+/* Timers and threads, going by the bus clock. */
+static uint64_t timer_us_gettime64(void) {
+    return bus_ns / 1000;
+}
+
+typedef int (*thd_cb_t)(void *data);
+
+static int thd_poll(thd_cb_t cb, void *data, unsigned long timeout_ms) {
+    uint64_t end = bus_ns + timeout_ms * 1000000ULL;
+    int rv;
+
+    while(!(rv = cb(data))) {
+        if(timeout_ms && bus_ns >= end)
+            return 0;
+    }
+
+    return rv;
+}
+
+#include "../../kernel/arch/dreamcast/hardware/sd.c"
+
+/* The workloads */
+#define MAX_COUNT   64
+
+static uint8_t shadow[CARD_BLOCKS * 512];
+static uint8_t buf[MAX_COUNT * 512];
+static int failures;
+
+static void fill(uint8_t *p, uint32_t block, size_t count, unsigned seed) {
+    size_t i;
+
+    for(i = 0; i < count * 512; ++i)
+        p[i] = (uint8_t)((block * 512 + i) * 2654435761u >> 13) ^ seed;
+}
+
+typedef struct test {
+    const char *name;
+    int count;                  /* Blocks per request */
+    bool random;
+    bool write;
+} test_t;
+
+static const test_t tests[] = {
+    { "read 1 seq", 1, false, false },
+    { "read 8 seq", 8, false, false },
+    { "read 64 seq", 64, false, false },
+    { "read 1 random", 1, true, false },
+    { "read 8 random", 8, true, false },
+    { "write 1 random", 1, true, true },
+    { "write 8 seq", 8, false, true },
+    { "write 64 seq", 64, false, true },
+    { "read/write 8", 8, true, true },
+};
+
+static void run_test(const test_t *t, int total) {
+    uint32_t block = 0;
+    uint64_t start_ns = bus_ns;
+    unsigned long start_bytes = bus_bytes, cmds = 0;
+    unsigned long start_cmds[64];
+    int i, done, bad = 0;
+    double secs;
+
+    memcpy(start_cmds, card.cmds, sizeof(start_cmds));
+
+    for(done = 0; done < total; done += t->count) {
+        if(t->random)
+            block = (uint32_t)rand() % (CARD_BLOCKS - t->count);
+
+        /* The mixed test writes every other request. */
+        if(t->write && (strcmp(t->name, "read/write 8") || (done / 8) & 1)) {
+            fill(buf, block, t->count, (unsigned)done);
+
+            if(sd_write_blocks(block, t->count, buf)) {
+                ++bad;
+            }
+            else {
+                memcpy(shadow + block * 512, buf, t->count * 512);
+            }
+        }
+        else {
+            if(sd_read_blocks(block, t->count, buf) ||
+               memcmp(buf, shadow + block * 512, t->count * 512))
+                ++bad;
+        }
+
+        if(!t->random)
+            block = (block + t->count) % (CARD_BLOCKS - MAX_COUNT);
+    }
+
+    /* Check that the writes landed, without counting the time. */
+    if(t->write && memcmp(card.data, shadow, sizeof(shadow)))
+        ++bad;
+
+    for(i = 0; i < 64; ++i)
+        cmds += card.cmds[i] - start_cmds[i];
+
+    secs = (bus_ns - start_ns) / 1e9;
+    printf("  %-15s %8.1f KiB/s %7.1f bytes/block %6lu cmds  %s\n", t->name,
+           total / 2.0 / secs, (double)(bus_bytes - start_bytes) / total,
+           cmds, bad ? "FAILED" : "ok");
+
+    if(bad)
+        ++failures;
+}
+
+static void run_all(sd_interface_t iface, bool sdsc, int corrupt_every) {
+    sd_init_params_t params = { iface, true };
+    size_t i;
+
+    memset(&card, 0, sizeof(card));
+    card.data = malloc(CARD_BLOCKS * 512);
+    card.sdsc = sdsc;
+    fill(card.data, 0, CARD_BLOCKS, 0);
+    memcpy(shadow, card.data, sizeof(shadow));
+
+    printf("%s, %s card%s:\n", iface == SD_IF_SCIF ? "SCIF" : "SCI",
+           sdsc ? "SDSC" : "SDHC", corrupt_every ? ", with errors" : "");
+
+    if(sd_init_ex(&params) ||
+       sd_get_size() != (uint64_t)CARD_BLOCKS * 512) {
+        printf("  card didn't come up\n");
+        ++failures;
+        free(card.data);
+        return;
+    }
+
+    card.corrupt_every = corrupt_every;
+
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+        run_test(&tests[i], 2048);
+
+    sd_shutdown();
+
+    if(corrupt_every)
+        printf("  %lu blocks corrupted\n", card.corrupted);
+
+    free(card.data);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        byte_ns = 8000 / strtoul(argv[1], NULL, 0);
+
+    run_all(SD_IF_SCIF, false, 0);
+    run_all(SD_IF_SCI, true, 0);
+    run_all(SD_IF_SCIF, false, 97);
+
+    if(failures) {
+        printf("%d test(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,492 @@
+/* KallistiOS ##version##
+
+   slabtest.c
+
+   Test and time the slab allocator. The real slab.c is built into this
+   program, getting its slabs from the PC's memalign(), with pthreads mutexes
+   standing in for KOS ones and a flag standing in for being inside an IRQ.
+
+   Caches of objects of all sorts of sizes and alignments are filled up,
+   partly emptied, filled again and emptied, in a random order. Every object
+   has to be aligned as asked, can't overlap any other one, and has to still
+   hold what was put in it when it's freed, and the counts the cache keeps
+   have to add up all along. Constructors and destructors have to be called
+   once for each object in each slab made and given back, and objects have
+   to keep what was in them while they're free. A cache made to be used from
+   IRQs has to keep working inside one, without going to malloc() when that
+   isn't safe, and without giving slabs back there.
+
+   Then objects the size of ARP entries and fragment trackers are allocated
+   and freed at random with slab_alloc() and with malloc(), and the time
+   taken is shown, along with the memory each object takes up in a slab
+   (counting its share of the slab's chunk from the Dreamcast's malloc())
+   and what it would take as a chunk of its own.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Keep the parts of KOS that need a Dreamcast out of it, and stand in for
+   them below. */
+#define __KOS_MUTEX_H
+#define __KOS_IRQ_H
+
+#ifndef __nonnull_all
+#define __nonnull_all               __attribute__((nonnull))
+#endif
+
+#ifndef __predict_false
+#define __predict_false(x)          __builtin_expect(!!(x), 0)
+#endif
+
+#ifndef __align_up
+#define __align_up(x, a)            (((x) + ((a) - 1)) & ~((a) - 1))
+#endif
+
+/* Mutexes */
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_TYPE_NORMAL           0
+#define mutex_init(m, t)            ((void)(t), pthread_mutex_init((m), NULL))
+#define mutex_destroy(m)            pthread_mutex_destroy(m)
+#define mutex_lock(m)               pthread_mutex_lock(m)
+#define mutex_unlock(m)             pthread_mutex_unlock(m)
+
+/* IRQs: whether we're pretending to be in one, and whether malloc() would
+   be safe to use in it */
+typedef int irq_mask_t;
+
+static bool in_irq, irq_malloc_ok;
+static int irqs_disabled;
+
+static inline irq_mask_t irq_disable(void) {
+    return irqs_disabled++;
+}
+
+static inline void irq_restore(irq_mask_t state) {
+    irqs_disabled = state;
+}
+
+#define irq_inside_int()            (in_irq)
+#define malloc_irq_safe()           (irq_malloc_ok)
+
+#include "../../kernel/mm/slab.c"
+
+static int failures;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *name) {
+    if(++failures <= 10)
+        printf("FAIL: %s: %s\n", what, name);
+}
+
+/********************************************************************************/
+/* Filling and emptying */
+
+#define OBJS            3000
+
+typedef struct obj_ref {
+    uint8_t *p;
+    uint32_t seed;
+} obj_ref_t;
+
+static obj_ref_t objs[OBJS];
+
+static int cmp_ref(const void *a, const void *b) {
+    const obj_ref_t *x = a, *y = b;
+
+    return x->p < y->p ? -1 : x->p > y->p;
+}
+
+static void fill(uint8_t *p, size_t size, uint32_t seed) {
+    size_t i;
+
+    for(i = 0; i < size; i++)
+        p[i] = (uint8_t)(seed + i * 7);
+}
+
+static int holds(const uint8_t *p, size_t size, uint32_t seed) {
+    size_t i;
+
+    for(i = 0; i < size; i++) {
+        if(p[i] != (uint8_t)(seed + i * 7))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void check_counts(slab_cache_t *c, size_t in_use, const char *name) {
+    slab_stats_t st;
+
+    slab_cache_get_stats(c, &st);
+
+    if(st.in_use != in_use || st.allocs - st.frees != in_use)
+        fail("in use count is wrong", name);
+
+    if(st.slabs * st.objs_per_slab < in_use ||
+       st.slabs != st.grows - st.shrinks)
+        fail("slab count is wrong", name);
+
+    if(irqs_disabled)
+        fail("interrupts left disabled", name);
+}
+
+/* No two live objects may overlap, or hold anything but what was put in
+   them. */
+static void check_live(size_t size, const char *name) {
+    obj_ref_t live[OBJS];
+    int i, n = 0;
+
+    for(i = 0; i < OBJS; i++) {
+        if(objs[i].p)
+            live[n++] = objs[i];
+    }
+
+    qsort(live, n, sizeof(obj_ref_t), cmp_ref);
+
+    for(i = 0; i < n; i++) {
+        if(i && live[i - 1].p + size > live[i].p)
+            fail("objects overlap", name);
+
+        if(!holds(live[i].p, size, live[i].seed))
+            fail("object changed while it was allocated", name);
+    }
+}
+
+static void check_size(size_t size, size_t align, uint32_t flags) {
+    char name[32];
+    slab_cache_t *c;
+    slab_stats_t st;
+    size_t in_use = 0;
+    int i, round;
+
+    snprintf(name, sizeof(name), "size %zu align %zu", size, align);
+
+    if(!(c = slab_cache_create(name, size, align, NULL, NULL, flags))) {
+        fail("couldn't make a cache", name);
+        return;
+    }
+
+    memset(objs, 0, sizeof(objs));
+
+    for(round = 0; round < 4; round++) {
+        /* Fill it up, then empty out a random half (or all of it, at the
+           end). */
+        for(i = 0; i < OBJS; i++) {
+            if(objs[i].p)
+                continue;
+
+            if(!(objs[i].p = slab_alloc(c))) {
+                fail("allocation failed", name);
+                continue;
+            }
+
+            if((uintptr_t)objs[i].p & ((align ? align : 8) - 1))
+                fail("object not aligned", name);
+
+            objs[i].seed = rand();
+            fill(objs[i].p, size, objs[i].seed);
+            in_use++;
+        }
+
+        check_counts(c, in_use, name);
+        check_live(size, name);
+
+        if(round == 1 && slab_cache_destroy(c) != -1)
+            fail("destroyed a cache with objects in use", name);
+
+        for(i = 0; i < OBJS; i++) {
+            if(objs[i].p && (round == 3 || rand() % 2)) {
+                if(!holds(objs[i].p, size, objs[i].seed))
+                    fail("object changed while it was allocated", name);
+
+                slab_free(c, objs[i].p);
+                objs[i].p = NULL;
+                in_use--;
+            }
+        }
+
+        check_counts(c, in_use, name);
+    }
+
+    slab_cache_get_stats(c, &st);
+
+    if(too_many_empty(c))
+        fail("too many empty slabs kept", name);
+
+    if(st.peak != OBJS)
+        fail("peak is wrong", name);
+
+    if(slab_cache_shrink(c) != st.slabs * st.slab_size)
+        fail("shrink gave back the wrong amount", name);
+
+    slab_cache_get_stats(c, &st);
+
+    if(st.slabs)
+        fail("slabs left after shrinking", name);
+
+    printf("%-22s %4zu per %5zu byte slab, %5.1f bytes an object\n", name,
+           st.objs_per_slab, st.slab_size,
+           (double)st.slab_size / st.objs_per_slab);
+
+    if(slab_cache_destroy(c))
+        fail("couldn't destroy an empty cache", name);
+}
+
+/********************************************************************************/
+/* Constructors and destructors */
+
+typedef struct thing {
+    uint32_t magic;
+    uint32_t uses;
+    char name[40];
+} thing_t;
+
+static int ctors, dtors;
+
+static void thing_ctor(void *obj) {
+    thing_t *t = obj;
+
+    t->magic = 0x7AB1E5;
+    t->uses = 0;
+    strcpy(t->name, "new");
+    ctors++;
+}
+
+static void thing_dtor(void *obj) {
+    thing_t *t = obj;
+
+    if(t->magic != 0x7AB1E5)
+        fail("destructor called on something that wasn't made", "thing");
+
+    t->magic = 0;
+    dtors++;
+}
+
+static void check_ctor(void) {
+    thing_t *things[200], *t;
+    slab_cache_t *c;
+    slab_stats_t st;
+    int i;
+
+    c = slab_cache_create_type("thing", thing_t, thing_ctor, thing_dtor, 0);
+
+    for(i = 0; i < 200; i++) {
+        things[i] = slab_alloc(c);
+
+        if(things[i]->magic != 0x7AB1E5 || things[i]->uses)
+            fail("object not constructed", "thing");
+
+        things[i]->uses++;
+    }
+
+    slab_cache_get_stats(c, &st);
+
+    if(ctors != (int)(st.grows * st.objs_per_slab))
+        fail("constructor not called once for each object", "thing");
+
+    /* Objects come back as they were left. */
+    slab_free(c, things[7]);
+    t = slab_alloc(c);
+
+    if(t != things[7] || t->uses != 1)
+        fail("object didn't keep its state", "thing");
+
+    for(i = 0; i < 200; i++)
+        slab_free(c, things[i]);
+
+    slab_cache_shrink(c);
+    slab_cache_get_stats(c, &st);
+
+    if(dtors != (int)(st.shrinks * st.objs_per_slab) || dtors != ctors)
+        fail("destructor not called once for each object", "thing");
+
+    slab_cache_destroy(c);
+}
+
+/********************************************************************************/
+/* IRQs */
+
+static void check_irq(void) {
+    void *objs[256], *o;
+    slab_cache_t *c;
+    slab_stats_t st;
+    int i, n;
+
+    c = slab_cache_create("irq", 100, 0, NULL, NULL, SLAB_IRQSAFE);
+
+    /* Nothing to hand out, and malloc() can't be used. */
+    in_irq = true;
+    irq_malloc_ok = false;
+
+    if(slab_alloc(c) || errno != ENOMEM)
+        fail("got a new slab when malloc() wasn't safe", "irq");
+
+    slab_cache_get_stats(c, &st);
+
+    if(st.failures != 1 || st.slabs)
+        fail("failure not counted", "irq");
+
+    /* It can be, now. */
+    irq_malloc_ok = true;
+
+    /* Enough for more empty slabs than are kept. */
+    for(n = 0; n < 256; n++) {
+        if(!(objs[n] = slab_alloc(c)))
+            break;
+    }
+
+    irq_malloc_ok = false;
+
+    /* Objects that are there can be had, and given back, and slabs aren't
+       given back inside the IRQ. */
+    slab_free(c, objs[--n]);
+
+    if(!(o = slab_alloc(c)))
+        fail("couldn't get a free object", "irq");
+
+    objs[n++] = o;
+
+    for(i = 0; i < n; i++)
+        slab_free(c, objs[i]);
+
+    slab_cache_get_stats(c, &st);
+
+    if(st.shrinks || st.in_use)
+        fail("slab given back inside an IRQ", "irq");
+
+    if(irqs_disabled)
+        fail("interrupts left disabled", "irq");
+
+    in_irq = false;
+
+    /* They go once an object is freed outside of it. */
+    slab_free(c, slab_alloc(c));
+    slab_cache_get_stats(c, &st);
+
+    if(too_many_empty(c) || !st.shrinks)
+        fail("slabs not given back after the IRQ", "irq");
+
+    slab_print_stats(printf);
+    slab_cache_destroy(c);
+}
+
+/********************************************************************************/
+/* Timing */
+
+#define ROUNDS          3000000
+#define LIVE            512
+
+/* What dlmalloc takes for a block on the Dreamcast: 4 bytes of header, 8
+   byte aligned, 16 at the least. */
+static size_t dc_chunk(size_t size) {
+    size = (size + 4 + 7) & ~7;
+    return size < 16 ? 16 : size;
+}
+
+static void time_size(const char *what, size_t size) {
+    static void *live[LIVE];
+    slab_cache_t *c;
+    slab_stats_t st;
+    double t_slab, t_malloc;
+    int i, j;
+
+    c = slab_cache_create(what, size, 0, NULL, NULL, SLAB_IRQSAFE);
+    memset(live, 0, sizeof(live));
+    srand(99);
+    t_slab = now();
+
+    for(i = 0; i < ROUNDS; i++) {
+        j = rand() % LIVE;
+
+        if(live[j]) {
+            slab_free(c, live[j]);
+            live[j] = NULL;
+        }
+        else {
+            live[j] = slab_alloc(c);
+            *(volatile uint32_t *)live[j] = i;
+        }
+    }
+
+    t_slab = now() - t_slab;
+
+    for(j = 0; j < LIVE; j++)
+        slab_free(c, live[j]);
+
+    slab_cache_get_stats(c, &st);
+    slab_cache_destroy(c);
+
+    memset(live, 0, sizeof(live));
+    srand(99);
+    t_malloc = now();
+
+    for(i = 0; i < ROUNDS; i++) {
+        j = rand() % LIVE;
+
+        if(live[j]) {
+            free(live[j]);
+            live[j] = NULL;
+        }
+        else {
+            live[j] = malloc(size);
+            *(volatile uint32_t *)live[j] = i;
+        }
+    }
+
+    t_malloc = now() - t_malloc;
+
+    for(j = 0; j < LIVE; j++)
+        free(live[j]);
+
+    printf("%-14s %5zu bytes: slab %5.1f ns, malloc %5.1f ns; "
+           "%6.1f bytes an object in a slab, %5zu in a DC malloc chunk\n",
+           what, size, t_slab / ROUNDS * 1e9, t_malloc / ROUNDS * 1e9,
+           (double)dc_chunk(st.slab_size) / st.objs_per_slab, dc_chunk(size));
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[][2] = {
+        { 1, 0 }, { 7, 1 }, { 24, 0 }, { 48, 4 }, { 60, 32 }, { 100, 0 },
+        { 500, 64 }, { 2000, 0 }, { 3001, 1 }, { 8300, 8 }
+    };
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1234);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        check_size(sizes[i][0], sizes[i][1], 0);
+        check_size(sizes[i][0], sizes[i][1], SLAB_IRQSAFE);
+    }
+
+    check_ctor();
+    check_irq();
+
+    time_size("ARP entry", 48);
+    time_size("addrinfo", 60);
+    time_size("IPv4 fragment", 8248);
+
+    if(failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,180 @@
+/* KallistiOS ##version##
+
+   twiddletest.c
+
+   Test the texture twiddler used by pvr_txr_load_ex() on a PC. Its output is
+   compared byte for byte against the per-texel loops that pvr_txr_load_ex()
+   used before, for every format and every power of two size from 8 to 1024
+   on each side, with and without PVR_TXRLOAD_INVERT_Y.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "pvr_twiddle.h"
+
+/* The old pvr_txr_load_ex(), writing to a buffer instead of VRAM. */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+#define MIN(a, b) ( (a)<(b)? (a):(b) )
+
+static void ref_twiddle(const void *src, uint16_t *vtex, uint32_t w,
+                        uint32_t h, uint32_t bpp, int invert) {
+    uint32_t x, y, yout, min, mask;
+
+    min = MIN(w, h);
+    mask = min - 1;
+
+    switch(bpp) {
+        case 4: {
+            const uint8_t *pixels = (const uint8_t *)src;
+
+            for(y = 0; y < h; y += 2) {
+                yout = invert ? ((h - 1) - y) : y;
+
+                for(x = 0; x < w; x += 2) {
+                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
+                         (x / min + yout / min)*min * min / 4] =
+                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                }
+            }
+        }
+        break;
+        case 8: {
+            const uint8_t *pixels = (const uint8_t *)src;
+
+            for(y = 0; y < h; y += 2) {
+                yout = invert ? ((h - 1) - y) : y;
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
+                         (x / min + yout / min)*min * min / 2] =
+                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+                }
+            }
+        }
+        break;
+        case 16: {
+            const uint16_t *pixels = (const uint16_t *)src;
+
+            for(y = 0; y < h; y++) {
+                yout = invert ? ((h - 1) - y) : y;
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT(x & mask, yout & mask) +
+                         (x / min + yout / min)*min * min] = pixels[y * w + x];
+                }
+            }
+        }
+        break;
+    }
+}
+
+#define MAX_SIDE    1024
+
+static uint16_t *src, *ref, *out;
+
+/* Twiddle the way pvr_txr_load_ex() does, a chunk at a time. */
+static void new_twiddle(uint32_t w, uint32_t h, uint32_t bpp, int invert) {
+    pvr_twiddle_t t;
+    size_t pos, n;
+
+    pvr_twiddle_init(&t, src, w, h, bpp, invert);
+
+    for(pos = 0; pos < t.words; pos += n) {
+        n = t.words - pos < 512 ? t.words - pos : 512;
+        pvr_twiddle(&t, out + pos, pos, n);
+    }
+}
+
+static int test(uint32_t w, uint32_t h, uint32_t bpp, int invert) {
+    size_t bytes = (size_t)w * h * bpp / 8;
+
+    memset(ref, 0xAA, bytes);
+    memset(out, 0x55, bytes);
+
+    ref_twiddle(src, ref, w, h, bpp, invert);
+    new_twiddle(w, h, bpp, invert);
+
+    if(memcmp(ref, out, bytes)) {
+        printf("FAIL: %lux%lu %lubpp%s\n", (unsigned long)w, (unsigned long)h,
+               (unsigned long)bpp, invert ? " inverted" : "");
+        return 1;
+    }
+
+    return 0;
+}
+
+static double time_it(int new, uint32_t bpp) {
+    clock_t start = clock();
+    int i;
+
+    for(i = 0; i < 10; ++i) {
+        if(new)
+            new_twiddle(MAX_SIDE, MAX_SIDE, bpp, 0);
+        else
+            ref_twiddle(src, ref, MAX_SIDE, MAX_SIDE, bpp, 0);
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 100.0;
+}
+
+int main(int argc, char *argv[]) {
+    static const uint32_t bpps[] = { 4, 8, 16 };
+    uint32_t w, h, b, i;
+    int failed = 0, tests = 0;
+
+    (void)argc;
+    (void)argv;
+
+    src = malloc(MAX_SIDE * MAX_SIDE * 2);
+    ref = malloc(MAX_SIDE * MAX_SIDE * 2);
+    out = malloc(MAX_SIDE * MAX_SIDE * 2);
+
+    if(!src || !ref || !out)
+        return 1;
+
+    srand(42);
+
+    for(i = 0; i < MAX_SIDE * MAX_SIDE; ++i)
+        src[i] = rand();
+
+    for(b = 0; b < 3; ++b) {
+        for(w = 8; w <= MAX_SIDE; w <<= 1) {
+            for(h = 8; h <= MAX_SIDE; h <<= 1) {
+                failed += test(w, h, bpps[b], 0);
+                failed += test(w, h, bpps[b], 1);
+                tests += 2;
+            }
+        }
+    }
+
+    /* VQ indices are twiddled like an 8bpp texture of half the size, which
+       goes down to 4x4 for an 8x8 texture. */
+    for(w = 4; w <= MAX_SIDE / 2; w <<= 1) {
+        for(h = 4; h <= MAX_SIDE / 2; h <<= 1) {
+            failed += test(w, h, 8, 0);
+            ++tests;
+        }
+    }
+
+    printf("%d of %d tests passed\n", tests - failed, tests);
+
+    for(b = 0; b < 3; ++b)
+        printf("%dx%d %lubpp: old %.2f ms, new %.2f ms\n", MAX_SIDE, MAX_SIDE,
+               (unsigned long)bpps[b], time_it(0, bpps[b]),
+               time_it(1, bpps[b]));
+
+    free(src);
+    free(ref);
+    free(out);
+
+    return failed ? 1 : 0;
+}